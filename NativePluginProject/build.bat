@@ -12,6 +12,19 @@ cl %CommonCompilerFlags% ../source/unity-ping.cpp -Fmunity-ping.map -LD -link -o
 
 cl %CommonCompilerFlags% ../source/test.cpp -Fmtest.map -link -out:test.exe -pdb:test_%random%.pdb -subsystem:console %CommonLinkerFlags% ws2_32.lib
 
+cl %CommonCompilerFlags% ../source/sim_bench.cpp -Fmsim_bench.map -link -out:sim_bench.exe -pdb:sim_bench_%random%.pdb -subsystem:console %CommonLinkerFlags% ws2_32.lib
+
+cl %CommonCompilerFlags% ../source/load_test.cpp -Fmload_test.map -link -out:load_test.exe -pdb:load_test_%random%.pdb -subsystem:console %CommonLinkerFlags% ws2_32.lib
+
+cl %CommonCompilerFlags% ../source/probe_log_reader.cpp -Fmprobe_log_reader.map -link -out:probe_log_reader.exe -pdb:probe_log_reader_%random%.pdb -subsystem:console %CommonLinkerFlags% ws2_32.lib
+
+cl %CommonCompilerFlags% ../source/cold_start.cpp -Fmcold_start.map -link -out:cold_start.exe -pdb:cold_start_%random%.pdb -subsystem:console %CommonLinkerFlags% ws2_32.lib
+
+cl %CommonCompilerFlags% ../source/burst_loss_test.cpp -Fmburst_loss_test.map -link -out:burst_loss_test.exe -pdb:burst_loss_test_%random%.pdb -subsystem:console %CommonLinkerFlags% ws2_32.lib
+
+cl %CommonCompilerFlags% ../source/race_test.cpp -Fmrace_test.map -link -out:race_test.exe -pdb:race_test_%random%.pdb -subsystem:console %CommonLinkerFlags% ws2_32.lib
+cl %CommonCompilerFlags% ../source/stop_test.cpp -Fmstop_test.map -link -out:stop_test.exe -pdb:stop_test_%random%.pdb -subsystem:console %CommonLinkerFlags% ws2_32.lib
+
 popd
 
 copy .\build\test.exe .\
@@ -13,6 +13,19 @@ cd ./build
 
 /bin/g++ $CommonCompilerFlags -o test.out ../source/test.cpp -lrt -pthread
 
+/bin/g++ $CommonCompilerFlags -o sim_bench.out ../source/sim_bench.cpp -lrt -pthread
+
+/bin/g++ $CommonCompilerFlags -o load_test.out ../source/load_test.cpp -lrt -pthread
+
+/bin/g++ $CommonCompilerFlags -o probe_log_reader.out ../source/probe_log_reader.cpp -lrt -pthread
+
+/bin/g++ $CommonCompilerFlags -o cold_start.out ../source/cold_start.cpp -lrt -pthread
+
+/bin/g++ $CommonCompilerFlags -o burst_loss_test.out ../source/burst_loss_test.cpp -lrt -pthread
+
+/bin/g++ $CommonCompilerFlags -o race_test.out ../source/race_test.cpp -lrt -pthread
+/bin/g++ $CommonCompilerFlags -o stop_test.out ../source/stop_test.cpp -lrt -pthread
+
 #get disassembly
 #/bin/g++ $CommonCompilerFlags -S -fverbose-asm -masm=intel -o unity-ping.s ../source/unity-ping.cpp
 #objdump -drwCS -Mintel --disassembler-options=intel unity-ping.so > unity-ping.s
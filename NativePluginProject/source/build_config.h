@@ -1,6 +1,12 @@
 #define SLOWCHECKS      1   // set 1 to run slow code like asserts and other dev-time tasks
 #define LOG_ASSERTS     0   // set 1 to log failed asserts rather than hard stop when SLOWCHECKS is enabled, could be useful during play testing if you prefer not to crash
 #define ALLOW_MALLOC    0
+#ifndef PING_LOG_LEVEL
+#define PING_LOG_LEVEL  0   // lowest log level compiled in, 0 debug (every packet), 1 info, 2 warn, 3 error, 4 none, see ping_log.h
+#endif
+#ifndef PING_TRACE
+#define PING_TRACE      0   // set 1 to record a Chrome trace-event timeline of jobs and requests, see ping_trace.h
+#endif
 
 #define WIN32_LEAN_AND_MEAN
 #define NOMINMAX
@@ -0,0 +1,176 @@
+// Checks the burst loss stats of ping sequences against the in-process network simulator. Each
+// case runs long sequences to destinations with a known loss process, independent or
+// Gilbert-Elliott, and compares the fitted transition probabilities and the share of single
+// request bursts, pooled over the sequences, with what the process should give. Needs no root or
+// network access.
+//
+// usage: burst_loss_test
+// Prints one line per case and exits with 1 if any estimate is off by more than MaxStdErrors
+// standard errors.
+
+#define MaxPingJobs         32
+#define MaxSequenceRequests 512
+#define PacerRatePPS        1000000.0f  // the cases are timed by their timeouts, not the pacer
+#define DefaultLogLevel     LogLevel_Warn
+
+#include "build_config.h"
+#include "platform/platform.h"
+#include "platform/ping.h"
+#include "platform/ping_sim.h"
+#include <cstdio>
+
+#include "platform/platform.cpp"
+#include "platform/timer.cpp"
+#include "platform/ping.cpp"
+
+#define TestTimeoutMS   5       // lost requests wait this long, replies come back in 0.1 ms
+#define TestSeed        0xB0B5ULL
+#define MaxStdErrors    4.0
+#define SequencesPerCase 8      // each to its own destination, so no two share a loss chain
+
+struct LossCase {
+    const char* name;
+    r32         lossRate;       // independent loss in the good state
+    r32         enterRate;      // Gilbert-Elliott transitions, 0 for independent loss only
+    r32         exitRate;
+};
+
+static const LossCase Cases[] = {
+    { "no loss",            0.00f, 0.00f, 0.0f },
+    { "independent 10%",    0.10f, 0.00f, 0.0f },
+    { "short bursts",       0.00f, 0.05f, 0.5f },
+    { "long bursts",        0.00f, 0.02f, 0.2f },
+};
+
+
+/**
+ * Compares an estimate with its expected value, within MaxStdErrors of a proportion's standard
+ * error over n trials.
+ * @returns true if the estimate is close enough
+ */
+static
+bool
+checkProportion(
+    const char* what,
+    r64 estimate,
+    r64 expected,
+    r64 n)
+{
+    r64 stdError = (n > 0.0 ? sqrt(expected * (1.0 - expected) / n) : 0.0);
+    bool pass = (fabs(estimate - expected) <= MaxStdErrors * stdError + 1e-6);
+
+    printf("  %-16s %8.4f expected %8.4f +/- %.4f%s\n",
+           what, estimate, expected, MaxStdErrors * stdError, (pass ? "" : "  FAIL"));
+    return pass;
+}
+
+
+int main()
+{
+    initHighPerfTimer();
+    setPingTransport(&simTransport);
+    simReset(TestSeed);
+
+    const u32 numSequences = countof(Cases) * SequencesPerCase;
+    static Ping pings[numSequences];
+    static PingStatsEx statsEx[numSequences];
+    static u32 addresses[numSequences];
+
+    // all sequences run at once
+    for (u32 s = 0; s < numSequences; ++s)
+    {
+        const LossCase& lossCase = Cases[s / SequencesPerCase];
+        char host[16];
+        snprintf(host, sizeof(host), "10.2.0.%u", s + 1);
+
+        SimDestinationConfig config{};
+        inet_pton(AF_INET, host, &config.address);
+        addresses[s] = config.address;
+        config.distribution = SimLatency_Constant;
+        config.baseMS = 0.1f;
+        config.lossRate = lossCase.lossRate;
+        config.burstEnterRate = lossCase.enterRate;
+        config.burstExitRate = lossCase.exitRate;
+        config.ttl = 64;
+        simConfigureDestination(config);
+
+        statsEx[s].size = sizeof(PingStatsEx);
+        pings[s] = ping(host, MaxSequenceRequests, DefaultDataSize, DefaultTTL, TestTimeoutMS, 0);
+    }
+
+    for (u32 s = 0; s < numSequences; ++s) {
+        while (!pollResult(pings[s], &statsEx[s])) {
+            yieldThread();
+        }
+    }
+
+    bool pass = true;
+    for (u32 c = 0; c < countof(Cases); ++c)
+    {
+        const LossCase& lossCase = Cases[c];
+
+        // pool the sequences, weighting each fit by the requests it was taken over
+        u32 received = 0;
+        u32 lost = 0;
+        u32 bursts = 0;
+        u32 singleBursts = 0;
+        u32 truthBursts = 0;
+        r64 enterSum = 0.0;
+        r64 exitSum = 0.0;
+        bool failed = false;
+
+        for (u32 s = c * SequencesPerCase; s < (c + 1) * SequencesPerCase; ++s)
+        {
+            const PingStats& stats = pings[s].stats;
+            const PingStatsEx& ex = statsEx[s];
+
+            if (pings[s].status != Sequence_Finished || ex.version != PingStatsExVersion) {
+                failed = true;
+                continue;
+            }
+
+            received += stats.received;
+            lost += stats.lost;
+            bursts += ex.lossBursts;
+            singleBursts += ex.burstLengths[0];
+            enterSum += ex.burstEnterProb * stats.received;
+            exitSum += ex.burstExitProb * stats.lost;
+
+            SimDestinationStats truth{};
+            simGetStats(addresses[s], truth);
+            truthBursts += truth.lossBursts;
+        }
+
+        printf("%s: received %u lost %u, %u bursts (simulator %u), mean burst %.3f, "
+               "mean gap %.3f\n",
+               lossCase.name, received, lost, bursts, truthBursts,
+               (bursts > 0 ? (r64)lost / bursts : 0.0),
+               (bursts > 0 ? (r64)received / bursts : (r64)received));
+
+        if (failed) {
+            printf("  sequence failed\n");
+            pass = false;
+            continue;
+        }
+
+        // independent loss is a simple Gilbert chain with p the loss rate and r 1 - p
+        r64 p = (lossCase.enterRate > 0.f ? lossCase.enterRate : lossCase.lossRate);
+        r64 r = (lossCase.enterRate > 0.f ? lossCase.exitRate : 1.0 - lossCase.lossRate);
+
+        pass &= checkProportion("p", enterSum / max(received, 1U), p, received);
+        if (lost > 0)
+        {
+            pass &= checkProportion("r", exitSum / lost, r, lost);
+
+            // burst lengths are geometric, a share r of the bursts are a single lost request
+            pass &= checkProportion("single bursts", (r64)singleBursts / bursts, r, bursts);
+        }
+        else if (bursts != 0) {
+            printf("  bursts without a loss  FAIL\n");
+            pass = false;
+        }
+    }
+
+    printf("%s\n", (pass ? "PASS" : "FAIL"));
+    return (pass ? 0 : 1);
+}
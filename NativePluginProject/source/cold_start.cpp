@@ -0,0 +1,214 @@
+// Cold start benchmark of the job engine, the time from calling ping to the first reply arriving.
+// Each trial pings a loopback host once from one of these starting points:
+//   cold       no job thread, no resolved name, no socket, as for the first ping of a session
+//   started    job thread parked by startPingEngine, the name and socket are still cold
+//   prewarmed  startPingEngine then prewarmPing for the host, as a game would while loading
+//   warm       the previous trial pinged the same host, the floor the others are compared against
+// Writes the median, p90 and max of each, and the engine work the trials did, as JSON.
+//
+// usage: cold_start [trials] [host] [output.json]
+// The default host, localhost, is a name so the trials include resolving it. Needs raw socket
+// privileges like test.out.
+
+#define DefaultLogLevel LogLevel_Warn
+
+#include "build_config.h"
+#include "platform/platform.h"
+#include "platform/ping.h"
+#include <cstdio>
+
+#include "platform/platform.cpp"
+#include "platform/timer.cpp"
+#include "platform/ping.cpp"
+
+#define MaxTrials       10000
+#define TrialTimeoutMS  1000
+#define SettleMS        20      // time given to a started thread to park, or a prewarm job to run
+
+enum StartMode : u32 {
+    Start_Cold = 0,
+    Start_Started,
+    Start_Prewarmed,
+    Start_Warm,
+    NumStartModes
+};
+
+static const char* StartModeNames[NumStartModes] = { "cold", "started", "prewarmed", "warm" };
+
+static const r64 Percentiles[] = { 0.5, 0.9, 1.0 };
+static const char* PercentileNames[] = { "p50", "p90", "max" };
+
+
+static
+int
+compareR64(
+    const void* a,
+    const void* b)
+{
+    r64 x = *(const r64*)a;
+    r64 y = *(const r64*)b;
+    return (x < y ? -1 : (x > y ? 1 : 0));
+}
+
+
+static
+r64
+percentile(
+    const r64* sorted,
+    u32 count,
+    r64 p)
+{
+    if (count == 0) {
+        return 0.0;
+    }
+    u32 i = (u32)(p * (count - 1) + 0.5);
+    return sorted[i];
+}
+
+
+/**
+ * Puts the engine in the starting state of the mode. Stopping the engine closes the socket pool,
+ * the name cache is cleared directly since nothing else empties it.
+ */
+static
+void
+prepareTrial(
+    StartMode mode,
+    const char* host)
+{
+    if (mode == Start_Warm) {
+        return;
+    }
+
+    stopPingEngine();
+    memset(resolvedHosts, 0, sizeof(resolvedHosts));
+
+    if (mode == Start_Started || mode == Start_Prewarmed)
+    {
+        startPingEngine(nullptr);
+        if (mode == Start_Prewarmed) {
+            prewarmPing(&host, 1);
+        }
+        platformSleep(SettleMS);
+    }
+}
+
+
+/**
+ * Pings the host once.
+ * @returns milliseconds from the ping call to the reply, or a negative value if there was none
+ */
+static
+r64
+runTrial(
+    const char* host)
+{
+    i64 start = timer_queryCounts();
+    Ping p = ping(host, 1, DefaultDataSize, DefaultTTL, TrialTimeoutMS, 0);
+
+    r64 firstReplyMS = -1.0;
+    while (p.hnd != null_h32)
+    {
+        // the reply time is read before pollResult frees the job
+        PingJob* job = jobs[p.hnd];
+        if (job && job->sequence.status.load(std::memory_order_acquire) == Sequence_Finished
+            && job->sequence.requests[0].status == Ping_Received)
+        {
+            firstReplyMS = timer_millisBetween(start, job->sequence.requests[0].replyTime);
+        }
+        pollResult(p);
+        yieldThread();
+    }
+
+    return firstReplyMS;
+}
+
+
+int main(int argc, char *argv[])
+{
+    u32 trials = (argc > 1 ? (u32)atoi(argv[1]) : 100);
+    const char* host = (argc > 2 ? argv[2] : "localhost");
+    const char* outPath = (argc > 3 ? argv[3] : "cold_start.json");
+
+    trials = max(min(trials, (u32)MaxTrials), 1U);
+
+    initHighPerfTimer();
+
+    static r64 times[NumStartModes][MaxTrials];
+    u32 numTimes[NumStartModes]{};
+    u32 failures[NumStartModes]{};
+    PingMetrics work[NumStartModes]{};
+
+    // modes are interleaved so drift in the machine's load affects them all alike
+    for (u32 t = 0; t < trials; ++t)
+    {
+        for (u32 m = 0; m < NumStartModes; ++m)
+        {
+            prepareTrial((StartMode)m, host);
+
+            PingMetrics before{};
+            getPingMetrics(before);
+
+            r64 ms = runTrial(host);
+            if (ms >= 0.0) {
+                times[m][numTimes[m]++] = ms;
+            }
+            else {
+                ++failures[m];
+            }
+
+            PingMetrics after{};
+            getPingMetrics(after);
+            work[m].socketsCreated += after.socketsCreated - before.socketsCreated;
+            work[m].socketsReused += after.socketsReused - before.socketsReused;
+            work[m].hostsResolved += after.hostsResolved - before.hostsResolved;
+        }
+    }
+    stopPingEngine();
+
+    if (numTimes[Start_Warm] == 0) {
+        fprintf(stderr, "Ping to %s failed, raw sockets need root or cap_net_raw\n", host);
+        return 1;
+    }
+
+    FILE* out = fopen(outPath, "w");
+    if (!out) {
+        fprintf(stderr, "Failed to open %s\n", outPath);
+        return 1;
+    }
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"host\": \"%s\",\n", host);
+    fprintf(out, "  \"transport\": \"%s\",\n", transport->name);
+    fprintf(out, "  \"trials\": %u,\n", trials);
+    fprintf(out, "  \"firstReplyMS\": {\n");
+
+    for (u32 m = 0; m < NumStartModes; ++m)
+    {
+        qsort(times[m], numTimes[m], sizeof(r64), compareR64);
+
+        fprintf(out, "    \"%s\": {", StartModeNames[m]);
+        for (u32 i = 0; i < countof(Percentiles); ++i) {
+            fprintf(out, " \"%s\": %.4f,", PercentileNames[i],
+                    percentile(times[m], numTimes[m], Percentiles[i]));
+        }
+        fprintf(out, " \"failures\": %u, \"socketsCreated\": %llu, \"socketsReused\": %llu, "
+                     "\"hostsResolved\": %llu }%s\n",
+                failures[m],
+                (unsigned long long)work[m].socketsCreated,
+                (unsigned long long)work[m].socketsReused,
+                (unsigned long long)work[m].hostsResolved,
+                (m + 1 < NumStartModes ? "," : ""));
+
+        fprintf(stderr, "%-10s first reply p50 %.3f ms, p90 %.3f ms\n", StartModeNames[m],
+                percentile(times[m], numTimes[m], 0.5),
+                percentile(times[m], numTimes[m], 0.9));
+    }
+
+    fprintf(out, "  }\n}\n");
+    fclose(out);
+
+    fprintf(stderr, "results in %s\n", outPath);
+
+    return 0;
+}
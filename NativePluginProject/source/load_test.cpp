@@ -0,0 +1,329 @@
+// Loopback load test of the job engine. The kernel answers echo requests to any 127.x.y.z address,
+// so it serves as a local responder with no network in the way. Keeps a fixed number of ping
+// sequences in flight through ping/pollResult for a fixed time, then writes throughput, CPU cost,
+// RTT overhead percentiles and dropped results as JSON.
+//
+// usage: load_test [seconds] [concurrency] [output.json] [linux|io_uring] [latency mode cpu]
+// Needs raw socket privileges like test.out.
+
+#define MaxPingJobs     1024        // ceiling of the concurrency argument
+#define PacerRatePPS    1000000.0f  // loopback needs no pacing, don't let it cap the rate
+#define DefaultLogLevel LogLevel_Warn // per packet lines would only measure the console
+
+#include "build_config.h"
+#include "platform/platform.h"
+#include "platform/ping.h"
+#include "platform/ping_uring.h"
+#include <cstdio>
+
+#include "platform/platform.cpp"
+#include "platform/timer.cpp"
+#include "platform/ping.cpp"
+
+#define NumDestinations     256
+#define RequestsPerSequence MaxSequenceRequests
+#define LoadTimeoutMS       1000
+#define MaxSamples          (1U << 22)
+#define TraceFlushSeconds   0.1         // often enough to keep the trace rings from filling
+
+static const r64 Percentiles[] = { 0.5, 0.9, 0.99, 0.999 };
+static const char* PercentileNames[] = { "p50", "p90", "p99", "p999" };
+
+static r32* samples = nullptr;
+static u32  numSamples = 0;
+static u32  droppedSamples = 0;
+
+
+/**
+ * Copies the round trips of a finished sequence before pollResult frees the job.
+ */
+static
+void
+collectSamples(
+    const Ping& p)
+{
+    PingJob* job = jobs[p.hnd];
+    if (!job
+        || job->sequence.status.load(std::memory_order_acquire) != Sequence_Finished)
+    {
+        return;
+    }
+
+    for (u32 r = 0; r < job->sequence.numRequests; ++r)
+    {
+        const PingRequest& req = job->sequence.requests[r];
+        if (req.status != Ping_Received) {
+            continue;
+        }
+        if (numSamples < MaxSamples) {
+            samples[numSamples++] = req.elapsedMS;
+        }
+        else {
+            ++droppedSamples;
+        }
+    }
+}
+
+
+static
+int
+compareR32(
+    const void* a,
+    const void* b)
+{
+    r32 x = *(const r32*)a;
+    r32 y = *(const r32*)b;
+    return (x < y ? -1 : (x > y ? 1 : 0));
+}
+
+
+static
+r64
+percentile(
+    const r32* sorted,
+    u32 count,
+    r64 p)
+{
+    if (count == 0) {
+        return 0.0;
+    }
+    u32 i = (u32)(p * (count - 1) + 0.5);
+    return sorted[i];
+}
+
+
+/**
+ * Round trip of a single sequence with nothing else running, the floor the loaded RTTs are
+ * compared against.
+ * @returns median round trip in ms, or a negative value if the sequence failed
+ */
+static
+r64
+measureIdleRoundTrip()
+{
+    Ping p = ping("127.0.0.1", RequestsPerSequence, DefaultDataSize, DefaultTTL, LoadTimeoutMS, 0);
+    while (p.hnd != null_h32) {
+        collectSamples(p);
+        pollResult(p);
+        yieldThread();
+    }
+
+    if (p.status != Sequence_Finished || numSamples == 0) {
+        return -1.0;
+    }
+
+    qsort(samples, numSamples, sizeof(r32), compareR32);
+    r64 median = percentile(samples, numSamples, 0.5);
+    numSamples = 0;
+
+    return median;
+}
+
+
+int main(int argc, char *argv[])
+{
+    r64 durationS = (argc > 1 ? atof(argv[1]) : 5.0);
+    u32 concurrency = (argc > 2 ? (u32)atoi(argv[2]) : 256);
+    const char* outPath = (argc > 3 ? argv[3] : "load_test.json");
+    const char* transportName = (argc > 4 ? argv[4] : "linux");
+    s32 latencyCpu = (argc > 5 ? atoi(argv[5]) : -2);
+
+    concurrency = max(min(concurrency, (u32)MaxPingJobs), 1U);
+
+    initHighPerfTimer();
+
+    if (strcmp(transportName, "io_uring") == 0)
+    {
+        const PingTransport* uringTransport = getUringTransport();
+        if (!uringTransport) {
+            fprintf(stderr, "io_uring isn't available\n");
+            return 1;
+        }
+        setPingTransport(uringTransport);
+    }
+
+    // any cpu argument turns on latency mode, -1 runs it without pinning. Realtime priority is
+    // left off, the spinning job thread would starve this thread on a machine with one free CPU
+    if (latencyCpu >= -1)
+    {
+        PingLatencyConfig config{};
+        config.cpu = latencyCpu;
+        config.busyPollMicros = 0;     // loopback has no device queue to busy poll
+        config.enabled = 1;
+        setPingLatencyMode(&config);
+    }
+
+    samples = (r32*)malloc(MaxSamples * sizeof(r32));
+    if (!samples) {
+        fprintf(stderr, "Failed to allocate the RTT samples\n");
+        return 1;
+    }
+
+    r64 idleMS = measureIdleRoundTrip();
+    if (idleMS < 0.0) {
+        fprintf(stderr, "Loopback ping failed, raw sockets need root or cap_net_raw\n");
+        return 1;
+    }
+
+    char hosts[NumDestinations][16];
+    for (u32 d = 0; d < NumDestinations; ++d) {
+        snprintf(hosts[d], sizeof(hosts[d]), "127.1.%u.%u", d / 250, 1 + d % 250);
+    }
+
+    static Ping pings[MaxPingJobs];
+    u32 nextDest = 0;
+
+    u64 sent = 0;
+    u64 received = 0;
+    u64 lost = 0;
+    u32 sequences = 0;
+    u32 sequenceErrors = 0;
+    u32 startFailures = 0;
+
+    r64 cpuStart = platformGetCpuSeconds();
+    i64 start = timer_queryCounts();
+    bool starting = true;
+
+#if defined(PING_TRACE) && PING_TRACE != 0
+    i64 lastTraceFlush = start;
+#endif
+
+    for (;;)
+    {
+        starting = starting && (timer_querySecondsSince(start) < durationS);
+        u32 active = 0;
+
+        for (u32 s = 0; s < concurrency; ++s)
+        {
+            Ping& p = pings[s];
+
+            if (p.hnd != null_h32)
+            {
+                collectSamples(p);
+                if (!pollResult(p)) {
+                    ++active;
+                    continue;
+                }
+
+                ++sequences;
+                if (p.status == Sequence_Finished) {
+                    sent += p.stats.sent;
+                    received += p.stats.received;
+                    lost += p.stats.lost;
+                }
+                else {
+                    ++sequenceErrors;
+                }
+            }
+
+            // keep every slot busy until the run time is up
+            if (starting)
+            {
+                p = ping(hosts[nextDest], RequestsPerSequence, DefaultDataSize, DefaultTTL,
+                         LoadTimeoutMS, 0);
+                nextDest = (nextDest + 1) % NumDestinations;
+
+                if (p.hnd != null_h32) {
+                    ++active;
+                }
+                else {
+                    ++startFailures;
+                }
+            }
+        }
+
+#if defined(PING_TRACE) && PING_TRACE != 0
+        if (timer_querySecondsSince(lastTraceFlush) >= TraceFlushSeconds) {
+            tracingFlush("load_test_trace.json");
+            lastTraceFlush = timer_queryCounts();
+        }
+#endif
+
+        if (!starting && active == 0) {
+            break;
+        }
+        yieldThread();
+    }
+
+    r64 elapsedS = timer_querySecondsSince(start);
+    r64 cpuS = platformGetCpuSeconds() - cpuStart;
+
+#if defined(PING_TRACE) && PING_TRACE != 0
+    tracingFlush("load_test_trace.json");
+#endif
+
+    PingMetrics metrics{};
+    getPingMetrics(metrics);
+
+    qsort(samples, numSamples, sizeof(r32), compareR32);
+
+    FILE* out = fopen(outPath, "w");
+    if (!out) {
+        fprintf(stderr, "Failed to open %s\n", outPath);
+        return 1;
+    }
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"transport\": \"%s\",\n", transport->name);
+    fprintf(out, "  \"seconds\": %.3f,\n", elapsedS);
+    fprintf(out, "  \"concurrency\": %u,\n", concurrency);
+    fprintf(out, "  \"destinations\": %u,\n", (u32)NumDestinations);
+    fprintf(out, "  \"sequences\": %u,\n", sequences);
+    fprintf(out, "  \"sent\": %llu,\n", (unsigned long long)sent);
+    fprintf(out, "  \"received\": %llu,\n", (unsigned long long)received);
+    fprintf(out, "  \"probesPerSecond\": %.0f,\n", (r64)sent / elapsedS);
+    fprintf(out, "  \"cpuSeconds\": %.3f,\n", cpuS);
+    fprintf(out, "  \"cpuMicrosPerProbe\": %.3f,\n", (sent > 0 ? cpuS * 1.0e6 / (r64)sent : 0.0));
+    fprintf(out, "  \"dropped\": { \"timedOut\": %llu, \"sequenceErrors\": %u, "
+                 "\"startFailures\": %u, \"samplesNotKept\": %u },\n",
+            (unsigned long long)lost, sequenceErrors, startFailures, droppedSamples);
+    fprintf(out, "  \"idleRttMS\": %.4f,\n", idleMS);
+    fprintf(out, "  \"jobLoop\": { \"iterations\": %llu, \"avgMicros\": %.3f, "
+                 "\"maxMicros\": %llu, \"repliesIgnored\": %llu, \"receivePending\": %llu, "
+                 "\"sendPending\": %llu },\n",
+            (unsigned long long)metrics.loopIterations,
+            (r64)metrics.loopMicros / (r64)max(metrics.loopIterations, 1ULL),
+            (unsigned long long)metrics.maxLoopMicros,
+            (unsigned long long)metrics.repliesIgnored,
+            (unsigned long long)metrics.receivePending,
+            (unsigned long long)metrics.sendPending);
+
+    // reply timestamp delay and its jitter in us, measured in latency mode
+    r64 delayMean = 0.0;
+    r64 delayStdDev = 0.0;
+    if (metrics.timestampSamples > 0) {
+        r64 n = (r64)metrics.timestampSamples;
+        delayMean = (r64)metrics.timestampDelayNanos / n / 1000.0;
+        delayStdDev = sqrt(max((r64)metrics.timestampDelaySqMicros / n - delayMean * delayMean,
+                               0.0));
+    }
+    fprintf(out, "  \"latencyMode\": %s,\n", (latencyCpu >= -1 ? "true" : "false"));
+    fprintf(out, "  \"timestampDelayMicros\": { \"samples\": %llu, \"mean\": %.3f, "
+                 "\"jitter\": %.3f, \"max\": %.3f },\n",
+            (unsigned long long)metrics.timestampSamples,
+            delayMean, delayStdDev,
+            (r64)metrics.maxTimestampDelayNanos / 1000.0);
+
+    fprintf(out, "  \"rttMS\": {");
+    for (u32 i = 0; i < countof(Percentiles); ++i) {
+        fprintf(out, "%s \"%s\": %.4f", (i > 0 ? "," : ""), PercentileNames[i],
+                percentile(samples, numSamples, Percentiles[i]));
+    }
+    fprintf(out, " },\n");
+
+    // time added to the idle round trip by the load, in the engine and the kernel
+    fprintf(out, "  \"rttOverheadMS\": {");
+    for (u32 i = 0; i < countof(Percentiles); ++i) {
+        fprintf(out, "%s \"%s\": %.4f", (i > 0 ? "," : ""), PercentileNames[i],
+                percentile(samples, numSamples, Percentiles[i]) - idleMS);
+    }
+    fprintf(out, " }\n}\n");
+    fclose(out);
+
+    fprintf(stderr, "%.0f probes/sec at %u sequences in flight, results in %s\n",
+            (r64)sent / elapsedS, concurrency, outPath);
+
+    free(samples);
+
+    return 0;
+}
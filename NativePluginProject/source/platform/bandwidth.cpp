@@ -0,0 +1,366 @@
+#include "bandwidth.h"
+#include "timer.h"
+
+static BandwidthJobMap bandwidths;
+
+
+/**
+ * @returns median of the values, which are sorted in place
+ */
+static
+r32
+sortedMedian(
+    r32* values,
+    u32 count)
+{
+    if (count == 0) {
+        return 0.f;
+    }
+
+    // insertion sort, there are at most MaxTrains values
+    for (u32 i = 1; i < count; ++i)
+    {
+        r32 v = values[i];
+        u32 j = i;
+        for (; j > 0 && values[j-1] > v; --j) {
+            values[j] = values[j-1];
+        }
+        values[j] = v;
+    }
+
+    return (count & 1 ? values[count / 2]
+                      : 0.5f * (values[count / 2 - 1] + values[count / 2]));
+}
+
+
+/**
+ * Matches a reply to its request in the current train by seq, replies to earlier trains are
+ * ignored.
+ */
+static
+void
+handleTrainReply(
+    BandwidthJob& job,
+    u32 bytes,
+    i64 replyTime)
+{
+    const IPHeader& ip = *(const IPHeader*)job.receiveBuffer;
+    const ICMPHeader& reply =
+        *(const ICMPHeader*)(job.receiveBuffer + ip.headerLen * sizeof(u32));
+
+    u16 seq = ntohs(reply.seq);
+    u32 k = seq % MaxTrainLength;
+
+    if (ntohs(ip.totalLen) > bytes
+        || ntohs(ip.totalLen) < ip.headerLen * sizeof(u32) + sizeof(ICMPHeader)
+        || reply.type != ICMPType_EchoReply
+        || reply.id != job.id
+        || job.sourceAddr.sin_addr.s_addr != job.destAddr.sin_addr.s_addr
+        || seq / MaxTrainLength != job.train
+        || k >= job.nextProbe
+        || !job.probes[k].waiting)
+    {
+        addMetric(metricIndex(repliesIgnored));
+        return;
+    }
+
+    TrainProbe& probe = job.probes[k];
+    probe.replyTime = max(replyTime, probe.sendTime);
+    probe.waiting = 0;
+    --job.numWaiting;
+    ++job.stats.received;
+}
+
+
+/**
+ * Adds the capacity and loaded round trip estimates of the train that was just answered.
+ */
+static
+void
+measureTrain(
+    BandwidthJob& job)
+{
+    i64 firstArrival = 0;
+    i64 lastArrival = 0;
+    u32 numReplies = 0;
+    r32 maxRoundTrip = 0.f;
+
+    for (u32 k = 0; k < job.trainLength; ++k)
+    {
+        const TrainProbe& probe = job.probes[k];
+        if (probe.replyTime == 0) {
+            continue;
+        }
+
+        if (numReplies == 0 || probe.replyTime < firstArrival) {
+            firstArrival = probe.replyTime;
+        }
+        lastArrival = max(lastArrival, probe.replyTime);
+        ++numReplies;
+
+        r32 roundTrip = (r32)timer_millisBetween(probe.sendTime, probe.replyTime);
+        maxRoundTrip = max(maxRoundTrip, roundTrip);
+        if (k == 0 && (job.stats.idleRoundTrip == 0.f || roundTrip < job.stats.idleRoundTrip)) {
+            job.stats.idleRoundTrip = roundTrip;
+        }
+    }
+
+    if (numReplies > 0) {
+        job.loadedRoundTrips[job.numLoaded++] = maxRoundTrip;
+    }
+
+    // replies that arrived within the same timer tick can't be timed, the path is faster than
+    // the clock (or the replies were only stamped as they were read)
+    r64 dispersion = timer_secondsBetween(firstArrival, lastArrival);
+    if (numReplies >= 2 && dispersion > 0.0)
+    {
+        r64 bits = (r64)(numReplies - 1) * job.packetSize * 8.0;
+        job.capacities[job.numCapacities++] = (r32)(bits / dispersion / 1000000.0);
+    }
+}
+
+
+SequenceStatus
+runBandwidth(
+    BandwidthHnd hnd)
+{
+    BandwidthJob* pJob = bandwidths[hnd];
+    if (!pJob) {
+        return Sequence_Error;
+    }
+    BandwidthJob& job = *pJob;
+
+    SequenceStatus status = (SequenceStatus)job.status.load(std::memory_order_relaxed);
+
+    if (status == Sequence_Inactive)
+    {
+        if (ok(resolveHost(job.host, job.destAddr))
+            && ok(acquireSocket(DefaultTTL, job.id, job.socket)))
+        {
+            // without kernel timestamps replies are timed as they're read, which still works
+            // while the job thread keeps up with them
+            if (transport->enableReceiveTimestamps) {
+                transport->enableReceiveTimestamps(job.socket);
+            }
+            status = Sequence_Running;
+        }
+        else {
+            status = Sequence_Error;
+        }
+    }
+
+    if (status == Sequence_Running)
+    {
+        u16 packetSize = job.packetSize - sizeof(IPHeader);
+
+        // send the rest of the train back to back, a full socket buffer continues it on the
+        // next iteration
+        while (job.nextProbe < job.trainLength)
+        {
+            u32 k = job.nextProbe;
+            ICMPHeader requestHdr;
+            makePingPacket(
+                job.sendBuffer,
+                packetSize,
+                job.id,
+                (u16)(job.train * MaxTrainLength + k),
+                requestHdr);
+
+            i64 sendTime = timer_queryCounts();
+            s32 result = transportSend(
+                job.socket,
+                job.destAddr,
+                job.sendBuffer,
+                packetSize,
+                DefaultTTL,
+                0);
+
+            if (result == Result_Pending) {
+                break;
+            }
+            if (result == Result_Error) {
+                status = Sequence_Error;
+                break;
+            }
+
+            TrainProbe& probe = job.probes[k];
+            probe.sendTime = sendTime;
+            probe.waiting = 1;
+            ++job.numWaiting;
+            ++job.nextProbe;
+            ++job.stats.sent;
+        }
+
+        while (status == Sequence_Running && job.numWaiting > 0)
+        {
+            u32 bytes;
+            i64 replyTime;
+            s32 result = transportReceiveTimestamped(
+                job.socket,
+                job.receiveBuffer,
+                ReceiveBufferSize,
+                job.sourceAddr,
+                bytes,
+                replyTime);
+
+            if (result != Result_Success) {
+                break;
+            }
+            handleTrainReply(job, bytes, replyTime);
+        }
+
+        i64 now = timer_queryCounts();
+        for (u32 k = 0; k < job.nextProbe; ++k)
+        {
+            TrainProbe& probe = job.probes[k];
+            if (probe.waiting && timer_millisBetween(probe.sendTime, now) >= job.timeoutMS) {
+                probe.waiting = 0;
+                --job.numWaiting;
+                addMetric(metricIndex(requestsTimedOut));
+            }
+        }
+
+        if (status == Sequence_Running
+            && job.nextProbe == job.trainLength
+            && job.numWaiting == 0)
+        {
+            if (job.trainEndTime == 0) {
+                measureTrain(job);
+                job.trainEndTime = now;
+                TRACE_INSTANT("bandwidth train", hnd.value, job.train);
+            }
+
+            if (job.train + 1 == job.numTrains) {
+                status = Sequence_Finished;
+            }
+            else if (timer_millisBetween(job.trainEndTime, now) >= TrainGapMS) {
+                memset(job.probes, 0, sizeof(job.probes));
+                job.trainEndTime = 0;
+                job.nextProbe = 0;
+                ++job.train;
+            }
+        }
+
+        if (status == Sequence_Finished)
+        {
+            BandwidthStats& stats = job.stats;
+            stats.trainsMeasured = job.numCapacities;
+            stats.capacityMbps = sortedMedian(job.capacities, job.numCapacities);
+            stats.loadedRoundTrip = sortedMedian(job.loadedRoundTrips, job.numLoaded);
+            stats.addedDelayMS = (job.numLoaded > 0 && stats.idleRoundTrip > 0.f
+                                  ? max(stats.loadedRoundTrip - stats.idleRoundTrip, 0.f)
+                                  : 0.f);
+        }
+
+        if (status > Sequence_Running) {
+            releaseSocket(job.id, job.socket, (status == Sequence_Error));
+        }
+    }
+
+    job.status.store(status, std::memory_order_release);
+    return status;
+}
+
+
+void
+abortBandwidth(
+    BandwidthHnd hnd)
+{
+    BandwidthJob* pJob = bandwidths[hnd];
+    if (!pJob) {
+        return;
+    }
+    BandwidthJob& job = *pJob;
+
+    SequenceStatus status = (SequenceStatus)job.status.load(std::memory_order_relaxed);
+    if (status == Sequence_Running) {
+        releaseSocket(job.id, job.socket, true);
+    }
+    if (status <= Sequence_Running) {
+        job.status.store(Sequence_Error, std::memory_order_release);
+    }
+}
+
+
+Bandwidth
+estimateBandwidth(
+    const char* host,
+    u16 packetSize,
+    u8  trainLength,
+    u8  numTrains,
+    u16 timeoutMS)
+{
+    Bandwidth b{ null_h32, Sequence_Inactive, {} };
+
+    if (!host
+        || packetSize < sizeof(IPHeader) + sizeof(ICMPHeader)
+        || trainLength < 2
+        || numTrains == 0)
+    {
+        b.status = Sequence_Error;
+        return b;
+    }
+
+    BandwidthJob* pJob = nullptr;
+    b.hnd = bandwidths.insert(nullptr, &pJob);
+
+    if (b.hnd != null_h32)
+    {
+        BandwidthJob& job = *pJob;
+
+        size_t hostLen = strlen(host);
+        job.host = (char*)malloc(hostLen+1);
+        memcpy(job.host, host, hostLen+1);
+
+        job.packetSize = min(packetSize, (u16)MaxPathMtu);
+        job.trainLength = min(trainLength, (u8)MaxTrainLength);
+        job.numTrains = min(numTrains, (u8)MaxTrains);
+        job.timeoutMS = (timeoutMS > 0 ? timeoutMS : (u16)DefaultTimeoutMS);
+        job.stats.packetSize = job.packetSize;
+        // ids following the pmtu jobs' ids keep train replies out of the other jobs
+        job.id = htons((u16)(getIcmpIdBase() + MaxPingJobs + MaxSweepJobs + MaxTracerouteJobs
+                             + MaxPmtuJobs + b.hnd.index));
+
+        jobQueue.push(b.hnd);
+        addMetric(metricIndex(jobsQueued));
+        TRACE_INSTANT("bandwidth submitted", b.hnd.value, job.numTrains);
+
+        startPingJobThread();
+    }
+
+    return b;
+}
+
+
+bool
+pollBandwidthResult(
+    Bandwidth& bandwidth)
+{
+    addMetric(metricIndex(polls));
+
+    if (bandwidth.hnd != null_h32)
+    {
+        BandwidthJob* job = bandwidths[bandwidth.hnd];
+        if (job)
+        {
+            bandwidth.status = (SequenceStatus)job->status.load(std::memory_order_acquire);
+
+            if (bandwidth.status > Sequence_Running)
+            {
+                if (bandwidth.status == Sequence_Finished) {
+                    bandwidth.stats = job->stats;
+                }
+                TRACE_INSTANT("bandwidth polled", bandwidth.hnd.value, bandwidth.status);
+                free(job->host);
+                bandwidths.erase(bandwidth.hnd);
+                bandwidth.hnd = null_h32;
+            }
+        }
+        else {
+            bandwidth.status = Sequence_Error;
+            bandwidth.hnd = null_h32;
+        }
+    }
+
+    return (bandwidth.status > Sequence_Running);
+}
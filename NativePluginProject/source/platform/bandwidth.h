@@ -0,0 +1,141 @@
+#ifndef _BANDWIDTH_H
+#define _BANDWIDTH_H
+
+#include "ping.h"
+
+#define MaxTrainLength      64      // requests in one train
+#define MaxTrains           16
+#define DefaultTrainLength  16
+#define DefaultNumTrains    4
+#define TrainGapMS          20      // pause after a train is answered, so the queues it built drain
+#define BandwidthJobTypeId  6
+
+typedef h32 BandwidthHnd;
+
+struct BandwidthStats {
+    r32         capacityMbps;       // bottleneck capacity, median of the trains' estimates, 0 if
+                                    // no train's replies were spread out enough to time
+    r32         idleRoundTrip;      // fastest round trip of a train's first request, which finds
+                                    // the queues empty
+    r32         loadedRoundTrip;    // median of the trains' slowest round trips
+    r32         addedDelayMS;       // loadedRoundTrip - idleRoundTrip, the queueing delay a
+                                    // burst of this size causes on the path
+    u32         sent;
+    u32         received;
+    u16         packetSize;         // IP packet size of the requests
+    u16         trainsMeasured;     // trains with a capacity estimate
+};
+
+/**
+ * Request of a train, job thread only.
+ */
+struct TrainProbe {
+    i64         sendTime;           // taken just before the send
+    i64         replyTime;          // arrival of the reply, 0 while none has come
+    u8          waiting;
+
+    u8          _pad[7];
+};
+
+/**
+ * Bandwidth jobs estimate the capacity of the path's narrowest link, and how much round trip a
+ * burst adds to it, with packet trains. Each train is trainLength echo requests of packetSize
+ * sent back to back. At the bottleneck they queue and leave one transmission time apart, and the
+ * replies keep that spacing (dispersion) on the way back, so
+ *     capacity = (replies - 1) * packetSize * 8 / (last reply arrival - first reply arrival)
+ * The first request of a train finds the queues empty and measures the idle round trip. The
+ * last ones wait behind the rest of the train, so their extra round trip shows how deep the
+ * queues on the path get (bufferbloat shows up as an added delay well beyond the train's own
+ * transmission time). Trains are repeated numTrains times TrainGapMS apart and the median is
+ * kept, which discards trains squeezed or spread by cross traffic.
+ *
+ * Reply arrivals are taken from the kernel's receive timestamps where the transport has them, so
+ * they don't depend on when the job thread gets to read the replies.
+ */
+struct BandwidthJob {
+    atomic_u32  status;             // SequenceStatus
+
+    char*       host;
+    u16         id;                 // ICMP id of the job's requests, network byte order
+    u16         timeoutMS;
+    u16         packetSize;         // IP packet size, the ICMP packet sent is 20 bytes less
+    u8          trainLength;
+    u8          numTrains;
+    u8          train;              // trains started
+    u8          nextProbe;          // next request of the train to send
+    u8          numWaiting;         // requests of the train waiting for a reply
+    u8          numCapacities;
+    u8          numLoaded;
+
+    u8          _pad[3];
+
+    i64         trainEndTime;       // when the last train was answered, 0 while one is running
+
+    r32         capacities[MaxTrains];      // Mbps
+    r32         loadedRoundTrips[MaxTrains];
+    BandwidthStats stats;           // sent, received and idleRoundTrip as the job runs, the rest
+                                    // as it finishes
+
+    TrainProbe  probes[MaxTrainLength];
+
+    SOCKET      socket;
+    sockaddr_in destAddr;
+    sockaddr_in sourceAddr;
+    u8          sendBuffer[MaxSendSize];
+    u8          receiveBuffer[ReceiveBufferSize];
+};
+
+struct Bandwidth {
+    BandwidthHnd   hnd;
+    SequenceStatus status;
+    BandwidthStats stats;
+};
+
+
+SparseHandleMap16_Typed_WithBuffer(
+    BandwidthJob,
+    BandwidthJobMap,
+    BandwidthHnd,
+    BandwidthJobTypeId,
+    MaxBandwidthJobs);
+
+
+/**
+ * Adds a packet train bandwidth job and runs it on the job thread. This is a non-blocking call.
+ * The defaults send 4 trains of 16 requests of 1500 bytes, about 100 KB each way, and take 4
+ * round trips plus 3 * TrainGapMS.
+ * @param host  host name or dotted-quad IP of the destination
+ * @param packetSize  IP packet size of the requests, at most MaxPathMtu. Larger packets time the
+ *  bottleneck better, but a size over the path MTU is fragmented, use discoverPmtu's pathMtu
+ * @param trainLength  requests per train, 2 to MaxTrainLength. A longer train fills deeper queues
+ * @param numTrains  trains sent, at most MaxTrains
+ * @returns Bandwidth struct with a non-zero hnd on success, or 0 in hnd if the bandwidth job map
+ *  is full
+ */
+Bandwidth
+estimateBandwidth(
+    const char* host,
+    u16 packetSize  = MaxPathMtu,
+    u8  trainLength = DefaultTrainLength,
+    u8  numTrains   = DefaultNumTrains,
+    u16 timeoutMS   = DefaultTimeoutMS);
+
+/**
+ * Checks the job for completion. When bandwidth.status is Sequence_Finished, bandwidth.stats is
+ * filled, the job is removed and bandwidth.hnd is cleared to zero.
+ * @returns true if the job is finished (Sequence_Finished or Sequence_Error)
+ */
+bool
+pollBandwidthResult(
+    Bandwidth& bandwidth);
+
+
+SequenceStatus
+runBandwidth(
+    BandwidthHnd hnd);
+
+void
+abortBandwidth(
+    BandwidthHnd hnd);
+
+#endif
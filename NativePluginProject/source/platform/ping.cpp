@@ -1,4 +1,17 @@
 #include "ping.h"
+#include "sweep.h"
+#include "race.h"
+#include "traceroute.h"
+#include "pmtu.h"
+#include "bandwidth.h"
+#include "ping_sim.h"
+#include "ping_metrics.h"
+#include "ping_trace.h"
+#include "ping_log.h"
+#include "ping_probelog.h"
+#include "ping_cache.h"
+#include "ping_rolling.h"
+#include "ping_uring.h"
 #include "timer.h"
 #include "platform.h"
 #include <cmath>
@@ -6,6 +19,175 @@
 static PingJobMap   jobs;
 static PingJobQueue jobQueue;
 
+// only accessed from the job thread
+static PingDestinationMap destinations;
+
+// read by the job thread when it starts and creates sockets
+static PingLatencyConfig latencyConfig{ -1, 0, 0, 0 };
+
+/**
+ * Socket for an ICMP id, kept open between the jobs that send with it. Ids belong to job slots, so
+ * the socket's filter stays right for every job that runs in the slot.
+ */
+struct PooledSocket {
+    const PingTransport* transport; // transport that created the socket, nullptr for none
+    SOCKET      socket;
+};
+
+/**
+ * Host name resolved by the job thread.
+ */
+struct ResolvedHost {
+    char        host[MaxResolvedHostLength];
+    u32         address;        // network byte order
+    i64         resolvedTime;   // timer counts, 0 for an empty slot
+};
+
+// only accessed from the job thread, the pool is closed as the thread ends
+static PooledSocket socketPool[MaxIcmpIds];
+static u32          numPooledSockets = 0;   // open, whether or not a job is using them
+static ResolvedHost resolvedHosts[MaxResolvedHosts];
+
+// hosts waiting for the prewarm job, at most one prewarm job is queued at a time
+static atomic_lock prewarmLock = ATOMIC_FLAG_INIT;
+static char*       prewarmHosts[MaxPrewarmHosts];
+static u32         numPrewarmHosts = 0;
+static u32         numPrewarmSockets = 0;
+static bool        prewarmQueued = false;
+
+// job thread lifecycle, the flag is set from the thread's start until it decides to end
+static atomic_lock     jobThreadRunning = ATOMIC_FLAG_INIT;
+static PlatformThread  jobThread{};
+static std::atomic<u8> idlePolicy{ PingIdle_Exit };
+static atomic_u32      idleTimeoutMS{ DefaultIdleExitMS };
+
+
+/**
+ * Applies latency mode to the job thread, called as it starts.
+ */
+static
+void
+applyJobThreadLatencyMode()
+{
+    if (!latencyConfig.enabled) {
+        return;
+    }
+    if (latencyConfig.cpu >= 0 && platformSetThreadAffinity((u32)latencyConfig.cpu) != 0) {
+        LOG_WARN("Failed to pin the job thread to CPU %d", latencyConfig.cpu);
+    }
+    if (latencyConfig.realtime && platformSetThreadRealtime() != 0) {
+        LOG_WARN("Failed to set realtime priority on the job thread");
+    }
+}
+
+
+/**
+ * Waits for the next job as the idle policy says. In latency mode the thread polls the queue, so
+ * a new job doesn't wait for the thread to be woken and scheduled, for as long as the policy lets
+ * it idle. The poll yields, on a CPU of its own the thread keeps running and on a shared CPU it
+ * doesn't starve the threads queueing the jobs.
+ * @returns false if the policy is PingIdle_Exit and no job arrived in time
+ */
+static
+bool
+waitForJob(
+    PingJobHnd* outHnd)
+{
+    u8 policy = idlePolicy.load(std::memory_order_relaxed);
+    u32 idleMS = idleTimeoutMS.load(std::memory_order_relaxed);
+
+    if (policy == PingIdle_Spin || latencyConfig.enabled)
+    {
+        i64 start = timer_queryCounts();
+        while (!jobQueue.try_pop(outHnd))
+        {
+            if (idleMS > 0 && timer_queryMillisSince(start) >= idleMS) {
+                if (policy == PingIdle_Exit) {
+                    return false;
+                }
+                jobQueue.wait_pop(outHnd);
+                return true;
+            }
+            yieldThread();
+        }
+        return true;
+    }
+
+    if (policy == PingIdle_Exit) {
+        return jobQueue.wait_pop(outHnd, idleMS);
+    }
+
+    jobQueue.wait_pop(outHnd);
+    return true;
+}
+
+
+/**
+ * Gives up the running flag as the job thread ends on an idle timeout. A job queued just before
+ * may have found the flag still set and not started a thread, so the thread takes the flag back
+ * and keeps running if the queue isn't empty and no other thread has started.
+ * @returns true if the thread should end
+ */
+static
+bool
+releaseJobThread()
+{
+    jobThreadRunning.clear();
+    return (jobQueue.empty() || jobThreadRunning.test_and_set());
+}
+
+
+static
+void
+closePooledSocket(
+    PooledSocket& pooled)
+{
+    if (pooled.transport) {
+        pooled.transport->closeSocket(pooled.socket);
+        pooled.transport = nullptr;
+        --numPooledSockets;
+    }
+}
+
+
+/**
+ * Ends the running jobs and the jobs still queued as the job thread stops, so none of them is
+ * left polling as running with nothing to run it.
+ */
+static
+void
+abortJobs(
+    const PingJobHnd* runningJobs,
+    u32 numRunning)
+{
+    for (u32 j = 0; j < numRunning; ++j) {
+        abortJob(runningJobs[j]);
+    }
+
+    PingJobHnd hnd = null_h32;
+    while (jobQueue.try_pop(&hnd))
+    {
+        if (hnd != null_h32) {
+            abortJob(hnd);
+        }
+    }
+}
+
+
+/**
+ * Closes the sockets kept open between jobs, called by the job thread as it ends. The transport
+ * gets one more iteration to submit the closes it queues.
+ */
+static
+void
+closeSocketPool()
+{
+    for (u32 s = 0; s < MaxIcmpIds; ++s) {
+        closePooledSocket(socketPool[s]);
+    }
+    transportEndIteration();
+}
+
 
 #ifdef _WIN32
 #include "ping_win32.cpp"
@@ -13,6 +195,308 @@ static PingJobQueue jobQueue;
 #include "ping_linux.cpp"
 #endif
 
+static const PingTransport* transport = &platformTransport;
+
+
+/**
+ * Starts the job thread if it isn't running, called each time a job is queued.
+ * @returns Result_Success, or Result_Error if the thread can't be created
+ */
+static
+s32
+startPingJobThread()
+{
+    if (!jobThreadRunning.test_and_set())
+    {
+        // a thread that ended on an idle timeout is still joinable
+        platformJoinThread(jobThread);
+
+        if (platformStartThread(jobThread, pingJobProcess, nullptr) != 0) {
+            LOG_ERROR("Failed to start the job thread");
+            jobThreadRunning.clear();
+            return Result_Error;
+        }
+    }
+
+    return Result_Success;
+}
+
+
+static
+bool
+isNullJob(
+    void* hnd)
+{
+    return (*(PingJobHnd*)hnd == null_h32);
+}
+
+
+s32
+startPingEngine(
+    const PingEngineConfig* config)
+{
+    idlePolicy.store((config ? config->idlePolicy : (u8)PingIdle_Park), std::memory_order_relaxed);
+    idleTimeoutMS.store((config ? config->idleMS : 0), std::memory_order_relaxed);
+
+    return startPingJobThread();
+}
+
+
+void
+stopPingEngine()
+{
+    if (jobThreadRunning.test_and_set())
+    {
+        // a null handle ends the thread
+        jobQueue.push(null_h32);
+        platformJoinThread(jobThread);
+
+        // the thread may have ended on an idle timeout before taking it
+        PingJobHnd hnd = null_h32;
+        jobQueue.try_pop_if(&hnd, isNullJob);
+    }
+    else {
+        platformJoinThread(jobThread);
+    }
+
+    jobThreadRunning.clear();
+}
+
+
+static inline
+s32
+transportSend(
+    SOCKET socket,
+    const sockaddr_in& dest,
+    const u8* buffer,
+    u32 packetSize,
+    u8 ttl,
+    u8 tos)
+{
+    s32 result = transport->sendPacket(socket, dest, buffer, packetSize, ttl, tos);
+
+    if (result == Result_Success)      { addMetric(metricIndex(packetsSent)); }
+    else if (result == Result_Pending) { addMetric(metricIndex(sendPending)); }
+    else                               { addMetric(metricIndex(sendErrors)); }
+
+    return result;
+}
+
+
+/**
+ * @param outBytes  size of the packet read, 0 unless the result is Result_Success
+ */
+static inline
+s32
+transportReceive(
+    SOCKET socket,
+    u8* recvBuffer,
+    u32 bufferSize,
+    sockaddr_in& source,
+    u32& outBytes)
+{
+    outBytes = 0;
+    s32 result = transport->receivePacket(socket, recvBuffer, bufferSize, source, outBytes);
+
+    if (result == Result_Success)      { addMetric(metricIndex(packetsReceived)); }
+    else if (result == Result_Pending) { addMetric(metricIndex(receivePending)); }
+    else                               { addMetric(metricIndex(receiveErrors)); }
+
+    return result;
+}
+
+
+/**
+ * Receives like transportReceive, with the time the packet arrived. Transports without receive
+ * timestamps give the time it was read.
+ * @param receiveTime  arrival of the packet in timer counts
+ */
+static inline
+s32
+transportReceiveTimestamped(
+    SOCKET socket,
+    u8* recvBuffer,
+    u32 bufferSize,
+    sockaddr_in& source,
+    u32& outBytes,
+    i64& receiveTime)
+{
+    if (!transport->receiveTimestampedPacket) {
+        s32 result = transportReceive(socket, recvBuffer, bufferSize, source, outBytes);
+        receiveTime = timer_queryCounts();
+        return result;
+    }
+
+    outBytes = 0;
+    s32 result = transport->receiveTimestampedPacket(
+        socket, recvBuffer, bufferSize, source, outBytes, receiveTime);
+
+    if (result == Result_Success)      { addMetric(metricIndex(packetsReceived)); }
+    else if (result == Result_Pending) { addMetric(metricIndex(receivePending)); }
+    else                               { addMetric(metricIndex(receiveErrors)); }
+
+    return result;
+}
+
+
+/**
+ * First ICMP id of this process. Each ping and sweep job sends with its own id from a block of
+ * MaxIcmpIds, so replies can be told apart between the raw sockets of one process, which all see
+ * every ICMP packet. Blocks are picked by pid so concurrent processes rarely overlap.
+ */
+static
+u16
+getIcmpIdBase()
+{
+    static const u16 idBase = (u16)((platformGetPid() % (0x10000 / MaxIcmpIds)) * MaxIcmpIds);
+    return idBase;
+}
+
+
+/**
+ * @param id  ICMP id from the block starting at getIcmpIdBase, network byte order
+ */
+static inline
+PooledSocket&
+getPooledSocket(
+    u16 id)
+{
+    return socketPool[(u16)(ntohs(id) - getIcmpIdBase()) % MaxIcmpIds];
+}
+
+
+/**
+ * Opens a socket for the id into the pool, closing a socket left over from a transport that has
+ * since been replaced.
+ * @returns 0 on success, -1 on error
+ */
+static
+s32
+createPooledSocket(
+    PooledSocket& pooled,
+    u8 ttl,
+    u16 id)
+{
+    closePooledSocket(pooled);
+
+    if (!ok(transport->createSocket(ttl, id, pooled.socket))) {
+        return Result_Error;
+    }
+    pooled.transport = transport;
+    ++numPooledSockets;
+    addMetric(metricIndex(socketsCreated));
+
+    return Result_Success;
+}
+
+
+/**
+ * Takes the pooled socket for the id as a job starts, creating it if there isn't one. Replies
+ * that reached a pooled socket after its last job ended are read and dropped, a late reply to
+ * that job's first request would otherwise pass for one to this job's.
+ * @param ttl  initial TTL of a new socket, each packet is sent with its own
+ * @param id  ICMP id of the job, network byte order
+ * @returns 0 on success, -1 on error
+ */
+static
+s32
+acquireSocket(
+    u8 ttl,
+    u16 id,
+    SOCKET& outSocket)
+{
+    PooledSocket& pooled = getPooledSocket(id);
+
+    if (pooled.transport == transport)
+    {
+        u8 discard[ReceiveBufferSize];
+        sockaddr_in from;
+        u32 bytes;
+        while (transport->receivePacket(pooled.socket, discard, sizeof(discard), from, bytes)
+               == Result_Success) {}
+
+        addMetric(metricIndex(socketsReused));
+    }
+    else if (!ok(createPooledSocket(pooled, ttl, id))) {
+        return Result_Error;
+    }
+
+    outSocket = pooled.socket;
+    return Result_Success;
+}
+
+
+/**
+ * Hands a job's socket back to the pool as the job ends. The socket is closed instead if more than
+ * MaxPooledSockets are open, so sockets are only kept while the engine is lightly loaded, and if
+ * the job ended in an error, in case the socket is what failed.
+ */
+static
+void
+releaseSocket(
+    u16 id,
+    SOCKET socket,
+    bool failed)
+{
+    PooledSocket& pooled = getPooledSocket(id);
+
+    if (pooled.transport != transport || pooled.socket != socket) {
+        transport->closeSocket(socket);
+    }
+    else if (failed || numPooledSockets > MaxPooledSockets) {
+        closePooledSocket(pooled);
+    }
+}
+
+
+/**
+ * Resolves the host through the transport, looking names up in the name cache first. Dotted
+ * quads aren't cached, the transport parses them without a lookup.
+ * @returns 0 on success, -1 on error
+ */
+static
+s32
+resolveHost(
+    const char* host,
+    sockaddr_in& dest)
+{
+    size_t hostLen = strlen(host);
+    if (hostLen >= MaxResolvedHostLength || inet_addr(host) != INADDR_NONE) {
+        return transport->resolveDestinationHost(host, dest);
+    }
+
+    // the entry for the host if it has expired, otherwise an empty or the oldest entry
+    ResolvedHost* slot = &resolvedHosts[0];
+    for (u32 h = 0; h < MaxResolvedHosts; ++h)
+    {
+        ResolvedHost& entry = resolvedHosts[h];
+        if (entry.resolvedTime != 0 && strcmp(entry.host, host) == 0)
+        {
+            if (timer_querySecondsSince(entry.resolvedTime) < ResolvedHostSeconds) {
+                dest.sin_family = AF_INET;
+                dest.sin_addr.s_addr = entry.address;
+                return Result_Success;
+            }
+            slot = &entry;
+            break;
+        }
+        if (entry.resolvedTime < slot->resolvedTime) {
+            slot = &entry;
+        }
+    }
+
+    s32 result = transport->resolveDestinationHost(host, dest);
+    addMetric(metricIndex(hostsResolved));
+
+    if (result == Result_Success) {
+        memcpy(slot->host, host, hostLen + 1);
+        slot->address = dest.sin_addr.s_addr;
+        slot->resolvedTime = timer_queryCounts();
+    }
+
+    return result;
+}
+
 
 /**
  * Make a ping request, fill the data section with 4 bytes of request timestamp, then hex "dada"
@@ -22,6 +506,7 @@ void
 makePingPacket(
     u8* buffer,
     u16 packetSize,
+    u16 id,
     u16 seq,
     ICMPHeader& outHdr)
 {
@@ -29,7 +514,7 @@ makePingPacket(
 
     ICMPHeader& hdr = *(ICMPHeader*)buffer;
     hdr.message = ICMP_EchoRequest;
-    hdr.id      = (u16)platformGetPid();
+    hdr.id      = id;
     hdr.seq     = htons(seq);
 
     memset(
@@ -44,17 +529,99 @@ makePingPacket(
 
 
 /**
- * @returns 0 on success, -1 on error, 1 on ignore, 2 on pending
+ * Finds the header of the echo request a received ICMP message answers. For an echo reply that's
+ * the reply's own header, which echoes the request's id and seq. An error from a router on the
+ * way, Time Exceeded or Destination Unreachable, quotes the request's IP header and the first 8
+ * bytes of its data, which are the request's ICMP header.
+ * @param buffer  received packet, starting at the IP header
+ * @param bufferSize  size of the buffer, the packet's own length is read from its IP header
+ * @returns the header holding the request's id and seq, or nullptr if the message isn't an echo
+ *  reply or an error about an echo request
+ */
+static
+const ICMPHeader*
+getEchoRequestHeader(
+    const u8* buffer,
+    u32 bufferSize)
+{
+    const IPHeader& ip = *(const IPHeader*)buffer;
+    u16 headerLen = ip.headerLen * sizeof(u32);
+    u16 totalLen = ntohs(ip.totalLen);
+
+    if (totalLen > bufferSize || totalLen < headerLen + sizeof(ICMPHeader)) {
+        return nullptr;
+    }
+
+    const ICMPHeader& icmp = *(const ICMPHeader*)(buffer + headerLen);
+    if (icmp.type == ICMPType_EchoReply) {
+        return &icmp;
+    }
+    if (icmp.type != ICMPType_TimeExceeded && icmp.type != ICMPType_DestinationUnreachable) {
+        return nullptr;
+    }
+
+    u16 quotedStart = headerLen + sizeof(ICMPHeader);
+    const IPHeader& quoted = *(const IPHeader*)(buffer + quotedStart);
+    u16 quotedHeaderLen = quoted.headerLen * sizeof(u32);
+
+    if (totalLen < quotedStart + sizeof(IPHeader)
+        || totalLen < quotedStart + quotedHeaderLen + sizeof(ICMPHeader)
+        || quoted.protocol != IPPROTO_ICMP)
+    {
+        return nullptr;
+    }
+
+    const ICMPHeader& request = *(const ICMPHeader*)(buffer + quotedStart + quotedHeaderLen);
+    return (request.type == ICMPType_EchoRequest ? &request : nullptr);
+}
+
+
+/**
+ * Counts a reply to a request before the one the sequence is waiting on. It answers a request
+ * that was already answered, or one that timed out and stays counted as lost.
+ */
+static
+void
+countEarlierReply(
+    PingSequence& sequence,
+    u16 replySeq)
+{
+    PingStatsEx& statsEx = sequence.statsEx;
+    PingStatus status = sequence.requests[replySeq].status;
+
+    if (status == Ping_Received) {
+        ++statsEx.duplicates;
+    }
+    else if (status == Ping_TimedOut)
+    {
+        ++statsEx.late;
+        if (sequence.stats.received > 0 && replySeq < sequence.lastReceivedSeq) {
+            ++statsEx.reordered;
+        }
+    }
+}
+
+
+/**
+ * Checks a received packet against the request the sequence is waiting on.
+ * @param bytes  size of the packet received
+ * @param receiveTime  arrival of the packet in timer counts, the end of the round trip
+ * @returns 0 on an echo reply from the destination, 3 on a Time Exceeded about the request on its
+ *  way to the destination, -1 on error, 1 on ignore
  */
 static
 s32
 handleReply(
-    PingRequest& req,
-    u16 forSeq,
+    PingSequence& sequence,
+    u32 forAddress,
     u8* buffer,
     u32 bytes,
-    const sockaddr_in& from)
+    const sockaddr_in& from,
+    i64 receiveTime)
 {
+    PingRequest& req = sequence.requests[sequence.seq];
+    u16 forId = sequence.id;
+    u16 forSeq = sequence.seq;
     IPHeader* reply = (IPHeader*)buffer;
 
     // skip to the ICMPHeader within the packet
@@ -64,113 +631,527 @@ handleReply(
     // do some error checking on the reply
     if (bytes < headerLen + sizeof(ICMPHeader))
     {
-        printf("Too few bytes from %s\n", inet_ntoa(from.sin_addr));
+        LOG_WARN("Too few bytes from %s", logAddress(from.sin_addr.s_addr));
         return Result_Error;
     }
+    else if (pingReply.type == ICMPType_EchoRequest) {
+        // raw sockets also see outgoing requests, most often our own on a loopback destination
+        return Result_Ignore;
+    }
     else if (pingReply.type != ICMPType_EchoReply
              && pingReply.type != ICMPType_TimeExceeded)
     {
-        printf(controlMessageString(pingReply.message));
-        printf("\n");
+        LOG_WARN("%s", controlMessageString(pingReply.message));
         return Result_Error;
     }
-    else if (pingReply.id != (u16)platformGetPid()) {
-        // must be a reply for another pinger running locally, ignore it
+
+    // Time Exceeded comes from a router on the way, and carries the id and seq of the request in
+    // the part of it that is quoted
+    const ICMPHeader* request = getEchoRequestHeader(buffer, bytes);
+    if (!request || request->id != forId) {
+        // must be a reply for another sequence or pinger running locally, ignore it
+        return Result_Ignore;
+    }
+    else if (pingReply.type == ICMPType_EchoReply && from.sin_addr.s_addr != forAddress) {
+        // an echo reply only comes from the destination itself
         return Result_Ignore;
     }
+    else if (pingReply.type == ICMPType_TimeExceeded)
+    {
+        // any router may send it, but the request it quotes has to be one sent to the destination
+        const IPHeader& quoted = *(const IPHeader*)(buffer + headerLen + sizeof(ICMPHeader));
+        if (quoted.destIP != forAddress) {
+            return Result_Ignore;
+        }
+    }
 
-    u16 replySeq = ntohs(pingReply.seq);
-    if (replySeq != forSeq) {
-        printf("Bad sequence number %d, expected %d\n", replySeq, forSeq);
+    u16 replySeq = ntohs(request->seq);
+    if ((replySeq & ~SequenceIndexMask) != sequence.seqGeneration) {
+        // answers a request of an earlier job on the same ICMP id
+        return Result_Ignore;
+    }
+
+    replySeq &= SequenceIndexMask;
+    if (replySeq < forSeq) {
+        // late or duplicate reply to an earlier request that has already been counted
+        countEarlierReply(sequence, replySeq);
+        return Result_Ignore;
+    }
+    else if (replySeq != forSeq) {
+        LOG_WARN("Bad sequence number %d, expected %d", replySeq, forSeq);
         return Result_Error;
     }
 
+    if (pingReply.type == ICMPType_TimeExceeded)
+    {
+        // the round trip and TTL are the router's, they say nothing about the destination
+        LOG_INFO(
+            "Reply from %s: seq=%d, TTL expired in transit.",
+            logAddress(from.sin_addr.s_addr),
+            replySeq);
+        return Result_TimeExceeded;
+    }
+
     // calculate number of hops
     s32 nHops = 256 - reply->ttl;
     // TTL came back 64, so ping was probably to a host on the LAN, single hop.
     if (nHops == 192) {
         nHops = 1;
     }
-    // probably localhost
-    else if (nHops == 128) {
-        nHops = 0;
+    // probably localhost
+    else if (nHops == 128) {
+        nHops = 0;
+    }
+
+    req.ttl = reply->ttl;
+    req.replyTime = receiveTime;
+    req.elapsedMS = (r32)timer_millisBetween(req.sendTime, req.replyTime);
+
+    u16 totalLen = ntohs(reply->totalLen);
+    u16 dataBytes = totalLen - headerLen - sizeof(ICMPHeader);
+
+    LOG_DEBUG(
+        "Reply from %s: bytes=%d seq=%d/%d hops=%d time=%.1fms TTL=%d",
+        logAddress(from.sin_addr.s_addr),
+        dataBytes,
+        replySeq,
+        request->seq,
+        nHops,
+        req.elapsedMS,
+        reply->ttl);
+
+    return Result_Success;
+}
+
+
+/**
+ * Folds a round trip into stats whose received count already includes it. Round trip mean and
+ * variance are accumulated with Welford's method, so the cost per sample is constant.
+ */
+static
+void
+addRoundTrip(
+    PingStats& stats,
+    r64& rttMean,
+    r64& rttM2,
+    r32 elapsedMS)
+{
+    r64 n = (r64)stats.received;
+    r64 delta = elapsedMS - rttMean;
+    rttMean += delta / n;
+    rttM2 += delta * (elapsedMS - rttMean);
+
+    if (stats.received == 1) {
+        stats.minRoundTrip = elapsedMS;
+        stats.maxRoundTrip = elapsedMS;
+    }
+    else {
+        stats.minRoundTrip = min(stats.minRoundTrip, elapsedMS);
+        stats.maxRoundTrip = max(stats.maxRoundTrip, elapsedMS);
+    }
+    stats.avgRoundTrip = (r32)rttMean;
+    stats.stdDevRoundTrip = (r32)sqrt(rttM2 / n);
+}
+
+
+/**
+ * Tracks the runs of lost and received requests, and fits a Gilbert model to them: a two-state
+ * chain where every request in the bad state is lost and none in the good one. The fit is the
+ * fraction of received requests followed by a loss (p) and of lost ones followed by a reply (r),
+ * so the mean burst is about 1 / r and the mean gap 1 / p. Runs cut off by the end of the sequence
+ * are counted at the length they reached.
+ * @param seq  the request's index in the sequence, requests are counted in order
+ */
+static
+void
+countLossRun(
+    PingSequence& sequence,
+    bool lost,
+    u16 seq)
+{
+    PingStatsEx& statsEx = sequence.statsEx;
+
+    if (seq > 0)
+    {
+        if (sequence.lossRunLength > 0) {
+            ++sequence.lostPairs;
+            sequence.lostToReceived += (lost ? 0 : 1);
+        }
+        else {
+            ++sequence.receivedPairs;
+            sequence.receivedToLost += (lost ? 1 : 0);
+        }
+    }
+
+    if (lost)
+    {
+        // the burst in progress is kept in the bin of its length so far, and moves up as it grows
+        if (sequence.lossRunLength == 0) {
+            ++statsEx.lossBursts;
+        }
+        else {
+            --statsEx.burstLengths[min(sequence.lossRunLength - 1, LossBurstBins - 1)];
+        }
+        ++sequence.lossRunLength;
+        ++statsEx.burstLengths[min(sequence.lossRunLength - 1, LossBurstBins - 1)];
+    }
+    else
+    {
+        if (seq == 0 || sequence.lossRunLength > 0) {
+            ++sequence.gaps;
+        }
+        sequence.lossRunLength = 0;
+    }
+
+    const PingStats& stats = sequence.stats;
+    statsEx.meanBurstLength =
+        (statsEx.lossBursts > 0 ? (r32)stats.lost / (r32)statsEx.lossBursts : 0.f);
+    statsEx.meanGapLength = (sequence.gaps > 0 ? (r32)stats.received / (r32)sequence.gaps : 0.f);
+    statsEx.burstEnterProb = (sequence.receivedPairs > 0
+                              ? (r32)sequence.receivedToLost / (r32)sequence.receivedPairs
+                              : 0.f);
+    statsEx.burstExitProb = (sequence.lostPairs > 0
+                             ? (r32)sequence.lostToReceived / (r32)sequence.lostPairs
+                             : 0.f);
+}
+
+
+/**
+ * Folds the outcome of one request into the sequence stats. Interarrival jitter is the RFC 3550
+ * estimator, J += (|D| - J) / 16, with D the difference between the round trips of consecutive
+ * replies, as both ends of an echo are timed by the same clock.
+ * @param seq  the request's index in the sequence
+ */
+static
+void
+calcStats(
+    PingSequence& sequence,
+    const PingRequest& req,
+    u16 seq)
+{
+    if (req.status == Ping_Received)
+    {
+        addRoundTrip(sequence.stats, sequence.rttMean, sequence.rttM2, req.elapsedMS);
+
+        if (sequence.stats.received > 1) {
+            r32 d = fabsf(req.elapsedMS - sequence.lastRoundTrip);
+            sequence.statsEx.jitterMS += (d - sequence.statsEx.jitterMS) / 16.f;
+        }
+        sequence.lastRoundTrip = req.elapsedMS;
+        sequence.lastReceivedSeq = seq;
+    }
+    countLossRun(sequence, (req.status != Ping_Received), seq);
+
+    sequence.stats.pctLost = (r32)sequence.stats.lost / (r32)sequence.stats.sent;
+}
+
+
+/**
+ * Two-sided 95% critical values of Student's t distribution, indexed by degrees of freedom - 1.
+ */
+static const r32 tCritical95[] = {
+    12.706f, 4.303f, 3.182f, 2.776f, 2.571f, 2.447f, 2.365f, 2.306f,
+     2.262f, 2.228f, 2.201f, 2.179f, 2.160f, 2.145f, 2.131f, 2.120f
+};
+
+
+/**
+ * With a toleranceMS set, a sequence may end before numRequests once its result is settled:
+ * either the 95% confidence interval of the mean round trip is within +/- toleranceMS, or the
+ * first MinSettledSamples requests were all lost and the host is considered unreachable.
+ * @returns true if the sequence can end early
+ */
+static
+bool
+isSequenceSettled(
+    const PingSequence& sequence)
+{
+    if (sequence.toleranceMS <= 0.f) {
+        return false;
+    }
+
+    u32 received = sequence.stats.received;
+    if (received >= MinSettledSamples)
+    {
+        // sample standard deviation of the mean
+        r64 variance = sequence.rttM2 / (r64)(received - 1);
+        // past the table, the last value is a slightly conservative stand-in
+        r64 halfWidth = tCritical95[min(received - 2, (u32)countof(tCritical95) - 1)]
+                        * sqrt(variance / (r64)received);
+
+        return (halfWidth <= sequence.toleranceMS);
+    }
+
+    return (received == 0 && sequence.stats.lost >= MinSettledSamples);
+}
+
+
+/**
+ * Makes room in the full destination table. Drops every destination that hasn't sent for
+ * DestinationIdleSeconds, or the one that sent longest ago when none is idle.
+ * @param now   time of the request that needs a new destination
+ */
+static
+void
+evictDestinations(
+    i64 now)
+{
+    u32 evicted = 0;
+    u32 oldestKey = 0;
+    i64 oldestTime = now;
+
+    for (u32 i = 0; i < MaxPingDestinations; )
+    {
+        u32 key = destinations._keys[i];
+        const PingDestination& dest = destinations._items[i];
+
+        // the bucket is refilled on every request, its refill time is the last use
+        if (key != 0 && timer_secondsBetween(dest.refillTime, now) >= DestinationIdleSeconds)
+        {
+            // erase shifts a later destination into the slot, check the slot again
+            destinations.erase(key);
+            ++evicted;
+            continue;
+        }
+        if (key != 0 && (oldestKey == 0 || dest.refillTime < oldestTime)) {
+            oldestKey = key;
+            oldestTime = dest.refillTime;
+        }
+        ++i;
+    }
+
+    if (evicted == 0 && oldestKey != 0) {
+        destinations.erase(oldestKey);
+        evicted = 1;
+    }
+    addMetric(metricIndex(destinationsEvicted), evicted);
+}
+
+
+/**
+ * Finds the state for a destination address, adding it with a full token bucket on first use.
+ * A full table makes room with evictDestinations, losing the state of the dropped destinations.
+ * @returns pointer to the destination, or nullptr if the address is 0
+ */
+static
+PingDestination*
+getDestination(
+    const sockaddr_in& addr)
+{
+    u32 key = addr.sin_addr.s_addr;
+    if (destinations.full() && !destinations.find(key)) {
+        evictDestinations(timer_queryCounts());
+    }
+
+    bool inserted = false;
+    PingDestination* dest = destinations.insert(key, &inserted);
+
+    if (inserted) {
+        dest->refillTime = timer_queryCounts();
+        dest->tokens = PacerBurst;
+        dest->ratePPS = PacerRatePPS;
+        dest->cacheSlot = NoCacheSlot;
+    }
+
+    return dest;
+}
+
+
+/**
+ * Refills the destination's token bucket and takes a token for one request.
+ * @returns false if the bucket is empty and the request must wait
+ */
+static
+bool
+takePacerToken(
+    PingDestination& dest,
+    u8& outRequestFlags)
+{
+    i64 now = timer_queryCounts();
+    r32 elapsedSeconds = (r32)timer_secondsBetween(dest.refillTime, now);
+    dest.refillTime = now;
+    dest.tokens = min(dest.tokens + elapsedSeconds * dest.ratePPS, PacerBurst);
+
+    if (dest.tokens < 1.0f) {
+        return false;
+    }
+
+    dest.tokens -= 1.0f;
+
+    // fewer than half the burst left means requests are arriving at close to the paced rate
+    outRequestFlags = (dest.tokens < PacerBurst * 0.5f ? Request_Limited : Request_None);
+
+    return true;
+}
+
+
+/**
+ * Feeds a request outcome into the pacer. Loss is tracked separately for requests sent at the
+ * rate limit and for those sent with tokens to spare. Loss that only shows up at the limit tracks
+ * the send rate, which is the signature of ICMP rate limiting, so the rate is backed off rather
+ * than reporting the loss as a property of the path.
+ */
+static
+void
+updatePacer(
+    PingDestination& dest,
+    u8 requestFlags,
+    bool received)
+{
+    r32 loss = (received ? 0.0f : 1.0f);
+
+    if (requestFlags & Request_Limited) {
+        dest.lossLimited += PacerLossGain * (loss - dest.lossLimited);
+    }
+    else {
+        dest.lossIdle += PacerLossGain * (loss - dest.lossIdle);
     }
 
-    req.replyTime = timer_queryCounts();
-    req.elapsedMS = (r32)timer_millisBetween(req.sendTime, req.replyTime);
+    if (received) {
+        dest.ratePPS = min(dest.ratePPS + PacerIncreasePPS, PacerRatePPS);
+    }
+    else if ((requestFlags & Request_Limited)
+             && dest.lossLimited > dest.lossIdle + PacerLossMargin)
+    {
+        dest.ratePPS = max(dest.ratePPS * PacerBackoffFactor, PacerMinRatePPS);
+        dest.tokens = min(dest.tokens, 1.0f);
+    }
+}
 
-    u16 totalLen = ntohs(reply->totalLen);
-    u16 dataBytes = totalLen - headerLen - sizeof(ICMPHeader);
 
-    if (pingReply.type != ICMPType_TimeExceeded)
-    {
-        printf(
-            "Reply from %s: bytes=%d seq=%d/%d hops=%d time=%.1fms TTL=%d\n",
-            inet_ntoa(from.sin_addr),
-            dataBytes,
-            replySeq,
-            pingReply.seq,
-            nHops,
-            req.elapsedMS,
-            reply->ttl);
+/**
+ * Feeds a round trip sample into the destination's RTO estimator (RFC 6298 section 2).
+ */
+static
+void
+updateTimeoutEstimate(
+    PingDestination& dest,
+    r32 rttMS,
+    u16 ceilingMS)
+{
+    if (dest.samples == 0) {
+        dest.srttMS = rttMS;
+        dest.rttVarMS = rttMS * 0.5f;
     }
     else {
-        printf(
-            "Reply from %s: bytes=%d seq=%d/%d, TTL Expired.\n",
-            inet_ntoa(from.sin_addr),
-            dataBytes,
-            replySeq,
-            pingReply.seq);
+        // RTTVAR must be updated using the old SRTT
+        dest.rttVarMS = 0.75f * dest.rttVarMS + 0.25f * fabsf(dest.srttMS - rttMS);
+        dest.srttMS = 0.875f * dest.srttMS + 0.125f * rttMS;
     }
+    ++dest.samples;
 
-    return Result_Success;
+    r32 rto = dest.srttMS + max(AdaptiveTimeoutGranularityMS, 4.0f * dest.rttVarMS);
+    dest.rtoMS = min(max(rto, (r32)MinAdaptiveTimeoutMS), (r32)ceilingMS);
 }
 
 
+/**
+ * Doubles the destination's RTO after a timeout (RFC 6298 section 5.5), so a host that has become
+ * slower is given more time until new samples bring the estimate back down.
+ */
 static
 void
-calcStats(
-    PingSequence& sequence)
+backoffTimeoutEstimate(
+    PingDestination& dest,
+    u16 ceilingMS)
+{
+    if (dest.samples > 0) {
+        dest.rtoMS = min(dest.rtoMS * 2.0f, (r32)ceilingMS);
+    }
+}
+
+
+/**
+ * @returns the upper bound of the adaptive timeout, the sequence timeoutMS or the default timeout
+ *  when the sequence has no timeout set
+ */
+static inline
+u16
+getTimeoutCeiling(
+    const PingSequence& sequence)
+{
+    return (sequence.timeoutMS > 0 ? sequence.timeoutMS : (u16)DefaultTimeoutMS);
+}
+
+
+/**
+ * @returns the timeout to use for the next request sent by the sequence, 0 for no timeout
+ */
+static
+u16
+getRequestTimeout(
+    PingJob& job)
 {
-    if (sequence.stats.received > 0)
+    u16 timeoutMS = job.sequence.timeoutMS;
+
+    if (job.sequence.flags & PingFlag_AdaptiveTimeout)
     {
-        r32 totalRoundTrip = 0.f;
-        r32 maxRoundTrip = 0.f;
-        r32 minRoundTrip = FLT_MAX;
+        timeoutMS = getTimeoutCeiling(job.sequence);
 
-        for(u32 r = 0;
-            r < sequence.seq;
-            ++r)
-        {
-            PingRequest& req = sequence.requests[r];
-            if (req.status == Ping_Received) {
-                maxRoundTrip = max(maxRoundTrip, req.elapsedMS);
-                minRoundTrip = min(minRoundTrip, req.elapsedMS);
-                totalRoundTrip += req.elapsedMS;
-            }
+        PingDestination* dest = destinations[job.destAddr.sin_addr.s_addr];
+        if (dest && dest->samples > 0) {
+            timeoutMS = (u16)ceilf(min(dest->rtoMS, (r32)timeoutMS));
         }
+    }
 
-        sequence.stats.maxRoundTrip = maxRoundTrip;
-        sequence.stats.minRoundTrip = minRoundTrip;
-        sequence.stats.avgRoundTrip = totalRoundTrip / (r32)sequence.stats.received;
+    return timeoutMS;
+}
 
-        r32 totalVariance = 0.f;
 
-        for(u32 r = 0;
-            r < sequence.seq;
-            ++r)
-        {
-            PingRequest& req = sequence.requests[r];
-            if (req.status == Ping_Received) {
-                r32 deviation = req.elapsedMS - sequence.stats.avgRoundTrip;
-                totalVariance += (deviation * deviation);
-            }
-        }
+/**
+ * Trace id of the sequence's current request, pairs the async begin and end events of a request.
+ */
+static inline
+u64
+requestTraceId(
+    const PingJob& job)
+{
+    return ((u64)ntohs(job.sequence.id) << 16) | job.sequence.seq;
+}
 
-        sequence.stats.stdDevRoundTrip = sqrtf(totalVariance / (r32)sequence.stats.received);
+
+/**
+ * Adds the result of the sequence's current request to the probe log, when it's open.
+ */
+static inline
+void
+logProbeResult(
+    const PingJob& job,
+    const PingRequest& req)
+{
+    if (probeLogging()) {
+        probeLogRecord(
+            ProbeKind_Ping,
+            job.destAddr.sin_addr.s_addr,
+            ntohs(job.sequence.id),
+            job.sequence.seq,
+            req.sendTime,
+            (req.status == Ping_Received ? req.elapsedMS : 0.f),
+            (req.status == Ping_Received ? req.ttl : 0),
+            req.status);
     }
+}
 
-    sequence.stats.pctLost = (r32)sequence.stats.lost / (r32)sequence.stats.sent;
+
+/**
+ * Folds the result of the sequence's current request into the latency cache, when it's open.
+ */
+static inline
+void
+cacheProbeResult(
+    const PingJob& job,
+    PingDestination* dest,
+    const PingRequest& req)
+{
+    if (latencyCaching()) {
+        u32 noSlot = NoCacheSlot;
+        latencyCacheUpdate(
+            (dest ? dest->cacheSlot : noSlot),
+            job.sequence.host,
+            job.destAddr.sin_addr.s_addr,
+            (req.status == Ping_Received),
+            req.elapsedMS);
+    }
 }
 
 
@@ -180,15 +1161,20 @@ runPingSequence(
 {
     u32 dataSize = job.sequence.dataSize;
     u8 ttl = job.sequence.ttl;
+    u8 tos = (u8)(job.sequence.dscp << 2);
 
     SequenceStatus status = (SequenceStatus)job.sequence.status.load(std::memory_order_relaxed);
 
     // sequence is inactive and ready to run, set up the socket
     if (status == Sequence_Inactive)
     {
-        if (ok(resolveDestinationHost(job.sequence.host, job.destAddr)) &&
-            ok(createSocket(ttl, job.socket)))
+        TRACE_BEGIN("resolve");
+        s32 resolved = resolveHost(job.sequence.host, job.destAddr);
+        TRACE_END("resolve");
+
+        if (ok(resolved) && ok(acquireSocket(ttl, job.sequence.id, job.socket)))
         {
+            TRACE_INSTANT("socket acquired", ntohs(job.sequence.id), 0);
             status = Sequence_Running;
         }
         else {
@@ -209,7 +1195,8 @@ runPingSequence(
             makePingPacket(
                 job.sendBuffer,
                 packetSize,
-                job.sequence.seq,
+                job.sequence.id,
+                job.sequence.seqGeneration | job.sequence.seq,
                 req.requestHdr);
 
             memset(&req.replyHdr, 0, sizeof(ICMPHeader));
@@ -217,73 +1204,164 @@ runPingSequence(
             req.status = Ping_Requested;
         }
         
+        // wait for a token from the destination's pacer, requests stay in Ping_Requested until
+        // the bucket refills
+        bool paced = true;
         if (req.status == Ping_Requested)
         {
-            s32 result = sendPingPacket(
+            PingDestination* dest = getDestination(job.destAddr);
+            if (dest) {
+                paced = takePacerToken(*dest, req.flags);
+            }
+            if (!paced) {
+                addMetric(metricIndex(requestsPaced));
+            }
+        }
+
+        if (req.status == Ping_Requested && paced)
+        {
+            // stamped before the send, on loopback the reply can be queued before it returns
+            i64 sendTime = timer_queryCounts();
+            s32 result = transportSend(
                 job.socket,
                 job.destAddr,
                 job.sendBuffer,
-                packetSize);
+                packetSize,
+                ttl,
+                tos);
             
             if (result == Result_Success) {
-                req.sendTime = timer_queryCounts();
+                req.sendTime = sendTime;
+                req.timeoutMS = getRequestTimeout(job);
                 ++job.sequence.stats.sent;
                 req.status = Ping_WaitingForReply;
+                TRACE_ASYNC_BEGIN("request", requestTraceId(job));
             }
             else if (result == Result_Error) {
                 req.status = Ping_Error;
+                req.sendTime = 0;   // never sent
                 status = Sequence_Error;
+                logProbeResult(job, req);
             }
         }
 
         if (req.status == Ping_WaitingForReply)
         {
-            s32 result = getPingReply(
-                job.socket,
-                job.receiveBuffer,
-                ReceiveBufferSize,
-                job.sourceAddr);
+            // read past packets meant for other sockets, so they can't hold up this request's
+            // reply or its timeout
+            s32 result = Result_Ignore;
+            while (result == Result_Ignore)
+            {
+                u32 bytes;
+                i64 receiveTime;
+                result = transportReceiveTimestamped(
+                    job.socket,
+                    job.receiveBuffer,
+                    ReceiveBufferSize,
+                    job.sourceAddr,
+                    bytes,
+                    receiveTime);
+
+                if (result == Result_Success) {
+                    result = handleReply(
+                        job.sequence,
+                        job.destAddr.sin_addr.s_addr,
+                        job.receiveBuffer,
+                        bytes,
+                        job.sourceAddr,
+                        receiveTime);
+
+                    if (result == Result_Ignore) {
+                        addMetric(metricIndex(repliesIgnored));
+                    }
+                }
+            }
 
             if (result == Result_Success)
             {
-                result = handleReply(
-                    req,
-                    job.sequence.seq,
-                    job.receiveBuffer,
-                    packetSize,
-                    job.sourceAddr);
-                
-                if (result == Result_Success)
+                req.status = Ping_Received;
+                TRACE_ASYNC_END("request", requestTraceId(job), Ping_Received);
+                logProbeResult(job, req);
+
+                PingDestination* dest = getDestination(job.destAddr);
+                cacheProbeResult(job, dest, req);
+                rollingStatsAdd(job.sequence.host, job.sequence.rollingKey,
+                                (req.status == Ping_Received), req.elapsedMS);
+                if (dest)
                 {
-                    req.status = Ping_Received;
-
-                    ++job.sequence.seq;
-                    ++job.sequence.stats.received;
-                    calcStats(job.sequence);
-                    
-                    if (job.sequence.seq == job.sequence.numRequests) {
-                        status = Sequence_Finished;
+                    updatePacer(*dest, req.flags, true);
+
+                    if (anomalyDetecting()) {
+                        detectAnomalies(dest->anomaly, job.destAddr.sin_addr.s_addr, true,
+                                        req.elapsedMS, req.ttl);
                     }
+
+                    if (job.sequence.flags & PingFlag_AdaptiveTimeout) {
+                        updateTimeoutEstimate(
+                            *dest,
+                            req.elapsedMS,
+                            getTimeoutCeiling(job.sequence));
+                    }
+                }
+
+                ++job.sequence.seq;
+                ++job.sequence.stats.received;
+                calcStats(job.sequence, req, job.sequence.seq - 1);
+                
+                if (job.sequence.seq == job.sequence.numRequests
+                    || isSequenceSettled(job.sequence))
+                {
+                    status = Sequence_Finished;
                 }
             }
 
-            if (result == Result_Error) {
+            // a TTL too short to reach the destination fails the same way for every request, and
+            // none of the router's round trip belongs in the destination's stats
+            if (result == Result_Error || result == Result_TimeExceeded) {
                 req.status = Ping_Error;
                 status = Sequence_Error;
+                TRACE_ASYNC_END("request", requestTraceId(job), Ping_Error);
+                logProbeResult(job, req);
             }
 
             // request timed out
             if (result == Result_Pending
-                && job.sequence.timeoutMS > 0
-                && (timer_queryMillisSince(req.sendTime) >= job.sequence.timeoutMS))
+                && req.timeoutMS > 0
+                && (timer_queryMillisSince(req.sendTime) >= req.timeoutMS))
             {
                 req.status = Ping_TimedOut;
+                addMetric(metricIndex(requestsTimedOut));
+                TRACE_ASYNC_END("request", requestTraceId(job), Ping_TimedOut);
+                TRACE_INSTANT("timeout", requestTraceId(job), req.timeoutMS);
+                logProbeResult(job, req);
+
+                PingDestination* dest = getDestination(job.destAddr);
+                cacheProbeResult(job, dest, req);
+                rollingStatsAdd(job.sequence.host, job.sequence.rollingKey,
+                                (req.status == Ping_Received), req.elapsedMS);
+                if (dest)
+                {
+                    updatePacer(*dest, req.flags, false);
+
+                    if (anomalyDetecting()) {
+                        detectAnomalies(dest->anomaly, job.destAddr.sin_addr.s_addr, false,
+                                        0.f, 0);
+                    }
+
+                    if (job.sequence.flags & PingFlag_AdaptiveTimeout) {
+                        backoffTimeoutEstimate(
+                            *dest,
+                            getTimeoutCeiling(job.sequence));
+                    }
+                }
                 
                 ++job.sequence.seq;
                 ++job.sequence.stats.lost;
-                calcStats(job.sequence);
+                calcStats(job.sequence, req, job.sequence.seq - 1);
                 
-                if (job.sequence.seq == job.sequence.numRequests) {
+                if (job.sequence.seq == job.sequence.numRequests
+                    || isSequenceSettled(job.sequence))
+                {
                     status = Sequence_Finished;
                 }
 
@@ -291,44 +1369,299 @@ runPingSequence(
         }
 
         if (status > Sequence_Running) {
-            platform_closesocket(job.socket);
+            releaseSocket(job.sequence.id, job.socket, (status == Sequence_Error));
         }
     }
 
+    if (status == Sequence_Finished) {
+        addMetric(metricIndex(sequencesFinished));
+    }
+    else if (status == Sequence_Error) {
+        addMetric(metricIndex(sequencesErrored));
+    }
+
     job.sequence.status.store(status, std::memory_order_release);
     return status;
 }
 
 
-Ping
-ping(
+void
+setPingLatencyMode(
+    const PingLatencyConfig* config)
+{
+    if (config) {
+        latencyConfig = *config;
+    }
+    else {
+        latencyConfig = PingLatencyConfig{ -1, 0, 0, 0 };
+    }
+}
+
+
+void
+transportEndIteration()
+{
+    if (transport->endIteration) {
+        transport->endIteration();
+    }
+}
+
+
+void
+setPingTransport(
+    const PingTransport* newTransport)
+{
+    transport = (newTransport ? newTransport : &platformTransport);
+
+    // names resolved by the old transport may mean nothing to the new one
+    memset(resolvedHosts, 0, sizeof(resolvedHosts));
+}
+
+
+/**
+ * Resolves the hosts queued by prewarmPing into the name cache and opens pooled sockets for the
+ * first ping job slots, in a single step. Slots whose socket is already open are left alone, their
+ * jobs may be running.
+ */
+static
+SequenceStatus
+runPrewarm()
+{
+    char* hosts[MaxPrewarmHosts];
+
+    lock_spin(prewarmLock);
+    u32 numHosts = numPrewarmHosts;
+    u32 numSockets = numPrewarmSockets;
+    memcpy(hosts, prewarmHosts, numHosts * sizeof(char*));
+    numPrewarmHosts = 0;
+    numPrewarmSockets = 0;
+    prewarmQueued = false;
+    unlock(prewarmLock);
+
+    TRACE_BEGIN("prewarm");
+    for (u32 h = 0; h < numHosts; ++h)
+    {
+        sockaddr_in dest{};
+        resolveHost(hosts[h], dest);
+        free(hosts[h]);
+    }
+
+    for (u32 s = 0; s < numSockets && numPooledSockets < MaxPooledSockets; ++s)
+    {
+        u16 id = htons((u16)(getIcmpIdBase() + s));
+        PooledSocket& pooled = getPooledSocket(id);
+        if (pooled.transport != transport) {
+            createPooledSocket(pooled, DefaultTTL, id);
+        }
+    }
+    TRACE_END("prewarm");
+
+    return Sequence_Finished;
+}
+
+
+SequenceStatus
+runJob(
+    PingJobHnd hnd)
+{
+    if (hnd.typeId == SweepJobTypeId) {
+        return runSweep(hnd);
+    }
+    if (hnd.typeId == RaceJobTypeId) {
+        return runRace(hnd);
+    }
+    if (hnd.typeId == TracerouteJobTypeId) {
+        return runTraceroute(hnd);
+    }
+    if (hnd.typeId == PmtuJobTypeId) {
+        return runPmtu(hnd);
+    }
+    if (hnd.typeId == BandwidthJobTypeId) {
+        return runBandwidth(hnd);
+    }
+    if (hnd.typeId == PrewarmJobTypeId) {
+        return runPrewarm();
+    }
+
+    PingJob* job = jobs[hnd];
+    if (!job) {
+        // invalid handle, error
+        return Sequence_Error;
+    }
+
+    return runPingSequence(*job);
+}
+
+
+/**
+ * Adds a ping job to the job map without queueing it to run.
+ * @returns handle of the job, or null_h32 if the job map is full
+ */
+static
+PingJobHnd
+addPingJob(
     const char* host,
     u16 numRequests,
     u16 dataSize,
     u8  ttl,
     u16 timeoutMS,
-    u16 intervalMS)
+    u16 intervalMS,
+    u16 flags,
+    r32 toleranceMS,
+    u8  dscp)
 {
-    Ping p{ null_h32, Sequence_Inactive, {} };
-
     PingJob* pJob = nullptr;
-    p.hnd = jobs.insert(nullptr, &pJob);
+    PingJobHnd hnd = jobs.insert(nullptr, &pJob);
 
-    if (p.hnd != null_h32)
+    if (hnd != null_h32)
     {
         PingSequence& sequence = pJob->sequence;
 
         size_t hostLen = strlen(host);
         sequence.host = (char*)malloc(hostLen+1);
         _strncpy_s(sequence.host, hostLen+1, host, hostLen);
+        sequence.host[hostLen] = '\0';
 
         sequence.dataSize = dataSize;
-        sequence.numRequests = numRequests;
+        sequence.numRequests = min(numRequests, (u16)MaxSequenceRequests);
         sequence.timeoutMS = timeoutMS;
         sequence.intervalMS = intervalMS;
+        sequence.flags = flags;
         sequence.ttl = ttl;
+        sequence.dscp = min(dscp, (u8)MaxDscp);
+        sequence.toleranceMS = toleranceMS;
+        sequence.id = htons((u16)(getIcmpIdBase() + hnd.index));
+        // the generation's top bit is shifted out, a slot's seqs repeat every 64 jobs
+        sequence.seqGeneration = (u16)(hnd.generation << SequenceIndexBits);
+        sequence.statsEx.size = sizeof(PingStatsEx);
+        sequence.statsEx.version = PingStatsExVersion;
+        sequence.rollingKey = getRollingKey(host);
+    }
+
+    return hnd;
+}
+
+
+static
+void
+freePingJob(
+    PingJobHnd hnd,
+    PingJob& job)
+{
+    free(job.sequence.host);
+    jobs.erase(hnd);
+}
+
+
+/**
+ * Stops a running sequence early, keeping the stats gathered so far.
+ */
+static
+void
+cancelPingSequence(
+    PingJob& job)
+{
+    SequenceStatus status = (SequenceStatus)job.sequence.status.load(std::memory_order_relaxed);
+    if (status == Sequence_Running) {
+        releaseSocket(job.sequence.id, job.socket, false);
+    }
+    if (status <= Sequence_Running) {
+        job.sequence.status.store(Sequence_Finished, std::memory_order_release);
+    }
+}
+
+
+/**
+ * Ends a sequence that won't run again as the job thread stops, closing its socket. Requests
+ * still waiting for a reply count as lost.
+ */
+static
+void
+abortPingSequence(
+    PingJob& job)
+{
+    SequenceStatus status = (SequenceStatus)job.sequence.status.load(std::memory_order_relaxed);
+    if (status == Sequence_Running) {
+        releaseSocket(job.sequence.id, job.socket, true);
+    }
+    if (status <= Sequence_Running) {
+        addMetric(metricIndex(sequencesErrored));
+        job.sequence.status.store(Sequence_Error, std::memory_order_release);
+    }
+}
 
+
+/**
+ * Drops the hosts of a prewarm that won't run, so the next prewarmPing queues a new one.
+ */
+static
+void
+abortPrewarm()
+{
+    lock_spin(prewarmLock);
+    for (u32 h = 0; h < numPrewarmHosts; ++h) {
+        free(prewarmHosts[h]);
+    }
+    numPrewarmHosts = 0;
+    numPrewarmSockets = 0;
+    prewarmQueued = false;
+    unlock(prewarmLock);
+}
+
+
+void
+abortJob(
+    PingJobHnd hnd)
+{
+    if (hnd.typeId == SweepJobTypeId) {
+        abortSweep(hnd);
+    }
+    else if (hnd.typeId == RaceJobTypeId) {
+        abortRace(hnd);
+    }
+    else if (hnd.typeId == TracerouteJobTypeId) {
+        abortTraceroute(hnd);
+    }
+    else if (hnd.typeId == PmtuJobTypeId) {
+        abortPmtu(hnd);
+    }
+    else if (hnd.typeId == BandwidthJobTypeId) {
+        abortBandwidth(hnd);
+    }
+    else if (hnd.typeId == PrewarmJobTypeId) {
+        abortPrewarm();
+    }
+    else {
+        PingJob* job = jobs[hnd];
+        if (job) {
+            abortPingSequence(*job);
+        }
+    }
+}
+
+
+Ping
+ping(
+    const char* host,
+    u16 numRequests,
+    u16 dataSize,
+    u8  ttl,
+    u16 timeoutMS,
+    u16 intervalMS,
+    u16 flags,
+    r32 toleranceMS,
+    u8  dscp)
+{
+    Ping p{ null_h32, Sequence_Inactive, {} };
+
+    p.hnd = addPingJob(
+        host, numRequests, dataSize, ttl, timeoutMS, intervalMS, flags, toleranceMS, dscp);
+
+    if (p.hnd != null_h32)
+    {
         jobQueue.push(p.hnd);
+        addMetric(metricIndex(jobsQueued));
+        TRACE_INSTANT("ping submitted", p.hnd.value, numRequests);
         
         startPingJobThread();
     }
@@ -337,10 +1670,64 @@ ping(
 }
 
 
+s32
+prewarmPing(
+    const char* const* hosts,
+    u32 numHosts)
+{
+    lock_spin(prewarmLock);
+
+    for (u32 h = 0; h < numHosts && numPrewarmHosts < MaxPrewarmHosts; ++h)
+    {
+        if (hosts[h]) {
+            size_t hostLen = strlen(hosts[h]);
+            char* host = (char*)malloc(hostLen+1);
+            _strncpy_s(host, hostLen+1, hosts[h], hostLen);
+            host[hostLen] = '\0';
+            prewarmHosts[numPrewarmHosts++] = host;
+        }
+    }
+    numPrewarmSockets = max(numPrewarmSockets, min(numHosts, (u32)MaxPooledSockets));
+
+    bool queue = !prewarmQueued;
+    prewarmQueued = true;
+    unlock(prewarmLock);
+
+    if (queue)
+    {
+        // the prewarm job has no slot of its own, the typeId is all the job thread needs
+        PingJobHnd hnd = null_h32;
+        hnd.typeId = PrewarmJobTypeId;
+        jobQueue.push(hnd);
+        addMetric(metricIndex(jobsQueued));
+    }
+
+    return startPingJobThread();
+}
+
+
+/**
+ * Copies as much of the extended stats as fits the caller's struct, keeping its size.
+ */
+static inline
+void
+copyStatsEx(
+    PingStatsEx& outStatsEx,
+    const PingStatsEx& statsEx)
+{
+    u32 size = outStatsEx.size;
+    memcpy(&outStatsEx, &statsEx, min(size, (u32)sizeof(PingStatsEx)));
+    outStatsEx.size = size;
+}
+
+
 bool
 pollResult(
-    Ping& ping)
+    Ping& ping,
+    PingStatsEx* outStatsEx)
 {
+    addMetric(metricIndex(polls));
+
     if (ping.hnd != null_h32)
     {
         PingJob* job = jobs[ping.hnd];
@@ -348,19 +1735,24 @@ pollResult(
         {
             ping.status = (SequenceStatus)job->sequence.status.load(std::memory_order_acquire);
 
+            if (ping.status > Sequence_Running) {
+                TRACE_INSTANT("ping polled", ping.hnd.value, ping.status);
+            }
+
             if (ping.status == Sequence_Finished)
             {
                 // job is finished, copy stats out and free the job from the map
                 memcpy(&ping.stats, &job->sequence.stats, sizeof(PingStats));
-                free(job->sequence.host);
-                jobs.erase(ping.hnd);
+                if (outStatsEx) {
+                    copyStatsEx(*outStatsEx, job->sequence.statsEx);
+                }
+                freePingJob(ping.hnd, *job);
                 ping.hnd = null_h32;
             }
             else if (ping.status == Sequence_Error)
             {
                 // job errored, remove it and don't copy anything
-                free(job->sequence.host);
-                jobs.erase(ping.hnd);
+                freePingJob(ping.hnd, *job);
                 ping.hnd = null_h32;
             }
         }
@@ -372,3 +1764,19 @@ pollResult(
 
     return (ping.status > Sequence_Running);
 }
+
+
+#include "sweep.cpp"
+#include "race.cpp"
+#include "traceroute.cpp"
+#include "pmtu.cpp"
+#include "bandwidth.cpp"
+#include "ping_sim.cpp"
+#include "ping_metrics.cpp"
+#include "ping_trace.cpp"
+#include "ping_log.cpp"
+#include "ping_probelog.cpp"
+#include "ping_cache.cpp"
+#include "ping_rolling.cpp"
+#include "ping_anomaly.cpp"
+#include "ping_uring.cpp"
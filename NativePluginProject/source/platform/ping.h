@@ -2,23 +2,89 @@
 #define _PING_H
 
 #include "icmp.h"
+#include "ping_anomaly.h"
 
+#ifndef MaxPingJobs
 #define MaxPingJobs         64
-#define MaxSequenceRequests 16
+#endif
+#define MaxSweepJobs        4
+#define MaxRaceJobs         4
+#define MaxTracerouteJobs   4
+#define MaxPmtuJobs         2
+#define MaxBandwidthJobs    2
+// ICMP ids used by one process
+#define MaxIcmpIds          (MaxPingJobs + MaxSweepJobs + MaxTracerouteJobs + MaxPmtuJobs \
+                             + MaxBandwidthJobs)
+#define MaxRunningJobs      (MaxIcmpIds + MaxRaceJobs + 1) // and a prewarm job
+#ifndef MaxSequenceRequests
+#define MaxSequenceRequests 16      // at most about 600, a PingJob must fit the job map's 32 KB
+#endif
+// a request's ICMP seq is its index in the low bits and the generation of the job's slot in the
+// rest, so a late reply to the last job that held the slot, and its ICMP id, isn't taken for one
+// to this job's request
+#define SequenceIndexBits   10
+#define SequenceIndexMask   ((1 << SequenceIndexBits) - 1)
 #define DefaultNumRequests  1
 #define DefaultDataSize     32
 #define DefaultTTL          128
+#define MaxDscp             63      // DSCP is the top 6 bits of the IP header's TOS byte
 #define DefaultTimeoutMS    1000
 #define DefaultIntervalMS   16
-#define MaxPacketSize       512
-#define ReceiveBufferSize   1024
+#ifndef MaxPacketSize
+#define MaxPacketSize       512     // largest request of ping, sweep and traceroute jobs
+#endif
+#ifndef MaxPathMtu
+#define MaxPathMtu          1500    // largest path MTU a pmtu job probes, raise for jumbo frames
+#endif
+// largest ICMP packet sent by any job, a path MTU probe leaves out the 20 byte IP header
+#define MaxSendSize         (MaxPacketSize > MaxPathMtu - 20 ? MaxPacketSize : MaxPathMtu - 20)
+// every raw socket may be handed any job's replies, so all receive buffers fit the largest one
+// with room for IP options, or an ICMP error quoting it
+#define ReceiveBufferSize   (MaxSendSize + 512)
+#define DefaultIdleExitMS   1000    // idle time before a job thread started by a job ends
+
+// host names are resolved on the job thread and kept for a while, so repeated pings to a name
+// don't each wait on DNS
+#define MaxResolvedHosts        64
+#define MaxResolvedHostLength   96      // including the terminator, longer names aren't cached
+#define ResolvedHostSeconds     300     // age after which a name is resolved again
+#define MaxPrewarmHosts         16      // hosts taken by one prewarmPing call
+
+// sockets are kept open between jobs, but every raw ICMP socket is handed its own copy of each
+// ICMP packet the host receives, so a job's socket is only kept while this many or fewer are open
+#define MaxPooledSockets        8
+#define PrewarmJobTypeId        3
+
+// adaptive timeout (PingFlag_AdaptiveTimeout) uses the TCP retransmission timeout estimator from
+// RFC 6298, RTO = SRTT + max(G, K*RTTVAR), clamped between the floor and the job's timeoutMS
+#define MaxPingDestinations     4096
+#define DestinationIdleSeconds  120     // a full table drops destinations unused for this long
+#define MinAdaptiveTimeoutMS    20
+#define AdaptiveTimeoutGranularityMS 1.0f
+
+// per-destination token bucket pacing, the rate is halved when loss is correlated with sending at
+// the limit (ICMP rate limiting by the host or a router) and recovers additively on each reply
+#ifndef PacerRatePPS
+#define PacerRatePPS            100.0f  // maximum sustained requests per second per destination
+#endif
+#define PacerMinRatePPS         1.0f
+#define PacerBurst              8.0f
+#define PacerIncreasePPS        1.0f
+#define PacerBackoffFactor      0.5f
+#define PacerLossGain           0.125f  // EWMA gain of the loss rate estimates
+#define PacerLossMargin         0.1f    // loss rate at the limit must exceed idle loss by this much
+
+// with a tolerance given, sequences end once the confidence interval of the mean round trip is
+// narrow enough, but never before this many replies (or losses, for an unreachable host)
+#define MinSettledSamples       3
 
 
 enum Result : s32 {
     Result_Error   = -1,
     Result_Success = 0,
     Result_Ignore  = 1,
-    Result_Pending = 2
+    Result_Pending = 2,
+    Result_TimeExceeded = 3     // a router on the way answered, the request's TTL ran out
 };
 
 bool ok(s32 r) {
@@ -34,6 +100,16 @@ enum PingStatus : u8 {
     Ping_Error
 };
 
+enum PingFlags : u16 {
+    PingFlag_None            = 0,
+    PingFlag_AdaptiveTimeout = 1 << 0   // timeoutMS is the ceiling of a per-destination RTO
+};
+
+enum PingRequestFlags : u8 {
+    Request_None    = 0,
+    Request_Limited = 1 << 0    // sent with the destination's token bucket nearly drained
+};
+
 enum SequenceStatus : u32 {
     Sequence_Inactive = 0,
     Sequence_Running,
@@ -51,8 +127,10 @@ struct PingRequest {
     r32         elapsedMS;
     u8          ttl;
     PingStatus  status;
-    
-    u16         _pad;
+    u16         timeoutMS;  // timeout chosen when the request was sent
+    u8          flags;      // PingRequestFlags
+
+    u8          _pad[7];
 };
 
 struct PingStats {
@@ -66,6 +144,37 @@ struct PingStats {
     r32         stdDevRoundTrip;
 };
 
+#define PingStatsExVersion  2
+#define LossBurstBins       8       // burst lengths in the loss histogram, the last bin is open
+
+/**
+ * Stats beyond PingStats, for real-time traffic where the variation of the round trip matters as
+ * much as its mean. The struct is versioned so fields can be added without breaking callers built
+ * against an older layout: the caller sets size to sizeof the struct it was built with, and only
+ * that many bytes are written. Fields are only ever appended.
+ */
+struct PingStatsEx {
+    u32         size;           // set by the caller
+    u32         version;        // PingStatsExVersion of the engine that filled it
+    r32         jitterMS;       // RFC 3550 interarrival jitter of the round trips, the smoothed
+                                // difference between consecutive replies' round trips. It starts
+                                // at 0 and takes about 16 replies to settle
+    u32         reordered;      // replies that came after the reply to a later request (RFC 4737)
+    u32         duplicates;     // replies to a request that had already been answered
+    u32         late;           // replies that arrived after their request timed out, which stays
+                                // counted as lost
+
+    // version 2
+    u32         lossBursts;     // runs of consecutive lost requests
+    u32         burstLengths[LossBurstBins];    // bursts of 1, 2, .. lost requests, the last bin
+                                                // also counts the longer ones
+    r32         meanBurstLength;// lost requests per burst
+    r32         meanGapLength;  // received requests per run of them
+    r32         burstEnterProb; // Gilbert model fit, p = P(lost | previous request received)
+    r32         burstExitProb;  // r = P(received | previous request lost), 0 while no lost
+                                // request has been followed by another
+};
+
 struct PingSequence {
     char*       host;
     atomic_u32  status;
@@ -74,13 +183,32 @@ struct PingSequence {
     u16         timeoutMS;
     u16         intervalMS;
     u16         seq;
+    u16         flags;      // PingFlags
     u8          ttl;
-    
-    u8          _pad;
+    u8          dscp;       // DiffServ code point the requests are marked with, 0 for best effort
+
+    u16         id;         // ICMP id of the sequence's requests, network byte order
+    r32         toleranceMS;// end early once the mean round trip is known within +/- this
+    r64         rttMean;    // running round trip mean and sum of squared deviations (Welford)
+    r64         rttM2;
 
     PingRequest requests[MaxSequenceRequests];
     PingStats   stats;
+    PingStatsEx statsEx;
+    r32         lastRoundTrip;  // of the latest reply, for the jitter
+    u32         rollingKey;     // getRollingKey of the host
+    u16         lastReceivedSeq;// seq of the latest reply, for the reorder count
+    u16         lossRunLength;  // lost requests since the last reply
+    u16         receivedPairs;  // requests that followed a received one, for the burst loss fit
+    u16         receivedToLost; //  and were lost
+    u16         lostPairs;      // requests that followed a lost one
+    u16         lostToReceived; //  and were received
+    u16         gaps;           // runs of received requests
+    u16         seqGeneration;  // slot generation, shifted to the high bits of the ICMP seq
+
+    u8          _pad[4];
 };
+static_assert(MaxSequenceRequests <= SequenceIndexMask + 1, "request index must fit the ICMP seq");
 
 struct Ping {
     PingJobHnd     hnd;
@@ -88,6 +216,66 @@ struct Ping {
     PingStats      stats;
 };
 
+/**
+ * Opt-in mode for LAN latency measurements, trading CPU for less scheduling jitter. The default
+ * mode blocks the idle job thread on the job queue and leaves scheduling to the OS.
+ */
+struct PingLatencyConfig {
+    s32         cpu;            // CPU the job thread is pinned to, -1 to not pin
+    u32         busyPollMicros; // SO_BUSY_POLL on Linux sockets, the driver is polled for this
+                                //  long on reads instead of waiting for an interrupt, 0 for off
+    u8          enabled;        // idle job thread spins on the queue instead of blocking, and
+                                //  reply timestamp delay is measured (Linux)
+    u8          realtime;       // job thread runs at realtime priority
+    u8          _pad[2];
+};
+
+/**
+ * What the job thread does while it has no jobs.
+ */
+enum PingIdlePolicy : u8 {
+    PingIdle_Park = 0,  // block on the job queue until the next job
+    PingIdle_Spin,      // poll the job queue, yielding, for idleMS (0 for ever) then park
+    PingIdle_Exit       // block on the job queue for idleMS then end the thread, the next job
+                        //  starts a new one
+};
+
+/**
+ * Job thread lifecycle. Without startPingEngine the first job starts the job thread with
+ * PingIdle_Exit and DefaultIdleExitMS.
+ */
+struct PingEngineConfig {
+    u32         idleMS;         // see PingIdlePolicy
+    u8          idlePolicy;     // PingIdlePolicy
+
+    u8          _pad[3];
+};
+
+/**
+ * Per destination address state shared by all sequences to that address. Holds the round trip
+ * time estimator, so a new sequence to a known host starts with a tuned timeout, the token
+ * bucket that paces requests so many sequences to one host don't trip its ICMP rate limit, and the
+ * baselines of the anomaly detector.
+ */
+struct PingDestination {
+    // timeout estimator
+    r32         srttMS;     // smoothed round trip time
+    r32         rttVarMS;   // round trip time variation
+    r32         rtoMS;      // current retransmission timeout, 0 until the first sample
+    u32         samples;
+
+    // pacer
+    i64         refillTime; // timer counts of the last token refill
+    r32         tokens;
+    r32         ratePPS;    // current refill rate, backs off below PacerRatePPS
+    r32         lossLimited;// loss rate of requests sent at the rate limit
+    r32         lossIdle;   // loss rate of requests sent with tokens to spare
+
+    u32         cacheSlot;  // latency cache slot last used for the destination
+
+    AnomalyDetector anomaly;
+};
+
 
 #ifdef _WIN32
 
@@ -108,6 +296,38 @@ typedef int SOCKET;
 
 #endif
 
+/**
+ * Socket operations used by the job engine. The platform transport uses raw ICMP sockets, the
+ * simulator transport in ping_sim.h delivers replies from an in-process network model, and the
+ * io_uring transport in ping_uring.h batches the system calls of the raw sockets on Linux.
+ * The functions return the Result codes documented on the platform implementations.
+ * The TTL and TOS are passed with each packet, so the job thread can keep a socket open between
+ * jobs with different TTLs or DSCP classes. createSocket's ttl is only the socket's initial
+ * default. The TOS byte holds the DSCP in its top 6 bits, the ECN bits are left 0.
+ */
+struct PingTransport {
+    const char* name;
+
+    s32  (*resolveDestinationHost)(const char* host, sockaddr_in& dest);
+    s32  (*createSocket)(u8 ttl, u16 id, SOCKET& outSocket);
+    void (*closeSocket)(SOCKET socket);
+    s32  (*sendPacket)(SOCKET socket, const sockaddr_in& dest, const u8* buffer, u32 packetSize,
+                       u8 ttl, u8 tos);
+    // gives the size of the packet read, which may be less than the buffer
+    s32  (*receivePacket)(SOCKET socket, u8* recvBuffer, u32 bufferSize, sockaddr_in& source,
+                          u32& outBytes);
+    void (*endIteration)();     // called after each job loop iteration, may be nullptr
+    // sets or clears the don't fragment bit of the socket's packets, may be nullptr if the
+    // transport never fragments
+    s32  (*setDontFragment)(SOCKET socket, u8 dontFragment);
+    // has the kernel stamp the socket's packets as they arrive, may be nullptr
+    s32  (*enableReceiveTimestamps)(SOCKET socket);
+    // receives like receivePacket and gives the packet's arrival in timer counts, the kernel's
+    // timestamp where there is one, may be nullptr
+    s32  (*receiveTimestampedPacket)(SOCKET socket, u8* recvBuffer, u32 bufferSize,
+                                     sockaddr_in& source, u32& outBytes, i64& receiveTime);
+};
+
 struct PingJob {
     PingSequence   sequence;
     SOCKET         socket;
@@ -120,6 +340,7 @@ struct PingJob {
 
 #include "../utility/sparse_handle_map_16.h"
 #include "../utility/concurrent_queue.h"
+#include "../utility/hash_map_32.h"
 
 SparseHandleMap16_Typed_WithBuffer(
     PingJob,
@@ -128,16 +349,32 @@ SparseHandleMap16_Typed_WithBuffer(
     0,
     MaxPingJobs);
 
+// queue of new ping, sweep, race, traceroute, pmtu and bandwidth jobs for the job thread, the
+// handle typeId tells them apart
 ConcurrentQueue_Typed_WithBuffer(
     PingJobHnd,
     PingJobQueue,
-    MaxPingJobs,
+    MaxRunningJobs,
     0);
 
+HashMap32_Typed_WithBuffer(
+    PingDestination,
+    PingDestinationMap,
+    MaxPingDestinations);
+
 
 
 /**
  * Adds a ping job and runs it immediately on the job thread. This is a non-blocking call.
+ * @param numRequests  number of requests, at most MaxSequenceRequests. With a toleranceMS this is
+ *  the maximum and the sequence may end sooner
+ * @param flags  PingFlags, with PingFlag_AdaptiveTimeout each request times out after the
+ *  destination's estimated RTO instead of the fixed timeoutMS, which becomes the upper bound
+ * @param toleranceMS  when > 0, the sequence ends as soon as the 95% confidence interval of the
+ *  mean round trip is within +/- toleranceMS (after at least MinSettledSamples replies), or the
+ *  first MinSettledSamples requests are all lost
+ * @param dscp  DiffServ code point to mark the requests with, up to MaxDscp, so the round trip is
+ *  measured in the priority class of the traffic it stands for (46 for expedited forwarding)
  * @returns Ping struct with a non-zero hnd on success, or 0 in hnd if job queue is full 
  */
 Ping
@@ -147,11 +384,14 @@ ping(
     u16 dataSize    = DefaultDataSize,
     u8  ttl         = DefaultTTL,
     u16 timeoutMS   = DefaultTimeoutMS,
-    u16 intervalMS  = DefaultIntervalMS); // TODO: interval not implemented
+    u16 intervalMS  = DefaultIntervalMS, // TODO: interval not implemented
+    u16 flags       = PingFlag_None,
+    r32 toleranceMS = 0.f,
+    u8  dscp        = 0);
 
 /**
  * Checks poll sequence status for completion and stores a copy of the resulting PingStats.
- * If ping.status is Sequence_Finished, ping.stats is filled.
+ * If ping.status is Sequence_Finished, ping.stats is filled, and outStatsEx if one is given.
  * If ping.status is Sequence_Error, ping.stats is not written to.
  * In both of the above cases, the job is removed and ping.hnd is cleared to zero.
  * If ping.status is Sequence_Running, the process is still running.
@@ -162,11 +402,92 @@ ping(
  */
 bool
 pollResult(
-    Ping& ping);
+    Ping& ping,
+    PingStatsEx* outStatsEx = nullptr);
+
+
+/**
+ * Replaces the transport used for all new sockets. Not thread-safe, only call this while no jobs
+ * are running. Sockets the job thread kept open from the old transport are closed as their ids
+ * are next used, or when the thread ends.
+ * @param transport  the transport to use, or nullptr to restore the platform transport
+ */
+void
+setPingTransport(
+    const PingTransport* transport);
+
+/**
+ * Starts the job thread, or sets the idle policy of the running one, which takes effect the next
+ * time it runs out of jobs. A thread parked in PingIdle_Park only sees a new policy after its next
+ * job. Starting the thread up front takes thread creation out of the first job's latency.
+ * @param config  idle policy, or nullptr for PingIdle_Park
+ * @returns Result_Success, or Result_Error if the thread can't be created
+ */
+s32
+startPingEngine(
+    const PingEngineConfig* config);
+
+/**
+ * Ends the job thread and waits for it to exit. Jobs still running or queued end with
+ * Sequence_Error and their sockets are closed, see abortJob. Don't call this concurrently with
+ * calls that queue jobs.
+ */
+void
+stopPingEngine();
+
+/**
+ * Readies the engine for pings to the given hosts before they're needed, so the first results
+ * come back sooner. Starts the job thread if it isn't running and queues a job that resolves the
+ * host names into the job thread's name cache and opens sockets for as many pings as there are
+ * hosts. This is a non-blocking call, the job thread does the work, and a ping queued meanwhile
+ * runs after it.
+ * @param hosts  dotted-quad addresses or host names, at most MaxPrewarmHosts are taken
+ * @returns Result_Success, or Result_Error if the job thread can't be started
+ */
+s32
+prewarmPing(
+    const char* const* hosts,
+    u32 numHosts);
+
+/**
+ * Sets or clears latency mode, see PingLatencyConfig. Only call this while the job thread isn't
+ * running, before the first job or after stopPingEngine. The job thread applies it when it starts
+ * and sockets when they are created. Pinning and priority
+ * failures are logged and the job thread runs without them.
+ * Reply timestamp delay, between the kernel receiving a reply and the job thread reading it, is
+ * reported through the timestamp* fields of PingMetrics.
+ * @param config  the mode to use, or nullptr for the default mode
+ */
+void
+setPingLatencyMode(
+    const PingLatencyConfig* config);
 
 
 SequenceStatus
 runPingSequence(
     PingJob& job);
 
+/**
+ * Lets the transport submit the I/O queued during a job loop iteration, called by the job thread
+ * after running its jobs.
+ */
+void
+transportEndIteration();
+
+/**
+ * Runs one step of a ping, sweep, race, traceroute, pmtu or bandwidth job on the job thread.
+ * @returns status of the job, Sequence_Error for a stale handle
+ */
+SequenceStatus
+runJob(
+    PingJobHnd hnd);
+
+/**
+ * Ends a job that won't run again as the job thread stops. A job still inactive or running
+ * finishes with Sequence_Error and its socket is closed, finished jobs are left as they are.
+ */
+void
+abortJob(
+    PingJobHnd hnd);
+
 #endif
\ No newline at end of file
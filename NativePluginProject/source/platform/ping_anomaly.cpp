@@ -0,0 +1,230 @@
+#include "ping_anomaly.h"
+#include "platform.h"
+
+struct alignas(CacheLineSize) AnomalyRing {
+    atomic_u32  head;       // next event written, only the job thread writes it
+    u8          _pad0[CacheLineSize - sizeof(atomic_u32)];
+    atomic_u32  tail;       // next event polled, only the poll holding anomalyPollLock writes it
+    atomic_u32  dropped;    // events lost to a full ring
+    u8          _pad1[CacheLineSize - 2*sizeof(atomic_u32)];
+
+    AnomalyEvent events[AnomalyRingEvents];
+};
+
+// 0 while detection is disabled
+atomic_u32 anomalyEpoch{ 0 };
+
+static AnomalyRing  anomalyRing;
+static atomic_u32   lastAnomalyEpoch{ 0 };
+static atomic_lock  anomalyPollLock = ATOMIC_FLAG_INIT;
+
+
+void
+anomalyDetectionEnable(
+    bool enable)
+{
+    if (!enable) {
+        anomalyEpoch.store(0, std::memory_order_relaxed);
+    }
+    else if (!anomalyDetecting())
+    {
+        u32 epoch = lastAnomalyEpoch.fetch_add(1, std::memory_order_relaxed) + 1;
+        anomalyEpoch.store((epoch != 0 ? epoch : 1), std::memory_order_relaxed);
+    }
+}
+
+
+static
+void
+pushAnomaly(
+    AnomalyKind kind,
+    u32 address,
+    r32 baseline,
+    r32 value)
+{
+    u32 head = anomalyRing.head.load(std::memory_order_relaxed);
+    if (head - anomalyRing.tail.load(std::memory_order_acquire) >= AnomalyRingEvents) {
+        anomalyRing.dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    AnomalyEvent& event = anomalyRing.events[head & (AnomalyRingEvents - 1)];
+    event.timeMicros = platformGetEpochMicros();
+    event.address = address;
+    event.baseline = baseline;
+    event.value = value;
+    event.kind = kind;
+    memset(event._pad, 0, sizeof(event._pad));
+
+    anomalyRing.head.store(head + 1, std::memory_order_release);
+}
+
+
+/**
+ * Adds a reply's round trip to the CUSUMs and the baseline.
+ */
+static
+void
+detectLatencyShift(
+    AnomalyDetector& detector,
+    u32 address,
+    r32 rttMS)
+{
+    if (detector.replies++ == 0) {
+        detector.baselineMS = rttMS;
+        return;
+    }
+
+    r32 stdDev = max(sqrtf(detector.baselineVar), AnomalyMinDeviationMS);
+    r32 z = min(max((rttMS - detector.baselineMS) / stdDev, -AnomalyMaxDeviations),
+                AnomalyMaxDeviations);
+
+    if (detector.replies > AnomalyWarmupSamples)
+    {
+        detector.cusumUp = max(detector.cusumUp + z - AnomalyCusumSlack, 0.f);
+        detector.cusumDown = max(detector.cusumDown - z - AnomalyCusumSlack, 0.f);
+
+        if (detector.cusumUp > AnomalyCusumThreshold
+            || detector.cusumDown > AnomalyCusumThreshold)
+        {
+            pushAnomaly((detector.cusumUp > AnomalyCusumThreshold
+                         ? Anomaly_LatencyUp
+                         : Anomaly_LatencyDown),
+                        address, detector.baselineMS, rttMS);
+
+            // the baseline is learned again from the new level, its variance carries over
+            detector.replies = 1;
+            detector.baselineMS = rttMS;
+            detector.cusumUp = 0.f;
+            detector.cusumDown = 0.f;
+            return;
+        }
+    }
+
+    // EWMA and EWMVar of the clamped deviation, so one late reply moves neither far. Until the
+    // EWMA's weight is reached they're plain means, so the first replies don't bias the baseline
+    r32 gain = max(1.f / detector.replies, AnomalyBaselineGain);
+    r32 d = z * stdDev;
+    detector.baselineMS += gain * d;
+    detector.baselineVar = (1.f - gain) * (detector.baselineVar + gain * d * d);
+}
+
+
+/**
+ * Adds a request's outcome to the loss EWMAs.
+ */
+static
+void
+detectLossSpike(
+    AnomalyDetector& detector,
+    u32 address,
+    bool received)
+{
+    r32 loss = (received ? 0.f : 1.f);
+    detector.lossFast += AnomalyLossFastGain * (loss - detector.lossFast);
+    if (!detector.lossSpike) {
+        detector.lossSlow += AnomalyLossSlowGain * (loss - detector.lossSlow);
+    }
+
+    if (++detector.requests <= AnomalyWarmupSamples) {
+        return;
+    }
+
+    if (!detector.lossSpike && detector.lossFast > detector.lossSlow + AnomalyLossSpike)
+    {
+        detector.lossSpike = 1;
+        pushAnomaly(Anomaly_LossSpike, address, detector.lossSlow, detector.lossFast);
+    }
+    else if (detector.lossSpike
+             && detector.lossFast < detector.lossSlow + 0.5f * AnomalyLossSpike)
+    {
+        detector.lossSpike = 0;
+        pushAnomaly(Anomaly_LossRecovered, address, detector.lossSlow, detector.lossFast);
+    }
+}
+
+
+/**
+ * Counts replies in a row at a TTL other than the established one, the route has changed once
+ * there are AnomalyRouteReplies of them. A reply at the established TTL starts the count again.
+ */
+static
+void
+detectRouteChange(
+    AnomalyDetector& detector,
+    u32 address,
+    u8 ttl)
+{
+    if (detector.replyTtl == 0 || ttl == detector.replyTtl)
+    {
+        detector.replyTtl = ttl;
+        detector.candidateReplies = 0;
+        return;
+    }
+
+    if (ttl != detector.candidateTtl) {
+        detector.candidateTtl = ttl;
+        detector.candidateReplies = 0;
+    }
+
+    if (++detector.candidateReplies >= AnomalyRouteReplies)
+    {
+        pushAnomaly(Anomaly_RouteChange, address, (r32)detector.replyTtl, (r32)ttl);
+        detector.replyTtl = ttl;
+        detector.candidateReplies = 0;
+    }
+}
+
+
+void
+detectAnomalies(
+    AnomalyDetector& detector,
+    u32 address,
+    bool received,
+    r32 rttMS,
+    u8 ttl)
+{
+    u32 epoch = anomalyEpoch.load(std::memory_order_relaxed);
+    if (detector.epoch != epoch) {
+        memset(&detector, 0, sizeof(AnomalyDetector));
+        detector.epoch = epoch;
+    }
+
+    detectLossSpike(detector, address, received);
+
+    if (received)
+    {
+        detectLatencyShift(detector, address, rttMS);
+        detectRouteChange(detector, address, ttl);
+    }
+}
+
+
+u32
+pollAnomalies(
+    AnomalyEvent* outEvents,
+    u32 maxEvents,
+    u32* outDropped)
+{
+    if (!outEvents) {
+        return 0;
+    }
+
+    lock_spin(anomalyPollLock);
+
+    u32 head = anomalyRing.head.load(std::memory_order_acquire);
+    u32 tail = anomalyRing.tail.load(std::memory_order_relaxed);
+    u32 count = 0;
+
+    for (; tail != head && count < maxEvents; ++tail, ++count) {
+        outEvents[count] = anomalyRing.events[tail & (AnomalyRingEvents - 1)];
+    }
+    anomalyRing.tail.store(tail, std::memory_order_release);
+
+    if (outDropped) {
+        *outDropped = anomalyRing.dropped.exchange(0, std::memory_order_relaxed);
+    }
+
+    unlock(anomalyPollLock);
+    return count;
+}
@@ -0,0 +1,126 @@
+#ifndef _PING_ANOMALY_H
+#define _PING_ANOMALY_H
+
+#include "../utility/common.h"
+
+/**
+ * Optional detector of changes in each destination's round trip, loss and path, fed every request
+ * of the ping sequences on the job thread. It pushes a compact event for each change into a ring
+ * that the game drains with pollAnomalies, so spotting a route change takes no scanning of results
+ * on the game thread. The job thread is the ring's only producer and never waits. Polls from
+ * several threads can share it, they take turns on a lock. Events are dropped while the ring is
+ * full and counted.
+ *
+ *  - Round trip: a slow EWMA of the round trip and its variance is the baseline, and two one-sided
+ *    CUSUMs add up each reply's deviation from it in standard deviations, less a slack of
+ *    AnomalyCusumSlack. A sum past AnomalyCusumThreshold is a sustained rise or fall, and the
+ *    baseline restarts at the new level. Deviations are clamped to AnomalyMaxDeviations, so a
+ *    single late reply can't raise an event on its own.
+ *  - Loss: a fast EWMA of requests lost that rises AnomalyLossSpike above a slow one is a spike,
+ *    and recovers once it's back within half that. The slow EWMA holds still during a spike.
+ *  - Path: replies whose TTL differs from the established one mean the path to the host has changed
+ *    length, a route change, once AnomalyRouteReplies of them arrive in a row. Load balanced
+ *    paths of different lengths mix TTLs from reply to reply and don't raise one.
+ *
+ * Round trip and loss events wait for AnomalyWarmupSamples, so a new baseline doesn't raise one,
+ * and a round trip baseline is learned again the same way after each shift.
+ * Each time detection is enabled the baselines start again.
+ */
+
+#define AnomalyRingEvents       1024    // power of 2
+#define AnomalyWarmupSamples    16      // replies, or requests for loss, before events are raised
+#define AnomalyBaselineGain     0.02f   // EWMA weight of a new round trip in the baseline
+#define AnomalyMinDeviationMS   1.0f    // floor of the standard deviation, smaller shifts are noise
+#define AnomalyMaxDeviations    4.0f    // clamp of one reply's deviation, in standard deviations
+#define AnomalyCusumSlack       0.5f    // k, in standard deviations
+#define AnomalyCusumThreshold   10.0f   // h, in standard deviations
+#define AnomalyLossFastGain     0.125f
+#define AnomalyLossSlowGain     0.01f
+#define AnomalyLossSpike        0.25f   // rise of the fast loss EWMA over the slow one
+#define AnomalyRouteReplies     16      // replies in a row at a new TTL before a route change
+
+enum AnomalyKind : u8 {
+    Anomaly_LatencyUp = 0,      // baseline and value are round trips in ms
+    Anomaly_LatencyDown,
+    Anomaly_LossSpike,          // baseline and value are loss rates, 0 to 1
+    Anomaly_LossRecovered,
+    Anomaly_RouteChange         // baseline and value are the reply TTLs before and after
+};
+
+struct AnomalyEvent {
+    u64         timeMicros;     // microseconds since the Unix epoch
+    u32         address;        // destination, network byte order
+    r32         baseline;       // level before the change
+    r32         value;          // level that raised the event
+    u8          kind;           // AnomalyKind
+
+    u8          _pad[3];
+};
+static_assert_aligned_size(AnomalyEvent, 8);
+
+/**
+ * Detector state of one destination, kept with the destination on the job thread.
+ */
+struct AnomalyDetector {
+    u32         epoch;          // detection epoch the state belongs to, reset when it changes
+    u32         replies;
+    u32         requests;
+    r32         baselineMS;     // slow EWMA of the round trip
+    r32         baselineVar;    // slow EWMA of its squared deviation
+    r32         cusumUp;        // one-sided CUSUMs of the deviations, in standard deviations
+    r32         cusumDown;
+    r32         lossFast;       // EWMAs of requests lost, 0 or 1
+    r32         lossSlow;
+    u8          replyTtl;       // of the replies since the last route change
+    u8          lossSpike;      // a spike was raised and hasn't recovered
+    u8          candidateTtl;   // of the latest replies that differ from replyTtl
+    u8          candidateReplies;   // in a row at candidateTtl
+};
+
+
+extern atomic_u32 anomalyEpoch;
+
+/**
+ * @returns true if anomaly detection is enabled, checked before feeding the detector
+ */
+inline
+bool
+anomalyDetecting()
+{
+    return (anomalyEpoch.load(std::memory_order_relaxed) != 0);
+}
+
+/**
+ * Enables or disables the detector. Enabling it starts every destination's baselines again.
+ */
+void
+anomalyDetectionEnable(
+    bool enable);
+
+/**
+ * Feeds a request's result to its destination's detector, called from the job thread only.
+ * @param address  destination, network byte order
+ * @param received  false for a request that timed out
+ * @param ttl  TTL of the reply
+ */
+void
+detectAnomalies(
+    AnomalyDetector& detector,
+    u32 address,
+    bool received,
+    r32 rttMS,
+    u8 ttl);
+
+/**
+ * Moves up to maxEvents events from the ring to outEvents, oldest first. Polls from several
+ * threads take turns, the job thread never waits on them.
+ * @param outDropped  if given, events lost to a full ring since the last poll that asked
+ * @returns number of events copied
+ */
+u32
+pollAnomalies(
+    AnomalyEvent* outEvents,
+    u32 maxEvents,
+    u32* outDropped = nullptr);
+
+#endif
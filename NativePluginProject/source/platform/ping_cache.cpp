@@ -0,0 +1,187 @@
+#include "ping_cache.h"
+#include "ping_log.h"
+#include "platform.h"
+
+std::atomic<bool> latencyCacheOpened{ false };
+
+// guards the mapping and the entries, the job thread only ever tries it
+static atomic_lock         latencyCacheLock = ATOMIC_FLAG_INIT;
+static PlatformMappedFile  latencyCacheFile{};
+static LatencyCacheEntry*  latencyCacheEntries = nullptr;
+
+
+s32
+latencyCacheOpen(
+    const char* path)
+{
+    if (!path) {
+        return Result_Error;
+    }
+
+    lock_spin(latencyCacheLock);
+    if (latencyCacheEntries) {
+        unlock(latencyCacheLock);
+        return Result_Error;
+    }
+
+    u64 size = sizeof(LatencyCacheHeader) + MaxCachedDestinations * sizeof(LatencyCacheEntry);
+    if (platformMapFile(path, size, true, latencyCacheFile) != 0) {
+        unlock(latencyCacheLock);
+        LOG_ERROR("Failed to map the latency cache %s", path);
+        return Result_Error;
+    }
+
+    LatencyCacheHeader& header = *(LatencyCacheHeader*)latencyCacheFile.data;
+    if (header.magic != LatencyCacheMagic
+        || header.version != LatencyCacheVersion
+        || header.entrySize != sizeof(LatencyCacheEntry)
+        || header.capacity != MaxCachedDestinations)
+    {
+        memset(latencyCacheFile.data, 0, (size_t)size);
+        header.magic = LatencyCacheMagic;
+        header.version = LatencyCacheVersion;
+        header.entrySize = sizeof(LatencyCacheEntry);
+        header.capacity = MaxCachedDestinations;
+    }
+    latencyCacheEntries = (LatencyCacheEntry*)(latencyCacheFile.data + sizeof(LatencyCacheHeader));
+
+    latencyCacheOpened.store(true, std::memory_order_release);
+    unlock(latencyCacheLock);
+    return Result_Success;
+}
+
+
+void
+latencyCacheClose()
+{
+    lock_spin(latencyCacheLock);
+    latencyCacheOpened.store(false, std::memory_order_release);
+    latencyCacheEntries = nullptr;
+    platformUnmapFile(latencyCacheFile, latencyCacheFile.size);
+    unlock(latencyCacheLock);
+}
+
+
+/**
+ * Finds the destination's slot, or claims an empty or the least recently updated one.
+ */
+static
+u32
+findCacheSlot(
+    u32 slotHint,
+    u32 address)
+{
+    if (slotHint < MaxCachedDestinations && latencyCacheEntries[slotHint].address == address) {
+        return slotHint;
+    }
+
+    u32 oldest = 0;
+    for (u32 s = 0; s < MaxCachedDestinations; ++s)
+    {
+        LatencyCacheEntry& entry = latencyCacheEntries[s];
+        if (entry.address == address) {
+            return s;
+        }
+        if (entry.updatedMicros < latencyCacheEntries[oldest].updatedMicros) {
+            oldest = s;
+        }
+    }
+
+    memset(&latencyCacheEntries[oldest], 0, sizeof(LatencyCacheEntry));
+    latencyCacheEntries[oldest].address = address;
+    return oldest;
+}
+
+
+void
+latencyCacheUpdate(
+    u32& slotHint,
+    const char* host,
+    u32 address,
+    bool received,
+    r32 rttMS)
+{
+    if (latencyCacheLock.test_and_set(std::memory_order_acquire)) {
+        return;
+    }
+    if (!latencyCacheEntries) {
+        unlock(latencyCacheLock);
+        return;
+    }
+
+    slotHint = findCacheSlot(slotHint, address);
+    LatencyCacheEntry& entry = latencyCacheEntries[slotHint];
+
+    if (host && strncmp(entry.host, host, MaxCacheHostLength - 1) != 0) {
+        _strncpy_s(entry.host, MaxCacheHostLength, host, MaxCacheHostLength - 1);
+        entry.host[MaxCacheHostLength - 1] = '\0';
+    }
+
+    u64 now = platformGetEpochMicros();
+    if (received)
+    {
+        // the first reply seeds the average, an entry without replies has no round trip yet
+        entry.rttMS = (entry.lastSeenMicros == 0
+                       ? rttMS
+                       : entry.rttMS + LatencyCacheRttAlpha * (rttMS - entry.rttMS));
+        entry.lastSeenMicros = now;
+    }
+    entry.loss += LatencyCacheLossAlpha * ((received ? 0.f : 1.f) - entry.loss);
+    ++entry.samples;
+    entry.updatedMicros = now;
+
+    unlock(latencyCacheLock);
+}
+
+
+bool
+latencyCacheLookup(
+    const char* host,
+    LatencyCacheEntry& outEntry)
+{
+    if (!host) {
+        return false;
+    }
+    u32 address = inet_addr(host);
+
+    lock_spin(latencyCacheLock);
+    bool found = false;
+
+    for (u32 s = 0; latencyCacheEntries && s < MaxCachedDestinations; ++s)
+    {
+        LatencyCacheEntry& entry = latencyCacheEntries[s];
+        if (entry.address == 0) {
+            continue;
+        }
+        if ((address != INADDR_NONE && entry.address == address)
+            || strncmp(entry.host, host, MaxCacheHostLength - 1) == 0)
+        {
+            outEntry = entry;
+            found = true;
+            break;
+        }
+    }
+
+    unlock(latencyCacheLock);
+    return found;
+}
+
+
+u32
+latencyCacheList(
+    LatencyCacheEntry* outEntries,
+    u32 maxEntries)
+{
+    u32 n = 0;
+    lock_spin(latencyCacheLock);
+
+    for (u32 s = 0; latencyCacheEntries && s < MaxCachedDestinations && n < maxEntries; ++s)
+    {
+        if (latencyCacheEntries[s].address != 0) {
+            outEntries[n++] = latencyCacheEntries[s];
+        }
+    }
+
+    unlock(latencyCacheLock);
+    return n;
+}
@@ -0,0 +1,108 @@
+#ifndef _PING_CACHE_H
+#define _PING_CACHE_H
+
+#include "../utility/common.h"
+#include "platform.h"
+
+/**
+ * Last known latency of each destination, kept in a small memory mapped file so it outlives the
+ * process. The job thread folds every request of a ping sequence into its destination's entry, and
+ * at the next start the game reads the entries back as provisional results while fresh sequences
+ * run. Entries are keyed by address and remember the host they were last pinged by, so they can be
+ * looked up by the same host string without resolving it.
+ *
+ * The job thread never waits on the cache. If a lookup holds the lock, the request's sample is
+ * skipped.
+ */
+
+#define LatencyCacheMagic       0x41434C50  // "PLCA"
+#define LatencyCacheVersion     1
+#define MaxCachedDestinations   256         // least recently updated entry is replaced when full
+#define MaxCacheHostLength      96          // including the terminator, longer hosts are truncated
+#define LatencyCacheRttAlpha    0.125f      // EWMA weight of a new round trip, as for SRTT
+#define LatencyCacheLossAlpha   0.0625f     // EWMA weight of a new request's loss, 0 or 1
+#define NoCacheSlot             0xFFFFFFFF
+
+struct LatencyCacheEntry {
+    char        host[MaxCacheHostLength];   // host last passed to ping for this address
+    u32         address;        // network byte order, 0 for an empty slot
+    r32         rttMS;          // EWMA of round trip times
+    r32         loss;           // EWMA of requests lost, 0 to 1
+    u32         samples;        // requests counted
+    u64         lastSeenMicros; // last reply, microseconds since the Unix epoch, 0 if never
+    u64         updatedMicros;  // last request counted
+};
+static_assert_aligned_size(LatencyCacheEntry, 128);
+
+struct LatencyCacheHeader {
+    u32         magic;          // LatencyCacheMagic
+    u16         version;        // LatencyCacheVersion
+    u16         entrySize;      // sizeof(LatencyCacheEntry)
+    u32         capacity;       // MaxCachedDestinations
+
+    u8          _pad[52];
+};
+static_assert_aligned_size(LatencyCacheHeader, 64);
+
+
+extern std::atomic<bool> latencyCacheOpened;
+
+/**
+ * @returns true if the latency cache is open
+ */
+inline
+bool
+latencyCaching()
+{
+    return latencyCacheOpened.load(std::memory_order_acquire);
+}
+
+/**
+ * Maps the cache file, creating it if it doesn't exist. A file with another version or layout is
+ * cleared.
+ * @returns Result_Success, or Result_Error if the cache is already open or the file can't be mapped
+ */
+s32
+latencyCacheOpen(
+    const char* path);
+
+/**
+ * Unmaps the cache file, its entries stay on disk for the next open.
+ */
+void
+latencyCacheClose();
+
+/**
+ * Adds a request's result to its destination's entry, called from the job thread only.
+ * @param slotHint  slot the destination had last time, updated to the slot used
+ * @param host  host the sequence was created with
+ * @param received  false for a request that timed out
+ */
+void
+latencyCacheUpdate(
+    u32& slotHint,
+    const char* host,
+    u32 address,
+    bool received,
+    r32 rttMS);
+
+/**
+ * Finds the entry for a host, by the host string it was pinged by or, for a dotted quad, by
+ * address.
+ * @returns true and a copy of the entry in outEntry if found
+ */
+bool
+latencyCacheLookup(
+    const char* host,
+    LatencyCacheEntry& outEntry);
+
+/**
+ * Copies up to maxEntries of the cache's entries, in slot order.
+ * @returns number of entries copied
+ */
+u32
+latencyCacheList(
+    LatencyCacheEntry* outEntries,
+    u32 maxEntries);
+
+#endif
@@ -2,6 +2,7 @@
 
 #include "ping.h"
 #include "timer.h"
+#include <linux/filter.h>
 
 
 /**
@@ -29,7 +30,7 @@ resolveDestinationHost(
         }
         else {
             // Not a recognized hostname either!
-            printf("Failed to resolve %s\n", host);
+            LOG_WARN("Failed to resolve %s", host);
             return Result_Error;
         }
     }
@@ -37,13 +38,69 @@ resolveDestinationHost(
     return Result_Success;
 }
 
+/**
+ * Attaches a classic BPF program that passes only ICMP messages for the ids firstId to lastId (host
+ * byte order). A raw ICMP socket otherwise gets a copy of every ICMP packet the host receives,
+ * so each socket would wake for replies meant for every other socket and process. Echo replies
+ * are matched on their id, errors (destination unreachable, time exceeded, parameter problem) on
+ * the id of the echo request they quote.
+ * @returns 0 on success, -1 on error
+ */
+static
+s32
+attachIcmpFilter(
+    SOCKET socket,
+    u16 firstId,
+    u16 lastId)
+{
+    // a raw socket's packets start at the IP header, X holds the IP header length
+    sock_filter code[] = {
+        BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),                                 // 0  X = ip hlen
+        BPF_STMT(BPF_LD  | BPF_B | BPF_IND, 0),                                 // 1  icmp type
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMPType_EchoReply, 12, 0),         // 2  -> 15
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMPType_DestinationUnreachable, 2, 0), // -> 6
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMPType_TimeExceeded, 1, 0),       // 4  -> 6
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMPType_ParameterProblem, 0, 13),  // 5  -> 19
+        // error, the quoted request follows the 8 byte ICMP header
+        BPF_STMT(BPF_LD  | BPF_B | BPF_IND, 8 + 9),                             // 6  quoted proto
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_ICMP, 0, 11),               // 7  -> 19
+        BPF_STMT(BPF_LD  | BPF_B | BPF_IND, 8),                                 // 8  quoted hlen
+        BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0x0F),                              // 9
+        BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 2),                                 // 10
+        BPF_STMT(BPF_ALU | BPF_ADD | BPF_X, 0),                                 // 11
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),                                        // 12 X += hlen
+        BPF_STMT(BPF_LD  | BPF_H | BPF_IND, 8 + 4),                             // 13 quoted id
+        BPF_STMT(BPF_JMP | BPF_JA, 1),                                          // 14 -> 16
+        BPF_STMT(BPF_LD  | BPF_H | BPF_IND, 4),                                 // 15 reply id
+        BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, firstId, 0, 2),                     // 16 -> 19
+        BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, lastId, 1, 0),                      // 17 -> 19
+        BPF_STMT(BPF_RET | BPF_K, 0xFFFFFFFF),                                  // 18 accept
+        BPF_STMT(BPF_RET | BPF_K, 0)                                            // 19 drop
+    };
+    sock_fprog program{ (u16)countof(code), code };
+
+    if (setsockopt(socket, SOL_SOCKET, SO_ATTACH_FILTER, &program, sizeof(program)) != 0) {
+        return Result_Error;
+    }
+
+    // packets queued between socket() and the filter weren't filtered, drop them
+    u8 discard[64];
+    while (recv(socket, discard, sizeof(discard), MSG_DONTWAIT) >= 0) {}
+
+    return Result_Success;
+}
+
+
 /**
  * @param ttl  number of hops
+ * @param id   ICMP id of the requests sent on the socket, network byte order, the socket only
+ *  receives replies and errors for this id
  * @returns 0 on success, -1 on error
  */
 s32
 createSocket(
     u8 ttl,
+    u16 id,
     SOCKET& outSocket)
 {
     outSocket = socket(
@@ -52,8 +109,7 @@ createSocket(
         IPPROTO_ICMP);
         
     if (outSocket == INVALID_SOCKET) {
-        printf("Failed to create raw socket: %d\n", errno);
-        perror("socket");
+        LOG_ERROR("Failed to create raw socket: %s", strerror(errno));
         return Result_Error;
     }
 
@@ -65,11 +121,31 @@ createSocket(
         sizeof(ttl));
 
     if (opt == SOCKET_ERROR) {
-        printf("TTL setsockopt failed: %d\n", errno);
-        perror("socket");
+        LOG_ERROR("TTL setsockopt failed: %s", strerror(errno));
+        close(outSocket);
         return Result_Error;
     }
 
+    // without the filter the socket still works, foreign replies are dropped by handleReply
+    if (!ok(attachIcmpFilter(outSocket, ntohs(id), ntohs(id)))) {
+        LOG_WARN("ICMP socket filter failed: %s", strerror(errno));
+    }
+
+    if (latencyConfig.enabled)
+    {
+        s32 on = 1;
+        if (setsockopt(outSocket, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) != 0) {
+            LOG_WARN("SO_TIMESTAMPNS failed: %s", strerror(errno));
+        }
+
+        s32 busyPoll = (s32)latencyConfig.busyPollMicros;
+        if (busyPoll > 0
+            && setsockopt(outSocket, SOL_SOCKET, SO_BUSY_POLL, &busyPoll, sizeof(busyPoll)) != 0)
+        {
+            LOG_WARN("SO_BUSY_POLL failed: %s", strerror(errno));
+        }
+    }
+
     /*u_long nonBlockingMode = 1;
     opt = ioctlsocket(outSocket, FIONBIO, &nonBlockingMode);
     if (opt != NO_ERROR) {
@@ -88,8 +164,65 @@ platform_closesocket(
 }
 
 
+/**
+ * With dontFragment set, packets are sent with the DF bit in IP_PMTUDISC_PROBE mode, which
+ * ignores the path MTU the kernel has learned so a path that has grown can be probed again. A
+ * packet larger than the local link's MTU fails to send with EMSGSIZE. Cleared, the socket goes
+ * back to the kernel's default.
+ * @returns 0 on success, -1 on error
+ */
+s32
+setDontFragment(
+    SOCKET socket,
+    u8 dontFragment)
+{
+    s32 mode = (dontFragment ? IP_PMTUDISC_PROBE : IP_PMTUDISC_WANT);
+    if (setsockopt(socket, IPPROTO_IP, IP_MTU_DISCOVER, &mode, sizeof(mode)) == SOCKET_ERROR) {
+        LOG_WARN("IP_MTU_DISCOVER setsockopt failed: %d", errno);
+        return Result_Error;
+    }
+    return Result_Success;
+}
+
+
+#define SendControlSize (2 * CMSG_SPACE(sizeof(s32)))
+
+/**
+ * Points the message's control data at IP_TTL and IP_TOS messages, so the packet is sent with its
+ * TTL and TOS without changing the socket's defaults.
+ * @param control  buffer of SendControlSize bytes, aligned for a cmsghdr
+ */
+static inline
+void
+setSendOptions(
+    msghdr& msg,
+    u8* control,
+    u8 ttl,
+    u8 tos)
+{
+    memset(control, 0, SendControlSize);
+    msg.msg_control = control;
+    msg.msg_controllen = SendControlSize;
+
+    s32 values[2] = { ttl, tos };
+    s32 types[2] = { IP_TTL, IP_TOS };
+
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    for (u32 c = 0; c < 2; ++c)
+    {
+        cmsg->cmsg_level = IPPROTO_IP;
+        cmsg->cmsg_type = types[c];
+        cmsg->cmsg_len = CMSG_LEN(sizeof(s32));
+        memcpy(CMSG_DATA(cmsg), &values[c], sizeof(s32));
+        cmsg = CMSG_NXTHDR(&msg, cmsg);
+    }
+}
+
+
 /**
  * @param packetSize  total size of packet to send including ICMPHeader
+ * @param ttl  number of hops, sent as ancillary data with the packet like tos
+ * @param tos  IP type of service byte, DSCP in the top 6 bits
  * @returns 0 on success, -1 on error, 2 on pending
  */
 s32
@@ -97,15 +230,20 @@ sendPingPacket(
     SOCKET socket,
     const sockaddr_in& dest,
     const u8* buffer,
-    u32 packetSize)
+    u32 packetSize,
+    u8 ttl,
+    u8 tos)
 {
-    s32 bytes = sendto(
-        socket,
-        (const char*)buffer,
-        packetSize,
-        0, 
-        (sockaddr*)&dest,
-        sizeof(dest));
+    iovec iov{ (void*)buffer, packetSize };
+    alignas(cmsghdr) u8 control[SendControlSize];
+    msghdr msg{};
+    msg.msg_name = (void*)&dest;
+    msg.msg_namelen = sizeof(dest);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    setSendOptions(msg, control, ttl, tos);
+
+    s32 bytes = sendmsg(socket, &msg, 0);
     
     if (bytes == SOCKET_ERROR) {
         s32 err = errno;
@@ -113,14 +251,14 @@ sendPingPacket(
             return Result_Pending;
         }
         else {
-            printf("Failed to send: %d\n", err);
+            LOG_WARN("Failed to send: %d", err);
             return Result_Error;
         }
     }
 
-    printf(
-        "Pinging %s with %d bytes of data:\n",
-        inet_ntoa(dest.sin_addr),
+    LOG_DEBUG(
+        "Pinging %s with %d bytes of data:",
+        logAddress(dest.sin_addr.s_addr),
         (s32)(bytes - sizeof(ICMPHeader)));
 
     return Result_Success;
@@ -128,72 +266,231 @@ sendPingPacket(
 
 
 /**
- * @param recvBuffer  buffer to receive data, must be larger than
- *  request buffer + sizeof(ICMPHeader) due to IP header options
- * @param bufferSize  size of the buffer pointed to by recvBuffer
- * @returns 0 on success, -1 on error, 2 on pending
+ * Reads a packet with recvmsg along with the kernel's receive timestamp, which comes with it once
+ * SO_TIMESTAMPNS is set on the socket.
+ * @param outDelayNanos  time from the kernel receiving the packet to now, -1 without a timestamp
+ * @returns bytes read, or SOCKET_ERROR
  */
+static
 s32
-getPingReply(
+receiveWithDelay(
     SOCKET socket,
     u8* recvBuffer,
     u32 bufferSize,
-    sockaddr_in& source)
+    sockaddr_in& source,
+    s64& outDelayNanos)
 {
-    socklen_t fromLen = sizeof(source);
+    iovec iov{ recvBuffer, bufferSize };
+    alignas(cmsghdr) u8 control[CMSG_SPACE(sizeof(timespec))];
+    msghdr msg{};
+    msg.msg_name = &source;
+    msg.msg_namelen = sizeof(source);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    s32 bytes = recvmsg(socket, &msg, 0);
+    outDelayNanos = -1;
+
+    cmsghdr* cmsg = (bytes > 0 ? CMSG_FIRSTHDR(&msg) : nullptr);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+    {
+        timespec received;
+        memcpy(&received, CMSG_DATA(cmsg), sizeof(received));
+        timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+
+        s64 delay = (s64)(now.tv_sec - received.tv_sec) * 1000000000LL
+                  + (now.tv_nsec - received.tv_nsec);
+        outDelayNanos = max(delay, (s64)0);
+    }
+
+    return bytes;
+}
 
-    s32 bytes = recvfrom(
-        socket,
-        (char*)recvBuffer, 
-        bufferSize,
-        0,
-        (sockaddr*)&source,
-        &fromLen);
 
+/**
+ * @param outBytes  set to bytes on success
+ * @returns 0 on success, -1 on error, 2 on pending
+ */
+static inline
+s32
+getReceiveResult(
+    s32 bytes,
+    u32& outBytes)
+{
     if (bytes == SOCKET_ERROR) {
         s32 err = errno;
         if (err == EWOULDBLOCK || err == EAGAIN) {
             return Result_Pending;
         }
         else {
-            printf("Failed to read reply: %d\n", err);
+            LOG_WARN("Failed to read reply: %d", err);
             return Result_Error;
         }
     }
     else if (bytes == 0) {
-        printf("Connection closed\n");
+        LOG_WARN("Connection closed");
         return Result_Error;
     }
 
+    outBytes = (u32)bytes;
     return Result_Success;
 }
 
 
-#include <pthread.h>
+/**
+ * Adds the delay of a timestamped reply in latency mode to the metrics.
+ * @param delay  from receiveWithDelay, -1 without a timestamp
+ */
+static inline
+void
+addTimestampDelay(
+    s64 delay)
+{
+    if (latencyConfig.enabled && delay >= 0)
+    {
+        u64 delayNanos = (u64)delay;
+        // a sum of ns^2 would overflow after 1.8e5 samples of 10 ms, us^2 lasts 1e6 times longer.
+        // Squaring in ns before scaling keeps sub-us delays, clamped to 4 s so the square fits
+        u64 clampedNanos = min(delayNanos, 4000000000ULL);
+        addMetric(metricIndex(timestampSamples));
+        addMetric(metricIndex(timestampDelayNanos), delayNanos);
+        addMetric(metricIndex(timestampDelaySqMicros), clampedNanos * clampedNanos / 1000000);
+        maxMetric(metricIndex(maxTimestampDelayNanos), delayNanos);
+    }
+}
+
+
+/**
+ * @param recvBuffer  buffer to receive data, must be larger than
+ *  request buffer + sizeof(ICMPHeader) due to IP header options
+ * @param bufferSize  size of the buffer pointed to by recvBuffer
+ * @param outBytes  size of the packet read
+ * @returns 0 on success, -1 on error, 2 on pending
+ */
+s32
+getPingReply(
+    SOCKET socket,
+    u8* recvBuffer,
+    u32 bufferSize,
+    sockaddr_in& source,
+    u32& outBytes)
+{
+    s32 bytes;
+
+    if (!latencyConfig.enabled)
+    {
+        socklen_t fromLen = sizeof(source);
+
+        bytes = recvfrom(
+            socket,
+            (char*)recvBuffer, 
+            bufferSize,
+            0,
+            (sockaddr*)&source,
+            &fromLen);
+    }
+    else {
+        // the delay from the kernel's receive timestamp to now is how long the reply waited for
+        // the job thread
+        s64 delay;
+        bytes = receiveWithDelay(socket, recvBuffer, bufferSize, source, delay);
+        addTimestampDelay(delay);
+    }
+
+    return getReceiveResult(bytes, outBytes);
+}
+
+
+/**
+ * Sets SO_TIMESTAMPNS, so the kernel stamps each packet as it arrives.
+ * @returns 0 on success, -1 on error
+ */
+s32
+enableReceiveTimestamps(
+    SOCKET socket)
+{
+    s32 on = 1;
+    if (setsockopt(socket, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) != 0) {
+        LOG_WARN("SO_TIMESTAMPNS failed: %s", strerror(errno));
+        return Result_Error;
+    }
+    return Result_Success;
+}
+
+
+/**
+ * Receives like getPingReply, and gives the time the kernel received the packet. Packets queued
+ * before enableReceiveTimestamps get the time they were read.
+ * @param receiveTime  arrival of the packet in timer counts
+ * @returns 0 on success, -1 on error, 2 on pending
+ */
+s32
+getTimestampedPingReply(
+    SOCKET socket,
+    u8* recvBuffer,
+    u32 bufferSize,
+    sockaddr_in& source,
+    u32& outBytes,
+    i64& receiveTime)
+{
+    s64 delay;
+    s32 bytes = receiveWithDelay(socket, recvBuffer, bufferSize, source, delay);
+    addTimestampDelay(delay);
+
+    // timer counts are microseconds of the realtime clock on Linux, as are the timestamps
+    receiveTime = timer_queryCounts() - (delay > 0 ? delay / 1000 : 0);
+
+    return getReceiveResult(bytes, outBytes);
+}
+
 
-static atomic_lock running = ATOMIC_FLAG_INIT;
-pthread_t threadId{};
+const PingTransport platformTransport = {
+    "linux",
+    resolveDestinationHost,
+    createSocket,
+    platform_closesocket,
+    sendPingPacket,
+    getPingReply,
+    nullptr,
+    setDontFragment,
+    enableReceiveTimestamps,
+    getTimestampedPingReply
+};
 
 
-static void*
+static void
 pingJobProcess(
-    void* lpParam)
+    void* arg)
 {
-    PingJobHnd runningJobs[MaxPingJobs]{};
+    PingJobHnd runningJobs[MaxRunningJobs]{};
     u32 numRunning = 0;
+    bool released = false;
 
     initHighPerfTimer();
+    bindJobThreadMetrics();
+    TRACE_JOB_THREAD();
+    applyJobThreadLatencyMode();
 
     for (;;)
     {
         if (numRunning == 0)
         {
-            // there are no running jobs, use wait_pop to yield the thread until we get a new job
+            // there are no running jobs, wait for a new job
+            setMetric(metricIndex(runningJobs), 0);
             PingJobHnd hnd = null_h32;
-            if (!jobQueue.wait_pop(&hnd, 1000))
+            if (!waitForJob(&hnd))
             {
-                // wait timed out, end the thread
-                break;
+                // idle timeout, end the thread unless a job slipped in as it let go. The pool is
+                // closed first, a new thread may start as soon as the flag is released
+                closeSocketPool();
+                released = releaseJobThread();
+                if (released) {
+                    break;
+                }
+                continue;
             }
 
             // exit thread when a null handle is pushed onto the queue
@@ -204,6 +501,9 @@ pingJobProcess(
             runningJobs[numRunning++] = hnd;
         }
         else {
+            i64 iterationStart = timer_queryCounts();
+            TRACE_BEGIN("job loop");
+
             {
                 PingJobHnd hnd = null_h32;
                 if (jobQueue.try_pop(&hnd))
@@ -213,7 +513,7 @@ pingJobProcess(
                         break;
                     }
                     // otherwise add this job to the running list
-                    assert(numRunning < MaxPingJobs && "too many jobs");
+                    assert(numRunning < MaxRunningJobs && "too many jobs");
                     runningJobs[numRunning++] = hnd;
                 }
             }
@@ -223,46 +523,36 @@ pingJobProcess(
                 j < numRunning;
                 ++j)
             {
-                PingJobHnd hnd = runningJobs[j];
-                PingJob* job = jobs[hnd];
-
-                if (job) {
-                    SequenceStatus status =
-                        runPingSequence(*job);
-                    
-                    if (status != Sequence_Running)
-                    {
-                        // sequence finished, remove from running jobs by swap and pop
-                        runningJobs[j] = runningJobs[--numRunning];
-                    }
-                }
-                else {
-                    // invalid handle, error
+                SequenceStatus status =
+                    runJob(runningJobs[j]);
+                
+                if (status != Sequence_Running)
+                {
+                    // job finished, remove from running jobs by swap and pop
+                    TRACE_INSTANT("job done", runningJobs[j].value, status);
+                    runningJobs[j] = runningJobs[--numRunning];
                 }
             }
-        }
-    }
 
-    running.clear();
-    threadId = {};
+            transportEndIteration();
 
-    return 0;
-}
+            u64 iterationMicros =
+                (u64)(timer_secondsBetween(iterationStart, timer_queryCounts()) * 1000000.0);
+            addMetric(metricIndex(loopIterations));
+            addMetric(metricIndex(loopMicros), iterationMicros);
+            maxMetric(metricIndex(maxLoopMicros), iterationMicros);
+            setMetric(metricIndex(runningJobs), numRunning);
+            TRACE_END("job loop");
+        }
+    }
 
+    setMetric(metricIndex(runningJobs), 0);
 
-s32
-startPingJobThread()
-{
-    if (!running.test_and_set())
-    {
-        pthread_create(
-            &threadId,
-            nullptr,
-            pingJobProcess,
-            nullptr);
+    if (!released) {
+        abortJobs(runningJobs, numRunning);
+        closeSocketPool();
+        jobThreadRunning.clear();
     }
-
-    return Result_Success;
 }
 
 
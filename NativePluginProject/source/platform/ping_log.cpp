@@ -0,0 +1,235 @@
+#include "ping_log.h"
+#include "platform.h"
+
+struct alignas(CacheLineSize) LogRing {
+    atomic_u32  head;       // next record written, only the owning thread writes it
+    u8          _pad0[CacheLineSize - sizeof(atomic_u32)];
+    atomic_u32  tail;       // next record formatted, only the consumer writes it
+    atomic_u32  dropped;    // records lost to a full ring
+    atomic_u32  owned;      // 1 while a thread holds the ring
+    u8          _pad1[CacheLineSize - 3*sizeof(atomic_u32)];
+
+    LogRecord   records[LogRingRecords];
+};
+
+/**
+ * The calling thread's ring, given back when the thread exits so threads that come and go don't
+ * use up the rings.
+ */
+struct LogRingClaim {
+    LogRing*    ring = nullptr;
+    bool        claimed = false;    // a ring was looked for, whether or not one was free
+
+    ~LogRingClaim();
+};
+
+std::atomic<u8> logLevel{ DefaultLogLevel };
+
+static LogRing    logRings[MaxLogThreads];
+static thread_local LogRingClaim localLogRing;
+
+static std::atomic<LogSink> logSink{ nullptr };
+static atomic_lock logConsumeLock = ATOMIC_FLAG_INIT;
+
+// the consumer thread starts on a record written while it isn't running
+static PlatformThread     logConsumerThread;
+static std::atomic<bool>  logConsumerRunning{ false };
+static std::atomic<bool>  logConsumerStop{ false };
+static atomic_lock        logThreadLock = ATOMIC_FLAG_INIT;
+
+static const char* LogLevelNames[] = { "debug", "info", "warn", "error" };
+
+
+static
+void
+writeLogStdout(
+    u8 level,
+    const char* message)
+{
+    if (level >= LogLevel_Warn) {
+        printf("%s: %s\n", LogLevelNames[level], message);
+    }
+    else {
+        printf("%s\n", message);
+    }
+}
+
+
+/**
+ * Formats and sinks every published record of every ring, the caller holds logConsumeLock.
+ * @returns number of records consumed
+ */
+static
+u32
+consumeLogRings()
+{
+    char line[MaxLogLineSize];
+    LogSink sink = logSink.load(std::memory_order_acquire);
+    if (!sink) {
+        sink = writeLogStdout;
+    }
+
+    u32 consumed = 0;
+
+    // rings no thread holds can still have records from a thread that has exited
+    for (u32 r = 0; r < MaxLogThreads; ++r)
+    {
+        LogRing& ring = logRings[r];
+        u32 head = ring.head.load(std::memory_order_acquire);
+        u32 tail = ring.tail.load(std::memory_order_relaxed);
+
+        for (; tail != head; ++tail)
+        {
+            LogRecord& record = ring.records[tail & (LogRingRecords - 1)];
+            record.format(record, line, sizeof(line));
+            sink(record.level, line);
+            ++consumed;
+        }
+        ring.tail.store(tail, std::memory_order_release);
+
+        u32 dropped = ring.dropped.exchange(0, std::memory_order_relaxed);
+        if (dropped > 0) {
+            snprintf(line, sizeof(line), "%u log records dropped, the ring was full", dropped);
+            sink(LogLevel_Warn, line);
+        }
+    }
+
+    if (consumed > 0) {
+        fflush(stdout);
+    }
+    return consumed;
+}
+
+
+static
+void
+logConsumerLoop(
+    void* arg)
+{
+    while (!logConsumerStop.load(std::memory_order_acquire))
+    {
+        lock_spin(logConsumeLock);
+        u32 consumed = consumeLogRings();
+        unlock(logConsumeLock);
+
+        if (consumed == 0) {
+            platformSleep(LogIdleSleepMS);
+        }
+    }
+
+    logFlush();
+}
+
+
+static
+void
+startLogThread()
+{
+    lock_spin(logThreadLock);
+    if (!logConsumerRunning.load(std::memory_order_relaxed))
+    {
+        logConsumerStop.store(false, std::memory_order_relaxed);
+        if (platformStartThread(logConsumerThread, logConsumerLoop, nullptr) == 0) {
+            logConsumerRunning.store(true, std::memory_order_relaxed);
+        }
+    }
+    unlock(logThreadLock);
+}
+
+
+void
+logStop()
+{
+    lock_spin(logThreadLock);
+    if (logConsumerRunning.load(std::memory_order_relaxed))
+    {
+        logConsumerStop.store(true, std::memory_order_release);
+        platformJoinThread(logConsumerThread);
+        logConsumerRunning.store(false, std::memory_order_relaxed);
+    }
+    unlock(logThreadLock);
+}
+
+
+void
+logSetLevel(
+    LogLevel level)
+{
+    logLevel.store(level, std::memory_order_relaxed);
+
+    if (level >= LogLevel_Off) {
+        logStop();
+    }
+}
+
+
+void
+logSetSink(
+    LogSink sink)
+{
+    logSink.store(sink, std::memory_order_release);
+}
+
+
+void
+logFlush()
+{
+    lock_spin(logConsumeLock);
+    consumeLogRings();
+    unlock(logConsumeLock);
+}
+
+
+LogRingClaim::~LogRingClaim()
+{
+    // records still in the ring are formatted all the same, the next owner writes after them
+    if (ring) {
+        ring->owned.store(0, std::memory_order_release);
+    }
+}
+
+
+LogRecord*
+logBeginRecord(
+    LogLevel level)
+{
+    if (!localLogRing.claimed)
+    {
+        localLogRing.claimed = true;
+
+        for (u32 r = 0; r < MaxLogThreads; ++r)
+        {
+            if (!logRings[r].owned.exchange(1, std::memory_order_acquire)) {
+                localLogRing.ring = &logRings[r];
+                break;
+            }
+        }
+    }
+
+    if (!logConsumerRunning.load(std::memory_order_relaxed)) {
+        startLogThread();
+    }
+
+    LogRing* ring = localLogRing.ring;
+    if (!ring) {
+        return nullptr;
+    }
+
+    u32 head = ring->head.load(std::memory_order_relaxed);
+    if (head - ring->tail.load(std::memory_order_acquire) >= LogRingRecords) {
+        ring->dropped.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    LogRecord& record = ring->records[head & (LogRingRecords - 1)];
+    record.level = level;
+    return &record;
+}
+
+
+void
+logEndRecord()
+{
+    LogRing* ring = localLogRing.ring;
+    ring->head.store(ring->head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
@@ -0,0 +1,286 @@
+#ifndef _PING_LOG_H
+#define _PING_LOG_H
+
+#include "../utility/common.h"
+#include <cstdio>
+
+/**
+ * Leveled logger that keeps formatting and stdio off the threads that take round trip times. A log
+ * call copies its arguments into a fixed size binary record in the calling thread's single
+ * producer, single consumer ring. A consumer thread, started on the first record, formats the
+ * records with snprintf and hands each line to the sink. Records are dropped while a ring is full
+ * and the count is logged once there's room. A thread gives its ring back when it exits, and
+ * logStop ends the consumer thread until the next record.
+ *
+ * PING_LOG_LEVEL in build_config.h is the lowest level compiled in, calls below it expand to
+ * nothing. The level seen at runtime starts at DefaultLogLevel and is changed with logSetLevel.
+ *
+ * Format strings must be string literals, only the pointer is recorded. String arguments are
+ * copied and truncated to LogStringSize, wrap network addresses in logAddress to have them
+ * formatted as dotted quads by the consumer.
+ */
+
+enum LogLevel : u8 {
+    LogLevel_Debug = 0,     // every packet sent and received
+    LogLevel_Info,
+    LogLevel_Warn,          // a request or sequence failed
+    LogLevel_Error,         // the engine can't run
+    LogLevel_Off
+};
+
+#ifndef DefaultLogLevel
+#define DefaultLogLevel     LogLevel_Debug
+#endif
+
+#define MaxLogThreads       8       // threads logging at once, more have their records dropped
+#define LogRingRecords      1024    // per thread, power of 2
+#define LogPayloadSize      104     // records are 128 bytes
+#define LogStringSize       48
+#define MaxLogLineSize      512
+#define LogIdleSleepMS      2       // consumer sleep when all rings are empty
+
+
+/**
+ * Receives each formatted line, without a trailing newline, on the consumer thread.
+ */
+typedef void (*LogSink)(u8 level, const char* message);
+
+struct LogRecord;
+typedef void (*LogFormatFn)(LogRecord& record, char* buffer, u32 bufferSize);
+
+struct LogRecord {
+    LogFormatFn format;     // unpacks the payload types it was written with
+    const char* fmt;
+    u8          level;
+    u8          _pad[7];
+
+    u8          payload[LogPayloadSize];
+};
+static_assert_aligned_size(LogRecord, 8);
+
+struct LogString {
+    char        str[LogStringSize];
+};
+
+struct LogAddress {
+    u32         address;    // network byte order
+    char        str[16];    // filled in by the consumer
+};
+
+
+extern std::atomic<u8> logLevel;
+
+inline
+bool
+logEnabled(
+    LogLevel level)
+{
+    return (level >= logLevel.load(std::memory_order_relaxed));
+}
+
+/**
+ * Sets the lowest level passed to the sink, LogLevel_Off silences the logger and stops the consumer
+ * thread. Levels below PING_LOG_LEVEL stay compiled out.
+ */
+void
+logSetLevel(
+    LogLevel level);
+
+/**
+ * Replaces the sink, nullptr restores the default sink that writes to stdout.
+ */
+void
+logSetSink(
+    LogSink sink);
+
+/**
+ * Formats every record written so far on the calling thread, so nothing is lost when the process
+ * exits right after.
+ */
+void
+logFlush();
+
+/**
+ * Formats every record written so far and joins the consumer thread, before the plugin unloads.
+ * A record written later starts the thread again. Setting LogLevel_Off stops it too.
+ */
+void
+logStop();
+
+/**
+ * Slot for the next record in the calling thread's ring, with level set.
+ * @returns nullptr if the ring is full or no ring is left for the thread
+ */
+LogRecord*
+logBeginRecord(
+    LogLevel level);
+
+/**
+ * Publishes the record returned by logBeginRecord to the consumer.
+ */
+void
+logEndRecord();
+
+
+// arguments are stored in order as a nested aggregate, so the formatter can unpack them in the
+// same order into a single snprintf call
+
+template<typename... Args>
+struct LogArgs;
+
+template<>
+struct LogArgs<> {};
+
+template<typename T, typename... Rest>
+struct LogArgs<T, Rest...> {
+    T               first;
+    LogArgs<Rest...> rest;
+};
+
+// argument conversion at the call site, anything a pointer refers to is copied into the record
+template<typename T>
+inline T logArg(T v) { return v; }
+inline f64 logArg(f32 v) { return v; }
+inline LogString logArg(const char* s) {
+    LogString ls;
+    _strncpy_s(ls.str, LogStringSize, (s ? s : "(null)"), LogStringSize - 1);
+    ls.str[LogStringSize - 1] = '\0';
+    return ls;
+}
+inline LogString logArg(char* s) { return logArg((const char*)s); }
+
+inline LogAddress logAddress(u32 address) {
+    LogAddress la;
+    la.address = address;
+    la.str[0] = '\0';
+    return la;
+}
+
+// argument conversion in the formatter, to what snprintf takes
+template<typename T>
+inline T logVararg(const T& v) { return v; }
+inline const char* logVararg(const LogString& s) { return s.str; }
+inline const char* logVararg(LogAddress& a) {
+    const u8* b = (const u8*)&a.address;
+    snprintf(a.str, sizeof(a.str), "%u.%u.%u.%u", b[0], b[1], b[2], b[3]);
+    return a.str;
+}
+
+inline
+void
+packLogArgs(
+    LogArgs<>& args)
+{}
+
+template<typename T, typename... Rest>
+inline
+void
+packLogArgs(
+    LogArgs<T, Rest...>& args,
+    const T& first,
+    const Rest&... rest)
+{
+    args.first = first;
+    packLogArgs(args.rest, rest...);
+}
+
+template<typename... Done>
+inline
+void
+formatLogArgs(
+    char* buffer,
+    u32 bufferSize,
+    const char* fmt,
+    LogArgs<>& args,
+    Done... done)
+{
+    snprintf(buffer, bufferSize, fmt, done...);
+}
+
+template<typename T, typename... Rest, typename... Done>
+inline
+void
+formatLogArgs(
+    char* buffer,
+    u32 bufferSize,
+    const char* fmt,
+    LogArgs<T, Rest...>& args,
+    Done... done)
+{
+    formatLogArgs(buffer, bufferSize, fmt, args.rest, done..., logVararg(args.first));
+}
+
+template<typename... Args>
+void
+formatLogRecord(
+    LogRecord& record,
+    char* buffer,
+    u32 bufferSize)
+{
+    formatLogArgs(buffer, bufferSize, record.fmt, *(LogArgs<Args...>*)record.payload);
+}
+
+template<typename... Args>
+void
+logWriteRecord(
+    LogLevel level,
+    const char* fmt,
+    const Args&... args)
+{
+    static_assert(sizeof(LogArgs<Args...>) <= LogPayloadSize, "too many log arguments");
+
+    LogRecord* record = logBeginRecord(level);
+    if (!record) {
+        return;
+    }
+    record->format = formatLogRecord<Args...>;
+    record->fmt = fmt;
+    packLogArgs(*(LogArgs<Args...>*)record->payload, args...);
+
+    logEndRecord();
+}
+
+template<typename... Args>
+inline
+void
+logWrite(
+    LogLevel level,
+    const char* fmt,
+    const Args&... args)
+{
+    logWriteRecord<decltype(logArg(args))...>(level, fmt, logArg(args)...);
+}
+
+
+#define PING_LOG(level, ...) \
+    do { \
+        if (logEnabled(level)) { \
+            logWrite(level, __VA_ARGS__); \
+        } \
+    } while (0)
+
+#if PING_LOG_LEVEL <= 0
+#define LOG_DEBUG(...)  PING_LOG(LogLevel_Debug, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...)  ((void)0)
+#endif
+
+#if PING_LOG_LEVEL <= 1
+#define LOG_INFO(...)   PING_LOG(LogLevel_Info, __VA_ARGS__)
+#else
+#define LOG_INFO(...)   ((void)0)
+#endif
+
+#if PING_LOG_LEVEL <= 2
+#define LOG_WARN(...)   PING_LOG(LogLevel_Warn, __VA_ARGS__)
+#else
+#define LOG_WARN(...)   ((void)0)
+#endif
+
+#if PING_LOG_LEVEL <= 3
+#define LOG_ERROR(...)  PING_LOG(LogLevel_Error, __VA_ARGS__)
+#else
+#define LOG_ERROR(...)  ((void)0)
+#endif
+
+#endif
@@ -0,0 +1,94 @@
+#include "ping_metrics.h"
+
+// block 0 belongs to the job thread, api threads claim the others on their first update
+static PingThreadMetrics threadMetrics[MaxMetricThreads];
+static atomic_u32 numMetricThreads{ 1 };
+static thread_local PingThreadMetrics* localMetrics = nullptr;
+
+
+static inline
+PingThreadMetrics&
+getThreadMetrics()
+{
+    if (!localMetrics)
+    {
+        u32 slot = numMetricThreads.fetch_add(1, std::memory_order_relaxed);
+        if (slot >= MaxMetricThreads) {
+            slot = MaxMetricThreads - 1;
+            threadMetrics[slot].shared = 1;
+        }
+        localMetrics = &threadMetrics[slot];
+    }
+    return *localMetrics;
+}
+
+
+void
+bindJobThreadMetrics()
+{
+    localMetrics = &threadMetrics[0];
+}
+
+
+void
+addMetric(
+    u32 index,
+    u64 n)
+{
+    PingThreadMetrics& m = getThreadMetrics();
+    if (!m.shared) {
+        m.values[index].store(
+            m.values[index].load(std::memory_order_relaxed) + n,
+            std::memory_order_relaxed);
+    }
+    else {
+        m.values[index].fetch_add(n, std::memory_order_relaxed);
+    }
+}
+
+
+void
+setMetric(
+    u32 index,
+    u64 value)
+{
+    getThreadMetrics().values[index].store(value, std::memory_order_relaxed);
+}
+
+
+void
+maxMetric(
+    u32 index,
+    u64 value)
+{
+    // threads past MaxMetricThreads share their block, so the raise is a CAS
+    atomic_u64& gauge = getThreadMetrics().values[index];
+    u64 current = gauge.load(std::memory_order_relaxed);
+    while (value > current
+           && !gauge.compare_exchange_weak(current, value, std::memory_order_relaxed)) {}
+}
+
+
+void
+getPingMetrics(
+    PingMetrics& outMetrics)
+{
+    u64* out = (u64*)&outMetrics;
+    memset(out, 0, sizeof(PingMetrics));
+
+    u32 numThreads = min(numMetricThreads.load(std::memory_order_relaxed), (u32)MaxMetricThreads);
+
+    for (u32 t = 0; t < numThreads; ++t)
+    {
+        const PingThreadMetrics& m = threadMetrics[t];
+
+        for (u32 i = 0; i < PingMetricsNumCounters; ++i) {
+            out[i] += m.values[i].load(std::memory_order_relaxed);
+        }
+        for (u32 i = PingMetricsNumCounters; i < PingMetricsNumValues; ++i) {
+            out[i] = max(out[i], m.values[i].load(std::memory_order_relaxed));
+        }
+    }
+
+    outMetrics.jobQueueDepth = jobQueue.unsafe_size();
+}
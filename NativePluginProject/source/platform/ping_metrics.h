@@ -0,0 +1,99 @@
+#ifndef _PING_METRICS_H
+#define _PING_METRICS_H
+
+#include <cstddef>
+#include "../utility/common.h"
+
+#define MaxMetricThreads    8   // threads with their own counters, more share the last slot
+
+/**
+ * Snapshot of the engine's counters and gauges. Counters only increase and are summed over all
+ * threads, gauges are the latest value set, or the max for the max* fields.
+ */
+struct PingMetrics {
+    // job thread
+    u64         loopIterations;     // iterations of the job loop with jobs running
+    u64         loopMicros;         // time spent in those iterations
+    u64         packetsSent;
+    u64         sendPending;        // sends that would block (EAGAIN), retried next iteration
+    u64         sendErrors;
+    u64         packetsReceived;
+    u64         receivePending;     // reads with nothing to read (EAGAIN)
+    u64         receiveErrors;
+    u64         repliesIgnored;     // packets read that belong to another sequence or process
+    u64         requestsTimedOut;
+    u64         requestsPaced;      // iterations a request waited on its destination's pacer
+    u64         sequencesFinished;
+    u64         sequencesErrored;
+    u64         timestampSamples;           // replies with a kernel receive timestamp
+    u64         timestampDelayNanos;        // kernel receive to read by the job thread, sum
+    u64         timestampDelaySqMicros;     //  and sum of squares in us^2, for the jitter (std dev)
+    u64         socketsCreated;
+    u64         socketsReused;      // jobs that started on a socket kept open by an earlier job
+    u64         hostsResolved;      // host names resolved, misses of the name cache
+    u64         destinationsEvicted;    // pacer and timeout state dropped from a full table
+
+    // api threads
+    u64         jobsQueued;
+    u64         polls;
+
+    // gauges
+    u64         runningJobs;        // jobs on the job thread's running list, 0 while it's idle
+    u64         maxLoopMicros;      // longest single job loop iteration
+    u64         jobQueueDepth;      // jobs queued but not yet picked up by the job thread
+    u64         maxTimestampDelayNanos;
+};
+
+#define PingMetricsNumCounters  (offsetof(PingMetrics, runningJobs) / sizeof(u64))
+#define PingMetricsNumValues    (sizeof(PingMetrics) / sizeof(u64))
+
+#define metricIndex(field)      (offsetof(PingMetrics, field) / sizeof(u64))
+
+/**
+ * Each thread writes only its own cache line aligned block, so updating a counter is a plain load
+ * and store with no lock prefix and no false sharing. Threads past MaxMetricThreads share the last
+ * block and fall back to atomic adds.
+ */
+struct alignas(CacheLineSize) PingThreadMetrics {
+    atomic_u64  values[PingMetricsNumValues];
+    u8          shared;
+};
+
+
+/**
+ * Binds the calling thread to the job thread's block, only one job thread runs at a time so the
+ * block is reused when the thread is restarted.
+ */
+void
+bindJobThreadMetrics();
+
+void
+addMetric(
+    u32 index,
+    u64 n = 1);
+
+/**
+ * Sets a gauge with an atomic store, readers see the old or the new value.
+ */
+void
+setMetric(
+    u32 index,
+    u64 value);
+
+/**
+ * Raises a max* gauge to value if it's larger, with a CAS so concurrent raises can't lower it.
+ */
+void
+maxMetric(
+    u32 index,
+    u64 value);
+
+/**
+ * Sums the counters of all threads into outMetrics. Values are read without stopping the threads,
+ * so a snapshot can be off by the updates in flight while it's taken.
+ */
+void
+getPingMetrics(
+    PingMetrics& outMetrics);
+
+#endif
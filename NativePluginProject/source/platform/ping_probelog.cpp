@@ -0,0 +1,368 @@
+#include "ping_probelog.h"
+#include "ping_log.h"
+#include "timer.h"
+#include "platform.h"
+
+struct alignas(CacheLineSize) ProbeRing {
+    atomic_u32  head;       // next record written, only the job thread writes it
+    u8          _pad0[CacheLineSize - sizeof(atomic_u32)];
+    atomic_u32  tail;       // next record appended to a segment, only the writer writes it
+    u8          _pad1[CacheLineSize - sizeof(atomic_u32)];
+
+    ProbeRecord records[ProbeLogRingRecords];
+};
+
+/**
+ * Writer state, only touched by the writer thread while the log is open.
+ */
+struct ProbeLogWriter {
+    PlatformMappedFile file;
+    ProbeLogHeader* header;
+    u32         segment;        // index of the open segment
+    u32         nextSegment;    // index of the segment to open, retried while it fails
+    u32         recordsPerSegment;
+    u32         maxSegments;
+    char        basePath[MaxProbeLogPath];
+};
+
+std::atomic<bool> probeLogOpened{ false };
+
+// the ring is never freed, so a record written as the log closes can't land in freed memory
+static ProbeRing      probeRing;
+static ProbeLogWriter probeWriter;
+static PlatformThread probeWriterThread;
+static std::atomic<bool> probeWriterStop{ false };
+static atomic_lock    probeLogOpenLock = ATOMIC_FLAG_INIT;
+
+static atomic_u64 probesDropped{ 0 };
+static atomic_u64 probesWritten{ 0 };
+static atomic_u32 probeSegments{ 0 };
+
+// send times are converted from timer counts to wall clock time against this pair
+static u64 probeLogBaseMicros = 0;
+static i64 probeLogBaseCounts = 0;
+
+
+static
+void
+getSegmentPath(
+    const ProbeLogWriter& writer,
+    u32 segment,
+    char* path,
+    u32 pathSize)
+{
+    snprintf(path, pathSize, "%s.%06u.plog", writer.basePath, segment);
+}
+
+
+struct SegmentSearch {
+    const char* prefix;         // file name part of the base path, followed by a '.'
+    size_t      prefixLen;
+    u32         next;           // one past the highest segment found
+};
+
+
+static
+void
+checkSegmentName(
+    const char* name,
+    void* arg)
+{
+    SegmentSearch& search = *(SegmentSearch*)arg;
+    if (strncmp(name, search.prefix, search.prefixLen) != 0 || name[search.prefixLen] != '.') {
+        return;
+    }
+
+    const char* digits = name + search.prefixLen + 1;
+    char* end = nullptr;
+    unsigned long segment = strtoul(digits, &end, 10);
+    if (end != digits && strcmp(end, ".plog") == 0 && segment < 0xFFFFFFFFUL) {
+        search.next = max(search.next, (u32)segment + 1);
+    }
+}
+
+
+/**
+ * @returns one past the highest segment of the base path on disk, 0 if there are none
+ */
+static
+u32
+findNextSegment(
+    const ProbeLogWriter& writer)
+{
+    char dir[MaxProbeLogPath];
+    const char* slash = strrchr(writer.basePath, '/');
+#ifdef _WIN32
+    const char* backslash = strrchr(writer.basePath, '\\');
+    if (!slash || (backslash && backslash > slash)) {
+        slash = backslash;
+    }
+#endif
+
+    SegmentSearch search{ writer.basePath, strlen(writer.basePath), 0 };
+    if (slash)
+    {
+        size_t dirLen = (slash > writer.basePath ? (size_t)(slash - writer.basePath) : 1);
+        memcpy(dir, writer.basePath, dirLen);
+        dir[dirLen] = '\0';
+        search.prefix = slash + 1;
+        search.prefixLen = strlen(search.prefix);
+    }
+    else {
+        dir[0] = '.';
+        dir[1] = '\0';
+    }
+
+    platformListDirectory(dir, checkSegmentName, &search);
+    return search.next;
+}
+
+
+/**
+ * Maps a new segment file and writes its header.
+ * @returns Result_Success or Result_Error
+ */
+static
+s32
+openSegment(
+    ProbeLogWriter& writer,
+    u32 segment)
+{
+    char path[MaxProbeLogPath + 16];
+    getSegmentPath(writer, segment, path, sizeof(path));
+
+    u64 size = sizeof(ProbeLogHeader) + (u64)writer.recordsPerSegment * sizeof(ProbeRecord);
+    if (platformMapFile(path, size, true, writer.file) != 0) {
+        // logged once per segment, the open is retried on every drain
+        if (writer.nextSegment != segment) {
+            LOG_ERROR("Failed to map probe log segment %s", path);
+        }
+        writer.header = nullptr;
+        writer.nextSegment = segment;
+        return Result_Error;
+    }
+
+    writer.segment = segment;
+    writer.nextSegment = segment + 1;
+    writer.header = (ProbeLogHeader*)writer.file.data;
+    memset(writer.header, 0, sizeof(ProbeLogHeader));
+    writer.header->magic = ProbeLogMagic;
+    writer.header->version = ProbeLogVersion;
+    writer.header->recordSize = sizeof(ProbeRecord);
+    writer.header->segment = segment;
+    writer.header->capacity = writer.recordsPerSegment;
+    writer.header->dropped = probesDropped.load(std::memory_order_relaxed);
+    writer.header->openMicros = platformGetEpochMicros();
+
+    probeSegments.fetch_add(1, std::memory_order_relaxed);
+
+    // rotate out the oldest segment kept
+    if (writer.maxSegments > 0 && segment >= writer.maxSegments) {
+        getSegmentPath(writer, segment - writer.maxSegments, path, sizeof(path));
+        remove(path);
+    }
+    return Result_Success;
+}
+
+
+static
+void
+closeSegment(
+    ProbeLogWriter& writer)
+{
+    if (!writer.header) {
+        return;
+    }
+    u64 keepSize = sizeof(ProbeLogHeader) + writer.header->count * sizeof(ProbeRecord);
+    platformUnmapFile(writer.file, keepSize);
+    writer.header = nullptr;
+}
+
+
+/**
+ * Appends every record in the ring to the segments, starting new segments as they fill up. A
+ * segment that failed to open is tried again once per call, its records are counted as dropped
+ * until it opens.
+ * @returns number of records taken from the ring
+ */
+static
+u32
+drainProbeRing(
+    ProbeLogWriter& writer)
+{
+    u32 head = probeRing.head.load(std::memory_order_acquire);
+    u32 tail = probeRing.tail.load(std::memory_order_relaxed);
+    u32 taken = head - tail;
+
+    if (tail != head && !writer.header) {
+        openSegment(writer, writer.nextSegment);
+    }
+
+    while (tail != head)
+    {
+        if (writer.header && writer.header->count == writer.header->capacity)
+        {
+            closeSegment(writer);
+            openSegment(writer, writer.nextSegment);
+        }
+
+        u32 index = tail & (ProbeLogRingRecords - 1);
+        u32 n = min(head - tail, (u32)ProbeLogRingRecords - index);
+
+        if (!writer.header) {
+            // no segment to write to, the records are lost
+            probesDropped.fetch_add(n, std::memory_order_relaxed);
+        }
+        else {
+            ProbeLogHeader& header = *writer.header;
+            n = min(n, (u32)(header.capacity - header.count));
+
+            ProbeRecord* records = (ProbeRecord*)(writer.file.data + sizeof(ProbeLogHeader));
+            memcpy(&records[header.count], &probeRing.records[index], n * sizeof(ProbeRecord));
+
+            // readers of a live segment go by count, publish it after the records
+            std::atomic_thread_fence(std::memory_order_release);
+            header.dropped = probesDropped.load(std::memory_order_relaxed);
+            header.count += n;
+            probesWritten.fetch_add(n, std::memory_order_relaxed);
+        }
+
+        tail += n;
+        probeRing.tail.store(tail, std::memory_order_release);
+    }
+
+    return taken;
+}
+
+
+static
+void
+probeLogWriterLoop(
+    void* arg)
+{
+    ProbeLogWriter& writer = *(ProbeLogWriter*)arg;
+
+    while (!probeWriterStop.load(std::memory_order_acquire))
+    {
+        if (drainProbeRing(writer) == 0) {
+            platformSleep(ProbeLogIdleSleepMS);
+        }
+    }
+    drainProbeRing(writer);
+    closeSegment(writer);
+}
+
+
+s32
+probeLogOpen(
+    const char* basePath,
+    u32 recordsPerSegment,
+    u32 maxSegments)
+{
+    if (!basePath || strlen(basePath) >= MaxProbeLogPath) {
+        return Result_Error;
+    }
+    if (probeLogOpenLock.test_and_set()) {
+        return Result_Error;
+    }
+
+    ProbeLogWriter& writer = probeWriter;
+    _strncpy_s(writer.basePath, MaxProbeLogPath, basePath, MaxProbeLogPath - 1);
+    writer.basePath[MaxProbeLogPath - 1] = '\0';
+    writer.recordsPerSegment = (recordsPerSegment > 0
+                                ? recordsPerSegment
+                                : ProbeLogDefaultSegmentRecords);
+    writer.maxSegments = maxSegments;
+
+    probesDropped.store(0, std::memory_order_relaxed);
+    probesWritten.store(0, std::memory_order_relaxed);
+    probeSegments.store(0, std::memory_order_relaxed);
+
+    // a log reopened with the same base path carries on after the last run's segments
+    writer.nextSegment = findNextSegment(writer);
+    if (openSegment(writer, writer.nextSegment) != Result_Success) {
+        unlock(probeLogOpenLock);
+        return Result_Error;
+    }
+
+    // skip anything left in the ring by a record written as the last log closed
+    u32 head = probeRing.head.load(std::memory_order_acquire);
+    probeRing.tail.store(head, std::memory_order_relaxed);
+
+    probeLogBaseCounts = timer_queryCounts();
+    probeLogBaseMicros = platformGetEpochMicros();
+
+    probeWriterStop.store(false, std::memory_order_relaxed);
+    if (platformStartThread(probeWriterThread, probeLogWriterLoop, &writer) != 0) {
+        LOG_ERROR("Failed to start the probe log writer");
+        closeSegment(writer);
+        unlock(probeLogOpenLock);
+        return Result_Error;
+    }
+
+    probeLogOpened.store(true, std::memory_order_release);
+    return Result_Success;
+}
+
+
+void
+probeLogClose()
+{
+    if (!probeLogOpened.exchange(false, std::memory_order_acq_rel)) {
+        return;
+    }
+
+    probeWriterStop.store(true, std::memory_order_release);
+    platformJoinThread(probeWriterThread);
+    unlock(probeLogOpenLock);
+}
+
+
+void
+probeLogRecord(
+    ProbeKind kind,
+    u32 target,
+    u16 id,
+    u32 seq,
+    i64 sendTime,
+    r32 rttMS,
+    u8 ttl,
+    u8 status)
+{
+    u32 head = probeRing.head.load(std::memory_order_relaxed);
+    if (head - probeRing.tail.load(std::memory_order_acquire) >= ProbeLogRingRecords) {
+        probesDropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    if (sendTime == 0) {
+        sendTime = timer_queryCounts();
+    }
+
+    ProbeRecord& record = probeRing.records[head & (ProbeLogRingRecords - 1)];
+    // a request sent before the log opened is earlier than the base
+    record.timeMicros = (u64)((i64)probeLogBaseMicros
+                      + (i64)(timer_secondsBetween(probeLogBaseCounts, sendTime) * 1.0e6));
+    record.target = target;
+    record.rttMS = rttMS;
+    record.seq = seq;
+    record.id = id;
+    record.ttl = ttl;
+    record.status = status;
+    record.kind = kind;
+    memset(record._pad, 0, sizeof(record._pad));
+
+    probeRing.head.store(head + 1, std::memory_order_release);
+}
+
+
+ProbeLogStats
+probeLogGetStats()
+{
+    ProbeLogStats stats{};
+    stats.written = probesWritten.load(std::memory_order_relaxed);
+    stats.dropped = probesDropped.load(std::memory_order_relaxed);
+    stats.segments = probeSegments.load(std::memory_order_relaxed);
+    stats.open = (probeLogging() ? 1 : 0);
+    return stats;
+}
@@ -0,0 +1,121 @@
+#ifndef _PING_PROBELOG_H
+#define _PING_PROBELOG_H
+
+#include "../utility/common.h"
+#include "platform.h"
+
+/**
+ * Binary log of every probe result, for offline analysis. The job thread copies each result into a
+ * single producer, single consumer ring and moves on, it never waits on the disk and drops the
+ * record if the ring is full. A writer thread appends the records to memory mapped segment files
+ * named <basePath>.<segment>.plog, starting a new segment each time one fills up and optionally
+ * deleting the oldest so only the last few are kept. Opening a log again with the same base path
+ * carries on after the segments already on disk rather than overwriting them.
+ *
+ * A segment is a ProbeLogHeader followed by up to capacity fixed size ProbeRecords. The header's
+ * count is updated after the records it covers are written, so a segment can be read while it's
+ * still being written. A closed segment is truncated to its records.
+ */
+
+#define ProbeLogMagic                   0x474F4C50  // "PLOG"
+#define ProbeLogVersion                 1
+#define ProbeLogRingRecords             (1 << 16)   // power of 2
+#define ProbeLogDefaultSegmentRecords   (1 << 20)   // 32 MB segments
+#define ProbeLogIdleSleepMS             5           // writer sleep when the ring is empty
+#define MaxProbeLogPath                 260
+
+enum ProbeKind : u8 {
+    ProbeKind_Ping = 0,     // a request of a ping sequence, including races
+    ProbeKind_Sweep         // a sweep target that replied
+};
+
+struct ProbeRecord {
+    u64         timeMicros; // send time, microseconds since the Unix epoch
+    u32         target;     // destination address, network byte order
+    r32         rttMS;      // 0 unless status is Ping_Received
+    u32         seq;        // sequence number, or target index for a sweep
+    u16         id;         // ICMP id, host byte order
+    u8          ttl;        // TTL of the reply, 0 without one
+    u8          status;     // PingStatus, Ping_Received, Ping_TimedOut or Ping_Error
+    u8          kind;       // ProbeKind
+
+    u8          _pad[7];
+};
+static_assert_aligned_size(ProbeRecord, 32);
+
+struct ProbeLogHeader {
+    u32         magic;          // ProbeLogMagic
+    u16         version;        // ProbeLogVersion
+    u16         recordSize;     // sizeof(ProbeRecord)
+    u32         segment;        // index in the rotation, counts up from the last segment on disk
+    u32         capacity;       // records the segment has room for
+    u64         count;          // records written so far
+    u64         dropped;        // records lost since the log opened, as of the last count update
+    u64         openMicros;     // when the segment was started, microseconds since the Unix epoch
+
+    u8          _pad[24];
+};
+static_assert_aligned_size(ProbeLogHeader, 64);
+
+struct ProbeLogStats {
+    u64         written;        // records in segment files
+    u64         dropped;        // records lost to a full ring or a segment that failed to open
+    u32         segments;       // segments started
+    u8          open;
+
+    u8          _pad[3];
+};
+
+
+extern std::atomic<bool> probeLogOpened;
+
+/**
+ * @returns true if the probe log is open, checked before building a record
+ */
+inline
+bool
+probeLogging()
+{
+    return probeLogOpened.load(std::memory_order_acquire);
+}
+
+/**
+ * Opens the probe log and starts its writer thread.
+ * @param basePath  path segment files are named after, <basePath>.000000.plog and up
+ * @param recordsPerSegment  records per segment file, 0 for ProbeLogDefaultSegmentRecords
+ * @param maxSegments  segments kept on disk, older ones are deleted as new ones start, 0 keeps all
+ * @returns Result_Success, or Result_Error if the log is already open or the first segment can't
+ *  be created
+ */
+s32
+probeLogOpen(
+    const char* basePath,
+    u32 recordsPerSegment,
+    u32 maxSegments);
+
+/**
+ * Stops logging, writes out the records still in the ring and truncates the last segment to its
+ * records. Results completing while the log closes may be lost.
+ */
+void
+probeLogClose();
+
+/**
+ * Adds a probe result to the ring, called from the job thread only.
+ * @param sendTime  timer counts when the request was sent, 0 for a request that was never sent
+ */
+void
+probeLogRecord(
+    ProbeKind kind,
+    u32 target,
+    u16 id,
+    u32 seq,
+    i64 sendTime,
+    r32 rttMS,
+    u8 ttl,
+    u8 status);
+
+ProbeLogStats
+probeLogGetStats();
+
+#endif
@@ -0,0 +1,344 @@
+#include "ping_rolling.h"
+#include "timer.h"
+
+// guards the map, the job thread only ever tries it
+static atomic_lock              rollingLock = ATOMIC_FLAG_INIT;
+static RollingDestinationMap    rollingDestinations;
+static i64                      rollingEpoch = 0;   // timer counts of the first request added
+static u32                      rollingOrder = 0;   // requests added, orders the destinations
+
+// buckets per window, including the current one
+static const u32 RollingWindowBuckets[RollingWindow_Count] = { 10, 60, 5, 15 };
+
+
+u32
+getRollingKey(
+    const char* host)
+{
+    // FNV-1a
+    u32 key = 2166136261U;
+    for (const char* c = host; *c; ++c) {
+        key = (key ^ (u8)*c) * 16777619U;
+    }
+    return (key != 0 ? key : 1);
+}
+
+
+/**
+ * @returns the key tried after another host was found holding this one, never 0
+ */
+static inline
+u32
+nextRollingKey(
+    u32 key)
+{
+    key = key * 2654435761U + 1;
+    return (key != 0 ? key : 1);
+}
+
+
+static inline
+bool
+isRollingHost(
+    const RollingDestination& dest,
+    const char* host)
+{
+    return (strncmp(dest.host, host, MaxRollingHostLength - 1) == 0);
+}
+
+
+/**
+ * Looks a host up by its key and the alternate keys after it, comparing the host strings.
+ * @param outKey  key the host was found at
+ */
+static
+RollingDestination*
+findRollingDestination(
+    const char* host,
+    u32 key,
+    u32& outKey)
+{
+    for (u32 p = 0; p < RollingKeyProbes; ++p, key = nextRollingKey(key))
+    {
+        RollingDestination* dest = rollingDestinations[key];
+        if (dest && isRollingHost(*dest, host)) {
+            outKey = key;
+            return dest;
+        }
+    }
+    return nullptr;
+}
+
+
+/**
+ * Makes room in a full map. Removes every destination that has been idle for 15 minutes, and if
+ * none has, the one whose last request was added before any other's. Linear in
+ * MaxRollingDestinations, only run as a new destination finds the map full.
+ */
+static
+void
+evictRollingDestinations(
+    u32 second)
+{
+    const u32 idleSeconds = RollingMinuteBuckets * 60;
+    bool evicted = false;
+    u32 oldestKey = 0;
+    u32 oldestAge = 0;
+
+    for (u32 i = 0; i < MaxRollingDestinations; )
+    {
+        u32 key = rollingDestinations._keys[i];
+        const RollingDestination& dest = rollingDestinations._items[i];
+
+        if (key != 0 && second - dest.lastAdded >= idleSeconds)
+        {
+            // erase shifts a later destination into the slot, check the slot again
+            rollingDestinations.erase(key);
+            evicted = true;
+            continue;
+        }
+        // requests since the destination's last, unsigned so the count can wrap
+        u32 age = rollingOrder - dest.lastOrder;
+        if (key != 0 && (oldestKey == 0 || age > oldestAge)) {
+            oldestKey = key;
+            oldestAge = age;
+        }
+        ++i;
+    }
+
+    if (!evicted && oldestKey != 0) {
+        rollingDestinations.erase(oldestKey);
+    }
+}
+
+
+/**
+ * Finds the host's destination, adding it if it's new.
+ * @returns the destination, or nullptr if the host's keys are all held by other hosts
+ */
+static
+RollingDestination*
+insertRollingDestination(
+    const char* host,
+    u32 key,
+    u32 second)
+{
+    u32 foundKey;
+    RollingDestination* dest = findRollingDestination(host, key, foundKey);
+    if (dest) {
+        return dest;
+    }
+
+    if (rollingDestinations.full()) {
+        evictRollingDestinations(second);
+    }
+
+    for (u32 p = 0; p < RollingKeyProbes; ++p, key = nextRollingKey(key))
+    {
+        bool inserted;
+        dest = rollingDestinations.insert(key, &inserted);
+        if (inserted)
+        {
+            dest->second = second;
+            dest->minute = second / 60;
+            _strncpy_s(dest->host, MaxRollingHostLength, host, MaxRollingHostLength - 1);
+            dest->host[MaxRollingHostLength - 1] = '\0';
+            return dest;
+        }
+    }
+    return nullptr;
+}
+
+
+/**
+ * @returns seconds since the first request was added
+ */
+static inline
+u32
+getRollingSecond()
+{
+    return (u32)timer_secondsBetween(rollingEpoch, timer_queryCounts());
+}
+
+
+static inline
+void
+addBucket(
+    RollingTotals& totals,
+    const RollingBucket& bucket)
+{
+    totals.sent += bucket.sent;
+    totals.lost += bucket.lost;
+    totals.sumRoundTrip += bucket.sumRoundTrip;
+    totals.sumSqRoundTrip += bucket.sumSqRoundTrip;
+}
+
+
+static inline
+void
+subtractBucket(
+    RollingTotals& totals,
+    const RollingBucket& bucket)
+{
+    totals.sent -= bucket.sent;
+    totals.lost -= bucket.lost;
+    totals.sumRoundTrip -= bucket.sumRoundTrip;
+    totals.sumSqRoundTrip -= bucket.sumSqRoundTrip;
+
+    // an empty window starts again from exact zeros, rounding can't build up
+    if (totals.sent == 0) {
+        totals.sumRoundTrip = 0.0;
+        totals.sumSqRoundTrip = 0.0;
+    }
+}
+
+
+/**
+ * Closes buckets up to now, adding each to the totals of the windows the ring feeds and
+ * subtracting the bucket that leaves each window. At most ringSize steps, a longer idle time
+ * clears the ring.
+ * @param current  bucket number of the ring's current bucket, set to now
+ */
+static
+void
+advanceRing(
+    RollingBucket* ring,
+    u32 ringSize,
+    u32& current,
+    u32 now,
+    RollingTotals* totals,
+    u32 firstWindow,
+    u32 endWindow)
+{
+    if (now - current >= ringSize)
+    {
+        memset(ring, 0, ringSize * sizeof(RollingBucket));
+        memset(&totals[firstWindow], 0, (endWindow - firstWindow) * sizeof(RollingTotals));
+        current = now;
+        return;
+    }
+
+    for (; current < now; ++current)
+    {
+        const RollingBucket& closed = ring[current % ringSize];
+
+        // a window of n buckets has n - 1 closed ones, the oldest leaves as another closes
+        for (u32 w = firstWindow; w < endWindow; ++w) {
+            addBucket(totals[w], closed);
+            subtractBucket(totals[w], ring[(current + 1 + ringSize - RollingWindowBuckets[w])
+                                           % ringSize]);
+        }
+
+        memset(&ring[(current + 1) % ringSize], 0, sizeof(RollingBucket));
+    }
+}
+
+
+static inline
+void
+advanceDestination(
+    RollingDestination& dest,
+    u32 second)
+{
+    advanceRing(dest.seconds, RollingSecondBuckets, dest.second, second, dest.totals,
+                RollingWindow_10s, RollingWindow_5m);
+    advanceRing(dest.minutes, RollingMinuteBuckets, dest.minute, second / 60, dest.totals,
+                RollingWindow_5m, RollingWindow_Count);
+}
+
+
+static inline
+void
+addSample(
+    RollingBucket& bucket,
+    bool received,
+    r32 rttMS)
+{
+    ++bucket.sent;
+    if (received) {
+        bucket.sumRoundTrip += rttMS;
+        bucket.sumSqRoundTrip += rttMS * rttMS;
+    }
+    else {
+        ++bucket.lost;
+    }
+}
+
+
+void
+rollingStatsAdd(
+    const char* host,
+    u32 key,
+    bool received,
+    r32 rttMS)
+{
+    if (rollingLock.test_and_set(std::memory_order_acquire)) {
+        return;
+    }
+
+    if (rollingEpoch == 0) {
+        rollingEpoch = timer_queryCounts();
+    }
+    u32 second = getRollingSecond();
+
+    RollingDestination* dest = insertRollingDestination(host, key, second);
+    if (dest)
+    {
+        dest->lastAdded = second;
+        dest->lastOrder = ++rollingOrder;
+        advanceDestination(*dest, second);
+
+        addSample(dest->seconds[dest->second % RollingSecondBuckets], received, rttMS);
+        addSample(dest->minutes[dest->minute % RollingMinuteBuckets], received, rttMS);
+    }
+
+    unlock(rollingLock);
+}
+
+
+bool
+getRollingStats(
+    const char* host,
+    RollingWindow window,
+    RollingStats& outStats)
+{
+    if (!host || window >= RollingWindow_Count) {
+        return false;
+    }
+    u32 key = getRollingKey(host);
+
+    lock_spin(rollingLock);
+
+    RollingDestination* dest = findRollingDestination(host, key, key);
+    if (!dest) {
+        unlock(rollingLock);
+        return false;
+    }
+    advanceDestination(*dest, getRollingSecond());
+
+    const RollingBucket& currentMinute = dest->minutes[dest->minute % RollingMinuteBuckets];
+    if (dest->totals[RollingWindow_15m].sent == 0 && currentMinute.sent == 0) {
+        rollingDestinations.erase(key);
+        unlock(rollingLock);
+        return false;
+    }
+
+    RollingTotals totals = dest->totals[window];
+    addBucket(totals, (window < RollingWindow_5m
+                       ? dest->seconds[dest->second % RollingSecondBuckets]
+                       : currentMinute));
+
+    unlock(rollingLock);
+
+    u32 received = totals.sent - totals.lost;
+    r64 mean = (received > 0 ? totals.sumRoundTrip / received : 0.0);
+    r64 variance = (received > 0 ? totals.sumSqRoundTrip / received - mean * mean : 0.0);
+
+    outStats.sent = totals.sent;
+    outStats.received = received;
+    outStats.lost = totals.lost;
+    outStats.pctLost = (totals.sent > 0 ? (r32)totals.lost / (r32)totals.sent : 0.f);
+    outStats.avgRoundTrip = (r32)mean;
+    outStats.stdDevRoundTrip = (r32)sqrt(max(variance, 0.0));
+    return true;
+}
@@ -0,0 +1,117 @@
+#ifndef _PING_ROLLING_H
+#define _PING_ROLLING_H
+
+#include "../utility/common.h"
+#include "../utility/hash_map_32.h"
+
+/**
+ * Rolling round trip and loss stats of each destination over the last 10 seconds, 1, 5 and 15
+ * minutes, for monitoring that runs for hours without keeping every sample. Requests are added to
+ * a ring of 1 second buckets and a ring of 1 minute buckets, and each window keeps a running total
+ * of its closed buckets: a bucket is added as it closes and subtracted as it leaves the window. So
+ * adding a request and reading a window are both constant time, and the memory is fixed, about
+ * 1.4 KB per destination, 5.6 MB for the default MaxRollingDestinations.
+ *
+ * Windows move a bucket at a time and include the current bucket so far. The 10 second window
+ * covers 9 to 10 seconds, the 5 minute window 4 to 5 minutes. Min and max round trips can't be
+ * subtracted from a total, so the windows have the mean and standard deviation only.
+ *
+ * Destinations are keyed by the host string the sequences were created with, so a name and its
+ * address are tracked apart. Each keeps its host string, a host whose hash is already taken by
+ * another moves on to the next of a few alternate keys. When the map is full, a new destination
+ * takes the place of those idle for 15 minutes, or else of the one pinged least recently. The job
+ * thread never waits on a query, if one holds the lock the request's sample is skipped.
+ */
+
+#ifndef MaxRollingDestinations
+#define MaxRollingDestinations  4096    // power of 2, up to 3/4 of it are tracked
+#endif
+#define MaxRollingHostLength    64      // longer hosts are compared by this much and their hash
+#define RollingKeyProbes        4       // keys tried for a host whose hash another host holds
+#define RollingSecondBuckets    60
+#define RollingMinuteBuckets    15
+
+enum RollingWindow : u8 {
+    RollingWindow_10s = 0,      // from the second buckets
+    RollingWindow_1m,
+    RollingWindow_5m,           // from the minute buckets
+    RollingWindow_15m,
+    RollingWindow_Count
+};
+
+struct RollingBucket {
+    u32         sent;
+    u32         lost;
+    r32         sumRoundTrip;
+    r32         sumSqRoundTrip;
+};
+
+struct RollingTotals {
+    u32         sent;
+    u32         lost;
+    r64         sumRoundTrip;
+    r64         sumSqRoundTrip;
+};
+
+struct RollingDestination {
+    u32         second;         // of the current second bucket, since the first request added
+    u32         minute;         // of the current minute bucket
+    u32         lastAdded;      // second of the last request added
+    u32         lastOrder;      // count of requests added to any destination, at the last one
+    char        host[MaxRollingHostLength];     // truncated, with the terminator
+
+    RollingTotals totals[RollingWindow_Count];  // closed buckets in each window
+    RollingBucket seconds[RollingSecondBuckets];
+    RollingBucket minutes[RollingMinuteBuckets];
+};
+
+HashMap32_Typed_WithBuffer(
+    RollingDestination,
+    RollingDestinationMap,
+    MaxRollingDestinations);
+
+struct RollingStats {
+    u32         sent;
+    u32         received;
+    u32         lost;
+    r32         pctLost;
+    r32         avgRoundTrip;
+    r32         stdDevRoundTrip;
+};
+
+
+/**
+ * @returns the key of a host's rolling stats, a hash of the host string, never 0
+ */
+u32
+getRollingKey(
+    const char* host);
+
+/**
+ * Adds a request's result to its destination's windows, called from the job thread only.
+ * @param host  host the sequence was created with
+ * @param key  getRollingKey of the host
+ * @param received  false for a request that timed out
+ */
+void
+rollingStatsAdd(
+    const char* host,
+    u32 key,
+    bool received,
+    r32 rttMS);
+
+/**
+ * Reads one window of a destination's rolling stats.
+ * @param host  host string the sequences were created with
+ * @param window  RollingWindow
+ * @returns true and the window's stats in outStats, or false if no request to the host was added
+ *  in the last 15 minutes, or the destination was replaced by others while the map was full. A
+ *  destination found idle that long is removed, to make room for others
+ */
+bool
+getRollingStats(
+    const char* host,
+    RollingWindow window,
+    RollingStats& outStats);
+
+#endif
@@ -0,0 +1,538 @@
+#include "ping_sim.h"
+#include "timer.h"
+
+#define SimNone     0xFFFFFFFFU
+
+/**
+ * A reply in flight, or queued on its socket once delivered. Only the first SimEchoBytes of the
+ * ICMP message are stored, the rest of the packet is zero filled on receive so the checksum still
+ * holds.
+ */
+struct SimPacket {
+    r64         deliverMS;  // time since the sim epoch that the reply arrives
+    u32         order;      // send order, keeps delivery deterministic for equal times
+    u32         next;       // next packet in the socket's receive list or the free list
+    u32         source;     // address the reply comes from, network byte order
+    u16         socket;
+    u16         generation; // socket generation at send, replies to a closed socket are dropped
+    u16         bytes;      // total size of the reply including the IP header
+
+    u8          data[sizeof(IPHeader) + SimEchoBytes];
+
+    u8          _pad[2];
+};
+
+struct SimSocket {
+    u32         head;       // delivered replies waiting to be read
+    u32         tail;
+    u16         generation;
+    u8          open;
+
+    u8          _pad;
+};
+
+static SimDestinationMap simDestinations;
+static SimDestination    simDefault;
+
+static SimSocket simSockets[MaxSimSockets];
+static SimPacket simPackets[MaxSimPackets];
+static u32       simHeap[MaxSimPackets];    // min-heap of packets in flight by delivery time
+static u32       simHeapSize = 0;
+static u32       simFreeList = SimNone;
+static u32       simOrder = 0;
+static u64       simRandomState = 0;
+static i64       simEpoch = 0;
+
+
+// Random
+
+/**
+ * xorshift64*, seeded through splitmix64 so nearby seeds give unrelated sequences.
+ */
+static inline
+u64
+simRandom()
+{
+    simRandomState ^= simRandomState >> 12;
+    simRandomState ^= simRandomState << 25;
+    simRandomState ^= simRandomState >> 27;
+    return simRandomState * 0x2545F4914F6CDD1DULL;
+}
+
+
+/**
+ * @returns uniform random in [0, 1)
+ */
+static inline
+r64
+simRandomUnit()
+{
+    return (r64)(simRandom() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+static
+r32
+simSampleRoundTrip(
+    const SimDestinationConfig& config)
+{
+    r64 rtt = config.baseMS;
+
+    switch (config.distribution)
+    {
+        case SimLatency_Uniform:
+            rtt += simRandomUnit() * config.spreadMS;
+            break;
+
+        case SimLatency_Normal: {
+            // Box-Muller, 1 - u keeps the log argument out of 0
+            r64 u1 = 1.0 - simRandomUnit();
+            r64 u2 = simRandomUnit();
+            rtt += config.spreadMS * sqrt(-2.0 * log(u1)) * cos(6.283185307179586 * u2);
+            break;
+        }
+        case SimLatency_Exponential:
+            rtt += -config.spreadMS * log(1.0 - simRandomUnit());
+            break;
+
+        default:
+            break;
+    }
+
+    return (r32)max(rtt, 0.0);
+}
+
+
+// Packets
+
+static inline
+bool
+simPacketBefore(
+    u32 a,
+    u32 b)
+{
+    const SimPacket& pa = simPackets[a];
+    const SimPacket& pb = simPackets[b];
+    return (pa.deliverMS < pb.deliverMS
+            || (pa.deliverMS == pb.deliverMS && pa.order < pb.order));
+}
+
+
+static
+void
+simHeapPush(
+    u32 packet)
+{
+    u32 i = simHeapSize++;
+    for (; i > 0; )
+    {
+        u32 parent = (i - 1) >> 1;
+        if (!simPacketBefore(packet, simHeap[parent])) {
+            break;
+        }
+        simHeap[i] = simHeap[parent];
+        i = parent;
+    }
+    simHeap[i] = packet;
+}
+
+
+static
+u32
+simHeapPop()
+{
+    u32 top = simHeap[0];
+    u32 last = simHeap[--simHeapSize];
+
+    u32 i = 0;
+    for (;;)
+    {
+        u32 child = (i << 1) + 1;
+        if (child >= simHeapSize) {
+            break;
+        }
+        if (child + 1 < simHeapSize && simPacketBefore(simHeap[child + 1], simHeap[child])) {
+            ++child;
+        }
+        if (!simPacketBefore(simHeap[child], last)) {
+            break;
+        }
+        simHeap[i] = simHeap[child];
+        i = child;
+    }
+    if (simHeapSize > 0) {
+        simHeap[i] = last;
+    }
+
+    return top;
+}
+
+
+static inline
+void
+simFreePacket(
+    u32 packet)
+{
+    simPackets[packet].next = simFreeList;
+    simFreeList = packet;
+}
+
+
+static inline
+r64
+simNowMS()
+{
+    return timer_millisBetween(simEpoch, timer_queryCounts());
+}
+
+
+/**
+ * Moves every reply whose delivery time has passed onto its socket's receive list.
+ */
+static
+void
+simDeliver(
+    r64 nowMS)
+{
+    while (simHeapSize > 0 && simPackets[simHeap[0]].deliverMS <= nowMS)
+    {
+        u32 p = simHeapPop();
+        SimPacket& packet = simPackets[p];
+        SimSocket& sock = simSockets[packet.socket];
+
+        if (!sock.open || sock.generation != packet.generation) {
+            simFreePacket(p);
+            continue;
+        }
+
+        packet.next = SimNone;
+        if (sock.tail != SimNone) {
+            simPackets[sock.tail].next = p;
+        }
+        else {
+            sock.head = p;
+        }
+        sock.tail = p;
+    }
+}
+
+
+static inline
+SimSocket*
+simGetSocket(
+    SOCKET socket)
+{
+    u32 s = (u32)(socket - SimSocketBase);
+    if (s >= MaxSimSockets || !simSockets[s].open) {
+        return nullptr;
+    }
+    return &simSockets[s];
+}
+
+
+// Transport
+
+static
+s32
+simResolveDestinationHost(
+    const char* host,
+    sockaddr_in& dest)
+{
+    u32 address = inet_addr(host);
+    if (address == INADDR_NONE) {
+        LOG_WARN("Simulator can't resolve %s", host);
+        return Result_Error;
+    }
+
+    dest.sin_addr.s_addr = address;
+    dest.sin_family = AF_INET;
+
+    return Result_Success;
+}
+
+
+static
+s32
+simCreateSocket(
+    u8 ttl,
+    u16 id,
+    SOCKET& outSocket)
+{
+    for (u32 s = 0; s < MaxSimSockets; ++s)
+    {
+        SimSocket& sock = simSockets[s];
+        if (!sock.open)
+        {
+            sock.head = sock.tail = SimNone;
+            ++sock.generation;
+            sock.open = 1;
+
+            outSocket = (SOCKET)(SimSocketBase + s);
+            return Result_Success;
+        }
+    }
+
+    LOG_WARN("Simulator is out of sockets");
+    return Result_Error;
+}
+
+
+static
+void
+simCloseSocket(
+    SOCKET socket)
+{
+    SimSocket* sock = simGetSocket(socket);
+    if (sock)
+    {
+        for (u32 p = sock->head; p != SimNone; )
+        {
+            u32 next = simPackets[p].next;
+            simFreePacket(p);
+            p = next;
+        }
+        sock->head = sock->tail = SimNone;
+        sock->open = 0;
+    }
+}
+
+
+/**
+ * Queues the reply to an echo request, or nothing if the model loses it. Running out of packets
+ * behaves like a full queue on the path and drops the reply. The model has no hops or priority
+ * classes, the TTL and TOS are ignored.
+ */
+static
+s32
+simSendPacket(
+    SOCKET socket,
+    const sockaddr_in& dest,
+    const u8* buffer,
+    u32 packetSize,
+    u8 ttl,
+    u8 tos)
+{
+    SimSocket* sock = simGetSocket(socket);
+    if (!sock || packetSize < sizeof(ICMPHeader)) {
+        return Result_Error;
+    }
+
+    const ICMPHeader& request = *(const ICMPHeader*)buffer;
+    if (request.type != ICMPType_EchoRequest) {
+        return Result_Success;
+    }
+
+    u32 address = dest.sin_addr.s_addr;
+    SimDestination* d = simDestinations[address];
+    if (!d) {
+        d = &simDefault;
+    }
+    const SimDestinationConfig& config = d->config;
+    SimDestinationStats& stats = d->stats;
+
+    ++stats.requests;
+
+    // draw every decision up front so the random sequence doesn't depend on which branch is taken
+    r64 lossDraw      = simRandomUnit();
+    r64 reorderDraw   = simRandomUnit();
+    r64 duplicateDraw = simRandomUnit();
+    r32 rtt = simSampleRoundTrip(config);
+
+    // only burst loss destinations draw for the chain, the others keep their random sequence
+    if (config.burstEnterRate > 0.f)
+    {
+        r64 burstDraw = simRandomUnit();
+        if (d->inBurst) {
+            d->inBurst = (burstDraw >= config.burstExitRate);
+        }
+        else if (burstDraw < config.burstEnterRate) {
+            d->inBurst = 1;
+            ++stats.lossBursts;
+        }
+    }
+
+    if (d->inBurst || lossDraw < config.lossRate) {
+        ++stats.lost;
+        return Result_Success;
+    }
+    if (reorderDraw < config.reorderRate) {
+        rtt += config.reorderDelayMS;
+        ++stats.reordered;
+    }
+
+    u32 replies = stats.requests - stats.lost;
+    if (replies == 1 || rtt < stats.minRoundTrip) {
+        stats.minRoundTrip = rtt;
+    }
+    if (rtt > stats.maxRoundTrip) {
+        stats.maxRoundTrip = rtt;
+    }
+    stats.sumRoundTrip += rtt;
+    stats.sumSqRoundTrip += (r64)rtt * rtt;
+
+    u32 copies = 1;
+    if (duplicateDraw < config.duplicateRate) {
+        ++copies;
+        ++stats.duplicated;
+    }
+
+    r64 sendMS = simNowMS();
+    u16 echoBytes = (u16)min(packetSize, (u32)SimEchoBytes);
+
+    for (u32 c = 0; c < copies && simFreeList != SimNone; ++c)
+    {
+        u32 p = simFreeList;
+        SimPacket& packet = simPackets[p];
+        simFreeList = packet.next;
+
+        packet.deliverMS = sendMS + rtt;
+        packet.order = simOrder++;
+        packet.next = SimNone;
+        packet.source = address;
+        packet.socket = (u16)(socket - SimSocketBase);
+        packet.generation = sock->generation;
+        packet.bytes = (u16)(sizeof(IPHeader) + packetSize);
+
+        IPHeader& ip = *(IPHeader*)packet.data;
+        memset(&ip, 0, sizeof(IPHeader));
+        ip.version   = 4;
+        ip.headerLen = sizeof(IPHeader) / sizeof(u32);
+        ip.totalLen  = htons(packet.bytes);
+        ip.ttl       = config.ttl;
+        ip.protocol  = IPPROTO_ICMP;
+        ip.sourceIP  = address;
+        ip.destIP    = htonl(INADDR_LOOPBACK);
+
+        u8* echo = packet.data + sizeof(IPHeader);
+        memcpy(echo, buffer, echoBytes);
+
+        ICMPHeader& reply = *(ICMPHeader*)echo;
+        reply.message = ICMP_EchoReply;
+        reply.checksum = 0;
+        reply.checksum = checksum((u16*)echo, echoBytes);
+
+        simHeapPush(p);
+    }
+
+    return Result_Success;
+}
+
+
+static
+s32
+simReceivePacket(
+    SOCKET socket,
+    u8* recvBuffer,
+    u32 bufferSize,
+    sockaddr_in& source,
+    u32& outBytes)
+{
+    SimSocket* sock = simGetSocket(socket);
+    if (!sock) {
+        return Result_Error;
+    }
+
+    simDeliver(simNowMS());
+
+    u32 p = sock->head;
+    if (p == SimNone) {
+        return Result_Pending;
+    }
+
+    SimPacket& packet = simPackets[p];
+    sock->head = packet.next;
+    if (sock->head == SimNone) {
+        sock->tail = SimNone;
+    }
+
+    u32 bytes = min((u32)packet.bytes, bufferSize);
+    u32 stored = min(bytes, (u32)sizeof(packet.data));
+    memcpy(recvBuffer, packet.data, stored);
+    memset(recvBuffer + stored, 0, bytes - stored);
+
+    source.sin_family = AF_INET;
+    source.sin_port = 0;
+    source.sin_addr.s_addr = packet.source;
+
+    simFreePacket(p);
+
+    outBytes = bytes;
+    return Result_Success;
+}
+
+
+const PingTransport simTransport = {
+    "sim",
+    simResolveDestinationHost,
+    simCreateSocket,
+    simCloseSocket,
+    simSendPacket,
+    simReceivePacket,
+    nullptr,
+    nullptr,    // the simulated network carries packets of any size
+    nullptr,
+    nullptr
+};
+
+
+// Configuration
+
+void
+simReset(
+    u64 seed)
+{
+    simDestinations.clear();
+
+    memset(&simDefault, 0, sizeof(simDefault));
+    simDefault.config.baseMS = 10.f;
+    simDefault.config.ttl = 64;
+
+    memset(simSockets, 0, sizeof(simSockets));
+
+    simHeapSize = 0;
+    simFreeList = SimNone;
+    for (u32 p = MaxSimPackets; p > 0; --p) {
+        simFreePacket(p - 1);
+    }
+    simOrder = 0;
+
+    // splitmix64 of the seed, xorshift needs a non-zero state
+    u64 z = seed + 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    simRandomState = (z ^ (z >> 31)) | 1;
+
+    simEpoch = timer_queryCounts();
+}
+
+
+s32
+simConfigureDestination(
+    const SimDestinationConfig& config)
+{
+    SimDestination* d = &simDefault;
+    if (config.address != 0) {
+        d = simDestinations.insert(config.address);
+        if (!d) {
+            return Result_Error;
+        }
+    }
+
+    d->config = config;
+    return Result_Success;
+}
+
+
+bool
+simGetStats(
+    u32 address,
+    SimDestinationStats& outStats)
+{
+    SimDestination* d = (address != 0 ? simDestinations[address] : &simDefault);
+    if (!d) {
+        return false;
+    }
+
+    outStats = d->stats;
+    return true;
+}
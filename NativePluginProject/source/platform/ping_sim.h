@@ -0,0 +1,116 @@
+#ifndef _PING_SIM_H
+#define _PING_SIM_H
+
+#include "ping.h"
+#include "../utility/hash_map_32.h"
+
+#define MaxSimDestinations  1024    // configured addresses, others use the default configuration
+#define MaxSimSockets       MaxIcmpIds
+#define MaxSimPackets       16384   // replies in flight across all sockets
+#define SimEchoBytes        64      // bytes of the request echoed in a reply, the rest reads as zero
+#define SimSocketBase       0x10000 // simulated socket handles start here to stand out from real ones
+
+enum SimLatencyDistribution : u8 {
+    SimLatency_Constant = 0,    // baseMS
+    SimLatency_Uniform,         // baseMS + [0, spreadMS)
+    SimLatency_Normal,          // baseMS + normal(0, spreadMS), clamped at 0
+    SimLatency_Exponential      // baseMS + exponential with mean spreadMS
+};
+
+/**
+ * Network model of one destination address. Round trips are drawn from the latency distribution
+ * when the request is sent, a reordered reply is held back an extra reorderDelayMS so replies sent
+ * later can overtake it.
+ *
+ * Burst loss follows a Gilbert-Elliott model: a two-state chain stepped once per request, that
+ * moves from the good state to the bad one with probability burstEnterRate and back with
+ * burstExitRate. Every request in the bad state is lost, in the good state lossRate applies. With
+ * burstEnterRate 0 the chain stays good and losses are independent.
+ */
+struct SimDestinationConfig {
+    u32         address;        // IPv4 address in network byte order, 0 sets the default
+    r32         baseMS;
+    r32         spreadMS;
+    r32         lossRate;       // probability a request gets no reply, 0..1
+    r32         reorderRate;    // probability a reply is delayed by reorderDelayMS
+    r32         reorderDelayMS;
+    r32         duplicateRate;  // probability a reply is delivered twice
+    r32         burstEnterRate; // probability a request starts a loss burst, from the good state
+    r32         burstExitRate;  // probability a request ends a loss burst, from the bad state
+    u8          distribution;   // SimLatencyDistribution
+    u8          ttl;            // TTL of replies
+
+    u8          _pad[2];
+};
+
+/**
+ * Ground truth of what the simulator did with a destination's requests. Round trip sums cover
+ * every reply the simulator sent, including late ones the engine may already have timed out.
+ */
+struct SimDestinationStats {
+    u32         requests;
+    u32         lost;
+    u32         reordered;
+    u32         duplicated;
+    u32         lossBursts;     // moves into the bad state of the burst loss model
+    r32         minRoundTrip;
+    r32         maxRoundTrip;
+    r64         sumRoundTrip;
+    r64         sumSqRoundTrip;
+};
+
+struct SimDestination {
+    SimDestinationConfig config;
+    SimDestinationStats  stats;
+    u8                   inBurst;   // burst loss model in the bad state
+
+    u8                   _pad[7];
+};
+
+HashMap32_Typed_WithBuffer(
+    SimDestination,
+    SimDestinationMap,
+    MaxSimDestinations);
+
+
+/**
+ * In-process network that answers echo requests according to per-destination configs, so the job
+ * engine can be run and benchmarked without root or a network. Host names are not resolved, only
+ * dotted-quad addresses are accepted.
+ *
+ * Random draws come from a seeded generator, so the same seed and the same order of requests give
+ * the same round trips, losses and duplicates. Delivery still follows the wall clock, which is
+ * what the engine measures against.
+ *
+ * Call simReset before the first job. Only the job thread uses simTransport, the functions below
+ * are not thread-safe and must be called while no jobs are running.
+ */
+extern const PingTransport simTransport;
+
+/**
+ * Drops all packets in flight, closes all sockets and clears configs and stats.
+ * @param seed  seed of the random generator
+ */
+void
+simReset(
+    u64 seed);
+
+/**
+ * Sets the network model of config.address, or the default model if the address is 0.
+ * @returns 0 on success, -1 if too many destinations are configured
+ */
+s32
+simConfigureDestination(
+    const SimDestinationConfig& config);
+
+/**
+ * Copies the ground truth stats of a configured address, address 0 gives the totals of all
+ * addresses that use the default model.
+ * @returns true if the address is configured
+ */
+bool
+simGetStats(
+    u32 address,
+    SimDestinationStats& outStats);
+
+#endif
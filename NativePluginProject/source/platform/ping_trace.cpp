@@ -0,0 +1,170 @@
+#include "ping_trace.h"
+
+#if defined(PING_TRACE) && PING_TRACE != 0
+
+#include <cstdio>
+#include "timer.h"
+
+struct TraceRingClaim {
+    TraceRing*  ring = nullptr;
+    bool        claimed = false;    // a ring was looked for, whether or not one was free
+
+    ~TraceRingClaim();
+};
+
+// ring 0 belongs to the job thread, other threads claim the rest on their first event
+static TraceRing  traceRings[MaxTraceThreads];
+static atomic_u32 numTraceRings{ 1 };   // one past the highest ring ever claimed
+static thread_local TraceRingClaim localTraceRing;
+
+static atomic_lock traceFlushLock = ATOMIC_FLAG_INIT;
+static bool        traceFileStarted = false;
+static u32         traceRingsNamed = 0;     // rings with a thread_name record in the file
+static u64         traceStartTicks = 0;
+static i64         traceStartCounts = 0;
+
+
+/**
+ * Pairs an rdtsc reading with the high resolution timer, ticks are converted to microseconds by
+ * comparing against a second pair taken at flush time. Runs once, on the first thread to trace.
+ */
+static
+void
+initTraceClock()
+{
+    static const bool initialized = (
+        traceStartTicks = __rdtsc(),
+        traceStartCounts = timer_queryCounts(),
+        true);
+    (void)initialized;
+}
+
+
+TraceRingClaim::~TraceRingClaim()
+{
+    // events still in the ring are flushed all the same, the next owner records after them
+    if (ring) {
+        ring->owned.store(0, std::memory_order_release);
+    }
+}
+
+
+TraceRing*
+getTraceRing()
+{
+    if (!localTraceRing.claimed)
+    {
+        localTraceRing.claimed = true;
+        initTraceClock();
+
+        for (u32 r = 1; r < MaxTraceThreads; ++r)
+        {
+            if (!traceRings[r].owned.exchange(1, std::memory_order_acquire))
+            {
+                localTraceRing.ring = &traceRings[r];
+
+                u32 numRings = numTraceRings.load(std::memory_order_relaxed);
+                while (numRings < r + 1
+                       && !numTraceRings.compare_exchange_weak(numRings, r + 1,
+                                                               std::memory_order_relaxed)) {}
+                break;
+            }
+        }
+    }
+    return localTraceRing.ring;
+}
+
+
+void
+traceBindJobThread()
+{
+    initTraceClock();
+    localTraceRing.ring = &traceRings[0];
+    localTraceRing.claimed = true;
+}
+
+
+s32
+tracingFlush(
+    const char* path)
+{
+    lock_spin(traceFlushLock);
+
+    initTraceClock();
+
+    FILE* file = fopen(path, (traceFileStarted ? "a" : "w"));
+    if (!file) {
+        unlock(traceFlushLock);
+        return Result_Error;
+    }
+
+    if (!traceFileStarted)
+    {
+        fprintf(file, "[\n");
+        fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+                      "\"args\":{\"name\":\"ping\"}},\n");
+        traceFileStarted = true;
+    }
+
+    // ticks per microsecond over everything recorded so far
+    u64 nowTicks = __rdtsc();
+    f64 elapsedMicros = timer_querySecondsSince(traceStartCounts) * 1000000.0;
+    f64 ticksPerMicro = (elapsedMicros > 0.0
+                         ? (f64)(nowTicks - traceStartTicks) / elapsedMicros
+                         : 1.0);
+
+    u32 numRings = min(numTraceRings.load(std::memory_order_relaxed), (u32)MaxTraceThreads);
+
+    for (; traceRingsNamed < numRings; ++traceRingsNamed) {
+        fprintf(file,
+                "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,"
+                "\"args\":{\"name\":\"%s %u\"}},\n",
+                traceRingsNamed,
+                (traceRingsNamed == 0 ? "job thread" : "api thread"),
+                traceRingsNamed);
+    }
+
+    for (u32 r = 0; r < numRings; ++r)
+    {
+        TraceRing& ring = traceRings[r];
+        u32 head = ring.head.load(std::memory_order_acquire);
+        u32 tail = ring.tail.load(std::memory_order_relaxed);
+
+        for (; tail != head; ++tail)
+        {
+            const TraceEvent& e = ring.events[tail & (TraceRingEvents - 1)];
+            f64 ts = (f64)(i64)(e.ticks - traceStartTicks) / ticksPerMicro;
+
+            fprintf(file,
+                    "{\"name\":\"%s\",\"cat\":\"ping\",\"ph\":\"%c\",\"ts\":%.3f,"
+                    "\"pid\":1,\"tid\":%u",
+                    e.name, e.phase, ts, r);
+
+            if (e.phase == TracePhase_AsyncBegin || e.phase == TracePhase_AsyncEnd) {
+                fprintf(file, ",\"id\":\"0x%llx\"", (unsigned long long)e.id);
+            }
+            else if (e.phase == TracePhase_Instant) {
+                fprintf(file, ",\"s\":\"t\"");
+            }
+            fprintf(file, ",\"args\":{\"id\":%llu,\"arg\":%u}},\n",
+                    (unsigned long long)e.id, e.arg);
+        }
+
+        ring.tail.store(tail, std::memory_order_release);
+
+        u32 dropped = ring.dropped.exchange(0, std::memory_order_relaxed);
+        if (dropped > 0) {
+            fprintf(file,
+                    "{\"name\":\"trace events dropped\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,"
+                    "\"pid\":1,\"tid\":%u,\"args\":{\"count\":%u}},\n",
+                    elapsedMicros, r, dropped);
+        }
+    }
+
+    fclose(file);
+    unlock(traceFlushLock);
+
+    return Result_Success;
+}
+
+#endif
@@ -0,0 +1,127 @@
+#ifndef _PING_TRACE_H
+#define _PING_TRACE_H
+
+#include "../utility/common.h"
+
+/**
+ * Timeline of job and request lifecycle events, written as Chrome trace-event JSON that loads in
+ * chrome://tracing or Perfetto. Enabled by PING_TRACE in build_config.h, when it's 0 the TRACE_*
+ * macros compile to nothing.
+ *
+ * Each thread records into its own single producer, single consumer ring, so recording an event
+ * is an rdtsc and a store of 32 bytes with no locks. A ring goes to another thread after its
+ * thread exits, and the timeline shows both on the same track. Events are dropped while a ring is full.
+ * tracingFlush moves the recorded events to a file and can be called from any thread, as often as
+ * needed to keep the rings from filling.
+ *
+ * Event names must be string literals, only the pointer is recorded.
+ */
+#if defined(PING_TRACE) && PING_TRACE != 0
+
+#define MaxTraceThreads     8
+#define TraceRingEvents     (1U << 15)  // per thread, power of 2
+
+enum TracePhase : u8 {
+    TracePhase_Begin      = 'B',    // span on the recording thread
+    TracePhase_End        = 'E',
+    TracePhase_Instant    = 'i',
+    TracePhase_AsyncBegin = 'b',    // span matched by id, may end on a later iteration
+    TracePhase_AsyncEnd   = 'e'
+};
+
+struct TraceEvent {
+    u64         ticks;  // rdtsc
+    const char* name;
+    u64         id;
+    u32         arg;
+    u8          phase;  // TracePhase
+
+    u8          _pad[3];
+};
+static_assert_aligned_size(TraceEvent, 8);
+
+struct alignas(CacheLineSize) TraceRing {
+    atomic_u32  head;       // next event written, only the recording thread writes it
+    u8          _pad0[CacheLineSize - sizeof(atomic_u32)];
+    atomic_u32  tail;       // next event flushed, only the flushing thread writes it
+    atomic_u32  dropped;    // events lost to a full ring, reported on flush
+    atomic_u32  owned;      // claimed by a thread, given back as the thread exits
+    u8          _pad1[CacheLineSize - 3*sizeof(atomic_u32)];
+
+    TraceEvent  events[TraceRingEvents];
+};
+
+/**
+ * Ring of the calling thread, claiming a free one on first use. The ring is given back when the
+ * thread exits, so short-lived threads don't use the rings up.
+ * @returns nullptr if all rings are taken
+ */
+TraceRing*
+getTraceRing();
+
+/**
+ * Binds the calling thread to the job thread's ring. Only one job thread runs at a time, so a
+ * restarted job thread continues the same track in the timeline.
+ */
+void
+traceBindJobThread();
+
+
+inline
+void
+traceEvent(
+    TracePhase phase,
+    const char* name,
+    u64 id,
+    u32 arg)
+{
+    TraceRing* ring = getTraceRing();
+    if (!ring) {
+        return;
+    }
+
+    u32 head = ring->head.load(std::memory_order_relaxed);
+    if (head - ring->tail.load(std::memory_order_acquire) >= TraceRingEvents) {
+        ring->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    TraceEvent& e = ring->events[head & (TraceRingEvents - 1)];
+    e.ticks = __rdtsc();
+    e.name  = name;
+    e.id    = id;
+    e.arg   = arg;
+    e.phase = phase;
+
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+/**
+ * Appends the events recorded since the last flush to a JSON array file, the file is created on
+ * the first flush. Chrome and Perfetto load the array without its closing bracket, so the file is
+ * valid to open after any flush.
+ * @returns 0 on success, -1 if the file can't be opened
+ */
+s32
+tracingFlush(
+    const char* path);
+
+#define TRACE_BEGIN(name)               traceEvent(TracePhase_Begin, name, 0, 0)
+#define TRACE_END(name)                 traceEvent(TracePhase_End, name, 0, 0)
+#define TRACE_INSTANT(name, id, arg)    traceEvent(TracePhase_Instant, name, id, arg)
+#define TRACE_ASYNC_BEGIN(name, id)     traceEvent(TracePhase_AsyncBegin, name, id, 0)
+#define TRACE_ASYNC_END(name, id, arg)  traceEvent(TracePhase_AsyncEnd, name, id, arg)
+#define TRACE_JOB_THREAD()              traceBindJobThread()
+
+#else
+
+#define TRACE_BEGIN(name)               ((void)0)
+#define TRACE_END(name)                 ((void)0)
+#define TRACE_INSTANT(name, id, arg)    ((void)0)
+#define TRACE_ASYNC_BEGIN(name, id)     ((void)0)
+#define TRACE_ASYNC_END(name, id, arg)  ((void)0)
+#define TRACE_JOB_THREAD()              ((void)0)
+
+#endif
+
+#endif
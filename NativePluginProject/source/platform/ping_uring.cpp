@@ -0,0 +1,634 @@
+#include "ping_uring.h"
+
+#ifdef __linux__
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+enum UringOp : u8 {
+    UringOp_Recv = 1,
+    UringOp_Send,
+    UringOp_Cancel
+};
+
+enum UringSocketState : u8 {
+    UringSocket_Free = 0,
+    UringSocket_Open,
+    UringSocket_Closing     // waiting for the receive and the sends on the descriptor to complete
+};
+
+struct UringSocket {
+    s32         fd;
+    u16         generation;     // tells completions for an earlier socket in the slot apart
+    u8          state;          // UringSocketState
+    u8          armed;          // multishot receive is active
+    u8          error;
+    u8          cancelled;      // the receive's cancel is queued
+    u16         sends;          // queued or in flight, the descriptor stays open until they're done
+    u32         head;
+    u32         tail;
+    u16         bids[UringSocketQueue];     // received packets, as provided buffer ids
+    u16         lens[UringSocketQueue];
+    i64         times[UringSocketQueue];    // when their completions were reaped, timer counts
+};
+
+struct UringSend {
+    msghdr      msg;
+    iovec       iov;
+    sockaddr_in dest;
+    u32         socket;         // slot of the socket sending it
+    alignas(cmsghdr) u8 control[SendControlSize];   // the packet's TTL and TOS
+    u8          data[MaxSendSize];
+};
+
+struct Uring {
+    s32         fd;
+    u32         sqEntries;
+
+    // mapped rings
+    u8*         rings;
+    size_t      ringsSize;
+    u32*        sqHead;
+    u32*        sqTail;
+    u32*        sqMask;
+    u32*        sqArray;
+    io_uring_sqe* sqes;
+    u32*        cqHead;
+    u32*        cqTail;
+    u32*        cqMask;
+    io_uring_cqe* cqes;
+    u32         sqLocalTail;    // SQEs written, published to sqTail on enter
+
+    // provided buffer ring, the kernel reads the tail from the resv field of the first entry.
+    // io_uring_buf_ring isn't used, in C++ its flexible array member starts 8 bytes late
+    io_uring_buf* bufRing;
+    u16*        bufRingTail;
+    u8*         bufMemory;
+    u16         bufTail;
+
+    UringSocket sockets[MaxIcmpIds];
+    UringSend   sends[UringSendSlots];
+    u16         freeSends[UringSendSlots];
+    u32         numFreeSends;
+};
+
+static Uring* uring = nullptr;
+
+
+static inline
+u64
+uringUserData(
+    UringOp op,
+    u32 slot,
+    u16 generation)
+{
+    return ((u64)op << 56) | ((u64)generation << 32) | slot;
+}
+
+
+static inline
+UringSocket*
+getUringSocket(
+    SOCKET socket)
+{
+    u32 slot = (u32)(socket - UringSocketBase);
+    if (slot >= MaxIcmpIds || uring->sockets[slot].state != UringSocket_Open) {
+        return nullptr;
+    }
+    return &uring->sockets[slot];
+}
+
+
+/**
+ * Returns a provided buffer to the kernel.
+ */
+static inline
+void
+recycleUringBuffer(
+    u16 bid)
+{
+    io_uring_buf& buf = uring->bufRing[uring->bufTail & (UringRecvBuffers - 1)];
+    buf.addr = (u64)(uring->bufMemory + (u64)bid * UringRecvBufferSize);
+    buf.len = UringRecvBufferSize;
+    buf.bid = bid;
+    ++uring->bufTail;
+    __atomic_store_n(uring->bufRingTail, uring->bufTail, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * @returns a cleared SQE, or nullptr if the submission queue is full even after submitting
+ */
+static
+io_uring_sqe*
+getUringSqe()
+{
+    u32 head = __atomic_load_n(uring->sqHead, __ATOMIC_ACQUIRE);
+    if (uring->sqLocalTail - head >= uring->sqEntries)
+    {
+        __atomic_store_n(uring->sqTail, uring->sqLocalTail, __ATOMIC_RELEASE);
+        syscall(__NR_io_uring_enter, uring->fd, uring->sqLocalTail - head, 0, 0, nullptr, 0);
+
+        head = __atomic_load_n(uring->sqHead, __ATOMIC_ACQUIRE);
+        if (uring->sqLocalTail - head >= uring->sqEntries) {
+            return nullptr;
+        }
+    }
+
+    u32 index = uring->sqLocalTail & *uring->sqMask;
+    io_uring_sqe* sqe = &uring->sqes[index];
+    memset(sqe, 0, sizeof(io_uring_sqe));
+    uring->sqArray[index] = index;
+    ++uring->sqLocalTail;
+
+    return sqe;
+}
+
+
+static
+void
+armUringReceive(
+    u32 slot)
+{
+    UringSocket& sock = uring->sockets[slot];
+    io_uring_sqe* sqe = getUringSqe();
+    if (!sqe) {
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = sock.fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = uringUserData(UringOp_Recv, slot, sock.generation);
+    sock.armed = 1;
+}
+
+
+/**
+ * @param reapTime  when the completion was taken from the queue, the receive time of a packet
+ */
+static
+void
+handleUringCompletion(
+    const io_uring_cqe& cqe,
+    i64 reapTime)
+{
+    UringOp op = (UringOp)(cqe.user_data >> 56);
+    u16 generation = (u16)(cqe.user_data >> 32);
+    u32 slot = (u32)cqe.user_data;
+
+    if (op == UringOp_Send)
+    {
+        if (cqe.res < 0) {
+            addMetric(metricIndex(sendErrors));
+        }
+        --uring->sockets[uring->sends[slot].socket].sends;
+        uring->freeSends[uring->numFreeSends++] = (u16)slot;
+        return;
+    }
+    if (op != UringOp_Recv) {
+        return;
+    }
+
+    bool hasBuffer = (cqe.flags & IORING_CQE_F_BUFFER) != 0;
+    u16 bid = (u16)(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+
+    UringSocket& sock = uring->sockets[slot];
+    if (sock.generation != generation || sock.state == UringSocket_Free) {
+        if (hasBuffer) {
+            recycleUringBuffer(bid);
+        }
+        return;
+    }
+
+    if (hasBuffer)
+    {
+        if (sock.state == UringSocket_Open && cqe.res > 0
+            && sock.tail - sock.head < UringSocketQueue)
+        {
+            u32 q = sock.tail++ & (UringSocketQueue - 1);
+            sock.bids[q] = bid;
+            sock.lens[q] = (u16)cqe.res;
+            sock.times[q] = reapTime;
+        }
+        else {
+            recycleUringBuffer(bid);
+        }
+    }
+
+    // the multishot receive ended, by cancellation, running out of buffers or an error
+    if (!(cqe.flags & IORING_CQE_F_MORE))
+    {
+        sock.armed = 0;
+
+        if (sock.state == UringSocket_Open && cqe.res == -EINVAL) {
+            LOG_ERROR("io_uring multishot receive isn't supported by this kernel");
+            sock.error = 1;
+        }
+    }
+}
+
+
+/**
+ * Cancels a closing socket's receive, and closes its descriptor once nothing queued or in flight
+ * uses it. Called after the submit, so no SQE holding the descriptor is left unsubmitted.
+ */
+static
+void
+finishUringClose(
+    u32 slot)
+{
+    UringSocket& sock = uring->sockets[slot];
+
+    if (sock.armed && !sock.cancelled)
+    {
+        io_uring_sqe* sqe = getUringSqe();
+        if (sqe) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = uringUserData(UringOp_Recv, slot, sock.generation);
+            sqe->user_data = uringUserData(UringOp_Cancel, slot, sock.generation);
+            sock.cancelled = 1;
+        }
+    }
+    else if (!sock.armed && sock.sends == 0)
+    {
+        close(sock.fd);
+        sock.state = UringSocket_Free;
+        ++sock.generation;
+    }
+}
+
+
+/**
+ * Submits the SQEs queued since the last call and handles the completions that have arrived,
+ * with one io_uring_enter. The completions are posted by the kernel as the call returns, with
+ * COOP_TASKRUN they don't arrive between calls.
+ */
+static
+void
+submitUring()
+{
+    u32 toSubmit = uring->sqLocalTail - __atomic_load_n(uring->sqHead, __ATOMIC_ACQUIRE);
+    __atomic_store_n(uring->sqTail, uring->sqLocalTail, __ATOMIC_RELEASE);
+
+    syscall(__NR_io_uring_enter, uring->fd, toSubmit, 0, IORING_ENTER_GETEVENTS, nullptr, 0);
+
+    // one time for all the completions reaped, they arrived since the last call
+    i64 reapTime = timer_queryCounts();
+
+    u32 head = *uring->cqHead;
+    u32 tail = __atomic_load_n(uring->cqTail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+        handleUringCompletion(uring->cqes[head & *uring->cqMask], reapTime);
+    }
+    __atomic_store_n(uring->cqHead, head, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * Submits what the iteration queued besides its sends, the receives of new sockets and the
+ * cancels of closing ones, and collects the replies that arrived since the last send. Multishot
+ * receives that ended are armed again for the next call.
+ */
+static
+void
+uringEndIteration()
+{
+    submitUring();
+
+    for (u32 s = 0; s < MaxIcmpIds; ++s)
+    {
+        UringSocket& sock = uring->sockets[s];
+        if (sock.state == UringSocket_Open && !sock.armed && !sock.error) {
+            armUringReceive(s);
+        }
+        else if (sock.state == UringSocket_Closing) {
+            finishUringClose(s);
+        }
+    }
+}
+
+
+/**
+ * Creates a raw socket with the platform transport and arms its multishot receive.
+ * @returns 0 on success, -1 on error
+ */
+static
+s32
+uringCreateSocket(
+    u8 ttl,
+    u16 id,
+    SOCKET& outSocket)
+{
+    for (u32 s = 0; s < MaxIcmpIds; ++s)
+    {
+        UringSocket& sock = uring->sockets[s];
+        if (sock.state == UringSocket_Free)
+        {
+            if (!ok(createSocket(ttl, id, sock.fd))) {
+                return Result_Error;
+            }
+            sock.state = UringSocket_Open;
+            sock.error = 0;
+            sock.cancelled = 0;
+            sock.head = sock.tail = 0;
+            armUringReceive(s);
+
+            outSocket = (SOCKET)(UringSocketBase + s);
+            return Result_Success;
+        }
+    }
+
+    LOG_WARN("io_uring transport is out of sockets");
+    return Result_Error;
+}
+
+
+/**
+ * Stops the socket's use, the descriptor is closed at the end of an iteration once its receive
+ * has been cancelled and its sends have completed, a queued SQE can't see it closed or reused.
+ */
+static
+void
+uringCloseSocket(
+    SOCKET socket)
+{
+    UringSocket* pSock = getUringSocket(socket);
+    if (!pSock) {
+        return;
+    }
+    UringSocket& sock = *pSock;
+
+    for (; sock.head != sock.tail; ++sock.head) {
+        recycleUringBuffer(sock.bids[sock.head & (UringSocketQueue - 1)]);
+    }
+    sock.state = UringSocket_Closing;
+}
+
+
+/**
+ * Queues the send and submits it at once, the caller's send time is stamped just before. Waiting
+ * for the end of the iteration would add the rest of the iteration to the request's round trip.
+ * @returns 0 on success, -1 on error, 2 if all send slots are in flight
+ */
+static
+s32
+uringSendPacket(
+    SOCKET socket,
+    const sockaddr_in& dest,
+    const u8* buffer,
+    u32 packetSize,
+    u8 ttl,
+    u8 tos)
+{
+    UringSocket* sock = getUringSocket(socket);
+    if (!sock || packetSize > MaxSendSize) {
+        return Result_Error;
+    }
+    if (uring->numFreeSends == 0) {
+        return Result_Pending;
+    }
+
+    io_uring_sqe* sqe = getUringSqe();
+    if (!sqe) {
+        return Result_Pending;
+    }
+
+    u16 slot = uring->freeSends[--uring->numFreeSends];
+    UringSend& send = uring->sends[slot];
+    send.socket = (u32)(socket - UringSocketBase);
+    ++sock->sends;
+    memcpy(send.data, buffer, packetSize);
+    send.dest = dest;
+    send.iov.iov_base = send.data;
+    send.iov.iov_len = packetSize;
+    send.msg = msghdr{};
+    send.msg.msg_name = &send.dest;
+    send.msg.msg_namelen = sizeof(send.dest);
+    send.msg.msg_iov = &send.iov;
+    send.msg.msg_iovlen = 1;
+    setSendOptions(send.msg, send.control, ttl, tos);
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = sock->fd;
+    sqe->addr = (u64)&send.msg;
+    sqe->len = 1;
+    sqe->user_data = uringUserData(UringOp_Send, slot, 0);
+    submitUring();
+
+    return Result_Success;
+}
+
+
+/**
+ * Copies the oldest packet received on the socket, the source is taken from its IP header.
+ * @param receiveTime  when the packet's completion was reaped, at the end of the last iteration
+ * @returns 0 on success, -1 on error, 2 on pending
+ */
+static
+s32
+uringReceiveTimestampedPacket(
+    SOCKET socket,
+    u8* recvBuffer,
+    u32 bufferSize,
+    sockaddr_in& source,
+    u32& outBytes,
+    i64& receiveTime)
+{
+    UringSocket* sock = getUringSocket(socket);
+    if (!sock || sock->error) {
+        return Result_Error;
+    }
+    if (sock->head == sock->tail) {
+        return Result_Pending;
+    }
+
+    u32 q = sock->head++ & (UringSocketQueue - 1);
+    u16 bid = sock->bids[q];
+    const u8* data = uring->bufMemory + (u64)bid * UringRecvBufferSize;
+
+    outBytes = min((u32)sock->lens[q], bufferSize);
+    memcpy(recvBuffer, data, outBytes);
+    recycleUringBuffer(bid);
+    receiveTime = sock->times[q];
+
+    source = sockaddr_in{};
+    source.sin_family = AF_INET;
+    source.sin_addr.s_addr = ((const IPHeader*)recvBuffer)->sourceIP;
+
+    return Result_Success;
+}
+
+
+static
+s32
+uringReceivePacket(
+    SOCKET socket,
+    u8* recvBuffer,
+    u32 bufferSize,
+    sockaddr_in& source,
+    u32& outBytes)
+{
+    i64 receiveTime;
+    return uringReceiveTimestampedPacket(
+        socket, recvBuffer, bufferSize, source, outBytes, receiveTime);
+}
+
+
+/**
+ * Sets the don't fragment option on the socket's descriptor, as for the platform transport. A
+ * queued send too large for the local link fails when it's submitted, like a lost request.
+ * @returns 0 on success, -1 on error
+ */
+static
+s32
+uringSetDontFragment(
+    SOCKET socket,
+    u8 dontFragment)
+{
+    UringSocket* sock = getUringSocket(socket);
+    if (!sock) {
+        return Result_Error;
+    }
+    return setDontFragment(sock->fd, dontFragment);
+}
+
+
+const PingTransport uringTransport = {
+    "io_uring",
+    resolveDestinationHost,
+    uringCreateSocket,
+    uringCloseSocket,
+    uringSendPacket,
+    uringReceivePacket,
+    uringEndIteration,
+    uringSetDontFragment,
+    nullptr,
+    uringReceiveTimestampedPacket
+};
+
+
+/**
+ * Unmaps and frees what initUring set up before it failed.
+ */
+static
+void
+freeUring(
+    Uring& u)
+{
+    if (u.bufRing) {
+        munmap(u.bufRing, UringRecvBuffers * sizeof(io_uring_buf));
+    }
+    free(u.bufMemory);
+    if (u.sqes) {
+        munmap(u.sqes, u.sqEntries * sizeof(io_uring_sqe));
+    }
+    if (u.rings) {
+        munmap(u.rings, u.ringsSize);
+    }
+    close(u.fd);
+}
+
+
+/**
+ * @returns 0 on success, -1 if io_uring or provided buffer rings aren't available
+ */
+static
+s32
+initUring(
+    Uring& u)
+{
+    io_uring_params params{};
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+    params.cq_entries = UringCQEntries;
+
+    u.fd = (s32)syscall(__NR_io_uring_setup, UringSQEntries, &params);
+    if (u.fd < 0) {
+        return Result_Error;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        freeUring(u);
+        return Result_Error;
+    }
+
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(u32);
+    size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    u.ringsSize = max(sqSize, cqSize);
+    u.sqEntries = params.sq_entries;
+
+    u8* rings = (u8*)mmap(nullptr, u.ringsSize, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, u.fd, IORING_OFF_SQ_RING);
+    void* sqes = mmap(nullptr, u.sqEntries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, u.fd, IORING_OFF_SQES);
+    u.rings = (rings != MAP_FAILED ? rings : nullptr);
+    u.sqes = (sqes != MAP_FAILED ? (io_uring_sqe*)sqes : nullptr);
+    if (!u.rings || !u.sqes) {
+        freeUring(u);
+        return Result_Error;
+    }
+
+    u.sqHead  = (u32*)(rings + params.sq_off.head);
+    u.sqTail  = (u32*)(rings + params.sq_off.tail);
+    u.sqMask  = (u32*)(rings + params.sq_off.ring_mask);
+    u.sqArray = (u32*)(rings + params.sq_off.array);
+    u.cqHead  = (u32*)(rings + params.cq_off.head);
+    u.cqTail  = (u32*)(rings + params.cq_off.tail);
+    u.cqMask  = (u32*)(rings + params.cq_off.ring_mask);
+    u.cqes    = (io_uring_cqe*)(rings + params.cq_off.cqes);
+    u.sqLocalTail = *u.sqTail;
+
+    // the provided buffer ring must be page aligned
+    void* bufRing = mmap(nullptr, UringRecvBuffers * sizeof(io_uring_buf),
+                         PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    u.bufRing = (bufRing != MAP_FAILED ? (io_uring_buf*)bufRing : nullptr);
+    u.bufMemory = (u8*)malloc((size_t)UringRecvBuffers * UringRecvBufferSize);
+    if (!u.bufRing || !u.bufMemory) {
+        freeUring(u);
+        return Result_Error;
+    }
+    u.bufRingTail = &u.bufRing[0].resv;
+
+    io_uring_buf_reg reg{};
+    reg.ring_addr = (u64)u.bufRing;
+    reg.ring_entries = UringRecvBuffers;
+    reg.bgid = 0;
+    if (syscall(__NR_io_uring_register, u.fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        freeUring(u);
+        return Result_Error;
+    }
+
+    return Result_Success;
+}
+
+
+const PingTransport*
+getUringTransport()
+{
+    static bool initialized = false;
+    if (!initialized)
+    {
+        initialized = true;
+
+        Uring* u = (Uring*)calloc(1, sizeof(Uring));
+        if (!u || !ok(initUring(*u))) {
+            LOG_INFO("io_uring isn't available, keeping the platform transport");
+            free(u);
+            return nullptr;
+        }
+        uring = u;
+
+        for (u32 b = 0; b < UringRecvBuffers; ++b) {
+            recycleUringBuffer((u16)b);
+        }
+        for (u32 s = 0; s < UringSendSlots; ++s) {
+            uring->freeSends[s] = (u16)(UringSendSlots - 1 - s);
+        }
+        uring->numFreeSends = UringSendSlots;
+    }
+
+    return (uring ? &uringTransport : nullptr);
+}
+
+#endif
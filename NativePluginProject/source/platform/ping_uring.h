@@ -0,0 +1,42 @@
+#ifndef _PING_URING_H
+#define _PING_URING_H
+
+#include "ping.h"
+
+/**
+ * Linux io_uring transport for high probe rates. It uses the same raw ICMP sockets and socket
+ * filter as the platform transport, but moves the per packet system calls out of the job loop:
+ *  - each socket has one multishot receive armed, taking buffers from a ring of provided buffers
+ *    shared by all sockets, so replies arrive without a recvfrom per job per iteration
+ *  - each send is submitted as it's made, with an io_uring_enter that also collects the
+ *    completions that have arrived, so a request's send time is when it's handed to the kernel
+ *  - the job loop makes one more io_uring_enter per iteration, through endIteration, for the
+ *    receives and cancels it queued and the replies since its last send
+ * A received packet's time is when its completion was reaped, given through
+ * receiveTimestampedPacket.
+ *
+ * Needs Linux 6.0 for multishot receives and provided buffer rings. The system calls are made
+ * directly, liburing is not needed.
+ */
+#ifdef __linux__
+
+#define UringSQEntries          256
+#define UringCQEntries          4096
+#define UringRecvBuffers        1024    // provided receive buffers, power of 2
+#define UringRecvBufferSize     ReceiveBufferSize
+#define UringSendSlots          1024    // sends in flight, further sends return Result_Pending
+#define UringSocketQueue        64      // received packets held per socket, power of 2
+#define UringSocketBase         0x20000 // SOCKET values handed out, apart from real descriptors
+
+/**
+ * Sets up the io_uring instance on first use.
+ * @returns the io_uring transport to pass to setPingTransport, or nullptr if io_uring isn't
+ *  available (old kernel, disabled by sysctl or a seccomp filter), in which case the platform
+ *  transport should be kept
+ */
+const PingTransport*
+getUringTransport();
+
+#endif
+
+#endif
@@ -2,6 +2,20 @@
 
 #include "ping.h"
 
+/**
+ * TTL and TOS last set on an open socket. Winsock takes them as socket options only, so a send
+ * sets IP_TTL or IP_TOS when its value differs from the socket's.
+ */
+struct SocketOptions {
+    SOCKET      socket;
+    u8          ttl;
+    u8          tos;
+    u8          used;
+};
+
+// only accessed from the job thread
+static SocketOptions socketOptions[MaxIcmpIds];
+
 
 /**
  * @param host  can be a dotted-quad IP address or a host name
@@ -29,7 +43,7 @@ resolveDestinationHost(
         }
         else {
             // Not a recognized hostname either!
-            printf("Failed to resolve %s\n", host);
+            LOG_WARN("Failed to resolve %s", host);
             return Result_Error;
         }
     }
@@ -39,11 +53,14 @@ resolveDestinationHost(
 
 /**
  * @param ttl  number of hops
+ * @param id   ICMP id of the requests sent on the socket, network byte order. Winsock has no
+ *  socket filters, so replies to other ids are dropped by handleReply.
  * @returns 0 on success, -1 on error
  */
 s32
 createSocket(
     u8 ttl,
+    u16 id,
     SOCKET& outSocket)
 {
     outSocket = socket(
@@ -52,7 +69,7 @@ createSocket(
         IPPROTO_ICMP);
         
     if (outSocket == INVALID_SOCKET) {
-        printf("Failed to create raw socket: %d\n", WSAGetLastError());
+        LOG_ERROR("Failed to create raw socket: %d", WSAGetLastError());
         return Result_Error;
     }
 
@@ -64,14 +81,21 @@ createSocket(
         sizeof(ttl));
 
     if (opt == SOCKET_ERROR) {
-        printf("TTL setsockopt failed: %d\n", WSAGetLastError());
+        LOG_ERROR("TTL setsockopt failed: %d", WSAGetLastError());
         return Result_Error;
     }
 
     u_long nonBlockingMode = 1;
     opt = ioctlsocket(outSocket, FIONBIO, &nonBlockingMode);
     if (opt != NO_ERROR) {
-        printf("ioctlsocket failed with error: %ud\n", opt);
+        LOG_ERROR("ioctlsocket failed with error: %d", opt);
+    }
+
+    for (u32 s = 0; s < MaxIcmpIds; ++s) {
+        if (!socketOptions[s].used) {
+            socketOptions[s] = SocketOptions{ outSocket, ttl, 0, 1 };
+            break;
+        }
     }
 
     return Result_Success;
@@ -81,12 +105,93 @@ void
 platform_closesocket(
     SOCKET socket)
 {
+    for (u32 s = 0; s < MaxIcmpIds; ++s) {
+        if (socketOptions[s].used && socketOptions[s].socket == socket) {
+            socketOptions[s].used = 0;
+            break;
+        }
+    }
     closesocket(socket);
 }
 
 
+/**
+ * Sets IP_TTL and IP_TOS on the socket if they were last set to other values, or it isn't
+ * tracked. Windows only marks packets with the TOS when the DisableUserTOSSetting registry value
+ * is 0, otherwise the option succeeds and the packets go out unmarked; qWAVE or a QoS policy is
+ * the supported way to mark them.
+ * @returns 0 on success, -1 on error
+ */
+static
+s32
+setSocketOptions(
+    SOCKET socket,
+    u8 ttl,
+    u8 tos)
+{
+    SocketOptions* tracked = nullptr;
+    for (u32 s = 0; s < MaxIcmpIds; ++s) {
+        if (socketOptions[s].used && socketOptions[s].socket == socket) {
+            tracked = &socketOptions[s];
+            break;
+        }
+    }
+
+    if (!tracked || tracked->ttl != ttl)
+    {
+        if (setsockopt(socket, IPPROTO_IP, IP_TTL, (const char*)&ttl, sizeof(ttl))
+            == SOCKET_ERROR)
+        {
+            LOG_WARN("TTL setsockopt failed: %d", WSAGetLastError());
+            return Result_Error;
+        }
+        if (tracked) {
+            tracked->ttl = ttl;
+        }
+    }
+
+    if (!tracked || tracked->tos != tos)
+    {
+        DWORD value = tos;
+        if (setsockopt(socket, IPPROTO_IP, IP_TOS, (const char*)&value, sizeof(value))
+            == SOCKET_ERROR)
+        {
+            LOG_WARN("TOS setsockopt failed: %d", WSAGetLastError());
+            return Result_Error;
+        }
+        if (tracked) {
+            tracked->tos = tos;
+        }
+    }
+    return Result_Success;
+}
+
+
+/**
+ * Sets or clears IP_DONTFRAGMENT. A packet with the bit set that is larger than the local link's
+ * MTU fails to send with WSAEMSGSIZE.
+ * @returns 0 on success, -1 on error
+ */
+s32
+setDontFragment(
+    SOCKET socket,
+    u8 dontFragment)
+{
+    DWORD value = dontFragment;
+    if (setsockopt(socket, IPPROTO_IP, IP_DONTFRAGMENT, (const char*)&value, sizeof(value))
+        == SOCKET_ERROR)
+    {
+        LOG_WARN("DF setsockopt failed: %d", WSAGetLastError());
+        return Result_Error;
+    }
+    return Result_Success;
+}
+
+
 /**
  * @param packetSize  total size of packet to send including ICMPHeader
+ * @param ttl  number of hops, set on the socket when it differs from the last packet's
+ * @param tos  IP type of service byte, DSCP in the top 6 bits, set like ttl
  * @returns 0 on success, -1 on error, 2 on pending
  */
 s32
@@ -94,8 +199,14 @@ sendPingPacket(
     SOCKET socket,
     const sockaddr_in& dest,
     const u8* buffer,
-    u32 packetSize)
+    u32 packetSize,
+    u8 ttl,
+    u8 tos)
 {
+    if (!ok(setSocketOptions(socket, ttl, tos))) {
+        return Result_Error;
+    }
+
     s32 bytes = sendto(
         socket,
         (const char*)buffer,
@@ -110,14 +221,14 @@ sendPingPacket(
             return Result_Pending;
         }
         else {
-            printf("Failed to send: %d\n", err);
+            LOG_WARN("Failed to send: %d", err);
             return Result_Error;
         }
     }
 
-    printf(
-        "Pinging %s with %d bytes of data:\n",
-        inet_ntoa(dest.sin_addr),
+    LOG_DEBUG(
+        "Pinging %s with %d bytes of data:",
+        logAddress(dest.sin_addr.s_addr),
         (s32)(bytes - sizeof(ICMPHeader)));
 
     return Result_Success;
@@ -127,6 +238,7 @@ sendPingPacket(
  * @param recvBuffer  buffer to receive data, must be larger than
  *  request buffer + sizeof(ICMPHeader) due to IP header options
  * @param bufferSize  size of the buffer pointed to by recvBuffer
+ * @param outBytes  size of the packet read
  * @returns 0 on success, -1 on error, 2 on pending
  */
 s32
@@ -134,7 +246,8 @@ getPingReply(
     SOCKET socket,
     u8* recvBuffer,
     u32 bufferSize,
-    sockaddr_in& source)
+    sockaddr_in& source,
+    u32& outBytes)
 {
     s32 fromLen = sizeof(source);
 
@@ -152,52 +265,74 @@ getPingReply(
             return Result_Pending;
         }
         else {
-            printf("Failed to read reply: %d\n", err);
+            LOG_WARN("Failed to read reply: %d", err);
             return Result_Error;
         }
     }
     else if (bytes == 0) {
-        printf("Connection closed\n");
+        LOG_WARN("Connection closed");
         return Result_Error;
     }
 
+    outBytes = (u32)bytes;
     return Result_Success;
 }
 
 
-static atomic_lock running = ATOMIC_FLAG_INIT;
-static HANDLE hThread = 0;
-static DWORD threadId = 0;
+const PingTransport platformTransport = {
+    "win32",
+    resolveDestinationHost,
+    createSocket,
+    platform_closesocket,
+    sendPingPacket,
+    getPingReply,
+    nullptr,
+    setDontFragment,
+    nullptr,
+    nullptr
+};
 
 
-DWORD WINAPI
+static void
 pingJobProcess(
-    LPVOID lpParam)
+    void* arg)
 {
-    PingJobHnd runningJobs[MaxPingJobs]{};
+    PingJobHnd runningJobs[MaxRunningJobs]{};
     u32 numRunning = 0;
+    bool released = false;
 
     initHighPerfTimer();
+    bindJobThreadMetrics();
+    TRACE_JOB_THREAD();
+    applyJobThreadLatencyMode();
 
     // start Winsock
     // TODO: replace with platform agnostic "platform_startupSockets" call
     WSAData wsaData;
     if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0)
     {
-        printf("Failed to find Winsock 2.2.\n");
-        return 1;
+        LOG_ERROR("Failed to find Winsock 2.2.");
+        jobThreadRunning.clear();
+        return;
     }
 
     for (;;)
     {
         if (numRunning == 0)
         {
-            // there are no running jobs, use wait_pop to yield the thread until we get a new job
+            // there are no running jobs, wait for a new job
+            setMetric(metricIndex(runningJobs), 0);
             PingJobHnd hnd = null_h32;
-            if (!jobQueue.wait_pop(&hnd, 1000))
+            if (!waitForJob(&hnd))
             {
-                // wait timed out, end the thread
-                break;
+                // idle timeout, end the thread unless a job slipped in as it let go. The pool is
+                // closed first, a new thread may start as soon as the flag is released
+                closeSocketPool();
+                released = releaseJobThread();
+                if (released) {
+                    break;
+                }
+                continue;
             }
 
             // exit thread when a null handle is pushed onto the queue
@@ -208,6 +343,9 @@ pingJobProcess(
             runningJobs[numRunning++] = hnd;
         }
         else {
+            i64 iterationStart = timer_queryCounts();
+            TRACE_BEGIN("job loop");
+
             {
                 PingJobHnd hnd = null_h32;
                 if (jobQueue.try_pop(&hnd))
@@ -217,7 +355,7 @@ pingJobProcess(
                         break;
                     }
                     // otherwise add this job to the running list
-                    assert(numRunning < MaxPingJobs && "too many jobs");
+                    assert(numRunning < MaxRunningJobs && "too many jobs");
                     runningJobs[numRunning++] = hnd;
                 }
             }
@@ -227,50 +365,39 @@ pingJobProcess(
                 j < numRunning;
                 ++j)
             {
-                PingJobHnd hnd = runningJobs[j];
-                PingJob* job = jobs[hnd];
-
-                if (job) {
-                    SequenceStatus status =
-                        runPingSequence(*job);
-                    
-                    if (status != Sequence_Running)
-                    {
-                        // sequence finished, remove from running jobs by swap and pop
-                        runningJobs[j] = runningJobs[--numRunning];
-                    }
-                }
-                else {
-                    // invalid handle, error
+                SequenceStatus status =
+                    runJob(runningJobs[j]);
+                
+                if (status != Sequence_Running)
+                {
+                    // job finished, remove from running jobs by swap and pop
+                    TRACE_INSTANT("job done", runningJobs[j].value, status);
+                    runningJobs[j] = runningJobs[--numRunning];
                 }
             }
-        }
-    }
 
-    WSACleanup();
-    running.clear();
-    hThread = 0;
-    threadId = 0;
+            transportEndIteration();
 
-    return 0;
-}
+            u64 iterationMicros =
+                (u64)(timer_secondsBetween(iterationStart, timer_queryCounts()) * 1000000.0);
+            addMetric(metricIndex(loopIterations));
+            addMetric(metricIndex(loopMicros), iterationMicros);
+            maxMetric(metricIndex(maxLoopMicros), iterationMicros);
+            setMetric(metricIndex(runningJobs), numRunning);
+            TRACE_END("job loop");
+        }
+    }
 
+    setMetric(metricIndex(runningJobs), 0);
 
-s32
-startPingJobThread()
-{
-    if (!running.test_and_set())
-    {
-        hThread = CreateThread( 
-            NULL,             // default security attributes
-            0,                // use default stack size  
-            pingJobProcess,   // thread function name
-            nullptr,          // argument to thread function 
-            0,                // use default creation flags 
-            &threadId);       // returns the thread identifier 
+    if (!released) {
+        abortJobs(runningJobs, numRunning);
+        closeSocketPool();
+    }
+    WSACleanup();
+    if (!released) {
+        jobThreadRunning.clear();
     }
-
-    return Result_Success;
 }
 
 #endif
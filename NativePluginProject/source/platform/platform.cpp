@@ -23,6 +23,175 @@ u32 platformGetPid()
     return (u32)GetCurrentProcessId();
 }
 
+f64 platformGetCpuSeconds()
+{
+    FILETIME creation, exit, kernel, user;
+    if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user)) {
+        return 0.0;
+    }
+    // FILETIME is in 100ns units
+    u64 k = ((u64)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime;
+    u64 u = ((u64)user.dwHighDateTime << 32) | user.dwLowDateTime;
+    return (f64)(k + u) * 1.0e-7;
+}
+
+s32 platformSetThreadAffinity(
+    u32 cpu)
+{
+    if (cpu >= sizeof(DWORD_PTR) * 8) {
+        return -1;
+    }
+    return (SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu) != 0 ? 0 : -1);
+}
+
+s32 platformSetThreadRealtime()
+{
+    return (SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL) ? 0 : -1);
+}
+
+u64 platformGetEpochMicros()
+{
+    FILETIME ft;
+    GetSystemTimePreciseAsFileTime(&ft);
+    // FILETIME counts 100ns units since 1601-01-01
+    u64 t = ((u64)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+    return (t - 116444736000000000ULL) / 10;
+}
+
+static DWORD WINAPI platformThreadProcess(
+    LPVOID lpParam)
+{
+    PlatformThread& thread = *(PlatformThread*)lpParam;
+    thread.proc(thread.arg);
+    return 0;
+}
+
+s32 platformStartThread(
+    PlatformThread& thread,
+    PlatformThreadProc proc,
+    void* arg)
+{
+    thread.proc = proc;
+    thread.arg = arg;
+    thread.handle = CreateThread(NULL, 0, platformThreadProcess, &thread, 0, nullptr);
+    thread.started = (thread.handle != NULL);
+    return (thread.started ? 0 : -1);
+}
+
+void platformJoinThread(
+    PlatformThread& thread)
+{
+    if (!thread.started) {
+        return;
+    }
+    WaitForSingleObject(thread.handle, INFINITE);
+    CloseHandle(thread.handle);
+    thread.started = false;
+}
+
+s32 platformMapFile(
+    const char* path,
+    u64 size,
+    bool writable,
+    PlatformMappedFile& outFile)
+{
+    outFile = PlatformMappedFile{};
+
+    HANDLE file = CreateFileA(
+        path,
+        (writable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ),
+        FILE_SHARE_READ | FILE_SHARE_WRITE,
+        NULL,
+        (writable ? OPEN_ALWAYS : OPEN_EXISTING),
+        FILE_ATTRIBUTE_NORMAL,
+        NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return -1;
+    }
+
+    if (!writable) {
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+            CloseHandle(file);
+            return -1;
+        }
+        size = (u64)fileSize.QuadPart;
+    }
+
+    // a writable mapping grows the file to its size
+    HANDLE mapping = CreateFileMappingA(
+        file,
+        NULL,
+        (writable ? PAGE_READWRITE : PAGE_READONLY),
+        (DWORD)(size >> 32),
+        (DWORD)size,
+        NULL);
+    if (mapping == NULL) {
+        CloseHandle(file);
+        return -1;
+    }
+
+    void* data = MapViewOfFile(mapping, (writable ? FILE_MAP_WRITE : FILE_MAP_READ), 0, 0, size);
+    if (data == NULL) {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return -1;
+    }
+
+    outFile.data = (u8*)data;
+    outFile.size = size;
+    outFile.file = file;
+    outFile.mapping = mapping;
+    return 0;
+}
+
+void platformUnmapFile(
+    PlatformMappedFile& file,
+    u64 keepSize)
+{
+    if (!file.data) {
+        return;
+    }
+    UnmapViewOfFile(file.data);
+    CloseHandle(file.mapping);
+
+    if (keepSize < file.size) {
+        LARGE_INTEGER end;
+        end.QuadPart = (LONGLONG)keepSize;
+        if (SetFilePointerEx(file.file, end, NULL, FILE_BEGIN)) {
+            SetEndOfFile(file.file);
+        }
+    }
+    CloseHandle(file.file);
+    file = PlatformMappedFile{};
+}
+
+s32 platformListDirectory(
+    const char* path,
+    PlatformDirectoryEntryProc proc,
+    void* arg)
+{
+    char pattern[MAX_PATH];
+    size_t pathLen = strlen(path);
+    if (pathLen + sizeof("\\*") > sizeof(pattern)) {
+        return -1;
+    }
+    memcpy(pattern, path, pathLen);
+    memcpy(pattern + pathLen, "\\*", sizeof("\\*"));
+
+    WIN32_FIND_DATAA entry;
+    HANDLE find = FindFirstFileA(pattern, &entry);
+    if (find == INVALID_HANDLE_VALUE) {
+        return -1;
+    }
+    do {
+        proc(entry.cFileName, arg);
+    } while (FindNextFileA(find, &entry));
+
+    FindClose(find);
+    return 0;
+}
+
 
 // NOT _WIN32
 #else
@@ -64,6 +233,163 @@ u32 platformGetPid()
     return (u32)getpid();
 }
 
+#include <sys/resource.h>
+
+f64 platformGetCpuSeconds()
+{
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return (f64)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec)
+         + (f64)(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1.0e-6;
+}
+
+#include <pthread.h>
+#include <sched.h>
+
+s32 platformSetThreadAffinity(
+    u32 cpu)
+{
+    if (cpu >= CPU_SETSIZE) {
+        return -1;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0 ? 0 : -1);
+}
+
+s32 platformSetThreadRealtime()
+{
+    sched_param param{};
+    param.sched_priority = sched_get_priority_min(SCHED_FIFO);
+    return (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == 0 ? 0 : -1);
+}
+
+#include <time.h>
+
+u64 platformGetEpochMicros()
+{
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (u64)ts.tv_sec * 1000000ULL + (u64)ts.tv_nsec / 1000;
+}
+
+static void* platformThreadProcess(
+    void* lpParam)
+{
+    PlatformThread& thread = *(PlatformThread*)lpParam;
+    thread.proc(thread.arg);
+    return nullptr;
+}
+
+s32 platformStartThread(
+    PlatformThread& thread,
+    PlatformThreadProc proc,
+    void* arg)
+{
+    thread.proc = proc;
+    thread.arg = arg;
+    thread.started = (pthread_create(&thread.handle, nullptr, platformThreadProcess, &thread) == 0);
+    return (thread.started ? 0 : -1);
+}
+
+void platformJoinThread(
+    PlatformThread& thread)
+{
+    if (!thread.started) {
+        return;
+    }
+    pthread_join(thread.handle, nullptr);
+    thread.started = false;
+}
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+s32 platformMapFile(
+    const char* path,
+    u64 size,
+    bool writable,
+    PlatformMappedFile& outFile)
+{
+    outFile = PlatformMappedFile{};
+    outFile.fd = -1;
+
+    s32 fd = open(path, (writable ? O_RDWR | O_CREAT : O_RDONLY) | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (writable) {
+        if (ftruncate(fd, (off_t)size) != 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    else {
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            close(fd);
+            return -1;
+        }
+        size = (u64)st.st_size;
+    }
+
+    void* data = mmap(
+        nullptr,
+        (size_t)size,
+        (writable ? PROT_READ | PROT_WRITE : PROT_READ),
+        MAP_SHARED,
+        fd,
+        0);
+    if (data == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+
+    outFile.data = (u8*)data;
+    outFile.size = size;
+    outFile.fd = fd;
+    return 0;
+}
+
+void platformUnmapFile(
+    PlatformMappedFile& file,
+    u64 keepSize)
+{
+    if (!file.data) {
+        return;
+    }
+    munmap(file.data, (size_t)file.size);
+
+    if (keepSize < file.size && ftruncate(file.fd, (off_t)keepSize) != 0) {
+        // the file keeps its mapped size, readers go by the header's record count
+    }
+    close(file.fd);
+    file = PlatformMappedFile{};
+    file.fd = -1;
+}
+
+#include <dirent.h>
+
+s32 platformListDirectory(
+    const char* path,
+    PlatformDirectoryEntryProc proc,
+    void* arg)
+{
+    DIR* dir = opendir(path);
+    if (!dir) {
+        return -1;
+    }
+    for (dirent* entry = readdir(dir); entry; entry = readdir(dir)) {
+        proc(entry->d_name, arg);
+    }
+
+    closedir(dir);
+    return 0;
+}
+
 
 // END NOT WIN32
 #endif
@@ -5,6 +5,8 @@
 
 #ifdef _WIN32
 #include "Windows.h"
+#else
+#include <pthread.h>
 #endif
 
 void platformPause();
@@ -16,4 +18,107 @@ void platformSleep(
 
 u32 platformGetPid();
 
+/**
+ * @returns user and kernel CPU time used by all threads of the process, in seconds
+ */
+f64 platformGetCpuSeconds();
+
+/**
+ * Pins the calling thread to one CPU.
+ * @returns 0 on success, -1 on error
+ */
+s32 platformSetThreadAffinity(
+    u32 cpu);
+
+/**
+ * Raises the calling thread to a realtime priority, SCHED_FIFO on Linux, which needs
+ * CAP_SYS_NICE, and time critical on Windows.
+ * @returns 0 on success, -1 on error
+ */
+s32 platformSetThreadRealtime();
+
+/**
+ * @returns wall clock time in microseconds since the Unix epoch
+ */
+u64 platformGetEpochMicros();
+
+
+typedef void (*PlatformThreadProc)(void* arg);
+
+/**
+ * A joinable thread. The struct is handed to the new thread, keep it in place until the thread
+ * is joined.
+ */
+struct PlatformThread {
+    PlatformThreadProc proc;
+    void*       arg;
+#ifdef _WIN32
+    HANDLE      handle;
+#else
+    pthread_t   handle;
+#endif
+    bool        started;
+};
+
+/**
+ * Starts a thread running proc(arg).
+ * @returns 0 on success, -1 on error
+ */
+s32 platformStartThread(
+    PlatformThread& thread,
+    PlatformThreadProc proc,
+    void* arg);
+
+/**
+ * Waits for a thread started by platformStartThread to return, does nothing if it never started.
+ */
+void platformJoinThread(
+    PlatformThread& thread);
+
+
+/**
+ * A file mapped into memory, shared with the file so writes reach it without a write call.
+ */
+struct PlatformMappedFile {
+    u8*         data;
+    u64         size;
+#ifdef _WIN32
+    HANDLE      file;
+    HANDLE      mapping;
+#else
+    s32         fd;
+#endif
+};
+
+/**
+ * Maps a file into memory. A writable file is created if it doesn't exist and sized to size
+ * bytes, a read only file is mapped whole and size is ignored.
+ * @returns 0 on success, -1 on error
+ */
+s32 platformMapFile(
+    const char* path,
+    u64 size,
+    bool writable,
+    PlatformMappedFile& outFile);
+
+/**
+ * Unmaps the file and closes it. A writable file is first truncated to keepSize bytes, pass
+ * file.size to keep all of it.
+ */
+void platformUnmapFile(
+    PlatformMappedFile& file,
+    u64 keepSize);
+
+
+typedef void (*PlatformDirectoryEntryProc)(const char* name, void* arg);
+
+/**
+ * Calls proc(name, arg) with the name of each entry in a directory, without the directory's path.
+ * @returns 0 on success, -1 if the directory can't be read
+ */
+s32 platformListDirectory(
+    const char* path,
+    PlatformDirectoryEntryProc proc,
+    void* arg);
+
 #endif
\ No newline at end of file
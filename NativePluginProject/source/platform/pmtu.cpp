@@ -0,0 +1,339 @@
+#include "pmtu.h"
+#include "timer.h"
+
+static PmtuJobMap pmtus;
+
+// common MTUs from RFC 1191, probed next when a router asks for fragmentation without an MTU
+static const u16 PmtuPlateaus[] = { 32000, 17914, 8166, 4352, 2002, 1492, 1006, 508, 296, 68 };
+
+
+/**
+ * @returns size of the next probe, maxMtu first, then the size a router reported or a plateau
+ *  when one is within the range, otherwise halfway up it. Until a reply has come back the low end
+ *  is MinPathMtu - 1
+ */
+static inline
+u16
+getNextProbeSize(
+    const PmtuJob& job)
+{
+    if (job.nextSize > job.low && job.nextSize <= job.high) {
+        return job.nextSize;
+    }
+    u32 low = max(job.low, (u16)(MinPathMtu - 1));
+    return (u16)((low + job.high + 1) / 2);
+}
+
+
+/**
+ * Rules out sizes from the probe's up, after it was lost PmtuAttempts times or couldn't be sent.
+ * The next probe is halfway down the range.
+ */
+static inline
+void
+ruleOutProbeSize(
+    PmtuJob& job)
+{
+    job.high = job.size - 1;
+    job.limitedBy = 0;
+    job.attempts = 0;
+}
+
+
+/**
+ * Narrows the range by the reply the probe waiting got.
+ * @returns 0 on success, -1 if the host can't be reached
+ */
+static
+s32
+handlePmtuReply(
+    PmtuJob& job,
+    u32 bytes,
+    i64 replyTime)
+{
+    const ICMPHeader* request = getEchoRequestHeader(job.receiveBuffer, bytes);
+    if (!request
+        || request->id != job.id
+        || request->seq != htons(job.seq)
+        || job.sendTime == 0)
+    {
+        addMetric(metricIndex(repliesIgnored));
+        return Result_Success;
+    }
+
+    const IPHeader& ip = *(const IPHeader*)job.receiveBuffer;
+    const ICMPHeader& message =
+        *(const ICMPHeader*)(job.receiveBuffer + ip.headerLen * sizeof(u32));
+    u32 source = job.sourceAddr.sin_addr.s_addr;
+
+    if (message.type == ICMPType_EchoReply && source == job.destAddr.sin_addr.s_addr)
+    {
+        r32 elapsedMS = (r32)timer_millisBetween(job.sendTime, replyTime);
+        job.maxRoundTrip = max(job.maxRoundTrip, elapsedMS);
+        job.low = job.size;
+        job.attempts = 0;
+        job.sendTime = 0;
+        return Result_Success;
+    }
+
+    if (message.message == ICMP_FragmentationRequired)
+    {
+        job.high = job.size - 1;
+        job.limitedBy = source;
+        job.attempts = 0;
+        job.sendTime = 0;
+
+        // the next-hop MTU is in the second half of the unused field (RFC 1191)
+        u16 mtu = ntohs(message.seq);
+        if (mtu >= MinPathMtu && mtu < job.size) {
+            job.high = mtu;
+            job.nextSize = mtu;
+        }
+        else {
+            for (u32 p = 0; p < countof(PmtuPlateaus); ++p) {
+                if (PmtuPlateaus[p] < job.size) {
+                    job.nextSize = PmtuPlateaus[p];
+                    break;
+                }
+            }
+        }
+
+        // a size answered earlier is too large now, the path has changed since
+        if (job.high < job.low) {
+            job.low = 0;
+        }
+        return Result_Success;
+    }
+
+    if (message.type == ICMPType_DestinationUnreachable)
+    {
+        LOG_WARN("%s is unreachable, code %d", job.host, (s32)message.code);
+        return Result_Error;
+    }
+
+    // Time Exceeded, or an echo reply from another host, the probe is lost if nothing else comes
+    addMetric(metricIndex(repliesIgnored));
+    return Result_Success;
+}
+
+
+SequenceStatus
+runPmtu(
+    PmtuHnd hnd)
+{
+    PmtuJob* pJob = pmtus[hnd];
+    if (!pJob) {
+        return Sequence_Error;
+    }
+    PmtuJob& job = *pJob;
+
+    SequenceStatus status = (SequenceStatus)job.status.load(std::memory_order_relaxed);
+
+    if (status == Sequence_Inactive)
+    {
+        status = Sequence_Error;
+
+        // only pmtu jobs use the ids of pmtu sockets, so the option stays set in the pool
+        if (ok(resolveHost(job.host, job.destAddr))
+            && ok(acquireSocket(DefaultTTL, job.id, job.socket)))
+        {
+            if (!transport->setDontFragment
+                || ok(transport->setDontFragment(job.socket, 1)))
+            {
+                status = Sequence_Running;
+            }
+            else {
+                releaseSocket(job.id, job.socket, true);
+            }
+        }
+    }
+
+    if (status == Sequence_Running)
+    {
+        for (;;)
+        {
+            u32 bytes;
+            s32 result = transportReceive(
+                job.socket,
+                job.receiveBuffer,
+                ReceiveBufferSize,
+                job.sourceAddr,
+                bytes);
+
+            if (result != Result_Success) {
+                break;
+            }
+
+            if (!ok(handlePmtuReply(job, bytes, timer_queryCounts()))) {
+                status = Sequence_Error;
+                break;
+            }
+        }
+
+        if (status == Sequence_Running && job.sendTime != 0)
+        {
+            r32 probeTimeoutMS = (r32)job.timeoutMS;
+            if (job.maxRoundTrip > 0.f) {
+                probeTimeoutMS = min(max(job.maxRoundTrip * PmtuTimeoutFactor,
+                                         (r32)MinAdaptiveTimeoutMS),
+                                     probeTimeoutMS);
+            }
+
+            if (timer_millisBetween(job.sendTime, timer_queryCounts()) >= probeTimeoutMS)
+            {
+                job.sendTime = 0;
+                addMetric(metricIndex(requestsTimedOut));
+                if (++job.attempts >= PmtuAttempts) {
+                    ruleOutProbeSize(job);
+                }
+            }
+        }
+
+        if (status == Sequence_Running && job.sendTime == 0)
+        {
+            if (job.low > 0 && job.low >= job.high) {
+                status = Sequence_Finished;
+            }
+            else if (job.high < MinPathMtu) {
+                status = Sequence_Error;
+            }
+            else {
+                // a lost probe is sent again at the same size
+                if (job.attempts == 0) {
+                    job.size = getNextProbeSize(job);
+                }
+
+                u16 packetSize = job.size - sizeof(IPHeader);
+                ICMPHeader requestHdr;
+                makePingPacket(job.sendBuffer, packetSize, job.id, ++job.seq, requestHdr);
+
+                i64 sendTime = timer_queryCounts();
+                s32 result = transportSend(
+                    job.socket,
+                    job.destAddr,
+                    job.sendBuffer,
+                    packetSize,
+                    DefaultTTL,
+                    0);
+
+                if (result != Result_Pending) {
+                    job.nextSize = 0;
+                }
+                if (result == Result_Success) {
+                    job.sendTime = sendTime;
+                    ++job.probes;
+                    TRACE_INSTANT("pmtu probe", hnd.value, job.size);
+                }
+                else if (result == Result_Error) {
+                    // larger than the local link's MTU
+                    ruleOutProbeSize(job);
+                }
+            }
+        }
+
+        if (status > Sequence_Running) {
+            releaseSocket(job.id, job.socket, (status == Sequence_Error));
+        }
+    }
+
+    job.status.store(status, std::memory_order_release);
+    return status;
+}
+
+
+void
+abortPmtu(
+    PmtuHnd hnd)
+{
+    PmtuJob* pJob = pmtus[hnd];
+    if (!pJob) {
+        return;
+    }
+    PmtuJob& job = *pJob;
+
+    SequenceStatus status = (SequenceStatus)job.status.load(std::memory_order_relaxed);
+    if (status == Sequence_Running) {
+        releaseSocket(job.id, job.socket, true);
+    }
+    if (status <= Sequence_Running) {
+        job.status.store(Sequence_Error, std::memory_order_release);
+    }
+}
+
+
+Pmtu
+discoverPmtu(
+    const char* host,
+    u16 maxMtu,
+    u16 timeoutMS)
+{
+    Pmtu p{ null_h32, Sequence_Inactive, 0, 0, 0 };
+
+    if (!host || maxMtu < MinPathMtu) {
+        p.status = Sequence_Error;
+        return p;
+    }
+
+    PmtuJob* pJob = nullptr;
+    p.hnd = pmtus.insert(nullptr, &pJob);
+
+    if (p.hnd != null_h32)
+    {
+        PmtuJob& job = *pJob;
+
+        size_t hostLen = strlen(host);
+        job.host = (char*)malloc(hostLen+1);
+        memcpy(job.host, host, hostLen+1);
+
+        job.high = min(maxMtu, (u16)MaxPathMtu);
+        job.nextSize = job.high;
+        job.timeoutMS = (timeoutMS > 0 ? timeoutMS : (u16)DefaultTimeoutMS);
+        // ids following the traceroute jobs' ids keep pmtu replies out of the other jobs
+        job.id = htons((u16)(getIcmpIdBase() + MaxPingJobs + MaxSweepJobs + MaxTracerouteJobs
+                             + p.hnd.index));
+
+        jobQueue.push(p.hnd);
+        addMetric(metricIndex(jobsQueued));
+        TRACE_INSTANT("pmtu submitted", p.hnd.value, job.high);
+
+        startPingJobThread();
+    }
+
+    return p;
+}
+
+
+bool
+pollPmtuResult(
+    Pmtu& pmtu)
+{
+    addMetric(metricIndex(polls));
+
+    if (pmtu.hnd != null_h32)
+    {
+        PmtuJob* job = pmtus[pmtu.hnd];
+        if (job)
+        {
+            pmtu.status = (SequenceStatus)job->status.load(std::memory_order_acquire);
+
+            if (pmtu.status > Sequence_Running)
+            {
+                if (pmtu.status == Sequence_Finished) {
+                    pmtu.pathMtu = job->low;
+                    pmtu.probes = job->probes;
+                    pmtu.limitedBy = job->limitedBy;
+                }
+                TRACE_INSTANT("pmtu polled", pmtu.hnd.value, pmtu.status);
+                free(job->host);
+                pmtus.erase(pmtu.hnd);
+                pmtu.hnd = null_h32;
+            }
+        }
+        else {
+            pmtu.status = Sequence_Error;
+            pmtu.hnd = null_h32;
+        }
+    }
+
+    return (pmtu.status > Sequence_Running);
+}
@@ -0,0 +1,106 @@
+#ifndef _PMTU_H
+#define _PMTU_H
+
+#include "ping.h"
+
+#define MinPathMtu          68      // smallest MTU an IPv4 link may have (RFC 791)
+#define PmtuJobTypeId       5
+#define PmtuAttempts        2       // probes lost in a row at one size before it's ruled out
+#define PmtuTimeoutFactor   4.0f    // after the first reply, probes time out at this many times
+                                    // the slowest round trip seen, at least MinAdaptiveTimeoutMS
+
+typedef h32 PmtuHnd;
+
+/**
+ * Path MTU jobs find the largest IP packet that reaches a host without fragmentation, and comes
+ * back answered. Echo requests are sent with the don't fragment bit and a binary search on their
+ * size keeps the range of MTUs that haven't been ruled out:
+ *  - an echo reply raises the low end to the probe's size
+ *  - Fragmentation Needed from a router lowers the high end to the next-hop MTU it reports, which
+ *    is probed next, so a path that reports its MTUs is found in one probe per smaller link plus
+ *    the first. A router that leaves the MTU out (RFC 792) only rules out the probe's size
+ *  - a probe lost PmtuAttempts times in a row, or too large for the local link to send, rules out
+ *    its size, for paths where a router drops it silently (a PMTU black hole)
+ * The search ends when the range is down to one size. Each probe waits for the last to be
+ * answered or time out.
+ */
+struct PmtuJob {
+    atomic_u32  status;         // SequenceStatus
+
+    char*       host;
+    u16         id;             // ICMP id of the job's requests, network byte order
+    u16         timeoutMS;
+    u16         low;            // largest MTU a reply came back at, 0 for none yet
+    u16         high;           // largest MTU not ruled out
+    u16         size;           // MTU of the last probe
+    u16         seq;
+    u16         probes;         // requests sent
+    u16         nextSize;       // size of the next probe, 0 for halfway up the range
+    u8          attempts;       // probes lost in a row at size
+
+    u8          _pad[3];
+
+    u32         limitedBy;      // router that last reported Fragmentation Needed
+    r32         maxRoundTrip;   // slowest reply so far, 0 for none
+
+    i64         sendTime;
+
+    SOCKET      socket;
+    sockaddr_in destAddr;
+    sockaddr_in sourceAddr;
+    u8          sendBuffer[MaxSendSize];
+    u8          receiveBuffer[ReceiveBufferSize];
+};
+
+struct Pmtu {
+    PmtuHnd        hnd;
+    SequenceStatus status;
+    u16            pathMtu;     // path MTU in bytes including the IP header, 0 until found
+    u16            probes;      // requests sent to find it
+    u32            limitedBy;   // router that reported the path MTU in network byte order, 0 if
+                                // it's the local link's MTU, maxMtu or a silent drop's
+};
+
+
+SparseHandleMap16_Typed_WithBuffer(
+    PmtuJob,
+    PmtuJobMap,
+    PmtuHnd,
+    PmtuJobTypeId,
+    MaxPmtuJobs);
+
+
+/**
+ * Adds a path MTU discovery job and runs it on the job thread. This is a non-blocking call.
+ * @param host  host name or dotted-quad IP of the destination
+ * @param maxMtu  largest MTU probed, the first probe is this size. At most MaxPathMtu
+ * @param timeoutMS  time a probe waits for a reply, until the first reply gives a round trip
+ *  to time out by
+ * @returns Pmtu struct with a non-zero hnd on success, or 0 in hnd if the pmtu job map is full
+ */
+Pmtu
+discoverPmtu(
+    const char* host,
+    u16 maxMtu    = MaxPathMtu,
+    u16 timeoutMS = DefaultTimeoutMS);
+
+/**
+ * Checks the job for completion. When pmtu.status is Sequence_Finished, pmtu.pathMtu, probes and
+ * limitedBy are filled, the job is removed and pmtu.hnd is cleared to zero. The job ends in
+ * Sequence_Error if no size down to MinPathMtu was answered, or the host can't be resolved.
+ * @returns true if the job is finished (Sequence_Finished or Sequence_Error)
+ */
+bool
+pollPmtuResult(
+    Pmtu& pmtu);
+
+
+SequenceStatus
+runPmtu(
+    PmtuHnd hnd);
+
+void
+abortPmtu(
+    PmtuHnd hnd);
+
+#endif
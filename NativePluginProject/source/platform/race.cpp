@@ -0,0 +1,344 @@
+#include "race.h"
+#include "timer.h"
+
+static RaceJobMap races;
+
+
+struct RaceBounds {
+    r32 lower;
+    r32 upper;
+    r32 mean;
+};
+
+
+/**
+ * Confidence interval of the candidate's mean round trip time. With no replies yet, the time the
+ * current request has been waiting is a lower bound of its round trip, and there is no upper
+ * bound.
+ */
+static
+RaceBounds
+getRaceBounds(
+    PingJob& job)
+{
+    PingSequence& sequence = job.sequence;
+    RaceBounds b{ 0.f, FLT_MAX, FLT_MAX };
+
+    if (sequence.stats.received > 0)
+    {
+        r32 n = (r32)sequence.stats.received;
+        r32 deviation = max(sequence.stats.stdDevRoundTrip,
+                            sequence.stats.avgRoundTrip * RaceMinDeviation);
+        r32 halfWidth = RaceConfidenceZ * deviation / sqrtf(n);
+
+        b.mean = sequence.stats.avgRoundTrip;
+        b.lower = max(b.mean - halfWidth, 0.f);
+        b.upper = b.mean + halfWidth;
+    }
+    else if (sequence.seq < sequence.numRequests
+             && sequence.requests[sequence.seq].status == Ping_WaitingForReply)
+    {
+        b.lower = (r32)timer_queryMillisSince(sequence.requests[sequence.seq].sendTime);
+    }
+
+    // a candidate that has lost every request so far can't be shown to be fast
+    if (sequence.stats.received == 0 && sequence.stats.lost > 0) {
+        b.lower = FLT_MAX;
+    }
+
+    return b;
+}
+
+
+/**
+ * Ranks the candidates that didn't fail by mean round trip, those with no replies last, and keeps
+ * the top k.
+ */
+static
+void
+settleRace(
+    RaceJob& race)
+{
+    u32 order[MaxRaceCandidates];
+    r32 means[MaxRaceCandidates];
+    u32 numRanked = 0;
+
+    for (u32 c = 0; c < race.numCandidates; ++c)
+    {
+        means[c] = FLT_MAX;
+
+        PingJob* job = jobs[race.candidates[c]];
+        if (job) {
+            if (job->sequence.stats.received > 0) {
+                means[c] = job->sequence.stats.avgRoundTrip;
+            }
+            cancelPingSequence(*job);
+        }
+
+        if (race.eliminated[c] != RaceCandidate_Failed) {
+            order[numRanked++] = c;
+        }
+    }
+
+    // insertion sort, there are only a handful of candidates
+    for (u32 i = 1; i < numRanked; ++i)
+    {
+        u32 c = order[i];
+        u32 j = i;
+        for (; j > 0 && means[order[j-1]] > means[c]; --j) {
+            order[j] = order[j-1];
+        }
+        order[j] = c;
+    }
+
+    race.numResults = min(race.k, numRanked);
+    for (u32 r = 0; r < race.numResults; ++r)
+    {
+        u32 c = order[r];
+        race.results[r].candidate = c;
+
+        PingJob* job = jobs[race.candidates[c]];
+        if (job) {
+            race.results[r].stats = job->sequence.stats;
+        }
+    }
+}
+
+
+SequenceStatus
+runRace(
+    RaceHnd hnd)
+{
+    RaceJob* pRace = races[hnd];
+    if (!pRace) {
+        return Sequence_Error;
+    }
+    RaceJob& race = *pRace;
+
+    SequenceStatus status = (SequenceStatus)race.status.load(std::memory_order_relaxed);
+    if (status == Sequence_Inactive) {
+        status = Sequence_Running;
+    }
+
+    if (status == Sequence_Running)
+    {
+        RaceBounds bounds[MaxRaceCandidates];
+        u32 numActive = 0;
+        u32 numRunning = 0;
+
+        // step each candidate's sequence that is still in the race
+        for (u32 c = 0; c < race.numCandidates; ++c)
+        {
+            if (race.eliminated[c]) {
+                continue;
+            }
+
+            PingJob* job = jobs[race.candidates[c]];
+            SequenceStatus candidateStatus = Sequence_Error;
+            if (job) {
+                candidateStatus = (SequenceStatus)job->sequence.status.load(std::memory_order_relaxed);
+                if (candidateStatus <= Sequence_Running) {
+                    candidateStatus = runPingSequence(*job);
+                }
+            }
+
+            if (candidateStatus == Sequence_Error) {
+                race.eliminated[c] = RaceCandidate_Failed;
+                continue;
+            }
+
+            bounds[c] = getRaceBounds(*job);
+            ++numActive;
+            if (candidateStatus == Sequence_Running) {
+                ++numRunning;
+            }
+        }
+
+        // the k-th smallest upper bound is the slowest a top k candidate can turn out to be
+        r32 kthUpper = FLT_MAX;
+        if (numActive > race.k)
+        {
+            r32 uppers[MaxRaceCandidates];
+            u32 numUppers = 0;
+            for (u32 c = 0; c < race.numCandidates; ++c) {
+                if (!race.eliminated[c]) {
+                    uppers[numUppers++] = bounds[c].upper;
+                }
+            }
+            // partial selection sort up to k
+            for (u32 i = 0; i < race.k; ++i) {
+                for (u32 j = i + 1; j < numUppers; ++j) {
+                    if (uppers[j] < uppers[i]) {
+                        r32 t = uppers[i]; uppers[i] = uppers[j]; uppers[j] = t;
+                    }
+                }
+            }
+            kthUpper = uppers[race.k - 1];
+        }
+
+        // stop probing candidates that are clearly out of the top k
+        for (u32 c = 0;
+             c < race.numCandidates && numActive > race.k && kthUpper < FLT_MAX;
+             ++c)
+        {
+            if (!race.eliminated[c] && bounds[c].lower > kthUpper)
+            {
+                PingJob* job = jobs[race.candidates[c]];
+                if (job) {
+                    if ((SequenceStatus)job->sequence.status.load(std::memory_order_relaxed) == Sequence_Running) {
+                        --numRunning;
+                    }
+                    cancelPingSequence(*job);
+                }
+                race.eliminated[c] = RaceCandidate_RuledOut;
+                ++race.numRuledOut;
+                --numActive;
+                TRACE_INSTANT("race candidate eliminated", race.candidates[c].value, c);
+            }
+        }
+
+        // the top k set is stable once the others have been ruled out, or no remaining sequence
+        // can add more samples. k or fewer candidates left by failures alone aren't separated from
+        // anything yet, they keep sampling so they can be ranked
+        if ((numActive <= race.k && race.numRuledOut > 0) || numRunning == 0)
+        {
+            settleRace(race);
+            status = (numActive > 0 ? Sequence_Finished : Sequence_Error);
+        }
+    }
+
+    race.status.store(status, std::memory_order_release);
+    return status;
+}
+
+
+void
+abortRace(
+    RaceHnd hnd)
+{
+    RaceJob* pRace = races[hnd];
+    if (!pRace) {
+        return;
+    }
+    RaceJob& race = *pRace;
+
+    SequenceStatus status = (SequenceStatus)race.status.load(std::memory_order_relaxed);
+    if (status > Sequence_Running) {
+        return;
+    }
+
+    for (u32 c = 0; c < race.numCandidates; ++c)
+    {
+        PingJob* job = jobs[race.candidates[c]];
+        if (job) {
+            abortPingSequence(*job);
+        }
+    }
+    race.status.store(Sequence_Error, std::memory_order_release);
+}
+
+
+Race
+race(
+    const char* const* hosts,
+    u32 numHosts,
+    u32 k,
+    u16 numRequests,
+    u16 timeoutMS,
+    u16 flags)
+{
+    Race r{ null_h32, Sequence_Inactive, 0 };
+
+    if (!hosts || numHosts == 0 || numHosts > MaxRaceCandidates || k == 0) {
+        r.status = Sequence_Error;
+        return r;
+    }
+
+    RaceJob* pRace = nullptr;
+    r.hnd = races.insert(nullptr, &pRace);
+
+    if (r.hnd != null_h32)
+    {
+        pRace->k = min(k, numHosts);
+        numRequests = min(numRequests, (u16)MaxSequenceRequests);
+
+        for (u32 c = 0; c < numHosts; ++c)
+        {
+            PingJobHnd hnd = addPingJob(
+                hosts[c],
+                numRequests,
+                DefaultDataSize,
+                DefaultTTL,
+                timeoutMS,
+                DefaultIntervalMS,
+                flags,
+                0.f,
+                0);
+
+            if (hnd == null_h32) {
+                // out of ping jobs, unwind the candidates added so far
+                for (u32 f = 0; f < pRace->numCandidates; ++f) {
+                    freePingJob(pRace->candidates[f], *jobs[pRace->candidates[f]]);
+                }
+                races.erase(r.hnd);
+                r.hnd = null_h32;
+                return r;
+            }
+
+            pRace->candidates[pRace->numCandidates++] = hnd;
+        }
+
+        jobQueue.push(r.hnd);
+        addMetric(metricIndex(jobsQueued));
+        TRACE_INSTANT("race submitted", r.hnd.value, pRace->numCandidates);
+
+        startPingJobThread();
+    }
+
+    return r;
+}
+
+
+bool
+pollRaceResult(
+    Race& race,
+    RaceResult* outResults,
+    u32 maxResults)
+{
+    addMetric(metricIndex(polls));
+
+    if (race.hnd != null_h32)
+    {
+        RaceJob* job = races[race.hnd];
+        if (job)
+        {
+            race.status = (SequenceStatus)job->status.load(std::memory_order_acquire);
+
+            if (race.status > Sequence_Running)
+            {
+                TRACE_INSTANT("race polled", race.hnd.value, race.status);
+                race.numResults = 0;
+                if (race.status == Sequence_Finished && outResults) {
+                    race.numResults = min(job->numResults, maxResults);
+                    memcpy(outResults, job->results, race.numResults * sizeof(RaceResult));
+                }
+
+                for (u32 c = 0; c < job->numCandidates; ++c)
+                {
+                    PingJob* candidate = jobs[job->candidates[c]];
+                    if (candidate) {
+                        freePingJob(job->candidates[c], *candidate);
+                    }
+                }
+                races.erase(race.hnd);
+                race.hnd = null_h32;
+            }
+        }
+        else {
+            race.status = Sequence_Error;
+            race.hnd = null_h32;
+        }
+    }
+
+    return (race.status > Sequence_Running);
+}
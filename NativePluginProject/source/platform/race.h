@@ -0,0 +1,104 @@
+#ifndef _RACE_H
+#define _RACE_H
+
+#include "ping.h"
+
+#define MaxRaceCandidates   32
+#define RaceJobTypeId       2
+#define RaceConfidenceZ     1.96f   // z score of the round trip confidence bounds, ~95%
+#define RaceMinDeviation    0.1f    // floor of the standard deviation as a fraction of the mean,
+                                    // keeps one or two identical samples from looking certain
+
+typedef h32 RaceHnd;
+
+enum RaceCandidateState : u8 {
+    RaceCandidate_Active = 0,
+    RaceCandidate_RuledOut,     // its bounds put it out of the top k, its sequence was stopped
+    RaceCandidate_Failed        // its sequence ended in an error
+};
+
+struct RaceResult {
+    u32         candidate;  // index of the host in the array passed to race
+    PingStats   stats;      // stats at the time the race settled, the sequence may be partial
+};
+
+/**
+ * A race pings every candidate host in parallel and keeps a confidence interval of each one's
+ * mean round trip time as samples arrive. A candidate whose lower bound is above the k-th best
+ * upper bound can't make the top k, so its sequence is stopped. The race finishes as soon as the
+ * top k set can no longer change, without waiting for the remaining sequences to run out. That
+ * takes at least one candidate ruled out: when k or fewer are left only because the others failed,
+ * or k covers every candidate, the remaining sequences run to the end before they're ranked.
+ *
+ * The candidates' sequences live in the ping job map, but only the race is on the job thread's
+ * running list and it steps the sequences itself.
+ */
+struct RaceJob {
+    atomic_u32  status;         // SequenceStatus
+    u32         numCandidates;
+    u32         k;
+    u32         numResults;
+
+    PingJobHnd  candidates[MaxRaceCandidates];
+    u8          eliminated[MaxRaceCandidates];  // RaceCandidateState
+    u8          numRuledOut;
+    u8          _pad[3];
+    RaceResult  results[MaxRaceCandidates]; // top k, best first, written when the race settles
+};
+
+struct Race {
+    RaceHnd        hnd;
+    SequenceStatus status;
+    u32            numResults;
+};
+
+
+SparseHandleMap16_Typed_WithBuffer(
+    RaceJob,
+    RaceJobMap,
+    RaceHnd,
+    RaceJobTypeId,
+    MaxRaceJobs);
+
+
+/**
+ * Adds a race between candidate hosts and runs it on the job thread. This is a non-blocking call.
+ * @param hosts  host names or dotted-quad IPs of the candidates
+ * @param k  number of fastest candidates wanted
+ * @param numRequests  max requests sent to each candidate, a candidate is usually stopped sooner
+ * @param flags  PingFlags applied to each candidate's sequence
+ * @returns Race struct with a non-zero hnd on success, or 0 in hnd if the race or ping job maps
+ *  are full
+ */
+Race
+race(
+    const char* const* hosts,
+    u32 numHosts,
+    u32 k,
+    u16 numRequests = MaxSequenceRequests,
+    u16 timeoutMS   = DefaultTimeoutMS,
+    u16 flags       = PingFlag_None);
+
+/**
+ * Checks the race for completion. When race.status is Sequence_Finished, up to maxResults of the
+ * ranked top k are copied to outResults, fastest first, the job is removed and race.hnd is cleared
+ * to zero. Candidates that never replied rank after those that did, and candidates whose sequence
+ * failed aren't ranked, so there may be fewer than k results.
+ * @returns true if the race is finished (Sequence_Finished or Sequence_Error)
+ */
+bool
+pollRaceResult(
+    Race& race,
+    RaceResult* outResults,
+    u32 maxResults);
+
+
+SequenceStatus
+runRace(
+    RaceHnd hnd);
+
+void
+abortRace(
+    RaceHnd hnd);
+
+#endif
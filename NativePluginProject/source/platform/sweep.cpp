@@ -0,0 +1,451 @@
+#include "sweep.h"
+#include "timer.h"
+#include "platform.h"
+
+static SweepJobMap      sweeps;
+static SweepResultQueue sweepResults[MaxSweepJobs];
+
+
+/**
+ * Parses "a.b.c.d/n" into the first address and number of addresses in the range.
+ * @returns 0 on success, -1 on error
+ */
+static
+s32
+parseCIDR(
+    const char* cidr,
+    u32& outFirstAddress,
+    u32& outNumAddresses)
+{
+    char address[16] = {};
+    u32 prefix = 32;
+
+    const char* slash = strchr(cidr, '/');
+    size_t addressLen = (slash ? (size_t)(slash - cidr) : strlen(cidr));
+    if (addressLen == 0 || addressLen >= sizeof(address)) {
+        return Result_Error;
+    }
+    memcpy(address, cidr, addressLen);
+
+    if (slash) {
+        char* end = nullptr;
+        prefix = (u32)strtoul(slash + 1, &end, 10);
+        if (end == slash + 1 || *end != '\0' || prefix > 32) {
+            return Result_Error;
+        }
+    }
+
+    u32 addr = inet_addr(address);
+    if (addr == INADDR_NONE && strcmp(address, "255.255.255.255") != 0) {
+        return Result_Error;
+    }
+
+    u32 mask = (prefix == 0 ? 0 : 0xFFFFFFFFU << (32 - prefix));
+    u64 numAddresses = 1ULL << (32 - prefix);
+    outFirstAddress = ntohl(addr) & mask;
+
+    // skip the network and broadcast addresses, /31 and /32 have neither
+    if (prefix < 31) {
+        outFirstAddress += 1;
+        numAddresses -= 2;
+    }
+
+    if (numAddresses > MaxSweepTargets) {
+        return Result_Error;
+    }
+    outNumAddresses = (u32)numAddresses;
+
+    return Result_Success;
+}
+
+
+/**
+ * Creates the sweep job, the address list is copied if given. Returns a null handle with
+ * Sequence_Error if the arguments are invalid or the job's lists can't be allocated.
+ */
+static
+Sweep
+addSweepJob(
+    u32 firstAddress,
+    const u32* addresses,
+    u32 numTargets,
+    u32 ratePPS,
+    u16 timeoutMS,
+    u16 dataSize,
+    u8  ttl)
+{
+    Sweep s{ null_h32, Sequence_Inactive, 0, 0 };
+
+    if (numTargets == 0 || numTargets > MaxSweepTargets || ratePPS == 0) {
+        s.status = Sequence_Error;
+        return s;
+    }
+
+    SweepJob* pJob = nullptr;
+    s.hnd = sweeps.insert(nullptr, &pJob);
+
+    if (s.hnd != null_h32)
+    {
+        SweepJob& job = *pJob;
+
+        job.firstAddress = firstAddress;
+        job.numTargets = numTargets;
+        if (addresses) {
+            job.addresses = (u32*)malloc(numTargets * sizeof(u32));
+        }
+        job.replied = (u8*)calloc((numTargets + 7) / 8, 1);
+
+        if ((addresses && !job.addresses) || !job.replied) {
+            free(job.addresses);
+            free(job.replied);
+            sweeps.erase(s.hnd);
+            return Sweep{ null_h32, Sequence_Error, 0, 0 };
+        }
+        if (addresses) {
+            memcpy(job.addresses, addresses, numTargets * sizeof(u32));
+        }
+
+        job.ratePPS = ratePPS;
+        job.timeoutMS = timeoutMS;
+        job.dataSize = max(dataSize, (u16)SweepMinDataSize);
+        job.ttl = ttl;
+        // ids following the ping jobs' ids keep sweep replies out of the ping sequences
+        job.id = htons((u16)(getIcmpIdBase() + MaxPingJobs + s.hnd.index));
+
+        sweepResults[s.hnd.index].clear();
+
+        jobQueue.push(s.hnd);
+        addMetric(metricIndex(jobsQueued));
+        TRACE_INSTANT("sweep submitted", s.hnd.value, numTargets);
+
+        startPingJobThread();
+    }
+
+    return s;
+}
+
+
+static
+void
+freeSweepJob(
+    SweepHnd hnd,
+    SweepJob& job)
+{
+    free(job.addresses);
+    free(job.replied);
+    sweeps.erase(hnd);
+}
+
+
+static inline
+u32
+getTargetAddress(
+    const SweepJob& job,
+    u32 target)
+{
+    return (job.addresses
+            ? job.addresses[target]
+            : htonl(job.firstAddress + target));
+}
+
+
+/**
+ * Makes an echo request with the target index and send time in the data section, so the reply
+ * carries everything needed to match it.
+ */
+static
+void
+makeSweepPacket(
+    SweepJob& job,
+    u32 target,
+    i64 sendTime,
+    u16 packetSize)
+{
+    u8* buffer = job.sendBuffer;
+    memset(buffer, 0, packetSize);
+
+    ICMPHeader& hdr = *(ICMPHeader*)buffer;
+    hdr.message = ICMP_EchoRequest;
+    hdr.id      = job.id;
+    hdr.seq     = htons((u16)target);
+
+    u8* data = buffer + sizeof(ICMPHeader);
+    memcpy(data, &target, sizeof(u32));
+    memcpy(data + sizeof(u32), &sendTime, sizeof(i64));
+    memset(
+        data + SweepMinDataSize,
+        0xDA,
+        packetSize - sizeof(ICMPHeader) - SweepMinDataSize);
+
+    hdr.checksum = checksum((u16*)buffer, packetSize);
+}
+
+
+/**
+ * Matches a reply to its target and reports the target the first time it responds.
+ */
+static
+void
+handleSweepReply(
+    SweepHnd hnd,
+    SweepJob& job,
+    u32 bytes,
+    i64 replyTime)
+{
+    IPHeader* reply = (IPHeader*)job.receiveBuffer;
+    u16 headerLen = reply->headerLen * sizeof(u32);
+    u16 totalLen = ntohs(reply->totalLen);
+
+    if (totalLen < headerLen + sizeof(ICMPHeader) + SweepMinDataSize
+        || totalLen > bytes)
+    {
+        return;
+    }
+
+    ICMPHeader& echo = *(ICMPHeader*)(job.receiveBuffer + headerLen);
+    if (echo.type != ICMPType_EchoReply || echo.id != job.id) {
+        return;
+    }
+
+    u32 target = 0;
+    i64 sendTime = 0;
+    u8* data = job.receiveBuffer + headerLen + sizeof(ICMPHeader);
+    memcpy(&target, data, sizeof(u32));
+    memcpy(&sendTime, data + sizeof(u32), sizeof(i64));
+
+    // the reply must come from the address we sent to, which also rejects forged target indices
+    if (target >= job.nextTarget
+        || job.sourceAddr.sin_addr.s_addr != getTargetAddress(job, target))
+    {
+        return;
+    }
+
+    u8 bit = (u8)(1 << (target & 7));
+    if (job.replied[target >> 3] & bit) {
+        return;
+    }
+    job.replied[target >> 3] |= bit;
+
+    SweepResult result{
+        job.sourceAddr.sin_addr.s_addr,
+        (r32)timer_millisBetween(sendTime, replyTime),
+        reply->ttl,
+        {}
+    };
+
+    if (probeLogging()) {
+        probeLogRecord(
+            ProbeKind_Sweep,
+            result.address,
+            ntohs(job.id),
+            target,
+            sendTime,
+            result.elapsedMS,
+            result.ttl,
+            Ping_Received);
+    }
+
+    if (sweepResults[hnd.index].push(result)) {
+        job.responded.fetch_add(1, std::memory_order_relaxed);
+    }
+    else {
+        job.dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+
+SequenceStatus
+runSweep(
+    SweepHnd hnd)
+{
+    SweepJob* pJob = sweeps[hnd];
+    if (!pJob) {
+        return Sequence_Error;
+    }
+    SweepJob& job = *pJob;
+
+    SequenceStatus status = (SequenceStatus)job.status.load(std::memory_order_relaxed);
+
+    if (status == Sequence_Inactive)
+    {
+        if (ok(acquireSocket(job.ttl, job.id, job.socket))) {
+            job.refillTime = timer_queryCounts();
+            job.tokens = 1.0f;
+            status = Sequence_Running;
+        }
+        else {
+            status = Sequence_Error;
+        }
+    }
+
+    if (status == Sequence_Running)
+    {
+        i64 now = timer_queryCounts();
+        u16 packetSize = min((u16)(sizeof(ICMPHeader) + job.dataSize), (u16)MaxPacketSize);
+
+        // refill the sweep's token bucket, allowing at most one batch to accumulate
+        job.tokens = min(
+            job.tokens + (r32)timer_secondsBetween(job.refillTime, now) * job.ratePPS,
+            (r32)SweepSendBatch);
+        job.refillTime = now;
+
+        sockaddr_in dest{};
+        dest.sin_family = AF_INET;
+
+        TRACE_BEGIN("sweep send batch");
+        for (u32 b = 0;
+             b < SweepSendBatch && job.nextTarget < job.numTargets && job.tokens >= 1.0f;
+             ++b)
+        {
+            dest.sin_addr.s_addr = getTargetAddress(job, job.nextTarget);
+            makeSweepPacket(job, job.nextTarget, now, packetSize);
+
+            s32 result = transportSend(job.socket, dest, job.sendBuffer, packetSize, job.ttl, 0);
+            if (result == Result_Pending) {
+                // socket buffer is full, try again on the next iteration
+                break;
+            }
+            // an unreachable target fails only its own send, keep sweeping
+            if (result == Result_Success) {
+                job.sent.fetch_add(1, std::memory_order_relaxed);
+                job.lastSendTime = now;
+            }
+            ++job.nextTarget;
+            job.tokens -= 1.0f;
+        }
+        TRACE_END("sweep send batch");
+
+        TRACE_BEGIN("sweep receive batch");
+        for (u32 r = 0;
+             r < SweepReceiveBatch;
+             ++r)
+        {
+            u32 bytes;
+            s32 result = transportReceive(
+                job.socket,
+                job.receiveBuffer,
+                ReceiveBufferSize,
+                job.sourceAddr,
+                bytes);
+
+            if (result != Result_Success) {
+                break;
+            }
+            handleSweepReply(hnd, job, bytes, timer_queryCounts());
+        }
+        TRACE_END("sweep receive batch");
+
+        // finished once every target has been sent and the last request has timed out
+        if (job.nextTarget == job.numTargets
+            && timer_queryMillisSince(job.lastSendTime) >= job.timeoutMS)
+        {
+            status = Sequence_Finished;
+        }
+
+        if (status > Sequence_Running) {
+            releaseSocket(job.id, job.socket, false);
+        }
+    }
+
+    job.status.store(status, std::memory_order_release);
+    return status;
+}
+
+
+void
+abortSweep(
+    SweepHnd hnd)
+{
+    SweepJob* pJob = sweeps[hnd];
+    if (!pJob) {
+        return;
+    }
+    SweepJob& job = *pJob;
+
+    SequenceStatus status = (SequenceStatus)job.status.load(std::memory_order_relaxed);
+    if (status == Sequence_Running) {
+        releaseSocket(job.id, job.socket, true);
+    }
+    if (status <= Sequence_Running) {
+        job.status.store(Sequence_Error, std::memory_order_release);
+    }
+}
+
+
+Sweep
+sweep(
+    const char* cidr,
+    u32 ratePPS,
+    u16 timeoutMS,
+    u16 dataSize,
+    u8  ttl)
+{
+    u32 firstAddress = 0;
+    u32 numAddresses = 0;
+
+    if (!ok(parseCIDR(cidr, firstAddress, numAddresses))) {
+        return Sweep{ null_h32, Sequence_Error, 0, 0 };
+    }
+
+    return addSweepJob(firstAddress, nullptr, numAddresses, ratePPS, timeoutMS, dataSize, ttl);
+}
+
+
+Sweep
+sweep(
+    const u32* addresses,
+    u32 numAddresses,
+    u32 ratePPS,
+    u16 timeoutMS,
+    u16 dataSize,
+    u8  ttl)
+{
+    if (!addresses) {
+        return Sweep{ null_h32, Sequence_Error, 0, 0 };
+    }
+
+    return addSweepJob(0, addresses, numAddresses, ratePPS, timeoutMS, dataSize, ttl);
+}
+
+
+u32
+pollSweepResults(
+    Sweep& sweep,
+    SweepResult* outResults,
+    u32 maxResults)
+{
+    u32 numResults = 0;
+
+    addMetric(metricIndex(polls));
+
+    if (sweep.hnd != null_h32)
+    {
+        SweepJob* job = sweeps[sweep.hnd];
+        if (job)
+        {
+            // load status before draining, so results pushed before the job finished are read
+            sweep.status = (SequenceStatus)job->status.load(std::memory_order_acquire);
+
+            if (outResults && maxResults > 0) {
+                numResults = sweepResults[sweep.hnd.index].try_pop_all(outResults, maxResults);
+            }
+
+            sweep.sent = job->sent.load(std::memory_order_relaxed);
+            sweep.responded = job->responded.load(std::memory_order_relaxed);
+
+            if (sweep.status == Sequence_Error
+                || (sweep.status == Sequence_Finished && sweepResults[sweep.hnd.index].empty()))
+            {
+                TRACE_INSTANT("sweep polled", sweep.hnd.value, sweep.status);
+                freeSweepJob(sweep.hnd, *job);
+                sweep.hnd = null_h32;
+            }
+        }
+        else {
+            sweep.status = Sequence_Error;
+            sweep.hnd = null_h32;
+        }
+    }
+
+    return numResults;
+}
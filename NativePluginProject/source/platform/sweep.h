@@ -0,0 +1,136 @@
+#ifndef _SWEEP_H
+#define _SWEEP_H
+
+#include "ping.h"
+
+#define MaxSweepTargets     (1U << 24)  // a /8, or an address list of the same length
+#define MaxSweepResults     2048        // responders buffered per sweep between polls
+#define SweepJobTypeId      1
+#define DefaultSweepRatePPS 5000
+#define SweepSendBatch      256         // max requests sent per job thread iteration
+#define SweepReceiveBatch   256         // max replies read per job thread iteration
+#define SweepMinDataSize    12          // target index and send timestamp are echoed in the data
+
+typedef h32 SweepHnd;
+
+/**
+ * A responding target. Targets that never reply are not reported.
+ */
+struct SweepResult {
+    u32         address;    // IPv4 address in network byte order
+    r32         elapsedMS;
+    u8          ttl;        // TTL of the reply
+
+    u8          _pad[3];
+};
+
+/**
+ * Sweep jobs send a single echo request to every address in a CIDR range or address list at a
+ * paced rate, through one socket. Replies are matched statelessly from the target index and send
+ * time echoed back in the request data, so the only per-target state is one bit to drop duplicate
+ * replies.
+ */
+struct SweepJob {
+    atomic_u32  status;     // SequenceStatus
+    atomic_u32  sent;
+    atomic_u32  responded;
+    atomic_u32  dropped;    // responders lost because the results queue was full
+
+    u32         firstAddress;   // first address of a CIDR range in host byte order
+    u32*        addresses;      // address list in network byte order, nullptr for a CIDR range
+    u32         numTargets;
+    u32         nextTarget;
+    u8*         replied;        // bitset of targets that have replied
+
+    i64         refillTime;
+    i64         lastSendTime;
+    r32         tokens;
+    u32         ratePPS;
+
+    u16         id;             // ICMP id of the sweep's requests
+    u16         dataSize;
+    u16         timeoutMS;
+    u8          ttl;
+
+    u8          _pad;
+
+    SOCKET      socket;
+    sockaddr_in sourceAddr;
+    u8          sendBuffer[MaxPacketSize];
+    u8          receiveBuffer[ReceiveBufferSize];
+};
+
+struct Sweep {
+    SweepHnd       hnd;
+    SequenceStatus status;
+    u32            sent;
+    u32            responded;
+};
+
+
+SparseHandleMap16_Typed_WithBuffer(
+    SweepJob,
+    SweepJobMap,
+    SweepHnd,
+    SweepJobTypeId,
+    MaxSweepJobs);
+
+ConcurrentQueue_Typed_WithBuffer(
+    SweepResult,
+    SweepResultQueue,
+    MaxSweepResults,
+    0);
+
+
+/**
+ * Adds a sweep job over a CIDR range and runs it on the job thread. This is a non-blocking call.
+ * The network and broadcast addresses are skipped for prefixes shorter than /31.
+ * @param cidr  range in "a.b.c.d/n" form, a bare dotted-quad address is treated as /32
+ * @param ratePPS  requests sent per second across the whole sweep
+ * @returns Sweep struct with a non-zero hnd on success, or 0 in hnd if the range can't be parsed,
+ *  or the sweep job map is full
+ */
+Sweep
+sweep(
+    const char* cidr,
+    u32 ratePPS   = DefaultSweepRatePPS,
+    u16 timeoutMS = DefaultTimeoutMS,
+    u16 dataSize  = DefaultDataSize,
+    u8  ttl       = DefaultTTL);
+
+/**
+ * Adds a sweep job over a list of addresses, the list is copied so it can be released after the
+ * call returns.
+ * @param addresses  IPv4 addresses in network byte order
+ */
+Sweep
+sweep(
+    const u32* addresses,
+    u32 numAddresses,
+    u32 ratePPS   = DefaultSweepRatePPS,
+    u16 timeoutMS = DefaultTimeoutMS,
+    u16 dataSize  = DefaultDataSize,
+    u8  ttl       = DefaultTTL);
+
+/**
+ * Copies responders found since the last poll into outResults and updates the sweep's status and
+ * counters. Once the sweep is finished (or errored) and all results have been read, the job is
+ * removed and sweep.hnd is cleared to zero.
+ * @returns number of results written to outResults
+ */
+u32
+pollSweepResults(
+    Sweep& sweep,
+    SweepResult* outResults,
+    u32 maxResults);
+
+
+SequenceStatus
+runSweep(
+    SweepHnd hnd);
+
+void
+abortSweep(
+    SweepHnd hnd);
+
+#endif
@@ -0,0 +1,411 @@
+#include "traceroute.h"
+#include "timer.h"
+
+static TracerouteJobMap traceroutes;
+
+
+static inline
+bool
+isRoundInProgress(
+    const TracerouteJob& job)
+{
+    return (job.nextHop < job.numHops || job.numWaiting > 0);
+}
+
+
+/**
+ * Copies the hop stats for polls. If a poll holds the lock the copy waits for the next iteration,
+ * unless wait is set for the final stats.
+ */
+static
+void
+publishHops(
+    TracerouteJob& job,
+    bool wait)
+{
+    if (wait) {
+        lock_spin(job.publishLock);
+    }
+    else if (job.publishLock.test_and_set(std::memory_order_acquire)) {
+        return;
+    }
+
+    memcpy(job.published, job.hops, job.numHops * sizeof(TracerouteHop));
+    job.numPublishedHops = job.numHops;
+    job.publishedRounds = job.round - (isRoundInProgress(job) ? 1 : 0);
+    job.dirty = 0;
+
+    unlock(job.publishLock);
+}
+
+
+/**
+ * Changes the path length. Hops past a shorter path are cleared and their waiting probes are
+ * dropped uncounted, they were answered by the destination or a router that can't reach it.
+ */
+static
+void
+setPathLength(
+    TracerouteJob& job,
+    u8 numHops)
+{
+    for (u32 h = numHops; h < job.numHops; ++h)
+    {
+        if (job.probes[h].sendTime != 0) {
+            --job.numWaiting;
+        }
+        memset(&job.probes[h], 0, sizeof(TracerouteProbe));
+        memset(&job.hops[h], 0, sizeof(TracerouteHop));
+    }
+
+    job.numHops = numHops;
+    job.nextHop = min(job.nextHop, numHops);
+    job.dirty = 1;
+}
+
+
+static inline
+void
+updateLoss(
+    TracerouteHop& hop)
+{
+    u32 resolved = hop.stats.received + hop.stats.lost;
+    hop.stats.pctLost = (resolved > 0 ? (r32)hop.stats.lost / (r32)resolved : 0.f);
+}
+
+
+/**
+ * Matches a reply or Time Exceeded message to the probe it answers, by the seq quoted or echoed,
+ * and adds its round trip to the hop.
+ */
+static
+void
+handleTracerouteReply(
+    TracerouteJob& job,
+    u32 bytes,
+    i64 replyTime)
+{
+    const ICMPHeader* request = getEchoRequestHeader(job.receiveBuffer, bytes);
+    if (!request || request->id != job.id) {
+        addMetric(metricIndex(repliesIgnored));
+        return;
+    }
+
+    const IPHeader& ip = *(const IPHeader*)job.receiveBuffer;
+    const ICMPHeader& message =
+        *(const ICMPHeader*)(job.receiveBuffer + ip.headerLen * sizeof(u32));
+    u32 source = job.sourceAddr.sin_addr.s_addr;
+    bool fromDestination = (message.type == ICMPType_EchoReply);
+
+    u16 seq = ntohs(request->seq);
+    u32 h = seq % MaxTracerouteHops;
+    TracerouteProbe& probe = job.probes[h];
+
+    // late replies to an earlier round, and echo replies from anywhere but the destination
+    if (h >= job.numHops
+        || probe.sendTime == 0
+        || probe.seq != seq
+        || (fromDestination && source != job.destAddr.sin_addr.s_addr))
+    {
+        addMetric(metricIndex(repliesIgnored));
+        return;
+    }
+
+    r32 elapsedMS = (r32)timer_millisBetween(probe.sendTime, replyTime);
+    probe.sendTime = 0;
+    probe.lastType = message.type;
+    --job.numWaiting;
+
+    TracerouteHop& hop = job.hops[h];
+    if (hop.address != 0 && hop.address != source && hop.changes < 255) {
+        ++hop.changes;
+    }
+    hop.address = source;
+    hop.reached = (fromDestination ? 1 : 0);
+    hop.lastRoundTrip = elapsedMS;
+
+    ++hop.stats.received;
+    addRoundTrip(hop.stats, probe.rttMean, probe.rttM2, elapsedMS);
+    updateLoss(hop);
+    job.dirty = 1;
+
+    // the destination, or a router that can't forward to it, is the end of the path
+    if (message.type != ICMPType_TimeExceeded && h + 1 < job.numHops) {
+        setPathLength(job, (u8)(h + 1));
+    }
+}
+
+
+SequenceStatus
+runTraceroute(
+    TracerouteHnd hnd)
+{
+    TracerouteJob* pJob = traceroutes[hnd];
+    if (!pJob) {
+        return Sequence_Error;
+    }
+    TracerouteJob& job = *pJob;
+
+    SequenceStatus status = (SequenceStatus)job.status.load(std::memory_order_relaxed);
+    bool stop = (job.stopRequested.load(std::memory_order_acquire) != 0);
+
+    if (status == Sequence_Inactive)
+    {
+        if (stop) {
+            status = Sequence_Finished;
+        }
+        else if (ok(resolveHost(job.host, job.destAddr))
+                 && ok(acquireSocket(DefaultTTL, job.id, job.socket)))
+        {
+            status = Sequence_Running;
+        }
+        else {
+            status = Sequence_Error;
+        }
+    }
+    else if (status == Sequence_Running && stop) {
+        releaseSocket(job.id, job.socket, false);
+        status = Sequence_Finished;
+    }
+
+    if (status == Sequence_Running)
+    {
+        i64 now = timer_queryCounts();
+        u16 packetSize = min((u16)(sizeof(ICMPHeader) + job.dataSize), (u16)MaxPacketSize);
+
+        if (!isRoundInProgress(job))
+        {
+            // a path whose last hop is a router may have grown, probe it to the end again
+            if (job.round > 0
+                && job.numHops < job.maxHops
+                && job.probes[job.numHops - 1].lastType == ICMPType_TimeExceeded)
+            {
+                setPathLength(job, job.maxHops);
+            }
+
+            if (job.numRounds > 0 && job.round == job.numRounds) {
+                status = Sequence_Finished;
+            }
+            else if (job.round == 0
+                     || timer_millisBetween(job.roundStartTime, now) >= job.intervalMS)
+            {
+                job.roundStartTime = now;
+                job.nextHop = 0;
+                ++job.round;
+                TRACE_INSTANT("traceroute round", hnd.value, job.round);
+            }
+        }
+
+        // send the round's probes for every TTL at once, a full socket buffer continues them on
+        // the next iteration
+        while (status == Sequence_Running && job.nextHop < job.numHops)
+        {
+            u32 h = job.nextHop;
+            u16 seq = (u16)(job.round * MaxTracerouteHops + h);
+            ICMPHeader requestHdr;
+            makePingPacket(job.sendBuffer, packetSize, job.id, seq, requestHdr);
+
+            i64 sendTime = timer_queryCounts();
+            s32 result = transportSend(
+                job.socket,
+                job.destAddr,
+                job.sendBuffer,
+                packetSize,
+                (u8)(h + 1),
+                job.tos);
+
+            if (result == Result_Pending) {
+                break;
+            }
+            if (result == Result_Error) {
+                status = Sequence_Error;
+                break;
+            }
+
+            TracerouteProbe& probe = job.probes[h];
+            probe.sendTime = sendTime;
+            probe.seq = seq;
+            job.hops[h].ttl = (u8)(h + 1);
+            ++job.hops[h].stats.sent;
+            ++job.numWaiting;
+            ++job.nextHop;
+            job.dirty = 1;
+        }
+
+        for (u32 r = 0;
+             r < TracerouteReceiveBatch && status == Sequence_Running && job.numWaiting > 0;
+             ++r)
+        {
+            u32 bytes;
+            s32 result = transportReceive(
+                job.socket,
+                job.receiveBuffer,
+                ReceiveBufferSize,
+                job.sourceAddr,
+                bytes);
+
+            if (result != Result_Success) {
+                break;
+            }
+            handleTracerouteReply(job, bytes, timer_queryCounts());
+        }
+
+        now = timer_queryCounts();
+        for (u32 h = 0; h < job.numHops; ++h)
+        {
+            TracerouteProbe& probe = job.probes[h];
+            if (probe.sendTime != 0 && timer_millisBetween(probe.sendTime, now) >= job.timeoutMS)
+            {
+                probe.sendTime = 0;
+                --job.numWaiting;
+                ++job.hops[h].stats.lost;
+                updateLoss(job.hops[h]);
+                job.dirty = 1;
+                addMetric(metricIndex(requestsTimedOut));
+            }
+        }
+
+        if (status > Sequence_Running) {
+            releaseSocket(job.id, job.socket, (status == Sequence_Error));
+        }
+        else if (job.dirty) {
+            publishHops(job, false);
+        }
+    }
+
+    if (status > Sequence_Running) {
+        publishHops(job, true);
+    }
+
+    job.status.store(status, std::memory_order_release);
+    return status;
+}
+
+
+void
+abortTraceroute(
+    TracerouteHnd hnd)
+{
+    TracerouteJob* pJob = traceroutes[hnd];
+    if (!pJob) {
+        return;
+    }
+    TracerouteJob& job = *pJob;
+
+    SequenceStatus status = (SequenceStatus)job.status.load(std::memory_order_relaxed);
+    if (status == Sequence_Running) {
+        releaseSocket(job.id, job.socket, true);
+    }
+    if (status <= Sequence_Running) {
+        job.status.store(Sequence_Error, std::memory_order_release);
+    }
+}
+
+
+Traceroute
+traceroute(
+    const char* host,
+    u8  maxHops,
+    u32 numRounds,
+    u16 intervalMS,
+    u16 timeoutMS,
+    u16 dataSize,
+    u8  dscp)
+{
+    Traceroute t{ null_h32, Sequence_Inactive, 0, 0 };
+
+    if (!host || maxHops == 0) {
+        t.status = Sequence_Error;
+        return t;
+    }
+
+    TracerouteJob* pJob = nullptr;
+    t.hnd = traceroutes.insert(nullptr, &pJob);
+
+    if (t.hnd != null_h32)
+    {
+        TracerouteJob& job = *pJob;
+
+        size_t hostLen = strlen(host);
+        job.host = (char*)malloc(hostLen+1);
+        memcpy(job.host, host, hostLen+1);
+
+        job.maxHops = min(maxHops, (u8)MaxTracerouteHops);
+        job.numHops = job.maxHops;
+        job.nextHop = job.numHops;  // no round in progress
+        job.numRounds = numRounds;
+        job.intervalMS = intervalMS;
+        job.timeoutMS = (timeoutMS > 0 ? timeoutMS : (u16)DefaultTimeoutMS);
+        job.dataSize = dataSize;
+        job.tos = (u8)(min(dscp, (u8)MaxDscp) << 2);
+        // ids following the sweep jobs' ids keep traceroute replies out of the other jobs
+        job.id = htons((u16)(getIcmpIdBase() + MaxPingJobs + MaxSweepJobs + t.hnd.index));
+
+        jobQueue.push(t.hnd);
+        addMetric(metricIndex(jobsQueued));
+        TRACE_INSTANT("traceroute submitted", t.hnd.value, job.maxHops);
+
+        startPingJobThread();
+    }
+
+    return t;
+}
+
+
+u32
+pollTracerouteResult(
+    Traceroute& traceroute,
+    TracerouteHop* outHops,
+    u32 maxHops)
+{
+    u32 numHops = 0;
+
+    addMetric(metricIndex(polls));
+
+    if (traceroute.hnd != null_h32)
+    {
+        TracerouteJob* job = traceroutes[traceroute.hnd];
+        if (job)
+        {
+            // load status before copying, so the stats published as the job finished are read
+            traceroute.status = (SequenceStatus)job->status.load(std::memory_order_acquire);
+
+            lock_spin(job->publishLock);
+            traceroute.rounds = job->publishedRounds;
+            traceroute.numHops = job->numPublishedHops;
+            if (outHops) {
+                numHops = min(traceroute.numHops, maxHops);
+                memcpy(outHops, job->published, numHops * sizeof(TracerouteHop));
+            }
+            unlock(job->publishLock);
+
+            if (traceroute.status > Sequence_Running)
+            {
+                TRACE_INSTANT("traceroute polled", traceroute.hnd.value, traceroute.status);
+                free(job->host);
+                traceroutes.erase(traceroute.hnd);
+                traceroute.hnd = null_h32;
+            }
+        }
+        else {
+            traceroute.status = Sequence_Error;
+            traceroute.hnd = null_h32;
+        }
+    }
+
+    return numHops;
+}
+
+
+void
+stopTraceroute(
+    Traceroute& traceroute)
+{
+    if (traceroute.hnd != null_h32)
+    {
+        TracerouteJob* job = traceroutes[traceroute.hnd];
+        if (job) {
+            job->stopRequested.store(1, std::memory_order_release);
+        }
+    }
+}
@@ -0,0 +1,160 @@
+#ifndef _TRACEROUTE_H
+#define _TRACEROUTE_H
+
+#include "ping.h"
+
+#define MaxTracerouteHops       32      // power of 2, TTLs 1 to this many can be probed
+#define DefaultTracerouteHops   30
+#define DefaultTracerouteIntervalMS 1000
+#define TracerouteJobTypeId     4
+#define TracerouteReceiveBatch  (MaxTracerouteHops * 2) // max replies read per job thread iteration
+
+typedef h32 TracerouteHnd;
+
+/**
+ * Replies and losses at one TTL of the path. A probe counts as lost once it has waited timeoutMS
+ * for a reply, probes still waiting aren't counted.
+ */
+struct TracerouteHop {
+    u32         address;        // last responder at this TTL in network byte order, 0 if none yet
+    r32         lastRoundTrip;  // round trip of the last reply
+    PingStats   stats;
+    u8          ttl;
+    u8          reached;        // the responder is the destination
+    u8          changes;        // times the responder has changed, saturates at 255
+
+    u8          _pad;
+};
+
+/**
+ * Probe sent at one TTL in the current round, job thread only.
+ */
+struct TracerouteProbe {
+    i64         sendTime;       // 0 while no probe is waiting for a reply
+    u16         seq;
+    u8          lastType;       // ICMPType of the last reply at this TTL
+
+    u8          _pad[5];
+
+    r64         rttMean;        // running round trip mean and sum of squared deviations (Welford)
+    r64         rttM2;
+};
+
+/**
+ * Traceroute jobs map the path to a host mtr style. Each round sends an echo request at every TTL
+ * from 1 to the path length at once, rather than hop by hop, so a round takes one round trip to
+ * the farthest hop and not one timeout per silent hop. Routers answer with Time Exceeded, which
+ * quotes the request's id and seq, and the destination with an echo reply. The path length starts
+ * at maxHops and shrinks to the lowest TTL the destination answers at. Rounds repeat every
+ * intervalMS, and each hop keeps its round trip and loss stats across rounds, so the hop where
+ * latency or loss is added shows up while the job runs.
+ *
+ * The job thread keeps the hop stats in hops and copies them to published when they change, if no
+ * poll holds publishLock at the time. The job thread only waits for a poll to copy the final
+ * stats.
+ */
+struct TracerouteJob {
+    atomic_u32  status;         // SequenceStatus
+    atomic_u32  stopRequested;
+    atomic_lock publishLock;
+
+    char*       host;
+    u16         id;             // ICMP id of the traceroute's requests, network byte order
+    u16         dataSize;
+    u16         timeoutMS;
+    u16         intervalMS;
+    u32         numRounds;      // 0 runs until stopTraceroute
+    u32         round;          // rounds started
+    u8          maxHops;
+    u8          numHops;        // path length probed each round
+    u8          nextHop;        // next TTL - 1 to send in the current round
+    u8          numWaiting;     // probes of the current round waiting for a reply
+    u8          tos;
+    u8          dirty;          // hops has changed since it was last published
+
+    u8          _pad[2];
+
+    i64         roundStartTime;
+
+    u32         publishedRounds;
+    u32         numPublishedHops;
+    TracerouteHop published[MaxTracerouteHops];
+
+    TracerouteProbe probes[MaxTracerouteHops];
+    TracerouteHop   hops[MaxTracerouteHops];
+
+    SOCKET      socket;
+    sockaddr_in destAddr;
+    sockaddr_in sourceAddr;
+    u8          sendBuffer[MaxPacketSize];
+    u8          receiveBuffer[ReceiveBufferSize];
+};
+
+struct Traceroute {
+    TracerouteHnd  hnd;
+    SequenceStatus status;
+    u32            rounds;      // rounds completed
+    u32            numHops;     // path length, TTLs past the destination aren't reported
+};
+
+
+SparseHandleMap16_Typed_WithBuffer(
+    TracerouteJob,
+    TracerouteJobMap,
+    TracerouteHnd,
+    TracerouteJobTypeId,
+    MaxTracerouteJobs);
+
+
+/**
+ * Adds a traceroute job and runs it on the job thread. This is a non-blocking call.
+ * @param host  host name or dotted-quad IP of the destination
+ * @param maxHops  highest TTL probed, at most MaxTracerouteHops
+ * @param numRounds  rounds of probes to send, 0 to keep probing until stopTraceroute
+ * @param intervalMS  time from the start of one round to the next, a round also waits for its
+ *  last probe to be answered or time out
+ * @param dscp  DiffServ code point to mark the probes with, as for ping
+ * @returns Traceroute struct with a non-zero hnd on success, or 0 in hnd if the traceroute job
+ *  map is full
+ */
+Traceroute
+traceroute(
+    const char* host,
+    u8  maxHops    = DefaultTracerouteHops,
+    u32 numRounds  = 0,
+    u16 intervalMS = DefaultTracerouteIntervalMS,
+    u16 timeoutMS  = DefaultTimeoutMS,
+    u16 dataSize   = DefaultDataSize,
+    u8  dscp       = 0);
+
+/**
+ * Copies the latest stats of up to maxHops hops, from TTL 1, into outHops and updates the
+ * traceroute's status and counters. Stats are cumulative, each poll returns the whole path. Once
+ * the traceroute is finished (or errored) the final stats are copied, the job is removed and
+ * traceroute.hnd is cleared to zero.
+ * @returns number of hops written to outHops
+ */
+u32
+pollTracerouteResult(
+    Traceroute& traceroute,
+    TracerouteHop* outHops,
+    u32 maxHops);
+
+/**
+ * Ends a traceroute started with any number of rounds, the job thread finishes it on its next
+ * step. Poll it to read the final stats and remove the job.
+ */
+void
+stopTraceroute(
+    Traceroute& traceroute);
+
+
+SequenceStatus
+runTraceroute(
+    TracerouteHnd hnd);
+
+void
+abortTraceroute(
+    TracerouteHnd hnd);
+
+#endif
@@ -0,0 +1,250 @@
+// Reader for the binary probe log written by probeLogOpen. Maps each segment file read only and
+// scans its records, then prints per target counts, loss and round trip stats, or with --csv
+// prints every record as a line of CSV instead. The scan rate goes to stderr.
+//
+// usage: probe_log_reader [--csv] segment.plog...
+// Segments are read in the order given, a segment still being written is read up to its count.
+
+#include "build_config.h"
+#include "platform/platform.h"
+#include "platform/ping.h"
+#include "platform/ping_probelog.h"
+#include "platform/timer.h"
+#include <cstdio>
+
+#include "platform/platform.cpp"
+#include "platform/timer.cpp"
+
+#define MaxReaderTargets    (1 << 16)   // power of 2, targets past this are pooled in one row
+
+static const char* StatusNames[] = {
+    "inactive", "requested", "waiting", "received", "timeout", "error"
+};
+static const char* KindNames[] = { "ping", "sweep" };
+
+struct TargetStats {
+    u32     target;
+    u32     used;
+    u64     probes;
+    u64     received;
+    u64     timedOut;
+    u64     errors;
+    r64     sumRoundTrip;
+    r32     minRoundTrip;
+    r32     maxRoundTrip;
+};
+
+static TargetStats targets[MaxReaderTargets];
+static TargetStats otherTargets;
+static u32 numTargets = 0;
+
+
+static inline
+TargetStats&
+getTargetStats(
+    u32 target)
+{
+    u32 i = (target * 2654435761U) & (MaxReaderTargets - 1);
+    for (u32 probe = 0; probe < MaxReaderTargets; ++probe)
+    {
+        TargetStats& t = targets[i];
+        if (t.used && t.target == target) {
+            return t;
+        }
+        if (!t.used) {
+            // leave one slot in eight empty so lookups stay short
+            if (numTargets >= MaxReaderTargets - MaxReaderTargets / 8) {
+                break;
+            }
+            t.used = 1;
+            t.target = target;
+            t.minRoundTrip = 1.0e30f;
+            ++numTargets;
+            return t;
+        }
+        i = (i + 1) & (MaxReaderTargets - 1);
+    }
+    return otherTargets;
+}
+
+
+static inline
+void
+addRecord(
+    const ProbeRecord& record)
+{
+    TargetStats& t = getTargetStats(record.target);
+    ++t.probes;
+    if (record.status == Ping_Received) {
+        ++t.received;
+        t.sumRoundTrip += record.rttMS;
+        t.minRoundTrip = min(t.minRoundTrip, record.rttMS);
+        t.maxRoundTrip = max(t.maxRoundTrip, record.rttMS);
+    }
+    else if (record.status == Ping_TimedOut) {
+        ++t.timedOut;
+    }
+    else {
+        ++t.errors;
+    }
+}
+
+
+static
+void
+printRecord(
+    const ProbeRecord& record)
+{
+    const u8* b = (const u8*)&record.target;
+    printf("%llu,%u.%u.%u.%u,%s,%u,%u,%s,%u,%.3f\n",
+           (unsigned long long)record.timeMicros,
+           b[0], b[1], b[2], b[3],
+           (record.kind < countof(KindNames) ? KindNames[record.kind] : "?"),
+           record.id,
+           record.seq,
+           (record.status < countof(StatusNames) ? StatusNames[record.status] : "?"),
+           record.ttl,
+           record.rttMS);
+}
+
+
+static
+void
+printTarget(
+    const char* name,
+    const TargetStats& t)
+{
+    r64 loss = (t.probes > 0 ? 100.0 * (r64)(t.probes - t.received) / (r64)t.probes : 0.0);
+    if (t.received > 0) {
+        printf("%-15s %10llu %10llu %8llu %8llu %7.2f%% %9.3f %9.3f %9.3f\n",
+               name,
+               (unsigned long long)t.probes,
+               (unsigned long long)t.received,
+               (unsigned long long)t.timedOut,
+               (unsigned long long)t.errors,
+               loss,
+               t.minRoundTrip,
+               t.sumRoundTrip / (r64)t.received,
+               t.maxRoundTrip);
+    }
+    else {
+        printf("%-15s %10llu %10llu %8llu %8llu %7.2f%% %9s %9s %9s\n",
+               name,
+               (unsigned long long)t.probes,
+               (unsigned long long)t.received,
+               (unsigned long long)t.timedOut,
+               (unsigned long long)t.errors,
+               loss,
+               "-", "-", "-");
+    }
+}
+
+
+int main(int argc, char *argv[])
+{
+    initHighPerfTimer();
+
+    bool csv = false;
+    int firstFile = 1;
+    if (argc > 1 && strcmp(argv[1], "--csv") == 0) {
+        csv = true;
+        firstFile = 2;
+    }
+    if (firstFile >= argc) {
+        fprintf(stderr, "usage: probe_log_reader [--csv] segment.plog...\n");
+        return 1;
+    }
+
+    if (csv) {
+        printf("time_us,target,kind,id,seq,status,ttl,rtt_ms\n");
+    }
+
+    u64 totalRecords = 0;
+    u64 dropped = 0;
+    u64 firstMicros = ~0ULL;
+    u64 lastMicros = 0;
+    u32 numFiles = 0;
+    i64 start = timer_queryCounts();
+
+    for (int f = firstFile; f < argc; ++f)
+    {
+        PlatformMappedFile file;
+        if (platformMapFile(argv[f], 0, false, file) != 0) {
+            fprintf(stderr, "Failed to map %s\n", argv[f]);
+            continue;
+        }
+
+        const ProbeLogHeader& header = *(const ProbeLogHeader*)file.data;
+        if (file.size < sizeof(ProbeLogHeader)
+            || header.magic != ProbeLogMagic
+            || header.version != ProbeLogVersion
+            || header.recordSize != sizeof(ProbeRecord))
+        {
+            fprintf(stderr, "%s is not a version %u probe log segment\n", argv[f], ProbeLogVersion);
+            platformUnmapFile(file, file.size);
+            continue;
+        }
+
+        // a live segment is mapped at full size, only count records have been written
+        u64 count = min(header.count, (file.size - sizeof(ProbeLogHeader)) / sizeof(ProbeRecord));
+        const ProbeRecord* records = (const ProbeRecord*)(file.data + sizeof(ProbeLogHeader));
+
+        if (csv) {
+            for (u64 r = 0; r < count; ++r) {
+                printRecord(records[r]);
+            }
+        }
+        else {
+            for (u64 r = 0; r < count; ++r) {
+                addRecord(records[r]);
+            }
+        }
+
+        if (count > 0) {
+            firstMicros = min(firstMicros, records[0].timeMicros);
+            lastMicros = max(lastMicros, records[count - 1].timeMicros);
+        }
+        dropped = max(dropped, header.dropped);
+        totalRecords += count;
+        ++numFiles;
+
+        platformUnmapFile(file, file.size);
+    }
+
+    r64 scanSeconds = timer_querySecondsSince(start);
+
+    if (!csv)
+    {
+        printf("%-15s %10s %10s %8s %8s %8s %9s %9s %9s\n",
+               "target", "probes", "received", "timeout", "error", "loss", "min ms", "avg ms",
+               "max ms");
+
+        char name[16];
+        for (u32 i = 0; i < MaxReaderTargets; ++i)
+        {
+            const TargetStats& t = targets[i];
+            if (!t.used) {
+                continue;
+            }
+            const u8* b = (const u8*)&t.target;
+            snprintf(name, sizeof(name), "%u.%u.%u.%u", b[0], b[1], b[2], b[3]);
+            printTarget(name, t);
+        }
+        if (otherTargets.probes > 0) {
+            printTarget("(other)", otherTargets);
+        }
+
+        printf("\n%llu records in %u segments, %llu dropped by the writer, %.3f seconds of probes\n",
+               (unsigned long long)totalRecords,
+               numFiles,
+               (unsigned long long)dropped,
+               (lastMicros > firstMicros ? (r64)(lastMicros - firstMicros) * 1.0e-6 : 0.0));
+    }
+
+    fprintf(stderr, "scanned %llu records in %.3fs, %.1f million records/sec\n",
+            (unsigned long long)totalRecords,
+            scanSeconds,
+            (scanSeconds > 0.0 ? (r64)totalRecords / scanSeconds * 1.0e-6 : 0.0));
+
+    return 0;
+}
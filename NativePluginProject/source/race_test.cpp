@@ -0,0 +1,112 @@
+// Checks when races settle, against the in-process network simulator. A race may only settle
+// before its sequences run out once a candidate has been ruled out of the top k. When k covers
+// every candidate, or failures leave k or fewer, the remaining candidates have to finish their
+// samples and be ranked by them. Needs no root or network access.
+//
+// usage: race_test
+// Prints one line per case and exits with 1 if any case fails.
+
+#define PacerRatePPS        1000000.0f  // the cases are timed by the simulated round trips
+#define DefaultLogLevel     LogLevel_Error
+
+#include "build_config.h"
+#include "platform/platform.h"
+#include "platform/ping.h"
+#include "platform/race.h"
+#include "platform/ping_sim.h"
+#include <cstdio>
+
+#include "platform/platform.cpp"
+#include "platform/timer.cpp"
+#include "platform/ping.cpp"
+
+#define TestRequests    8
+#define TestTimeoutMS   500
+#define TestSeed        0x7ACEULL
+
+struct RaceCase {
+    const char* name;
+    const char* hosts[4];       // the simulator can't resolve names, so they fail
+    u32         numHosts;
+    u32         k;
+    u32         expected[4];    // candidates in rank order
+    u32         numExpected;
+    bool        fullSamples;    // the ranked candidates ran every request
+};
+
+static const RaceCase Cases[] = {
+    { "k covers every host",
+      { "10.3.0.3", "10.3.0.1", "10.3.0.2" }, 3, 5, { 1, 2, 0 }, 3, true },
+    { "failures leave k",
+      { "10.3.0.2", "no.such.host", "10.3.0.1", "another.host" }, 4, 2, { 2, 0 }, 2, true },
+    { "failures leave fewer than k",
+      { "no.such.host", "10.3.0.3", "another.host" }, 3, 2, { 1 }, 1, true },
+    { "losers ruled out",
+      { "10.3.0.4", "10.3.0.1", "10.3.0.3", "10.3.0.2" }, 4, 1, { 1 }, 1, false },
+};
+
+// base round trip of 10.3.0.n
+static const r32 BaseMS[] = { 2.f, 4.f, 8.f, 60.f };
+
+
+static
+bool
+runCase(
+    const RaceCase& raceCase)
+{
+    Race r = race(raceCase.hosts, raceCase.numHosts, raceCase.k, TestRequests, TestTimeoutMS);
+
+    RaceResult results[MaxRaceCandidates];
+    while (!pollRaceResult(r, results, MaxRaceCandidates)) {
+        yieldThread();
+    }
+
+    printf("%s: status %d, %u results", raceCase.name, r.status, r.numResults);
+    for (u32 i = 0; i < r.numResults; ++i) {
+        printf(", %u (%u replies %.2f ms)", results[i].candidate, results[i].stats.received,
+               results[i].stats.avgRoundTrip);
+    }
+    printf("\n");
+
+    bool pass = (r.status == Sequence_Finished && r.numResults == raceCase.numExpected);
+    for (u32 i = 0; pass && i < r.numResults; ++i)
+    {
+        pass = (results[i].candidate == raceCase.expected[i]
+                && results[i].stats.received > 0
+                && (!raceCase.fullSamples || results[i].stats.received == TestRequests));
+    }
+
+    if (!pass) {
+        printf("  FAIL\n");
+    }
+    return pass;
+}
+
+
+int main()
+{
+    initHighPerfTimer();
+    setPingTransport(&simTransport);
+    simReset(TestSeed);
+
+    for (u32 d = 0; d < countof(BaseMS); ++d)
+    {
+        char host[16];
+        snprintf(host, sizeof(host), "10.3.0.%u", d + 1);
+
+        SimDestinationConfig config{};
+        inet_pton(AF_INET, host, &config.address);
+        config.distribution = SimLatency_Constant;
+        config.baseMS = BaseMS[d];
+        config.ttl = 64;
+        simConfigureDestination(config);
+    }
+
+    bool pass = true;
+    for (u32 c = 0; c < countof(Cases); ++c) {
+        pass &= runCase(Cases[c]);
+    }
+
+    printf("%s\n", (pass ? "PASS" : "FAIL"));
+    return (pass ? 0 : 1);
+}
@@ -0,0 +1,263 @@
+// Scheduler benchmark against the in-process network simulator, needs no root or network access.
+// Runs ping sequences to simulated destinations with known latency, loss, reordering and
+// duplication for a fixed time, then writes probe throughput and the error of the measured stats
+// against the simulator's ground truth as JSON. With a probe log path, every probe result is also
+// written to the probe log, for probe_log_reader.
+//
+// usage: sim_bench [seconds] [output.json] [probe log base path]
+
+#define MaxPingJobs     1024        // enough sequences in flight to load the job thread
+#define PacerRatePPS    1000000.0f  // pacing is measured separately, don't let it cap the rate
+#define DefaultLogLevel LogLevel_Warn // per packet lines would only measure the console
+
+#include "build_config.h"
+#include "platform/platform.h"
+#include "platform/ping.h"
+#include "platform/ping_sim.h"
+#include "platform/ping_probelog.h"
+#include <cstdio>
+
+#include "platform/platform.cpp"
+#include "platform/timer.cpp"
+#include "platform/ping.cpp"
+
+#define NumDestinations     256
+#define RequestsPerSequence MaxSequenceRequests
+#define BenchTimeoutMS      250
+#define BenchSeed           0x5EEDULL
+
+static const char* DistributionNames[] = { "constant", "uniform", "normal", "exponential" };
+
+
+/**
+ * Engine stats of all finished sequences to one destination, pooled.
+ */
+struct BenchDestination {
+    char    host[16];
+    u32     address;
+    u32     sent;
+    u32     received;
+    u32     errors;
+    u32     late;
+    u32     duplicates;
+    r64     sumRoundTrip;
+    r64     sumSqRoundTrip;
+};
+
+
+static
+void
+configureNetwork(
+    BenchDestination* dests)
+{
+    simReset(BenchSeed);
+
+    for (u32 d = 0; d < NumDestinations; ++d)
+    {
+        BenchDestination& dest = dests[d];
+        memset(&dest, 0, sizeof(dest));
+        snprintf(dest.host, sizeof(dest.host), "10.0.%u.%u", d / 250, 1 + d % 250);
+        dest.address = inet_addr(dest.host);
+
+        SimDestinationConfig config{};
+        config.address = dest.address;
+        config.distribution = (u8)(d % countof(DistributionNames));
+        config.baseMS = 1.0f + (r32)(d % 7);
+        config.spreadMS = 0.5f + (r32)(d % 3);
+        config.lossRate = 0.01f * (r32)(d % 5);
+        config.reorderRate = 0.02f;
+        config.reorderDelayMS = 2.0f;
+        config.duplicateRate = 0.02f;
+        config.ttl = 64;
+
+        simConfigureDestination(config);
+    }
+}
+
+
+static
+void
+addSequenceStats(
+    BenchDestination& dest,
+    const Ping& p,
+    const PingStatsEx& statsEx)
+{
+    if (p.status != Sequence_Finished) {
+        ++dest.errors;
+        return;
+    }
+
+    r64 n = (r64)p.stats.received;
+    r64 mean = p.stats.avgRoundTrip;
+    r64 sd = p.stats.stdDevRoundTrip;
+
+    dest.sent += p.stats.sent;
+    dest.received += p.stats.received;
+    dest.late += statsEx.late;
+    dest.duplicates += statsEx.duplicates;
+    dest.sumRoundTrip += n * mean;
+    dest.sumSqRoundTrip += n * (sd * sd + mean * mean);
+}
+
+
+int main(int argc, char *argv[])
+{
+    r64 durationS = (argc > 1 ? atof(argv[1]) : 5.0);
+    const char* outPath = (argc > 2 ? argv[2] : "sim_bench.json");
+    const char* probeLogPath = (argc > 3 ? argv[3] : nullptr);
+
+    initHighPerfTimer();
+    setPingTransport(&simTransport);
+
+    if (probeLogPath && probeLogOpen(probeLogPath, 0, 0) != Result_Success) {
+        fprintf(stderr, "Failed to open the probe log %s\n", probeLogPath);
+        return 1;
+    }
+
+    static BenchDestination dests[NumDestinations];
+    configureNetwork(dests);
+
+    static Ping pings[MaxPingJobs];
+    static u32 pingDest[MaxPingJobs];
+    u32 nextDest = 0;
+
+    i64 start = timer_queryCounts();
+    bool starting = true;
+
+    for (;;)
+    {
+        starting = starting && (timer_querySecondsSince(start) < durationS);
+        u32 active = 0;
+
+        for (u32 s = 0; s < MaxPingJobs; ++s)
+        {
+            Ping& p = pings[s];
+
+            if (p.hnd != null_h32) {
+                PingStatsEx statsEx{};
+                statsEx.size = sizeof(PingStatsEx);
+                if (!pollResult(p, &statsEx)) {
+                    ++active;
+                    continue;
+                }
+                addSequenceStats(dests[pingDest[s]], p, statsEx);
+            }
+
+            // keep every slot busy until the run time is up
+            if (starting)
+            {
+                pingDest[s] = nextDest;
+                nextDest = (nextDest + 1) % NumDestinations;
+
+                p = ping(dests[pingDest[s]].host, RequestsPerSequence, DefaultDataSize, DefaultTTL,
+                         BenchTimeoutMS, 0);
+                if (p.hnd != null_h32) {
+                    ++active;
+                }
+            }
+        }
+
+        if (!starting && active == 0) {
+            break;
+        }
+        yieldThread();
+    }
+
+    r64 elapsedS = timer_querySecondsSince(start);
+
+    ProbeLogStats probeLog{};
+    if (probeLogPath) {
+        probeLogClose();
+        probeLog = probeLogGetStats();
+    }
+
+    // compare the measured stats with ground truth, per destination and per distribution
+    u64 totalSent = 0;
+    u64 totalReceived = 0;
+    u32 totalErrors = 0;
+    u64 totalLate = 0;
+    u64 totalDuplicates = 0;
+    u64 truthDuplicated = 0;
+    r64 sumAbsMeanError[countof(DistributionNames)] = {};
+    r64 maxAbsMeanError[countof(DistributionNames)] = {};
+    r64 sumAbsLossError[countof(DistributionNames)] = {};
+    r64 sumAbsStdDevError[countof(DistributionNames)] = {};
+    u32 numDists[countof(DistributionNames)] = {};
+
+    for (u32 d = 0; d < NumDestinations; ++d)
+    {
+        BenchDestination& dest = dests[d];
+        totalSent += dest.sent;
+        totalReceived += dest.received;
+        totalErrors += dest.errors;
+        totalLate += dest.late;
+        totalDuplicates += dest.duplicates;
+
+        SimDestinationStats truth{};
+        if (!simGetStats(dest.address, truth) || dest.received == 0) {
+            continue;
+        }
+        truthDuplicated += truth.duplicated;
+
+        u32 truthReplies = truth.requests - truth.lost;
+        r64 truthMean = (truthReplies > 0 ? truth.sumRoundTrip / truthReplies : 0.0);
+        r64 truthLoss = (truth.requests > 0 ? (r64)truth.lost / truth.requests : 0.0);
+        r64 measuredMean = dest.sumRoundTrip / dest.received;
+        r64 measuredLoss = 1.0 - (r64)dest.received / dest.sent;
+        r64 truthStdDev = sqrt(max(
+            truth.sumSqRoundTrip / max(truthReplies, 1U) - truthMean * truthMean, 0.0));
+        r64 measuredStdDev = sqrt(max(
+            dest.sumSqRoundTrip / dest.received - measuredMean * measuredMean, 0.0));
+
+        u32 dist = d % countof(DistributionNames);
+        r64 meanError = fabs(measuredMean - truthMean);
+        sumAbsMeanError[dist] += meanError;
+        maxAbsMeanError[dist] = max(maxAbsMeanError[dist], meanError);
+        sumAbsLossError[dist] += fabs(measuredLoss - truthLoss);
+        sumAbsStdDevError[dist] += fabs(measuredStdDev - truthStdDev);
+        ++numDists[dist];
+    }
+
+    FILE* out = fopen(outPath, "w");
+    if (!out) {
+        fprintf(stderr, "Failed to open %s\n", outPath);
+        return 1;
+    }
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"transport\": \"%s\",\n", simTransport.name);
+    fprintf(out, "  \"seconds\": %.3f,\n", elapsedS);
+    fprintf(out, "  \"maxJobs\": %u,\n", (u32)MaxPingJobs);
+    fprintf(out, "  \"destinations\": %u,\n", (u32)NumDestinations);
+    fprintf(out, "  \"sent\": %llu,\n", (unsigned long long)totalSent);
+    fprintf(out, "  \"received\": %llu,\n", (unsigned long long)totalReceived);
+    fprintf(out, "  \"sequenceErrors\": %u,\n", totalErrors);
+    fprintf(out, "  \"lateReplies\": %llu,\n", (unsigned long long)totalLate);
+    fprintf(out, "  \"duplicateReplies\": %llu,\n", (unsigned long long)totalDuplicates);
+    fprintf(out, "  \"duplicatesSent\": %llu,\n", (unsigned long long)truthDuplicated);
+    fprintf(out, "  \"probesPerSecond\": %.0f,\n", (r64)totalSent / elapsedS);
+    fprintf(out, "  \"probesLogged\": %llu,\n", (unsigned long long)probeLog.written);
+    fprintf(out, "  \"probesNotLogged\": %llu,\n", (unsigned long long)probeLog.dropped);
+    fprintf(out, "  \"distributions\": [\n");
+    for (u32 i = 0; i < countof(DistributionNames); ++i)
+    {
+        r64 n = max((r64)numDists[i], 1.0);
+        fprintf(out,
+            "    { \"name\": \"%s\", \"destinations\": %u, \"meanAbsRttErrorMS\": %.4f, "
+            "\"maxAbsRttErrorMS\": %.4f, \"meanAbsStdDevErrorMS\": %.4f, \"meanAbsLossError\": %.5f }%s\n",
+            DistributionNames[i],
+            numDists[i],
+            sumAbsMeanError[i] / n,
+            maxAbsMeanError[i],
+            sumAbsStdDevError[i] / n,
+            sumAbsLossError[i] / n,
+            (i + 1 < countof(DistributionNames) ? "," : ""));
+    }
+    fprintf(out, "  ]\n}\n");
+    fclose(out);
+
+    fprintf(stderr, "%.0f probes/sec over %.1fs, results in %s\n",
+            (r64)totalSent / elapsedS, elapsedS, outPath);
+
+    return 0;
+}
@@ -0,0 +1,111 @@
+// Stops the engine while a ping, a sweep and a race are part way through, against the in-process
+// network simulator. Each job has to end with Sequence_Error rather than being left running, and
+// a ping started after the stop has to run to the end on the new thread. Needs no root or
+// network access.
+//
+// usage: stop_test
+// Prints one line per job and exits with 1 if any check fails.
+
+#define PacerRatePPS        1000000.0f  // the jobs are timed by the simulated round trips
+#define DefaultLogLevel     LogLevel_Error
+
+#include "build_config.h"
+#include "platform/platform.h"
+#include "platform/ping.h"
+#include "platform/sweep.h"
+#include "platform/race.h"
+#include "platform/ping_sim.h"
+#include <cstdio>
+
+#include "platform/platform.cpp"
+#include "platform/timer.cpp"
+#include "platform/ping.cpp"
+
+#define TestRequests    20
+#define TestRoundTripMS 50.f
+#define TestRunMS       200
+#define TestPollMS      1000    // a job still running this long after the stop was abandoned
+#define TestSeed        0x570FULL
+
+static const char* const RaceHosts[] = { "10.4.0.1", "10.4.0.2" };
+
+
+static
+bool
+check(
+    const char* name,
+    SequenceStatus status,
+    SequenceStatus expected)
+{
+    bool pass = (status == expected);
+    printf("%s: status %d%s\n", name, status, (pass ? "" : "  FAIL"));
+    return pass;
+}
+
+
+static
+bool
+pollUntil(
+    i64 start,
+    bool done)
+{
+    return (done || timer_queryMillisSince(start) >= TestPollMS);
+}
+
+
+int main()
+{
+    initHighPerfTimer();
+    setPingTransport(&simTransport);
+    simReset(TestSeed);
+
+    for (u32 d = 0; d < countof(RaceHosts); ++d)
+    {
+        SimDestinationConfig config{};
+        inet_pton(AF_INET, RaceHosts[d], &config.address);
+        config.distribution = SimLatency_Constant;
+        config.baseMS = TestRoundTripMS;
+        config.ttl = 64;
+        simConfigureDestination(config);
+    }
+
+    Ping p = ping(RaceHosts[0], TestRequests, DefaultDataSize, DefaultTTL, 1000);
+    Sweep s = sweep("10.4.1.0/24", 100, 1000);
+    Race r = race(RaceHosts, countof(RaceHosts), 1, TestRequests, 1000);
+
+    platformSleep(TestRunMS);
+    stopPingEngine();
+
+    bool pass = true;
+    i64 start = timer_queryCounts();
+
+    while (!pollUntil(start, pollResult(p))) {
+        yieldThread();
+    }
+    pass &= check("ping", p.status, Sequence_Error);
+
+    SweepResult sweepResults[16];
+    while (!pollUntil(start, s.status > Sequence_Running)) {
+        pollSweepResults(s, sweepResults, countof(sweepResults));
+        yieldThread();
+    }
+    pass &= check("sweep", s.status, Sequence_Error);
+
+    RaceResult raceResults[2];
+    while (!pollUntil(start, pollRaceResult(r, raceResults, countof(raceResults)))) {
+        yieldThread();
+    }
+    pass &= check("race", r.status, Sequence_Error);
+
+    // the next job starts a new thread, and the slots of the stopped jobs are free again
+    Ping after = ping(RaceHosts[1], 2, DefaultDataSize, DefaultTTL, 1000);
+    start = timer_queryCounts();
+    while (!pollUntil(start, pollResult(after))) {
+        yieldThread();
+    }
+    pass &= check("ping after stop", after.status, Sequence_Finished);
+    stopPingEngine();
+
+    printf("%s\n", (pass ? "PASS" : "FAIL"));
+    return (pass ? 0 : 1);
+}
@@ -38,6 +38,8 @@ int main(int argc, char *argv[])
         }
     }
 
+    stopPingEngine();
+    logFlush();
     platformPause();
 
     return 0;
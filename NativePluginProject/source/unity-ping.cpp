@@ -1,12 +1,29 @@
+#define DefaultLogLevel LogLevel_Off   // silent until the game asks for logs with SetPingLogLevel
+
 #include "build_config.h"
 #include "platform/platform.h"
 #include "platform/ping.h"
+#include "platform/sweep.h"
+#include "platform/race.h"
+#include "platform/traceroute.h"
+#include "platform/pmtu.h"
+#include "platform/bandwidth.h"
+#include "platform/ping_metrics.h"
+#include "platform/ping_trace.h"
+#include "platform/ping_log.h"
+#include "platform/ping_probelog.h"
+#include "platform/ping_cache.h"
+#include "platform/ping_rolling.h"
+#include "platform/ping_anomaly.h"
 #include "unity/IUnityInterface.h"
 
 #include "platform/platform.cpp"
 #include "platform/timer.cpp"
 #include "platform/ping.cpp"
 
+// the job thread parks while idle, so the first ping of a session doesn't wait for a new thread
+static PingEngineConfig engineConfig{ 0, PingIdle_Park, {} };
+
 
 extern "C"
 {
@@ -16,18 +33,30 @@ void
 UNITY_INTERFACE_EXPORT UNITY_INTERFACE_API
 UnityPluginLoad(
     IUnityInterfaces* unityInterfaces)
-{}
+{
+    startPingEngine(&engineConfig);
+}
 
 
 // Unity plugin unload event
 void
 UNITY_INTERFACE_EXPORT UNITY_INTERFACE_API
 UnityPluginUnload()
-{}
+{
+    stopPingEngine();
+    probeLogClose();
+    latencyCacheClose();
+    logStop();
+}
 
 
 /**
  * Adds a ping job and runs it immediately on the job thread. This is a non-blocking call.
+ * @param flags  PingFlags, with PingFlag_AdaptiveTimeout each request times out after the
+ *  destination's estimated RTO instead of the fixed timeoutMS, which becomes the upper bound
+ * @param toleranceMS  when > 0, numRequests is the maximum and the sequence ends as soon as the
+ *  95% confidence interval of the mean round trip is within +/- toleranceMS
+ * @param dscp  DiffServ code point to mark the requests with, the class the game's packets use
  * @returns Ping struct with a non-zero hnd on success, or 0 in hnd if job queue is full 
  */
 Ping
@@ -38,9 +67,12 @@ CreatePing(
     u16 dataSize    = DefaultDataSize,
     u8  ttl         = DefaultTTL,
     u16 timeoutMS   = DefaultTimeoutMS,
-    u16 intervalMS  = DefaultIntervalMS)
+    u16 intervalMS  = DefaultIntervalMS,
+    u16 flags       = PingFlag_None,
+    r32 toleranceMS = 0.f,
+    u8  dscp        = 0)
 {
-    return ping(host, numRequests, dataSize, ttl, timeoutMS, intervalMS);
+    return ping(host, numRequests, dataSize, ttl, timeoutMS, intervalMS, flags, toleranceMS, dscp);
 }
 
 /**
@@ -66,5 +98,555 @@ PollPingResult(
     return pollResult(*ping);
 }
 
+/**
+ * PollPingResult that also copies the extended stats (jitter, reordered, duplicate and late
+ * replies, burst loss) once the sequence is finished. The caller sets statsEx->size to sizeof its struct, no
+ * more than that is written.
+ * @returns true if job is finished running (Sequence_Finished or Sequence_Error)
+ */
+bool
+UNITY_INTERFACE_EXPORT
+PollPingResultEx(
+    Ping* ping,
+    PingStatsEx* statsEx)
+{
+    if (ping == nullptr || statsEx == nullptr) {
+        return false;
+    }
+
+    return pollResult(*ping, statsEx);
+}
+
+/**
+ * Copies a snapshot of the engine's counters and gauges, summed over all threads. Counters start
+ * at zero when the plugin is loaded and only increase, so rates come from the difference of two
+ * snapshots.
+ */
+void
+UNITY_INTERFACE_EXPORT
+GetPingMetrics(
+    PingMetrics* metrics)
+{
+    if (metrics == nullptr) {
+        return;
+    }
+
+    getPingMetrics(*metrics);
+}
+
+
+/**
+ * Sets what the job thread does while it has no jobs, and starts it if it isn't running. The
+ * plugin starts it on load with PingIdle_Park.
+ * @param idlePolicy  PingIdlePolicy, 0 park, 1 spin for idleMS (0 for ever) then park, 2 end the
+ *  thread after idleMS, the next ping starts a new one
+ * @returns 0 on success, -1 if the thread can't be created
+ */
+s32
+UNITY_INTERFACE_EXPORT
+StartPingEngine(
+    u8 idlePolicy,
+    u32 idleMS)
+{
+    engineConfig.idlePolicy = min(idlePolicy, (u8)PingIdle_Exit);
+    engineConfig.idleMS = idleMS;
+    return startPingEngine(&engineConfig);
+}
+
+
+/**
+ * Ends the job thread and waits for it. Pings still running or queued end with an error status,
+ * the next ping or StartPingEngine starts the thread again. Also called on unload.
+ */
+void
+UNITY_INTERFACE_EXPORT
+StopPingEngine()
+{
+    stopPingEngine();
+}
+
+
+/**
+ * Resolves the hosts and opens sockets for them on the job thread, ahead of the first pings, see
+ * prewarmPing. Call it while loading, before the UI asks for results. Starts the job thread if it
+ * isn't running.
+ * @returns 0 on success, -1 if the job thread can't be created
+ */
+s32
+UNITY_INTERFACE_EXPORT
+PrewarmPing(
+    const char* const* hosts,
+    u32 numHosts)
+{
+    if (hosts == nullptr) {
+        return Result_Error;
+    }
+
+    return prewarmPing(hosts, numHosts);
+}
+
+
+/**
+ * Turns latency mode on or off, see PingLatencyConfig. Restarts the job thread to apply it, pings
+ * still running end with an error status.
+ * @param cpu  CPU to pin the job thread to, -1 to not pin
+ * @param realtime  non-zero to run the job thread at realtime priority
+ * @param busyPollMicros  SO_BUSY_POLL time on Linux sockets, 0 for off
+ */
+void
+UNITY_INTERFACE_EXPORT
+SetPingLatencyMode(
+    bool enabled,
+    s32 cpu,
+    u8 realtime,
+    u32 busyPollMicros)
+{
+    stopPingEngine();
+
+    if (!enabled) {
+        setPingLatencyMode(nullptr);
+    }
+    else {
+        PingLatencyConfig config{};
+        config.cpu = cpu;
+        config.busyPollMicros = busyPollMicros;
+        config.enabled = 1;
+        config.realtime = realtime;
+        setPingLatencyMode(&config);
+    }
+
+    startPingEngine(&engineConfig);
+}
+
+
+/**
+ * Sets the lowest level logged, 0 debug (every packet), 1 info, 2 warn, 3 error, 4 off. The plugin
+ * starts at 4, levels below PING_LOG_LEVEL in build_config.h are compiled out.
+ */
+void
+UNITY_INTERFACE_EXPORT
+SetPingLogLevel(
+    u8 level)
+{
+    logSetLevel((LogLevel)min(level, (u8)LogLevel_Off));
+}
+
+
+/**
+ * Receives log lines in place of stdout, nullptr restores stdout. The callback runs on the
+ * logger's own thread.
+ */
+void
+UNITY_INTERFACE_EXPORT
+SetPingLogCallback(
+    LogSink callback)
+{
+    logSetSink(callback);
+}
+
+
+/**
+ * Appends the trace events recorded since the last call to a Chrome trace-event JSON file. Only
+ * records when the plugin is built with PING_TRACE set in build_config.h.
+ * @returns 0 on success, -1 if tracing is compiled out or the file can't be opened
+ */
+s32
+UNITY_INTERFACE_EXPORT
+FlushPingTrace(
+    const char* path)
+{
+#if defined(PING_TRACE) && PING_TRACE != 0
+    if (path == nullptr) {
+        return Result_Error;
+    }
+
+    return tracingFlush(path);
+#else
+    (void)path;
+    return Result_Error;
+#endif
+}
+
+
+/**
+ * Starts logging every probe result to binary segment files, see ping_probelog.h for the format.
+ * @param basePath  segments are named <basePath>.000000.plog and up
+ * @param recordsPerSegment  0 for the default of 1M records (32 MB)
+ * @param maxSegments  segments kept on disk, 0 keeps all
+ * @returns 0 on success, -1 if the log is already open or the first segment can't be created
+ */
+s32
+UNITY_INTERFACE_EXPORT
+OpenProbeLog(
+    const char* basePath,
+    u32 recordsPerSegment,
+    u32 maxSegments)
+{
+    return probeLogOpen(basePath, recordsPerSegment, maxSegments);
+}
+
+
+/**
+ * Stops the probe log and writes out the records not yet in a segment. Also called on unload.
+ */
+void
+UNITY_INTERFACE_EXPORT
+CloseProbeLog()
+{
+    probeLogClose();
+}
+
+
+/**
+ * Copies the probe log's record counts into outStats.
+ */
+void
+UNITY_INTERFACE_EXPORT
+GetProbeLogStats(
+    ProbeLogStats* outStats)
+{
+    if (outStats) {
+        *outStats = probeLogGetStats();
+    }
+}
+
+
+/**
+ * Opens the latency cache, a file of each destination's last known round trip and loss. Open it
+ * at startup, before the first ping, and read provisional results with GetCachedLatency while
+ * fresh sequences run. Every ping request after this updates the file.
+ * @returns 0 on success, -1 if the cache is already open or the file can't be mapped
+ */
+s32
+UNITY_INTERFACE_EXPORT
+OpenLatencyCache(
+    const char* path)
+{
+    return latencyCacheOpen(path);
+}
+
+
+/**
+ * Closes the latency cache, its entries stay in the file. Also called on unload.
+ */
+void
+UNITY_INTERFACE_EXPORT
+CloseLatencyCache()
+{
+    latencyCacheClose();
+}
+
+
+/**
+ * Looks up the last known latency of a host, by the host string it was pinged with.
+ * @returns true and the entry in outEntry if the host is in the cache
+ */
+bool
+UNITY_INTERFACE_EXPORT
+GetCachedLatency(
+    const char* host,
+    LatencyCacheEntry* outEntry)
+{
+    if (!outEntry) {
+        return false;
+    }
+    return latencyCacheLookup(host, *outEntry);
+}
+
+
+/**
+ * Copies up to maxEntries entries of the latency cache into outEntries.
+ * @returns number of entries copied
+ */
+u32
+UNITY_INTERFACE_EXPORT
+GetCachedLatencies(
+    LatencyCacheEntry* outEntries,
+    u32 maxEntries)
+{
+    if (!outEntries) {
+        return 0;
+    }
+    return latencyCacheList(outEntries, maxEntries);
+}
+
+
+/**
+ * Reads the round trip and loss of a host over one rolling window, 10 seconds, 1, 5 or 15
+ * minutes, by the host string it was pinged with.
+ * @param window  RollingWindow
+ * @returns true and the window's stats in outStats if the host was pinged in the last 15 minutes
+ */
+bool
+UNITY_INTERFACE_EXPORT
+GetRollingStats(
+    const char* host,
+    u8 window,
+    RollingStats* outStats)
+{
+    if (!outStats) {
+        return false;
+    }
+    return getRollingStats(host, (RollingWindow)window, *outStats);
+}
+
+
+/**
+ * Enables or disables anomaly detection over all ping sequences. Enabling it starts every host's
+ * baselines again.
+ */
+void
+UNITY_INTERFACE_EXPORT
+EnableAnomalyDetection(
+    bool enable)
+{
+    anomalyDetectionEnable(enable);
+}
+
+
+/**
+ * Moves up to maxEvents anomaly events, oldest first, to outEvents.
+ * @param outDropped  if given, events lost to a full queue since the last poll that asked
+ * @returns number of events copied
+ */
+u32
+UNITY_INTERFACE_EXPORT
+PollAnomalies(
+    AnomalyEvent* outEvents,
+    u32 maxEvents,
+    u32* outDropped)
+{
+    return pollAnomalies(outEvents, maxEvents, outDropped);
+}
+
+
+/**
+ * Adds a sweep job over a CIDR range ("a.b.c.d/n") and runs it on the job thread. This is a
+ * non-blocking call.
+ * @returns Sweep struct with a non-zero hnd on success, or 0 in hnd on error
+ */
+Sweep
+UNITY_INTERFACE_EXPORT
+CreateSweep(
+    const char* cidr,
+    u32 ratePPS   = DefaultSweepRatePPS,
+    u16 timeoutMS = DefaultTimeoutMS,
+    u16 dataSize  = DefaultDataSize,
+    u8  ttl       = DefaultTTL)
+{
+    return sweep(cidr, ratePPS, timeoutMS, dataSize, ttl);
+}
+
+/**
+ * Adds a sweep job over a list of IPv4 addresses in network byte order. The list is copied.
+ * @returns Sweep struct with a non-zero hnd on success, or 0 in hnd on error
+ */
+Sweep
+UNITY_INTERFACE_EXPORT
+CreateSweepList(
+    const u32* addresses,
+    u32 numAddresses,
+    u32 ratePPS   = DefaultSweepRatePPS,
+    u16 timeoutMS = DefaultTimeoutMS,
+    u16 dataSize  = DefaultDataSize,
+    u8  ttl       = DefaultTTL)
+{
+    return sweep(addresses, numAddresses, ratePPS, timeoutMS, dataSize, ttl);
+}
+
+/**
+ * Copies responders found since the last poll into results and updates the sweep's status and
+ * counters. Once the sweep is finished and all results have been read, the job is removed and
+ * sweep.hnd is cleared to zero.
+ * @returns number of results written
+ */
+u32
+UNITY_INTERFACE_EXPORT
+PollSweepResults(
+    Sweep* sweep,
+    SweepResult* results,
+    u32 maxResults)
+{
+    if (sweep == nullptr) {
+        return 0;
+    }
+
+    return pollSweepResults(*sweep, results, maxResults);
+}
+
+
+/**
+ * Adds a race between candidate hosts to find the k fastest, and runs it on the job thread. This
+ * is a non-blocking call.
+ * @returns Race struct with a non-zero hnd on success, or 0 in hnd on error
+ */
+Race
+UNITY_INTERFACE_EXPORT
+CreateRace(
+    const char* const* hosts,
+    u32 numHosts,
+    u32 k,
+    u16 numRequests = MaxSequenceRequests,
+    u16 timeoutMS   = DefaultTimeoutMS,
+    u16 flags       = PingFlag_None)
+{
+    return race(hosts, numHosts, k, numRequests, timeoutMS, flags);
+}
+
+/**
+ * Checks the race for completion. When race.status is Sequence_Finished, the ranked top k are
+ * copied to results, fastest first, the job is removed and race.hnd is cleared to zero.
+ * @returns true if the race is finished (Sequence_Finished or Sequence_Error)
+ */
+bool
+UNITY_INTERFACE_EXPORT
+PollRaceResult(
+    Race* race,
+    RaceResult* results,
+    u32 maxResults)
+{
+    if (race == nullptr) {
+        return false;
+    }
+
+    return pollRaceResult(*race, results, maxResults);
+}
+
+
+/**
+ * Adds a traceroute job that probes every TTL to the host at once each round, and runs it on the
+ * job thread. This is a non-blocking call.
+ * @param numRounds  rounds of probes, 0 to keep probing until StopTraceroute
+ * @returns Traceroute struct with a non-zero hnd on success, or 0 in hnd on error
+ */
+Traceroute
+UNITY_INTERFACE_EXPORT
+CreateTraceroute(
+    const char* host,
+    u8  maxHops    = DefaultTracerouteHops,
+    u32 numRounds  = 0,
+    u16 intervalMS = DefaultTracerouteIntervalMS,
+    u16 timeoutMS  = DefaultTimeoutMS,
+    u16 dataSize   = DefaultDataSize,
+    u8  dscp       = 0)
+{
+    if (host == nullptr) {
+        return Traceroute{ null_h32, Sequence_Error, 0, 0 };
+    }
+
+    return traceroute(host, maxHops, numRounds, intervalMS, timeoutMS, dataSize, dscp);
+}
+
+/**
+ * Copies the latest stats of each hop, from TTL 1, into hops and updates the traceroute's status.
+ * Once the traceroute is finished the final stats are copied, the job is removed and
+ * traceroute.hnd is cleared to zero.
+ * @returns number of hops written
+ */
+u32
+UNITY_INTERFACE_EXPORT
+PollTracerouteResult(
+    Traceroute* traceroute,
+    TracerouteHop* hops,
+    u32 maxHops)
+{
+    if (traceroute == nullptr) {
+        return 0;
+    }
+
+    return pollTracerouteResult(*traceroute, hops, maxHops);
+}
+
+/**
+ * Ends a traceroute, poll it afterwards for the final stats.
+ */
+void
+UNITY_INTERFACE_EXPORT
+StopTraceroute(
+    Traceroute* traceroute)
+{
+    if (traceroute) {
+        stopTraceroute(*traceroute);
+    }
+}
+
+
+/**
+ * Adds a job that finds the path MTU to the host with don't fragment probes, and runs it on the
+ * job thread. This is a non-blocking call.
+ * @param maxMtu  largest MTU probed, at most MaxPathMtu
+ * @returns Pmtu struct with a non-zero hnd on success, or 0 in hnd on error
+ */
+Pmtu
+UNITY_INTERFACE_EXPORT
+CreatePmtu(
+    const char* host,
+    u16 maxMtu    = MaxPathMtu,
+    u16 timeoutMS = DefaultTimeoutMS)
+{
+    if (host == nullptr) {
+        return Pmtu{ null_h32, Sequence_Error, 0, 0, 0 };
+    }
+
+    return discoverPmtu(host, maxMtu, timeoutMS);
+}
+
+/**
+ * Checks the job for completion, once finished pmtu.pathMtu is filled, the job is removed and
+ * pmtu.hnd is cleared to zero.
+ * @returns true if the job is finished
+ */
+bool
+UNITY_INTERFACE_EXPORT
+PollPmtuResult(
+    Pmtu* pmtu)
+{
+    if (pmtu == nullptr) {
+        return false;
+    }
+
+    return pollPmtuResult(*pmtu);
+}
+
+
+/**
+ * Adds a job that estimates the bottleneck capacity to the host, and the round trip a burst adds,
+ * with trains of back to back requests. It runs on the job thread, this is a non-blocking call.
+ * @param packetSize  IP packet size of the requests, at most MaxPathMtu
+ * @returns Bandwidth struct with a non-zero hnd on success, or 0 in hnd on error
+ */
+Bandwidth
+UNITY_INTERFACE_EXPORT
+CreateBandwidthEstimate(
+    const char* host,
+    u16 packetSize  = MaxPathMtu,
+    u8  trainLength = DefaultTrainLength,
+    u8  numTrains   = DefaultNumTrains,
+    u16 timeoutMS   = DefaultTimeoutMS)
+{
+    if (host == nullptr) {
+        return Bandwidth{ null_h32, Sequence_Error, {} };
+    }
+
+    return estimateBandwidth(host, packetSize, trainLength, numTrains, timeoutMS);
+}
+
+/**
+ * Checks the job for completion, once finished bandwidth.stats is filled, the job is removed and
+ * bandwidth.hnd is cleared to zero.
+ * @returns true if the job is finished
+ */
+bool
+UNITY_INTERFACE_EXPORT
+PollBandwidthResult(
+    Bandwidth* bandwidth)
+{
+    if (bandwidth == nullptr) {
+        return false;
+    }
+
+    return pollBandwidthResult(*bandwidth);
+}
+
 
 }
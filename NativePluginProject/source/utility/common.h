@@ -42,6 +42,9 @@
     static_assert(sizeof(Type) % (bytes) == 0, \
                   #Type " size is not a multiple of " xstr(bytes))
 
+// size of a cache line, align data written by different threads to this to avoid false sharing
+#define CacheLineSize   64
+
 inline bool is_power_of_2(s32 x) { return (x > 0 && !(x & (x-1))); }
 
 // size in bytes macros
@@ -0,0 +1,318 @@
+#ifndef _HASH_MAP_32_H
+#define _HASH_MAP_32_H
+
+#include <cstdlib>
+#include <cstring>
+#include "common.h"
+
+
+/**
+ * @struct HashMap32
+ *	Open-addressed hash map with linear probing, keyed by a non-zero 32-bit value such as an IPv4
+ *	address. Keys are kept in their own dense array so a probe sequence touches as few cache lines
+ *	as possible, and the items are stored in a parallel array at the same index.
+ *
+ *	The capacity must be a power of 2. Inserts are refused once the map reaches 3/4 of capacity to
+ *	keep probe sequences short, so usage code must handle a nullptr return from insert. Erase uses
+ *	backward-shift deletion, so there are no tombstones and lookups never degrade over time.
+ *
+ *	Key 0 is reserved to mark an empty slot.
+ */
+struct HashMap32 {
+    // Variables
+    u32*	keys = nullptr;				// array of keys, 0 for an empty slot
+    void*	items = nullptr;			// array of stored objects, parallel to keys
+
+    u32		length = 0;					// current number of objects contained in map
+    u32		capacity = 0;				// maximum number of slots, power of 2
+    u16		elementSizeB = 0;			// size in bytes of individual stored objects
+    u8		_memoryOwned = 0;			// set to 1 if buffer memory is owned by HashMap32
+    u8		_padding[5];
+
+    // Functions
+
+    static size_t getTotalBufferSize(u16 elementSizeB, u32 capacity);
+
+    /**
+     * Constructor
+     * @param	elementSizeB	size in bytes of individual objects stored
+     * @param	capacity		number of slots, must be a power of 2
+     * @param	buffer
+     *	Optional pre-allocated buffer for all dynamic storage used in the HashMap32, with ample size
+     *	(obtained by call to getTotalBufferSize). If passed, the memory is not owned by HashMap32 and
+     *	thus not freed on delete. Pass nullptr (default) to allocate the storage on create and free
+     *	on delete.
+     */
+    explicit HashMap32(
+        u16 _elementSizeB,
+        u32 _capacity,
+        void* buffer = nullptr)
+    {
+        init(_elementSizeB, _capacity, buffer);
+    }
+
+    explicit HashMap32() {}
+
+    ~HashMap32() {
+        deinit();
+    }
+
+    /**
+     * Finds the item stored for key.
+     * @returns pointer to the item, or nullptr if key is not in the map
+     */
+    void* find(u32 key);
+
+    void* operator[](u32 key) {
+        return find(key);
+    }
+
+    /**
+     * Finds the item stored for key, or adds a new zeroed item for it.
+     * @param[out]	inserted	optional, set to true if a new item was added
+     * @returns pointer to the item, or nullptr if key is 0 or the map is at its load limit
+     */
+    void* insert(
+        u32 key,
+        bool* inserted = nullptr);
+
+    /**
+     * Removes the item stored for key
+     * @returns true if item removed, false if not found
+     */
+    bool erase(u32 key);
+
+    /**
+     * Removes all items. Complexity is linear in capacity.
+     */
+    void clear();
+
+    inline bool full() {
+        return (length >= capacity - (capacity >> 2));
+    }
+
+    inline void* item(u32 index)
+    {
+        assert(index < capacity && "index out of range");
+        return (void*)((uintptr_t)items + (index * elementSizeB));
+    }
+
+    /**
+     * Integer finalizer from MurmurHash3, spreads sequential keys (adjacent addresses) across the
+     * table.
+     */
+    static inline u32 hash(u32 key)
+    {
+        key ^= key >> 16;
+        key *= 0x85EBCA6B;
+        key ^= key >> 13;
+        key *= 0xC2B2AE35;
+        key ^= key >> 16;
+        return key;
+    }
+
+    void init(u16 elementSizeB,
+              u32 capacity,
+              void* buffer = nullptr);
+
+    void deinit();
+};
+static_assert_aligned_size(HashMap32,8);
+
+
+size_t HashMap32::getTotalBufferSize(u16 elementSizeB, u32 capacity)
+{
+    return _align(sizeof(u32) * capacity, 8) + _align((size_t)elementSizeB * capacity, 8);
+}
+
+
+void* HashMap32::find(u32 key)
+{
+    if (key == 0) {
+        return nullptr;
+    }
+
+    u32 mask = capacity - 1;
+    for (u32 i = hash(key) & mask;
+         keys[i] != 0;
+         i = (i + 1) & mask)
+    {
+        if (keys[i] == key) {
+            return item(i);
+        }
+    }
+    return nullptr;
+}
+
+
+void* HashMap32::insert(
+    u32 key,
+    bool* inserted)
+{
+    if (inserted) {
+        *inserted = false;
+    }
+    if (key == 0) {
+        return nullptr;
+    }
+
+    u32 mask = capacity - 1;
+    u32 i = hash(key) & mask;
+    for (; keys[i] != 0; i = (i + 1) & mask)
+    {
+        if (keys[i] == key) {
+            return item(i);
+        }
+    }
+
+    if (full()) {
+        return nullptr;
+    }
+
+    keys[i] = key;
+    void* addr = item(i);
+    memset(addr, 0, elementSizeB);
+    ++length;
+
+    if (inserted) {
+        *inserted = true;
+    }
+    return addr;
+}
+
+
+bool HashMap32::erase(u32 key)
+{
+    if (key == 0) {
+        return false;
+    }
+
+    u32 mask = capacity - 1;
+    u32 i = hash(key) & mask;
+    for (; keys[i] != key; i = (i + 1) & mask)
+    {
+        if (keys[i] == 0) {
+            return false;
+        }
+    }
+
+    // backward-shift deletion, pull later members of the probe sequence into the hole so that no
+    // lookup is broken by the empty slot
+    u32 hole = i;
+    for (u32 j = (i + 1) & mask;
+         keys[j] != 0;
+         j = (j + 1) & mask)
+    {
+        u32 home = hash(keys[j]) & mask;
+        // move the item if its home slot is not cyclically within (hole, j]
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            keys[hole] = keys[j];
+            memcpy(item(hole), item(j), elementSizeB);
+            hole = j;
+        }
+    }
+    keys[hole] = 0;
+
+    --length;
+
+    return true;
+}
+
+
+void HashMap32::clear()
+{
+    memset(keys, 0, sizeof(u32) * capacity);
+    length = 0;
+
+    #if defined(SLOWCHECKS) && SLOWCHECKS != 0
+    // clear item memory to zero (slow build only) to help in debugging
+    memset(items, 0, (size_t)elementSizeB * capacity);
+    #endif
+}
+
+
+void HashMap32::init(
+    u16 _elementSizeB,
+    u32 _capacity,
+    void* buffer)
+{
+    assert(is_power_of_2((s32)_capacity) && "capacity must be a power of 2");
+    elementSizeB = _elementSizeB;
+    capacity = _capacity;
+
+    if (!buffer) {
+        size_t size = getTotalBufferSize(elementSizeB, capacity);
+        buffer = Q_malloc(size);
+        memset(buffer, 0, size);
+        _memoryOwned = 1;
+    }
+
+    keys = (u32*)buffer;
+    items = (void*)((uintptr_t)buffer + _align(sizeof(u32) * capacity, 8));
+
+    clear();
+}
+
+
+void HashMap32::deinit()
+{
+    if (_memoryOwned && keys) {
+        Q_free(keys);
+        keys = nullptr;
+        items = nullptr;
+    }
+}
+
+
+// Helper Macros
+
+// Macro for defining a type-safe HashMap32 wrapper that avoids void* and elementSizeB in the api
+#define HashMap32_Typed(Type, Name) \
+    struct Name {\
+        enum { TypeSize = sizeof(Type) };\
+        HashMap32 _map;\
+        static size_t getTotalBufferSize(u32 capacity)\
+                                            { return HashMap32::getTotalBufferSize(TypeSize, capacity); }\
+        explicit Name(u32 _capacity, void* buffer = nullptr)\
+                                            { _map.init(TypeSize, _capacity, buffer); }\
+        explicit Name() {}\
+        Type* find(u32 key)					{ return (Type*)_map.find(key); }\
+        Type* operator[](u32 key)			{ return find(key); }\
+        Type* insert(u32 key, bool* inserted = nullptr)\
+                                            { return (Type*)_map.insert(key, inserted); }\
+        bool erase(u32 key)					{ return _map.erase(key); }\
+        void clear()						{ _map.clear(); }\
+        bool full()							{ return _map.full(); }\
+        u32 length()						{ return _map.length; }\
+        void init(u32 capacity, void* buffer = nullptr)\
+                                            { _map.init(TypeSize, capacity, buffer); }\
+        void deinit()						{ _map.deinit(); }\
+    };
+
+
+// Macro like HashMap32_Typed but also internally includes the storage buffer, so there is no need
+// to call init or create the buffer externally
+#define HashMap32_Typed_WithBuffer(Type, Name, _capacity) \
+    struct Name {\
+        enum { TypeSize = sizeof(Type) };\
+        HashMap32 _map;\
+        u32  _keys[_capacity];\
+        Type _items[_capacity];\
+        static_assert(((_capacity) & ((_capacity) - 1)) == 0, "capacity must be a power of 2");\
+        static_assert(alignof(Type) <= 8, #Type " alignment must be <= 8 to follow the keys array");\
+        static_assert(is_aligned(sizeof(Name::_keys), 8), "sizeof keys array must be a multiple of 8");\
+        explicit Name() : _keys{} {\
+            _map.init(TypeSize, _capacity, &_keys);\
+        }\
+        Type* find(u32 key)					{ return (Type*)_map.find(key); }\
+        Type* operator[](u32 key)			{ return find(key); }\
+        Type* insert(u32 key, bool* inserted = nullptr)\
+                                            { return (Type*)_map.insert(key, inserted); }\
+        bool erase(u32 key)					{ return _map.erase(key); }\
+        void clear()						{ _map.clear(); }\
+        bool full()							{ return _map.full(); }\
+        u32 length()						{ return _map.length; }\
+    };
+
+
+#endif
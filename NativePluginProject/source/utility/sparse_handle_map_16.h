@@ -193,7 +193,11 @@ h32 SparseHandleMap16::insert(
         freeListFront = i.header->next;
 
         i.header->next = index;
+        // skip generation 0 as it wraps, so slot 0 of type 0 never hands out null_h32
         ++i.header->generation;
+        if (i.header->generation == 0) {
+            i.header->generation = 1;
+        }
         i.header->free = 0;
         i.header->typeId = typeId;
         
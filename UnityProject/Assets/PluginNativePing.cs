@@ -6,6 +6,20 @@ using System.Text;
 using System.Threading.Tasks;
 
 
+[Flags]
+public enum PingFlags : ushort {
+    PingFlag_None            = 0,
+    PingFlag_AdaptiveTimeout = 1 << 0
+};
+
+
+public enum PingIdlePolicy : byte {
+    PingIdle_Park = 0,  // block until the next ping
+    PingIdle_Spin,      // poll for idleMS (0 for ever) then park
+    PingIdle_Exit       // end the thread after idleMS, the next ping starts a new one
+};
+
+
 public enum SequenceStatus : uint {
     Sequence_Inactive = 0,
     Sequence_Running,
@@ -43,6 +57,44 @@ public struct PingStats
 }
 
 
+// size must be set to Marshal.SizeOf<PingStatsEx>() before it's passed to PollPingResultEx
+[StructLayout(LayoutKind.Sequential)]
+public struct PingStatsEx
+{
+    public uint  size;
+    public uint  version;
+    public float jitterMS;
+    public uint  reordered;
+    public uint  duplicates;
+    public uint  late;
+
+    // version 2
+    public uint  lossBursts;
+    [MarshalAs(UnmanagedType.ByValArray, SizeConst = 8)]
+    public uint[] burstLengths;     // bursts of 1, 2, .. lost requests, the last bin also longer
+    public float meanBurstLength;
+    public float meanGapLength;
+    public float burstEnterProb;
+    public float burstExitProb;
+
+
+    public override string ToString()
+    {
+        StringBuilder sb = new StringBuilder();
+        sb.AppendLine($"jitter: {jitterMS:F3}ms");
+        sb.AppendLine($"reordered: {reordered}");
+        sb.AppendLine($"duplicates: {duplicates}");
+        sb.AppendLine($"late: {late}");
+        sb.AppendLine($"lossBursts: {lossBursts}");
+        sb.AppendLine($"meanBurstLength: {meanBurstLength:F2}");
+        sb.AppendLine($"meanGapLength: {meanGapLength:F2}");
+        sb.AppendLine($"burstEnterProb: {burstEnterProb:F3}");
+        sb.AppendLine($"burstExitProb: {burstExitProb:F3}");
+        return sb.ToString();
+    }
+}
+
+
 [StructLayout(LayoutKind.Sequential)]
 public struct PingJob
 {
@@ -57,6 +109,209 @@ public struct PingJob
 }
 
 
+[StructLayout(LayoutKind.Sequential)]
+public struct SweepJob
+{
+    public uint           hnd;
+    public SequenceStatus status;
+    public uint           sent;
+    public uint           responded;
+}
+
+
+[StructLayout(LayoutKind.Sequential)]
+public struct SweepResult
+{
+    public uint  address; // network byte order
+    public float elapsedMS;
+    public byte  ttl;
+    private byte _pad0, _pad1, _pad2;
+}
+
+
+[StructLayout(LayoutKind.Sequential)]
+public struct RaceJob
+{
+    public uint           hnd;
+    public SequenceStatus status;
+    public uint           numResults;
+}
+
+
+[StructLayout(LayoutKind.Sequential)]
+public struct RaceResult
+{
+    public uint      candidate; // index of the host in the array passed to CreateRace
+    public PingStats stats;
+}
+
+
+[StructLayout(LayoutKind.Sequential)]
+public struct TracerouteJob
+{
+    public uint           hnd;
+    public SequenceStatus status;
+    public uint           rounds;   // rounds completed
+    public uint           numHops;  // path length
+}
+
+
+[StructLayout(LayoutKind.Sequential)]
+public struct TracerouteHop
+{
+    public uint      address;       // last responder at this TTL, network byte order, 0 if none
+    public float     lastRoundTrip;
+    public PingStats stats;
+    public byte      ttl;
+    public byte      reached;       // the responder is the destination
+    public byte      changes;       // times the responder has changed
+    private byte     _pad0;
+}
+
+
+[StructLayout(LayoutKind.Sequential)]
+public struct PmtuJob
+{
+    public uint           hnd;
+    public SequenceStatus status;
+    public ushort         pathMtu;  // including the IP header, 0 until found
+    public ushort         probes;
+    public uint           limitedBy; // router that reported the path MTU, network byte order
+}
+
+
+[StructLayout(LayoutKind.Sequential)]
+public struct BandwidthStats
+{
+    public float  capacityMbps;     // bottleneck capacity, 0 if it couldn't be timed
+    public float  idleRoundTrip;
+    public float  loadedRoundTrip;  // round trip at the end of a train
+    public float  addedDelayMS;     // queueing delay a train causes
+    public uint   sent;
+    public uint   received;
+    public ushort packetSize;
+    public ushort trainsMeasured;
+}
+
+
+[StructLayout(LayoutKind.Sequential)]
+public struct BandwidthJob
+{
+    public uint           hnd;
+    public SequenceStatus status;
+    public BandwidthStats stats;
+}
+
+
+// counters only increase, take the difference of two snapshots for rates
+[StructLayout(LayoutKind.Sequential)]
+public struct PingMetrics
+{
+    // job thread
+    public ulong loopIterations;
+    public ulong loopMicros;
+    public ulong packetsSent;
+    public ulong sendPending;
+    public ulong sendErrors;
+    public ulong packetsReceived;
+    public ulong receivePending;
+    public ulong receiveErrors;
+    public ulong repliesIgnored;
+    public ulong requestsTimedOut;
+    public ulong requestsPaced;
+    public ulong sequencesFinished;
+    public ulong sequencesErrored;
+    public ulong timestampSamples;
+    public ulong timestampDelayNanos;
+    public ulong timestampDelaySqMicros;
+    public ulong socketsCreated;
+    public ulong socketsReused;
+    public ulong hostsResolved;
+    public ulong destinationsEvicted;
+
+    // api threads
+    public ulong jobsQueued;
+    public ulong polls;
+
+    // gauges
+    public ulong runningJobs;
+    public ulong maxLoopMicros;
+    public ulong jobQueueDepth;
+    public ulong maxTimestampDelayNanos;
+}
+
+
+[StructLayout(LayoutKind.Sequential)]
+public struct ProbeLogStats
+{
+    public ulong written;   // records in segment files
+    public ulong dropped;   // records lost to a full ring or a segment that failed to open
+    public uint  segments;
+    public byte  open;
+    private byte _pad0, _pad1, _pad2;
+}
+
+
+// last known latency of a destination, from previous runs
+[StructLayout(LayoutKind.Sequential, CharSet=CharSet.Ansi)]
+public struct LatencyCacheEntry
+{
+    [MarshalAs(UnmanagedType.ByValTStr, SizeConst = 96)]
+    public string host;
+    public uint   address;          // network byte order
+    public float  rttMS;            // EWMA of round trip times
+    public float  loss;             // EWMA of requests lost, 0 to 1
+    public uint   samples;
+    public ulong  lastSeenMicros;   // last reply, microseconds since the Unix epoch, 0 if never
+    public ulong  updatedMicros;
+}
+
+
+public enum RollingWindow : byte {
+    RollingWindow_10s = 0,
+    RollingWindow_1m,
+    RollingWindow_5m,
+    RollingWindow_15m
+};
+
+
+// round trip and loss of a destination over a rolling window
+[StructLayout(LayoutKind.Sequential)]
+public struct RollingStats
+{
+    public uint  sent;
+    public uint  received;
+    public uint  lost;
+    public float pctLost;
+    public float avgRoundTrip;
+    public float stdDevRoundTrip;
+}
+
+
+public enum AnomalyKind : byte {
+    Anomaly_LatencyUp = 0,
+    Anomaly_LatencyDown,
+    Anomaly_LossSpike,
+    Anomaly_LossRecovered,
+    Anomaly_RouteChange
+};
+
+
+// a change in a destination's round trip, loss or path
+[StructLayout(LayoutKind.Sequential)]
+public struct AnomalyEvent
+{
+    public ulong timeMicros;
+    public uint  address;
+    public float baseline;
+    public float value;
+    public AnomalyKind kind;
+    private byte _pad0;
+    private byte _pad1;
+    private byte _pad2;
+}
+
+
 public class PluginNativePing : MonoBehaviour
 {
     const ushort DefaultNumRequests = 1;
@@ -64,6 +319,13 @@ public class PluginNativePing : MonoBehaviour
     const byte   DefaultTTL         = 128;
     const ushort DefaultTimeoutMS   = 1000;
     const ushort DefaultIntervalMS  = 16;
+    const uint   DefaultSweepRatePPS = 5000;
+    const ushort MaxSequenceRequests = 16;
+    const byte   DefaultTracerouteHops = 30;
+    const ushort DefaultTracerouteIntervalMS = 1000;
+    const ushort MaxPathMtu         = 1500;
+    const byte   DefaultTrainLength = 16;
+    const byte   DefaultNumTrains   = 4;
     
 
     [DllImport("unity-ping", CallingConvention = CallingConvention.Cdecl, CharSet=CharSet.Ansi)]
@@ -76,7 +338,10 @@ public class PluginNativePing : MonoBehaviour
         ushort dataSize    = DefaultDataSize,
         byte   ttl         = DefaultTTL,
         ushort timeoutMS   = DefaultTimeoutMS,
-        ushort intervalMS  = DefaultIntervalMS);
+        ushort intervalMS  = DefaultIntervalMS,
+        PingFlags flags    = PingFlags.PingFlag_None,
+        float toleranceMS  = 0f,
+        byte  dscp         = 0);
 
     
     [DllImport("unity-ping", CallingConvention = CallingConvention.Cdecl)]
@@ -86,10 +351,299 @@ public class PluginNativePing : MonoBehaviour
         ref PingJob ping);
 
 
+    [DllImport("unity-ping", CallingConvention = CallingConvention.Cdecl)]
+    private static extern
+    bool
+    PollPingResultEx(
+        ref PingJob ping,
+        ref PingStatsEx statsEx);
+
+
+    [DllImport("unity-ping", CallingConvention = CallingConvention.Cdecl)]
+    private static extern
+    void
+    GetPingMetrics(
+        out PingMetrics metrics);
+
+
+    [DllImport("unity-ping", CallingConvention = CallingConvention.Cdecl)]
+    private static extern
+    int
+    StartPingEngine(
+        PingIdlePolicy idlePolicy,
+        uint idleMS = 0);
+
+
+    [DllImport("unity-ping", CallingConvention = CallingConvention.Cdecl)]
+    private static extern
+    void
+    StopPingEngine();
+
+
+    [DllImport("unity-ping", CallingConvention = CallingConvention.Cdecl, CharSet=CharSet.Ansi)]
+    private static extern
+    int
+    PrewarmPing(
+        [MarshalAs(UnmanagedType.LPArray, ArraySubType = UnmanagedType.LPStr)]
+        string[]  hosts,
+        uint      numHosts);
+
+
+    [DllImport("unity-ping", CallingConvention = CallingConvention.Cdecl)]
+    private static extern
+    void
+    SetPingLatencyMode(
+        bool   enabled,
+        int    cpu            = -1,
+        byte   realtime       = 0,
+        uint   busyPollMicros = 0);
+
+
+    [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
+    private delegate void PingLogCallback(byte level, IntPtr message);
+
+
+    [DllImport("unity-ping", CallingConvention = CallingConvention.Cdecl)]
+    private static extern
+    void
+    SetPingLogLevel(
+        byte level);
+
+
+    [DllImport("unity-ping", CallingConvention = CallingConvention.Cdecl)]
+    private static extern
+    void
+    SetPingLogCallback(
+        PingLogCallback callback);
+
+
+    [DllImport("unity-ping", CallingConvention = CallingConvention.Cdecl, CharSet=CharSet.Ansi)]
+    private static extern
+    int
+    OpenProbeLog(
+        [MarshalAs(UnmanagedType.LPStr)]
+        string basePath,
+        uint recordsPerSegment = 0,
+        uint maxSegments       = 0);
+
+
+    [DllImport("unity-ping", CallingConvention = CallingConvention.Cdecl)]
+    private static extern
+    void
+    CloseProbeLog();
+
+
+    [DllImport("unity-ping", CallingConvention = CallingConvention.Cdecl)]
+    private static extern
+    void
+    GetProbeLogStats(
+        out ProbeLogStats stats);
+
+
+    [DllImport("unity-ping", CallingConvention = CallingConvention.Cdecl, CharSet=CharSet.Ansi)]
+    private static extern
+    int
+    OpenLatencyCache(
+        [MarshalAs(UnmanagedType.LPStr)]
+        string path);
+
+
+    [DllImport("unity-ping", CallingConvention = CallingConvention.Cdecl)]
+    private static extern
+    void
+    CloseLatencyCache();
+
+
+    [DllImport("unity-ping", CallingConvention = CallingConvention.Cdecl, CharSet=CharSet.Ansi)]
+    private static extern
+    bool
+    GetCachedLatency(
+        [MarshalAs(UnmanagedType.LPStr)]
+        string host,
+        out LatencyCacheEntry entry);
+
+
+    [DllImport("unity-ping", CallingConvention = CallingConvention.Cdecl)]
+    private static extern
+    uint
+    GetCachedLatencies(
+        [Out] LatencyCacheEntry[] entries,
+        uint maxEntries);
+
+
+    [DllImport("unity-ping", CallingConvention = CallingConvention.Cdecl, CharSet=CharSet.Ansi)]
+    private static extern
+    bool
+    GetRollingStats(
+        [MarshalAs(UnmanagedType.LPStr)]
+        string host,
+        RollingWindow window,
+        out RollingStats stats);
+
+
+    [DllImport("unity-ping", CallingConvention = CallingConvention.Cdecl)]
+    private static extern
+    void
+    EnableAnomalyDetection(
+        bool enable);
+
+
+    [DllImport("unity-ping", CallingConvention = CallingConvention.Cdecl)]
+    private static extern
+    uint
+    PollAnomalies(
+        [Out] AnomalyEvent[] events,
+        uint maxEvents,
+        out uint dropped);
+
+
+    [DllImport("unity-ping", CallingConvention = CallingConvention.Cdecl, CharSet=CharSet.Ansi)]
+    private static extern
+    int
+    FlushPingTrace(
+        [MarshalAs(UnmanagedType.LPStr)]
+        string path);
+
+
+    [DllImport("unity-ping", CallingConvention = CallingConvention.Cdecl, CharSet=CharSet.Ansi)]
+    private static extern
+    SweepJob
+    CreateSweep(
+        [MarshalAs(UnmanagedType.LPStr)]
+        string cidr,
+        uint   ratePPS   = DefaultSweepRatePPS,
+        ushort timeoutMS = DefaultTimeoutMS,
+        ushort dataSize  = DefaultDataSize,
+        byte   ttl       = DefaultTTL);
+
+
+    [DllImport("unity-ping", CallingConvention = CallingConvention.Cdecl)]
+    private static extern
+    SweepJob
+    CreateSweepList(
+        uint[] addresses,
+        uint   numAddresses,
+        uint   ratePPS   = DefaultSweepRatePPS,
+        ushort timeoutMS = DefaultTimeoutMS,
+        ushort dataSize  = DefaultDataSize,
+        byte   ttl       = DefaultTTL);
+
+
+    [DllImport("unity-ping", CallingConvention = CallingConvention.Cdecl)]
+    private static extern
+    uint
+    PollSweepResults(
+        ref SweepJob sweep,
+        [Out] SweepResult[] results,
+        uint maxResults);
+
+
+    [DllImport("unity-ping", CallingConvention = CallingConvention.Cdecl, CharSet=CharSet.Ansi)]
+    private static extern
+    RaceJob
+    CreateRace(
+        [MarshalAs(UnmanagedType.LPArray, ArraySubType = UnmanagedType.LPStr)]
+        string[]  hosts,
+        uint      numHosts,
+        uint      k,
+        ushort    numRequests = MaxSequenceRequests,
+        ushort    timeoutMS   = DefaultTimeoutMS,
+        PingFlags flags       = PingFlags.PingFlag_None);
+
+
+    [DllImport("unity-ping", CallingConvention = CallingConvention.Cdecl)]
+    private static extern
+    bool
+    PollRaceResult(
+        ref RaceJob race,
+        [Out] RaceResult[] results,
+        uint maxResults);
+
+
+    [DllImport("unity-ping", CallingConvention = CallingConvention.Cdecl, CharSet=CharSet.Ansi)]
+    private static extern
+    TracerouteJob
+    CreateTraceroute(
+        [MarshalAs(UnmanagedType.LPStr)]
+        string host,
+        byte   maxHops    = DefaultTracerouteHops,
+        uint   numRounds  = 0,
+        ushort intervalMS = DefaultTracerouteIntervalMS,
+        ushort timeoutMS  = DefaultTimeoutMS,
+        ushort dataSize   = DefaultDataSize,
+        byte   dscp       = 0);
+
+
+    [DllImport("unity-ping", CallingConvention = CallingConvention.Cdecl)]
+    private static extern
+    uint
+    PollTracerouteResult(
+        ref TracerouteJob traceroute,
+        [Out] TracerouteHop[] hops,
+        uint maxHops);
+
+
+    [DllImport("unity-ping", CallingConvention = CallingConvention.Cdecl)]
+    private static extern
+    void
+    StopTraceroute(
+        ref TracerouteJob traceroute);
+
+
+    [DllImport("unity-ping", CallingConvention = CallingConvention.Cdecl, CharSet=CharSet.Ansi)]
+    private static extern
+    PmtuJob
+    CreatePmtu(
+        [MarshalAs(UnmanagedType.LPStr)]
+        string host,
+        ushort maxMtu    = MaxPathMtu,
+        ushort timeoutMS = DefaultTimeoutMS);
+
+
+    [DllImport("unity-ping", CallingConvention = CallingConvention.Cdecl)]
+    private static extern
+    bool
+    PollPmtuResult(
+        ref PmtuJob pmtu);
+
+
+    [DllImport("unity-ping", CallingConvention = CallingConvention.Cdecl, CharSet=CharSet.Ansi)]
+    private static extern
+    BandwidthJob
+    CreateBandwidthEstimate(
+        [MarshalAs(UnmanagedType.LPStr)]
+        string host,
+        ushort packetSize  = MaxPathMtu,
+        byte   trainLength = DefaultTrainLength,
+        byte   numTrains   = DefaultNumTrains,
+        ushort timeoutMS   = DefaultTimeoutMS);
+
+
+    [DllImport("unity-ping", CallingConvention = CallingConvention.Cdecl)]
+    private static extern
+    bool
+    PollBandwidthResult(
+        ref BandwidthJob bandwidth);
+
+
     async
     void
     Start()
     {
+        // last known latencies from previous runs, provisional until the fresh sequences finish
+        OpenLatencyCache(Application.persistentDataPath + "/ping_latency.cache");
+        string[] hosts = { "google.com", "yahoo.com", "gamedev.net", "unity3d.com" };
+
+        // resolve the names and open sockets while the cached results are shown
+        PrewarmPing(hosts, (uint)hosts.Length);
+
+        foreach (string host in hosts) {
+            LatencyCacheEntry entry;
+            if (GetCachedLatency(host, out entry)) {
+                Debug.Log(host + " last known rtt " + entry.rttMS + "ms, loss " + entry.loss);
+            }
+        }
+
         PingJob[] pings = {
             // TODO: change this to a known IP on your local network
             CreatePing(